@@ -4,6 +4,10 @@
 #include <algorithm>
 #include <unordered_map>
 #include <mutex>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <cstdint>
 #include <core123/datetimeutils.hpp>
 
 // Mark an object of type T with an expiration time.
@@ -217,4 +221,81 @@ public:
     size_t expirations() const { return _expirations; }
     size_t size() const { std::lock_guard<std::mutex> lg(mtx); return themap.size(); }
 };
+
+// sharded_expiring_cache - an expiring_cache split into nshards
+//  independent expiring_caches, each with its own mutex and
+//  1/nshards of the max_size.  The key's std::hash (scrambled, in
+//  case the hash is the identity, as it is for integers) selects the
+//  shard.  The API and the semantics are those of expiring_cache,
+//  except that the random evictions are per-shard, so the total
+//  size() may fall a little further short of max_size.
+//
+//  With one mutex per shard, threads that look up different keys
+//  rarely contend.  The counters are summed over the shards when
+//  they're asked for.
+template <typename K, typename V, typename Clk = std::chrono::system_clock>
+class sharded_expiring_cache{
+    using eV = expiring<V, Clk>;
+    using shard_t = expiring_cache<K, V, Clk>;
+    // Give each shard its own cache line(s), so that the mutexes
+    // of neighboring shards don't share.
+    struct alignas(64) aligned_shard : public shard_t{
+        aligned_shard(size_t sz) : shard_t(sz){}
+    };
+    std::vector<std::unique_ptr<aligned_shard>> shards;
+
+    shard_t& shard_for(const K& k) const {
+        // Fibonacci hashing:  the high bits of the product depend
+        // on all the bits of the hash.
+        uint64_t h = uint64_t(std::hash<K>{}(k)) * 0x9e3779b97f4a7c15ull;
+        return *shards[(h>>32) % shards.size()];
+    }
+    template <typename F>
+    size_t sum(F f) const {
+        size_t ret = 0;
+        for(const auto& s : shards)
+            ret += f(*s);
+        return ret;
+    }
+
+public:
+    using clk_t = Clk;
+    sharded_expiring_cache(size_t max_size, size_t nshards = 16){
+        if(nshards == 0)
+            nshards = 1;
+        // Round up, so a small, non-zero max_size doesn't turn into
+        // shards of size zero, which would never cache anything.
+        size_t shard_size = (max_size + nshards - 1)/nshards;
+        shards.reserve(nshards);
+        for(size_t i=0; i<nshards; ++i)
+            shards.push_back(std::make_unique<aligned_shard>(shard_size));
+    }
+    eV lookup(const K& k, typename clk_t::time_point asifnow = clk_t::now()){
+        return shard_for(k).lookup(k, asifnow);
+    }
+    bool insert(const K& k, const eV& v){
+        return shard_for(k).insert(k, v);
+    }
+    template <class Rep, class Period>
+    bool insert(const K& k, const V& r, std::chrono::duration<Rep, Period> ttl){
+        return shard_for(k).insert(k, r, ttl);
+    }
+    bool insert(const K& k, const V& r, const typename Clk::time_point& tp){
+        return shard_for(k).insert(k, r, tp);
+    }
+    auto erase(const K& k){
+        return shard_for(k).erase(k);
+    }
+    void erase_expired(typename clk_t::time_point asifnow = clk_t::now()){
+        for(auto& s : shards)
+            s->erase_expired(asifnow);
+    }
+
+    size_t nshards() const { return shards.size(); }
+    size_t evictions() const { return sum([](const shard_t& s){ return s.evictions(); }); }
+    size_t hits() const { return sum([](const shard_t& s){ return s.hits(); }); }
+    size_t misses() const { return sum([](const shard_t& s){ return s.misses(); }); }
+    size_t expirations() const { return sum([](const shard_t& s){ return s.expirations(); }); }
+    size_t size() const { return sum([](const shard_t& s){ return s.size(); }); }
+};
 } // namespace core123
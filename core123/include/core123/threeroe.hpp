@@ -9,6 +9,11 @@
 #include <cstring>
 #include <cassert>
 #include <utility>
+#include <algorithm>
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__ICC)
+#define CORE123_THREEROE_X86_SIMD 1
+#include <immintrin.h>
+#endif
 
 // DOCUMENTATION_BEGIN
 
@@ -59,6 +64,20 @@
 // Like the constructor, update() has overloads for any type
 // that supplies data() and size() methods.
 //
+// To hash many independent inputs, e.g., all the names in a
+// directory, use the static hash_many method:
+//
+//    std::vector<const void*> ptrs = ...;
+//    std::vector<size_t> lens = ...;
+//    std::vector<threeroe::hashpair64_type> hashes(ptrs.size());
+//    threeroe::hash_many(ptrs.size(), ptrs.data(), lens.data(), hashes.data());
+//
+// hashes[i] is the same as threeroe(ptrs[i], lens[i]).hashpair64().
+// On x86_64, hash_many hashes 8 (AVX-512) or 4 (AVX2) inputs at a
+// time, one per SIMD lane.  It's fastest when the inputs in each
+// group of 8 or 4 have similar lengths.  Without AVX2, or when
+// hash_many is called with simd=threeroe::SCALAR, it's just a loop.
+//
 // The output functions (hashpair64, digest, hash64, hexdigest,
 // bytedigest) are all const, so it's permissible to call them more
 // than once or to add more data with update after calling them.
@@ -84,10 +103,24 @@
 //   0.2 cycles per byte on a 3.50GHz Xeon ES-1650 (Sandy Bridge).
 //   Short strings (0-32 bytes) take 10-16ns or about 35 to 50 cycles
 //   per hash.
+//
+//   The state is a serial chain from one block to the next, so a
+//   single hash can't use wide SIMD registers profitably.  Keeping
+//   the four state words in one ymm register ran at 6.2GB/s (AVX2)
+//   and 7.9GB/s (AVX-512VL) on an AVX-512 Xeon, vs. 10-13GB/s for
+//   the scalar code.  hash_many gets its speed from independent
+//   hashes in SIMD lanes instead.  On the same Xeon, one core
+//   hashes 4KiB inputs at about 10GB/s one at a time, 15GB/s with
+//   AVX2 and 22GB/s with AVX-512.  Below about 256 bytes, finishing
+//   each hash dominates, and hash_many is no faster than a loop.
 
 // Portability:
 //
-//   threeroe.hpp is standard, portable C++14.
+//   threeroe.hpp is standard, portable C++14, except for
+//   hash_many's SIMD kernels, which use gcc's vector extensions,
+//   target attributes and intrinsics on x86_64 (tested with gcc 12,
+//   but not clang), and are compiled out elsewhere.  They're chosen at run time, with
+//   __builtin_cpu_supports, so there's no need for -march.
 //
 //   It compiles cleanly with g++ and clang++ -Wall, but it has not
 //   undergone serious portability testing.
@@ -209,26 +242,42 @@ private:
     }
 
     // mixoneblock - inject one block (4x64-bits) of data
-    //   into the state, s and do some mixing:
-    //
-    //   Inject the data into the state with +=.
-    //   Do the first round of ThreeFry4x64
-    //   reinject, rotated with += again
-    //   Mix s[0] into s[3] and s[2] into s[1] with xor
+    //   into the state, s and do some mixing.  See mixwords.
     static void mixoneblock(const char *data, uint64_t s[4]){
         static const size_t s64 = sizeof(uint64_t);
         uint64_t k0; memcpy(&k0, data+0*s64, s64); k0 = letonative(k0);
         uint64_t k1; memcpy(&k1, data+1*s64, s64); k1 = letonative(k1);
         uint64_t k2; memcpy(&k2, data+2*s64, s64); k2 = letonative(k2);
         uint64_t k3; memcpy(&k3, data+3*s64, s64); k3 = letonative(k3);
+        mixwords(s, k0, k1, k2, k3);
+    }
 
-        uint64_t k4=rotl(k3,R_64x4_2_0), k5=rotl(k2,R_64x4_1_0); 
-        uint64_t k6=rotl(k1,R_64x4_2_1), k7=rotl(k0,R_64x4_1_1); 
+    // rotw - rotl in place, for W, which may be a gcc vector of
+    // uint64_t.
+    template <unsigned R, typename W>
+    static void rotw(W& x){
+        x = (x<<R) | (x>>(64u-R));
+    }
+
+    // mixwords - the arithmetic of mixoneblock.  W is uint64_t, or,
+    //   in hash_many, a gcc vector of uint64_t with one hash per
+    //   lane.  Vectors are never passed or returned by value, so
+    //   there's no vector ABI to worry about.
+    //
+    //   Inject the data into the state with +=.
+    //   Do the first round of ThreeFry4x64
+    //   reinject, rotated with += again
+    //   Mix s[0] into s[3] and s[2] into s[1] with xor
+    template <typename W>
+    static void mixwords(W s[4], const W& k0, const W& k1, const W& k2, const W& k3){
+        W k4=k3, k5=k2, k6=k1, k7=k0;
+        rotw<R_64x4_2_0>(k4); rotw<R_64x4_1_0>(k5);
+        rotw<R_64x4_2_1>(k6); rotw<R_64x4_1_1>(k7);
 
-        s[0] += k0; s[1] += k1; s[2] += k2; s[3] += k3; 
+        s[0] += k0; s[1] += k1; s[2] += k2; s[3] += k3;
 
-        s[0] += s[1]; s[1] = rotl(s[1],R_64x4_0_0); s[1] ^= s[0]; 
-        s[2] += s[3]; s[3] = rotl(s[3],R_64x4_0_1); s[3] ^= s[2]; 
+        s[0] += s[1]; rotw<R_64x4_0_0>(s[1]); s[1] ^= s[0];
+        s[2] += s[3]; rotw<R_64x4_0_1>(s[3]); s[3] ^= s[2];
 
         s[0] += k4; s[1] += k5; s[2] += k6; s[3] += k7;
         s[3] ^= s[0];
@@ -396,6 +445,69 @@ public:
         return ret;
     }
         
+    // hash_many - out[i] = threeroe(data[i], lens[i], seed1,
+    //   seed2).hashpair64() for i in [0, n).  simd says how many
+    //   hashes to compute at once.  It defaults to the widest the
+    //   cpu supports (best_simd()), and anything wider is narrowed to
+    //   that.
+    enum simd_t { SCALAR = 1, AVX2 = 4, AVX512 = 8 };
+    static simd_t best_simd(){
+#if CORE123_THREEROE_X86_SIMD
+        static const simd_t best = [](){
+                                       __builtin_cpu_init();
+                                       if(__builtin_cpu_supports("avx512f"))
+                                           return AVX512;
+                                       if(__builtin_cpu_supports("avx2"))
+                                           return AVX2;
+                                       return SCALAR;
+                                   }();
+        return best;
+#else
+        return SCALAR;
+#endif
+    }
+
+    static void hash_many(size_t n, const void* const data[], const size_t lens[],
+                          hashpair64_type out[], uint64_t seed1 = 0, uint64_t seed2 = 0,
+                          simd_t simd = best_simd()){
+        size_t i = 0;
+#if CORE123_THREEROE_X86_SIMD
+        const size_t lanes = std::min(simd, best_simd());
+        for( ; lanes > 1 && i+lanes <= n; i += lanes){
+            // The SIMD kernel does the blocks that all the lanes
+            // have.  The rest is done one hash at a time.
+            size_t nblk = *std::min_element(&lens[i], &lens[i+lanes]) / CHARS_PER_INBLK;
+            const threeroe init(seed1, seed2);
+            uint64_t s[4][8];
+            for(size_t w=0; w<WORDS_PER_INBLK; ++w)
+                for(size_t j=0; j<lanes; ++j)
+                    s[w][j] = init.state[w];
+            if(nblk){
+                const char* p[8];
+                for(size_t j=0; j<lanes; ++j)
+                    p[j] = static_cast<const char*>(data[i+j]);
+                if(lanes == AVX512)
+                    bulk8(p, nblk, s);
+                else
+                    bulk4(p, nblk, s);
+            }
+            for(size_t j=0; j<lanes; ++j){
+                threeroe h;
+                for(size_t w=0; w<WORDS_PER_INBLK; ++w)
+                    h.state[w] = s[w][j];
+                size_t done = nblk * CHARS_PER_INBLK;
+                h.len = done;
+                h.update(static_cast<const char*>(data[i+j]) + done, lens[i+j] - done);
+                out[i+j] = h.finish();
+            }
+        }
+#else
+        (void)simd;
+#endif
+        for( ; i<n; ++i)
+            out[i] = threeroe(data[i], lens[i], seed1, seed2).hashpair64();
+    }
+
     // In threeroe/0.08 we changed the way SMHasher calls threeroe: it
     // calls the new, endian-independent digest() method, rather than
     // doing endian-dependent type-punning of the values returned by
@@ -469,6 +581,66 @@ private:
         }
         return (char *)b;
     }
+
+#if CORE123_THREEROE_X86_SIMD
+    // load4 - transpose block blk of the 4 inputs at p into k, so
+    //   that lane j of k[w] is word w of input j.
+    __attribute__((target("avx2")))
+    static void load4(const char* const p[4], size_t blk, __m256i k[4]){
+        size_t off = blk * CHARS_PER_INBLK;
+        __m256i r0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p[0] + off));
+        __m256i r1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p[1] + off));
+        __m256i r2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p[2] + off));
+        __m256i r3 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p[3] + off));
+        __m256i t0 = _mm256_unpacklo_epi64(r0, r1); // r0[0] r1[0] r0[2] r1[2]
+        __m256i t1 = _mm256_unpackhi_epi64(r0, r1); // r0[1] r1[1] r0[3] r1[3]
+        __m256i t2 = _mm256_unpacklo_epi64(r2, r3);
+        __m256i t3 = _mm256_unpackhi_epi64(r2, r3);
+        k[0] = _mm256_permute2x128_si256(t0, t2, 0x20);
+        k[1] = _mm256_permute2x128_si256(t1, t3, 0x20);
+        k[2] = _mm256_permute2x128_si256(t0, t2, 0x31);
+        k[3] = _mm256_permute2x128_si256(t1, t3, 0x31);
+    }
+
+    // bulk4, bulk8 - mix nblk blocks of 4 or 8 inputs into the
+    //   states in s, where s[w][j] is word w of input j's state.
+    __attribute__((target("avx2")))
+    static void bulk4(const char* const p[4], size_t nblk, uint64_t s[4][8]){
+        using W = uint64_t __attribute__((__vector_size__(32)));
+        W sv[4], kv[4];
+        for(size_t w=0; w<WORDS_PER_INBLK; ++w)
+            memcpy(&sv[w], s[w], sizeof(W));
+        for(size_t b=0; b<nblk; ++b){
+            load4(p, b, reinterpret_cast<__m256i*>(kv));
+            mixwords(sv, kv[0], kv[1], kv[2], kv[3]);
+        }
+        for(size_t w=0; w<WORDS_PER_INBLK; ++w)
+            memcpy(s[w], &sv[w], sizeof(W));
+    }
+
+    // gcc-12's _mm512_inserti64x4 uses _mm512_undefined_epi32, which
+    // trips -Wmaybe-uninitialized.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+    __attribute__((target("avx2,avx512f")))
+    static void bulk8(const char* const p[8], size_t nblk, uint64_t s[4][8]){
+        using W = uint64_t __attribute__((__vector_size__(64)));
+        W sv[4], kv[4];
+        for(size_t w=0; w<WORDS_PER_INBLK; ++w)
+            memcpy(&sv[w], s[w], sizeof(W));
+        for(size_t b=0; b<nblk; ++b){
+            __m256i lo[4], hi[4];
+            load4(p, b, lo);
+            load4(p+4, b, hi);
+            for(size_t w=0; w<WORDS_PER_INBLK; ++w)
+                kv[w] = W(_mm512_inserti64x4(_mm512_castsi256_si512(lo[w]), hi[w], 1));
+            mixwords(sv, kv[0], kv[1], kv[2], kv[3]);
+        }
+        for(size_t w=0; w<WORDS_PER_INBLK; ++w)
+            memcpy(s[w], &sv[w], sizeof(W));
+    }
+#pragma GCC diagnostic pop
+#endif
 };
 
 } // namespace core123
@@ -29,6 +29,9 @@
 // padded_uchar_span (not just a uchar_span), so they retain the
 // bounding box.
 
+// A "shared_padded_uchar_span" is a padded_uchar_span that also holds
+// a reference-counted pointer to its bounding box.  See below.
+
 // The free function: as_str_view converts from a uchar_span to a
 // str_view.
 
@@ -153,6 +156,53 @@ public:
     }
 };
 
+// A "shared_padded_uchar_span" is a padded_uchar_span that also
+// shares ownership of the memory in its bounding box.  Copying one is
+// a reference-count bump, not a memcpy, so a block of bytes read from
+// disk or the network can be handed from one layer to the next (and
+// held by several at once) without ever being copied.
+//
+// The bytes are not const, but the convention is that they are
+// immutable once they're shared.  Code that wants to modify them in
+// place (e.g., in-place decryption) must first check that
+// use_count()==1, and make a private copy (with copy_of) if it isn't.
+class shared_padded_uchar_span : public padded_uchar_span{
+    std::shared_ptr<unsigned char[]> owner;
+public:
+    // constructors: default, from a uchar_blob (whose memory is
+    // taken over), and from a padded_uchar_span whose bounding box
+    // lies within the bounding box of an existing
+    // shared_padded_uchar_span, e.g., the return value of subspan.
+    shared_padded_uchar_span() : padded_uchar_span(), owner() {}
+    shared_padded_uchar_span(uchar_blob&& blob, size_t offset=0, size_t count=tcb::dynamic_extent) :
+        padded_uchar_span(uchar_span(blob), offset, count),
+        owner(blob.release())
+    {}
+    shared_padded_uchar_span(const shared_padded_uchar_span& sharer, const padded_uchar_span& view) :
+        padded_uchar_span(view),
+        owner(sharer.owner)
+    {
+        auto vbb = view.bounding_box();
+        auto sbb = sharer.bounding_box();
+        if(vbb.data() < sbb.data() || vbb.data() + vbb.size() > sbb.data() + sbb.size())
+            throw std::invalid_argument("shared_padded_uchar_span::ctor view's bounding box is not within the sharer's bounding box");
+    }
+
+    // copy_of - returns a newly allocated (unshared) copy of the
+    // bytes in sv, with pad_front and pad_back bytes of room to
+    // grow in front and back.
+    static shared_padded_uchar_span copy_of(str_view sv, size_t pad_front=0, size_t pad_back=0){
+        uchar_blob b(pad_front + sv.size() + pad_back);
+        if(!sv.empty())
+            ::memcpy(b.data()+pad_front, sv.data(), sv.size());
+        return {std::move(b), pad_front, sv.size()};
+    }
+
+    // use_count - the number of shared_padded_uchar_spans sharing
+    // the bounding box with *this, or 0 if *this is empty.
+    long use_count() const { return owner.use_count(); }
+};
+
 inline str_view as_str_view(uchar_span sp){
     return {reinterpret_cast<const char*>(sp.data()), sp.size()};
 }
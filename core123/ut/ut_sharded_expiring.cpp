@@ -0,0 +1,132 @@
+// Tests for sharded_expiring_cache, and a multithreaded benchmark
+// comparing it to expiring_cache.
+//
+// Usage:  ut_sharded_expiring [nthreads [seconds]]
+
+#include "core123/expiring.hpp"
+#include "core123/threeroe.hpp"
+#include "core123/svto.hpp"
+#include "core123/ut.hpp"
+#include <thread>
+#include <vector>
+#include <iostream>
+
+using std::cout;
+using core123::expiring_cache;
+using core123::sharded_expiring_cache;
+using core123::threeroe;
+using core123::svto;
+
+struct Int{
+    int i;
+    Int(int _i=0): i{_i}{}
+    operator int() const{ return i; }
+};
+
+uint64_t scramble(int i){
+    return threeroe(&i, sizeof(i)).hashpair64().first;
+}
+
+// Each thread does lookups of random-ish keys, and inserts the ones
+// that miss, until the duration is up.  Most lookups hit.  That's
+// what the attrcache sees when many compilers stat the same headers.
+template <typename Cache>
+double mt_lookups_per_sec(Cache& c, unsigned nthreads, std::chrono::duration<double> dur){
+    std::atomic<bool> done(false);
+    std::vector<std::thread> threads;
+    std::vector<size_t> counts(nthreads);
+    auto start = std::chrono::steady_clock::now();
+    for(unsigned t=0; t<nthreads; ++t){
+        threads.emplace_back([&, t](){
+                                 size_t n = 0;
+                                 int i = t;
+                                 while(!done.load(std::memory_order_relaxed)){
+                                     auto k = scramble(i%1000);
+                                     if(c.lookup(k).expired())
+                                         c.insert(k, i, std::chrono::seconds(100));
+                                     i += 7;
+                                     ++n;
+                                 }
+                                 counts[t] = n;
+                             });
+    }
+    std::this_thread::sleep_for(dur);
+    done = true;
+    for(auto& th : threads)
+        th.join();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    size_t total = 0;
+    for(auto n : counts)
+        total += n;
+    return total/elapsed.count();
+}
+
+int main(int argc, char **argv){
+    unsigned nthreads = argc>1 ? svto<unsigned>(argv[1]) : std::max(4u, std::thread::hardware_concurrency());
+    double secs = argc>2 ? svto<double>(argv[2]) : 0.5;
+
+    sharded_expiring_cache<uint64_t, Int> sec(1000, 8);
+    EQUAL(sec.nshards(), 8);
+    for(int i=0; i<50; ++i)
+        CHECK(sec.insert(scramble(i), -i, std::chrono::seconds(100)));
+    // Like expiring_cache, insert does not replace.
+    CHECK(!sec.insert(scramble(0), 99, std::chrono::seconds(100)));
+    EQUAL(sec.size(), 50);
+    for(int i=0; i<50; ++i){
+        auto e = sec.lookup(scramble(i));
+        CHECK(!e.expired());
+        EQUAL(e, -i);
+    }
+    EQUAL(sec.hits(), 50);
+    CHECK(sec.lookup(scramble(1000)).expired());
+    EQUAL(sec.misses(), 1);
+
+    // expiration, with an 'asifnow' in the future.
+    auto later = std::chrono::system_clock::now() + std::chrono::seconds(200);
+    for(int i=0; i<10; ++i)
+        CHECK(sec.lookup(scramble(i), later).expired());
+    EQUAL(sec.expirations(), 10);
+    EQUAL(sec.size(), 40);
+    sec.erase(scramble(10));
+    EQUAL(sec.size(), 39);
+    sec.erase_expired(later);
+    EQUAL(sec.size(), 0);
+
+    // Lots of insertions stay within max_size.
+    for(int i=0; i<100000; ++i)
+        sec.insert(scramble(i), -i, std::chrono::seconds(100));
+    CHECK(sec.size() <= 1000 && sec.size() > 900);
+    CHECK(sec.evictions() > 0);
+    size_t nfound = 0;
+    for(int i=0; i<100000; ++i){
+        auto x = sec.lookup(scramble(i));
+        if(!x.expired()){
+            EQUAL(x, -i);
+            ++nfound;
+        }
+    }
+    EQUAL(nfound, sec.size());
+
+    // Small integer keys (e.g., inos) still spread over the shards.
+    sharded_expiring_cache<uint64_t, Int> small(16, 16);
+    for(int i=0; i<16; ++i)
+        small.insert(i, i, std::chrono::seconds(100));
+    CHECK(small.size() > 8);
+
+    // A zero max_size caches nothing, as with expiring_cache.
+    sharded_expiring_cache<uint64_t, Int> zero(0);
+    CHECK(!zero.insert(1, 1, std::chrono::seconds(100)));
+
+    // The benchmark.  Report, don't CHECK: the numbers depend on
+    // the machine and its load.
+    expiring_cache<uint64_t, Int> ec(100000);
+    sharded_expiring_cache<uint64_t, Int> sharded(100000);
+    std::chrono::duration<double> dur(secs);
+    for(unsigned nt : {1u, nthreads}){
+        auto unsharded_rate = mt_lookups_per_sec(ec, nt, dur);
+        auto sharded_rate = mt_lookups_per_sec(sharded, nt, dur);
+        cout << nt << " threads:  expiring_cache: " << unsharded_rate << " lookups/sec, "
+             << "sharded_expiring_cache(" << sharded.nshards() << " shards): " << sharded_rate << " lookups/sec\n";
+    }
+    return utstatus();
+}
@@ -124,6 +124,69 @@ void trbench(size_t nbytes){
               << (sec*1.e9)/nhash << "nsec/hash, " << (nbytes*nhash/1.e6)/sec << " Mbytes/sec\n";
 }
 
+// check_hash_many - hash_many must agree with one-at-a-time threeroe
+// for every simd_t, whatever the lengths, alignments and seeds.
+void check_hash_many(){
+    std::vector<unsigned char> buf(70000);
+    std::iota(buf.begin(), buf.end(), 7);
+    std::vector<const void*> ptrs;
+    std::vector<size_t> lens;
+    for(size_t i=0; i<301; ++i){
+        // Misaligned pointers, lengths that aren't multiples of the
+        // block size, some empty inputs, and a few long ones mixed in
+        // with short ones.
+        ptrs.push_back(&buf[(i*37)%1000]);
+        lens.push_back(i%50==7 ? 65536+i : (i*i)%333);
+    }
+    for(auto simd : {threeroe::SCALAR, threeroe::AVX2, threeroe::AVX512}){
+        for(uint64_t seed : {0, 99}){
+            std::vector<threeroe::hashpair64_type> out(ptrs.size());
+            threeroe::hash_many(ptrs.size(), ptrs.data(), lens.data(), out.data(), seed, seed+1, simd);
+            size_t bad = 0;
+            for(size_t i=0; i<ptrs.size(); ++i)
+                if(out[i] != threeroe(ptrs[i], lens[i], seed, seed+1).hashpair64())
+                    bad++;
+            EQUAL(bad, 0);
+        }
+    }
+}
+
+// manybench - GB/s on one core for nhash inputs of nbytes each,
+// hashed one at a time, and with hash_many using each simd_t.
+void manybench(size_t nbytes){
+    const size_t nhash = 64;
+    std::vector<unsigned char> v(nbytes*nhash);
+    std::iota(v.begin(), v.end(), 0);
+    std::vector<const void*> ptrs;
+    std::vector<size_t> lens(nhash, nbytes);
+    for(size_t i=0; i<nhash; ++i)
+        ptrs.push_back(&v[i*nbytes]);
+    std::vector<threeroe::hashpair64_type> out(nhash);
+
+    uint64_t sum = 0;
+    auto report = [&](const char* what, const core123::timeit_result& timing){
+                      auto sec = dur2dbl(timing.dur);
+                      std::cout << std::setprecision(2) << std::fixed;
+                      std::cout << what << "(" << nbytes << " bytes): "
+                                << (timing.count*nhash*nbytes/1.e9)/sec << " GB/s\n";
+                  };
+    report("one at a time   ", timeit(std::chrono::seconds(1), [&](){
+                                                for(size_t i=0; i<nhash; ++i)
+                                                    sum += threeroe(ptrs[i], nbytes).hash64();
+                                            }));
+    for(auto simd : {threeroe::SCALAR, threeroe::AVX2, threeroe::AVX512}){
+        if(simd > threeroe::best_simd())
+            break;
+        auto timing = timeit(std::chrono::seconds(1), [&](){
+                                            threeroe::hash_many(nhash, ptrs.data(), lens.data(), out.data(), 0, 0, simd);
+                                            sum += out[0].first;
+                                        });
+        report(simd==threeroe::SCALAR ? "hash_many SCALAR" : simd==threeroe::AVX2 ? "hash_many AVX2  " : "hash_many AVX512", timing);
+    }
+    if(sum==0)
+        std::cout << "Surpise!  sum==0\n";
+}
+
 int main(int,  char **){
     uint32_t v = verifier();
     int errs = 0;
@@ -147,5 +210,10 @@ int main(int,  char **){
     trbench(1000000);
     trbench(100000000);
 
+    check_hash_many();
+    std::cout << "best_simd: " << threeroe::best_simd() << " lanes\n";
+    for(size_t nbytes : {32, 64, 256, 4096, 65536, 1<<20})
+        manybench(nbytes);
+
     return utstatus();
 }
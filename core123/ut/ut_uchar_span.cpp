@@ -7,6 +7,8 @@
 using core123::complain;
 using core123::padded_uchar_span;
 using core123::uchar_blob;
+using core123::shared_padded_uchar_span;
+using core123::as_str_view;
 
 int main(int, char **) try {
     uchar_blob ub(33);
@@ -58,6 +60,44 @@ int main(int, char **) try {
     EQUAL(w.avail_front(), 0);
     EQUAL(w.avail_back(), 0);
 
+    // shared_padded_uchar_span
+    shared_padded_uchar_span empty;
+    EQUAL(empty.use_count(), 0);
+    EQUAL(empty.size(), 0);
+
+    auto sp = shared_padded_uchar_span::copy_of("hello world", 16, 4);
+    EQUAL(sp.use_count(), 1);
+    EQUAL(as_str_view(sp), "hello world");
+    EQUAL(sp.avail_front(), 16);
+    EQUAL(sp.avail_back(), 4);
+    {
+        auto sp2 = sp;   // no copy of the bytes
+        EQUAL(sp.use_count(), 2);
+        CHECK(sp2.data() == sp.data());
+        shared_padded_uchar_span world(sp2, sp2.last(5));
+        EQUAL(sp.use_count(), 3);
+        EQUAL(as_str_view(world), "world");
+        EQUAL(world.avail_front(), 16+6);
+        EQUAL(world.avail_back(), 4);
+    }
+    EQUAL(sp.use_count(), 1);
+
+    uchar_blob ub2(10);
+    auto ub2data = ub2.data();
+    shared_padded_uchar_span fromblob(std::move(ub2), 2, 3);
+    CHECK(!ub2);
+    CHECK(fromblob.data() == ub2data+2);
+    EQUAL(fromblob.size(), 3);
+    EQUAL(fromblob.bounding_box().size(), 10);
+
+    caught = false;
+    try{
+        shared_padded_uchar_span bogus(sp, fromblob);
+    }catch(std::invalid_argument&){
+        caught = true;
+    }
+    CHECK(caught);
+
     return utstatus(true);
 }catch(std::exception& e) {
     complain(e, "Exception caught.  main returns 1");
@@ -40,6 +40,8 @@ int complain(){
         " LogDestination\n"
         " HttpMaxRedirects\n"
         " CurlHandlesRedirects\n"
+        " EwmaOriginSelection\n"
+        " EwmaOriginSeconds\n"
         " LogMaxHourlyRate\n"
         " EvictLwm\n"
         " EvictTargetFraction\n"
@@ -140,6 +142,10 @@ int app_ctl(int argc, char **argv) try {
         ioc = HTTP_MAXREDIRECTS_IOC;
     }else if(cmd == "CurlHandlesRedirects"){
         ioc = CURL_HANDLES_REDIRECTS_IOC;
+    }else if(cmd == "EwmaOriginSelection"){
+        ioc = EWMA_ORIGIN_SELECTION_IOC;
+    }else if(cmd == "EwmaOriginSeconds"){
+        ioc = EWMA_ORIGIN_SECONDS_IOC;
     }else if(cmd == "LogMaxHourlyRate"){
         ioc = LOG_MAX_HOURLY_RATE_IOC;
     }else if(cmd == "EvictLwm"){
@@ -29,6 +29,7 @@
 #include "special_ino.hpp"
 #include "fuseful.hpp"
 #include "openfilemap.hpp"
+#include "memcache.hpp"
 #include "fs123/fs123_ioctl.hpp"
 #include "fs123/stat_serializev3.hpp"
 #include "fs123/httpheaders.hpp"
@@ -55,12 +56,15 @@
 #include <core123/strutils.hpp>
 #include <core123/pathutils.hpp>
 #include <core123/periodic.hpp>
+#include <core123/threadpool.hpp>
 #include <core123/addrinfo_cache.hpp>
 #include <core123/non_null_or_throw.hpp>
 #include <fuse/fuse_lowlevel.h>
 
 #include <unordered_map>
+#include <unordered_set>
 #include <thread>
+#include <future>
 #include <exception>
 #include <memory>
 #include <mutex>
@@ -169,13 +173,24 @@ size_t Fs123Chunk;
 // Nevertheless, they are used freely, without checking for validity
 // in the callbacks.  Wrapping them in a unique_ptr prevents valgrind
 // from complaining about them at program termination.
+//
+// Every lookup, getattr, open and readlink goes through one or the
+// other, so they're sharded to keep their mutexes from becoming a
+// point of contention when many threads are busy.
 
 std::string baseurl;
 static_assert(sizeof(fuse_ino_t) == sizeof(uint64_t), "fuse_ino_t must be 64 bits");
-std::unique_ptr<expiring_cache<fuse_ino_t, std::string>> linkmap;
+std::unique_ptr<sharded_expiring_cache<fuse_ino_t, std::string>> linkmap;
 
 
-std::unique_ptr<expiring_cache<fuse_ino_t, attrcache_value_t, clk123_t>> attrcache;
+std::unique_ptr<sharded_expiring_cache<fuse_ino_t, attrcache_value_t, clk123_t>> attrcache;
+// Stale attrcache entries are revalidated in the background by the
+// attr_revalidate_tp threadpool.  attr_revalidating holds the keys
+// that are currently being revalidated so we don't pile up duplicates.
+// See attr_revalidate_detached.
+std::unique_ptr<core123::threadpool<void>> attr_revalidate_tp;
+std::mutex attr_revalidating_mtx;
+std::unordered_set<uint64_t> attr_revalidating;
 bool privileged_server;
 bool support_xattr;
 // Note that the 0-valued 'squash_ids' mean DO NOT SQUASH.  Thus, you
@@ -195,8 +210,34 @@ std::unique_ptr<addrinfo_cache> aicache;
 backend123* be;
 std::unique_ptr<backend123_http> http_be;
 std::unique_ptr<diskcache> diskcache_be;
+std::unique_ptr<diskcache> slowcache_be; // the lower tier, if any.  See diskcache::set_lower_tier.
 std::unique_ptr<distrib_cache_backend> distrib_cache_be;
 
+// The readahead threadpool prefetches chunks of sequentially-read
+// files into the diskcache.  It's only created if there's a
+// diskcache.  See readahead_advise.
+std::unique_ptr<core123::threadpool<void>> readahead_tp;
+std::atomic<size_t> readahead_inflight_bytes;
+std::atomic<bool> readahead_stopping;
+
+// The chunk threadpool fetches the second and subsequent chunks of a
+// read that straddles chunk boundaries, so they're requested
+// concurrently with the first.  The threads are long-lived so that
+// their thread_local curl handles (see backend123_http.cpp) keep
+// their connections open from one read to the next.  It's null if
+// Fs123ChunkThreads is 0.  See fs123_read.
+std::unique_ptr<core123::threadpool<decoded_reply>> chunk_tp;
+unsigned chunk_threads;
+
+// The memcache holds recently decoded replies, keyed by the
+// (unencrypted) urlstem, in front of the whole backend chain.  A
+// fresh hit costs no syscalls, no threeroe and no decryption.  See
+// beget_decode_memcached.  It's null if Fs123MemCacheMBytes is 0,
+// which is the default:  its memory comes on top of the kernel's
+// page cache, which already holds recently read data, so it's
+// opt-in for mounts that are known to benefit.
+std::unique_ptr<memcache<std::string, decoded_reply, clk123_t>> dr_memcache;
+
 // The maintenance task runs in the background, started in fs123_init and destroyed
 // in fs123_destroy
 std::unique_ptr<core123::periodic> maintenance_task;
@@ -221,9 +262,15 @@ std::string signal_filename;
 bool no_kernel_data_caching; // DEBUGGING TESTING ONLY.  WILL KILL PERFORMANCE!
 bool no_kernel_attr_caching;   // DEBUGGING TESTING ONLY.  WILL KILL PERFORMANCE!
 bool no_kernel_dentry_caching;   // DEBUGGING TESTING ONLY.  WILL KILL PERFORMANCE!
+bool nochunk_direct_io;  // see fs123_read_nochunk
+// nochunk_fh is the fi->fh of an O_DIRECT open that's read by
+// fs123_read_nochunk.  It's never a valid openfile_register handle.
+const uint64_t nochunk_fh = 1;
+std::atomic<bool> readdirplus; // see begetchunk_dir
 
 std::string executable_path;
 std::string cache_dir;
+std::string slow_cache_dir;
 std::string diag_destination;
 std::string log_destination;
 
@@ -574,12 +621,12 @@ void rethrow_to_abandon_retry(std::exception& e, const req123& req, const reply1
 // outages and unreliable servers) will be retried starting at
 // 100msec, exponentially backing off to 1sec, and then for one second
 // until the RetryTimeout is reached.
-auto retrying_berefresh(const req123& req){
+auto retrying_berefresh(const req123& req, backend123* b){
     delay_manager<> dm(volatiles->retry_timeout, volatiles->retry_initial_millis, volatiles->retry_saturate);
     reply123 reply;
     while(1)
         try{
-            be->refresh(req, &reply);
+            b->refresh(req, &reply);
             return reply;
         }catch(std::exception &e){
             rethrow_to_abandon_retry(e, req, reply, dm);
@@ -589,12 +636,12 @@ auto retrying_berefresh(const req123& req){
     // notreached
 }
 
-decoded_reply beget_decode(const req123& req){
+decoded_reply beget_decode(const req123& req, backend123* b){
     // FIXME?  This feels like it belongs in the decoded_reply constructor.
     // It more-or-less *is* the decoded_reply constructor.
     // But then  the decoded_reply constructor would have to know about
     // secret_mgr.  Is that better than this??
-    reply123 reply = retrying_berefresh(req);
+    reply123 reply = retrying_berefresh(req, b);
     switch(reply.content_encoding){
     case content_codec::CE_IDENT:
         if(!accept_plaintext_replies)
@@ -606,16 +653,51 @@ decoded_reply beget_decode(const req123& req){
     case content_codec::CE_FS123_SECRETBOX:
         if(!secret_mgr)
             throw se(EIO, "reply is encoded with secretbox, but there's no secret manager");
-        auto sp = content_codec::decode(reply.content_encoding, as_uchar_span(reply.content), *secret_mgr); // might throw, trashes content
-        // FIXME: If reply.content were a span, we'd just put it on
-        // the lhs of the assignment above and we'd be done.  But
-        // since it's a string, we're obliged to make a new one and
-        // copy the decoded span into it.
-        return {std::move(reply), std::string(as_str_view(sp)), req.urlstem};
+        // decode works in place, i.e., it trashes the ciphertext.
+        // That's fine if we're the only owner of reply.content, but
+        // if a backend (e.g., the diskcache's background serializer)
+        // is sharing it, we have to decode a private copy.
+        shared_padded_uchar_span rc = std::move(reply.content);
+        if(rc.use_count() > 1){
+            stats.decode_shared_copies++;
+            stats.decode_shared_copy_bytes += rc.size();
+            rc = shared_padded_uchar_span::copy_of(as_str_view(rc));
+        }
+        auto sp = content_codec::decode(reply.content_encoding, rc, *secret_mgr); // might throw, trashes rc
+        return {std::move(reply), shared_padded_uchar_span(rc, sp), req.urlstem};
     }
     throw se(EIO, "Unrecognized content-encoding");
 }
 
+// beget_decode_memcached - look for a fresh decoded_reply for
+// mckey in the memcache.  If there isn't one, call beget_decode and
+// insert the result into the memcache (replacing any stale entry).
+// Only requests for the top of the backend chain use the memcache,
+// and no_cache requests don't look in it (but they do replace
+// what's there).  Stale entries are never returned: it's up to the
+// backend chain (e.g., the diskcache) to decide whether stale data
+// is usable within the stale-while-revalidate window.
+decoded_reply beget_decode_memcached(const std::string& mckey, const req123& req, backend123* b){
+    if(!dr_memcache || b != be)
+        return beget_decode(req, b);
+    if(!req.no_cache){
+        auto hit = dr_memcache->lookup(mckey);
+        if(hit)
+            return hit->copy();
+    }
+    auto reply = beget_decode(req, b);
+    if(reply.cacheable){
+        // Charge the entry for the whole bounding box of the
+        // plaintext (which may be bigger than the plaintext itself),
+        // and make a guess at the overhead of the key, the kvmap and
+        // the memcache's own bookkeeping.
+        size_t bytes = reply._plaintext.bounding_box().size() + reply.kvinputstring7_2.size()
+            + 2*mckey.size() + sizeof(decoded_reply) + 64*(reply.kvmap.size()+2);
+        dr_memcache->insert(mckey, std::make_shared<decoded_reply>(reply.copy()), reply.expires, bytes);
+    }
+    return reply;
+}
+
 // fullname - slightly tricky because pino might be the ino of the
 // *parent* of the mount-point itself, in which case, we can't call
 // ino_to_fullname on it...
@@ -660,6 +742,8 @@ void beflush(fuse_ino_t pino, str_view lastcomponent){
     std::string name = fullname(pino, lastcomponent);
     req123 req = req123::attrreq(name);
     req.no_cache = true;
+    if(dr_memcache)
+        dr_memcache->erase(req.urlstem);
     if(encrypt_requests)
         encrypt_request(req);
     reply123 unused;
@@ -673,11 +757,16 @@ void beflush(fuse_ino_t pino, str_view lastcomponent){
 // tries again with req.no_cache = true, and if there's still a
 // mismatch, invalidate the entry in the kernel, call beflush to
 // flush/replace the attributes in the attrcache and web caches, and
-// throw an ESTALE.
-decoded_reply beget(fuse_ino_t ino, req123& req, bool check_cookie){
+// throw an ESTALE.  The optional last argument may be used to skip
+// the top of the stack of backends, e.g., to bypass the diskcache.
+decoded_reply beget(fuse_ino_t ino, req123& req, bool check_cookie, backend123* b = nullptr){
+    if(!b)
+        b = be;
+    // The memcache is keyed by the unencrypted urlstem.
+    std::string mckey = dr_memcache ? req.urlstem : std::string{};
     if(encrypt_requests)
         encrypt_request(req);
-    auto reply = beget_decode(req);
+    auto reply = beget_decode_memcached(mckey, req, b);
     if(!(reply.eno==0 && check_cookie && cookie_mismatch(ino, reply.estale_cookie())))
         // We return from here the vast majority of  the time!
         return reply;
@@ -688,7 +777,7 @@ decoded_reply beget(fuse_ino_t ino, req123& req, bool check_cookie){
     stats.estale_retries++;
     req123 ncreq = req;
     ncreq.no_cache = true;
-    reply = beget_decode(ncreq);
+    reply = beget_decode_memcached(mckey, ncreq, b);
     if(reply.eno==0 && check_cookie && cookie_mismatch(ino, reply.estale_cookie())){
         // The estale cookie has changed, making the ino itself bogus.
         // Let's tell the kernel:
@@ -709,6 +798,8 @@ decoded_reply beget(fuse_ino_t ino, req123& req, bool check_cookie){
         // /a/ 'getattr' URL is stale.  For the benefit of future
         // accesses, we want to flush that too.
         beflush(pino_name.first, pino_name.second);
+        if(dr_memcache)
+            dr_memcache->erase(mckey);
         stats.estale_thrown++;
         throw se(ESTALE, "estale detected in befresh:  req.urlstem: " + req.urlstem
                  + " reply.estale_cookie: " + std::to_string(reply.estale_cookie()));
@@ -716,69 +807,228 @@ decoded_reply beget(fuse_ino_t ino, req123& req, bool check_cookie){
     return reply;
 }
 
+// cc_seconds - returns the value of the 'key=' directive (e.g.,
+// max-age=) in a cache-control string, or 0 if there isn't one.
+// Take care not to match s-maxage when we're looking for max-age.
+long cc_seconds(str_view cc, str_view key){
+    str_view::size_type pos = 0;
+    while( (pos = cc.find(key, pos)) != str_view::npos ){
+        if(pos == 0 || cc[pos-1] == ',' || ::isspace(cc[pos-1])){
+            auto start = pos + key.size();
+            auto end = cc.find(',', start);
+            return svto<long>(cc.substr(start, end==str_view::npos ? end : end-start));
+        }
+        pos += 1;
+    }
+    return 0;
+}
+
+// dirplus_to_dir - parse the content of an /r (readdirplus) reply
+// for the directory ino.  Entries that carry attributes are inserted
+// into the attrcache, as if they'd been obtained by begetattr.  The
+// return value is the same content in the format of a /d reply, so
+// that readdir's byte-offsets are the same for /r and /d.
+//
+// Each entry's max-age is relative to when the origin generated the
+// /r reply, not to now:  the reply may have spent a while in a proxy
+// cache or in our diskcache.  And an entry never outlives the /r
+// reply it came in.
+std::string dirplus_to_dir(fuse_ino_t ino, const decoded_reply& dr){
+    str_view svin = dr.content();
+    std::string ret;
+    ret.reserve(svin.size());
+    size_t off = svscan(svin, nullptr, 0);
+    while(off < svin.size()){
+        str_view name, attrs, cc;
+        int d_type;
+        uint64_t esc;
+        uint64_t validator;
+        off = svscan_netstring(svin, &name, off);
+        off = svscan(svin, &d_type, off);
+        off = svscan(svin, &esc, off);
+        off = svscan_netstring(svin, &attrs, off);
+        off = svscan(svin, &validator, off);
+        off = svscan_netstring(svin, &cc, off);
+        off = svscan(svin, nullptr, off);
+        ret += netstring(name) + ' ' + std::to_string(d_type) + ' ' + std::to_string(esc) + '\n';
+        if(attrs.empty() || !dr.cacheable)
+            continue;
+        attrcache_value_t av;
+        av.eno = 0;
+        svscan(attrs, &av.sb, 0);
+        av.estale_cookie = (S_ISREG(av.sb.st_mode) || S_ISDIR(av.sb.st_mode)) ? esc : 0;
+        av.validator = validator;
+        av.stale_while_revalidate = std::chrono::seconds(cc_seconds(cc, "stale-while-revalidate="));
+        av.cacheable = true;
+        av.expires = std::min(dr.expires, dr.last_refresh + std::chrono::seconds(cc_seconds(cc, "max-age=")));
+        if(attrcache->insert(attrcache_key(ino, name), av, av.expires + av.stale_while_revalidate))
+            stats.readdirplus_attrs_primed++;
+    }
+    return ret;
+}
+
+// has_http_400 - is there an http 400 (Bad Request) anywhere in the nest?
+bool has_http_400(const std::exception& e){
+    for(auto& er : rexnest(e)){
+        auto sep = dynamic_cast<const std::system_error*>(&er);
+        if(sep && sep->code().category() == http_error_category() && sep->code().value() == 400)
+            return true;
+    }
+    return false;
+}
+
 // The different variants of begetchunk are "necessary" because of the need
 // to accomodate unpredictable (possibly negative) values of
 // chunkstart and the begin flag necessary for readdir.
-auto begetchunk_dir(fuse_ino_t ino, const std::string& start){
+//
+// begetchunk_dir sets *dcontents to the content of the reply, in the
+// format of a /d reply.  If readdirplus is true, we first ask for /r,
+// which primes the attrcache with the attributes of the directory's
+// entries, saving the /a round-trip in the lookups that almost always
+// follow a readdir.  Servers that don't know about /r reply with
+// ENOTSUP (or with a 400 if they're older still), after which we stop
+// asking and just use /d.
+decoded_reply begetchunk_dir(fuse_ino_t ino, const std::string& start, std::string* dcontents){
     std::string name = ino_to_fullname(ino);
+    if(readdirplus){
+        req123 req = req123::dirplusreq(name, Fs123Chunk, start);
+        try{
+            auto reply = beget(ino, req, true);
+            if(reply.eno != ENOTSUP){
+                stats.readdirplus_chunks++;
+                if(reply.eno == 0)
+                    *dcontents = dirplus_to_dir(ino, reply);
+                return reply;
+            }
+        }catch(std::exception& e){
+            if(!has_http_400(e))
+                throw;
+        }
+        if(readdirplus.exchange(false)){
+            stats.readdirplus_fallbacks++;
+            complain(LOG_NOTICE, "server does not support /r (readdirplus).  Falling back to /d");
+        }
+    }
     req123 req = req123::dirreq(name, Fs123Chunk, start);
-    return beget(ino, req, true);
+    auto reply = beget(ino, req, true);
+    if(reply.eno == 0)
+        *dcontents = std::string(reply.content());
+    return reply;
 }    
 
-auto begetchunk_file(fuse_ino_t ino, int64_t startkib, bool no_cache = false){
+auto begetrange_file(fuse_ino_t ino, uint64_t lenkib, int64_t startkib, bool no_cache, backend123* b){
     std::string name = ino_to_fullname(ino);
-    req123 req = req123::filereq(name, Fs123Chunk, startkib);
+    req123 req = req123::filereq(name, lenkib, startkib);
     req.no_cache = no_cache;
-    return beget(ino, req, true);
+    return beget(ino, req, true, b);
 }    
 
-begetattr_t begetattr(fuse_ino_t pino, str_view lc, fuse_ino_t ino, std::optional<int> max_stale, bool no_cache){
+// begetattr_upstream - get the attributes from the backend chain and
+// insert them into the attrcache, replacing whatever was there
+// (e.g., a stale entry that's being revalidated).  If the reply is an
+// error (e.g., ENOENT), whatever was there is erased.
+begetattr_t begetattr_upstream(fuse_ino_t pino, str_view lc, fuse_ino_t ino, std::optional<int> max_stale, bool no_cache){
     auto key = attrcache_key(pino, lc);
-    if(no_cache){
-        attrcache->erase(key);
-    }else{
-        auto cached_reply = attrcache->lookup(key);
-        if( !cached_reply.expired() ){
-            if( !cookie_mismatch(ino, cached_reply.estale_cookie) )
-                return cached_reply;
-            // It's not clear how we get here.  But if we're here
-            // the reply stored in the attrcache is for the same name, but
-            // a different 'ino' than the one we're being asked about.
-            // Delete the attrcache entry and fall through to refresh.
-            complain(LOG_NOTICE, "attrcache erased:  cookie mismatch in " + strfunargs("begetattr", pino, lc,  ino) + " cached.estale_cookie: " + str(cached_reply.estale_cookie));
-            attrcache->erase(key);
-        }
-    }
-    DIAGkey(_getattr, str("attrcache miss: pino:", pino, "lastcomponent:", lc));
-    // If we get here, the key is no longer in the attrcache.  Either
-    // it was expired, in which case it was erased as part of the lookup,
-    // or it was unexpired but had a cookie_mismatch, in which case
-    // we erased it on the line above.  In any case, there's no need
-    // to erase it again.
     std::string name = fullname(pino,  lc);
     req123 req = req123::attrreq(name);
     req.max_stale = max_stale;
     req.no_cache = no_cache;
     decoded_reply dr = beget(ino, req, true);
-    // A subsequent request might be for max-stale=0.  Since the
-    // attrcache doesn't understand swr or max-stale, we can't put
-    // anything in the cache that's expired but within the swr window.
-    // Therefore, use dr.expires, not dr.stale_while_revalidate for
-    // the insertion time_point.
-    //
-    // FIXME: the attrcache should "understand" stale-while-revalidate
-    // and max-stale.
-    expiring<attrcache_value_t> eav{dr.expires, dr};
+    // The attrcache entry lives until the end of the
+    // stale-while-revalidate window, but the value returned to our
+    // caller expires at dr.expires.  See begetattr.
+    attrcache_value_t av(dr);
     if(dr.eno == 0){
         DIAGkey(_getattr||_validator, "/a reply with content: " <<  dr.content() << "\n");
-        bool inserted = attrcache->insert(key, eav);
+        attrcache->erase(key);
+        bool inserted = attrcache->insert(key, av, dr.expires + dr.stale_while_revalidate);
         DIAGfkey(_getattr, "attrcache->insert(pino=%ju, lastcomponent=%s, key=%ju, name=%s, estale_cookie=%ju ttl=%s):  %s\n",
                  (uintmax_t)pino, std::string(lc).c_str(),
                  (uintmax_t)key, name.c_str(), (uintmax_t)dr.estale_cookie(), str(dr.expires).c_str(),
                  inserted? "replaced" : "did not replace");
-        DIAG(_validator && inserted, "attrcache->insert with validator = " << eav.validator);
+        DIAG(_validator && inserted, "attrcache->insert with validator = " << av.validator);
+    }else{
+        // Don't let a stale entry for a name that's gone (or is now
+        // an error) outlive the reply that says so.
+        attrcache->erase(key);
+    }
+    return {dr.expires, av};
+}
+
+// attr_revalidate_detached - called by begetattr when it returns a
+// stale attrcache entry from within its stale-while-revalidate
+// window.  Refreshes the entry in the attr_revalidate_tp threadpool.
+// Any number of callers may ask for the same key while it's being
+// refreshed, but only the first one submits anything.
+void attr_revalidate_detached(fuse_ino_t pino, str_view lc, fuse_ino_t ino, uint64_t key){
+    {
+        std::lock_guard<std::mutex> lg(attr_revalidating_mtx);
+        if(!attr_revalidating.insert(key).second){
+            stats.attrcache_swr_dups++;
+            return;
+        }
+    }
+    auto done = [key](){
+                    std::lock_guard<std::mutex> lg(attr_revalidating_mtx);
+                    attr_revalidating.erase(key);
+                };
+    try{
+        attr_revalidate_tp->submit([pino, lc=std::string(lc), ino, key, done](){
+                                       try{
+                                           // max_stale=0:  don't let a cache below us
+                                           // hand back the same stale reply.
+                                           begetattr_upstream(pino, lc, ino, 0, false);
+                                           stats.attrcache_swr_refreshes++;
+                                       }catch(std::exception& e){
+                                           // Let the next caller try again in the foreground.
+                                           attrcache->erase(key);
+                                           stats.attrcache_swr_errors++;
+                                           complain(LOG_WARNING, e, "attr_revalidate_detached(pino=%ju, lc=%s):  background refresh failed",
+                                                    (uintmax_t)pino, lc.c_str());
+                                       }
+                                       done();
+                                   });
+    }catch(std::exception& e){
+        done();
+        complain(LOG_WARNING, e, "attr_revalidate_detached:  failed to submit to threadpool");
+    }
+}
+
+begetattr_t begetattr(fuse_ino_t pino, str_view lc, fuse_ino_t ino, std::optional<int> max_stale, bool no_cache){
+    auto key = attrcache_key(pino, lc);
+    if(no_cache){
+        attrcache->erase(key);
+    }else{
+        auto cached_reply = attrcache->lookup(key);
+        if( !cached_reply.expired() ){
+            if( !cookie_mismatch(ino, cached_reply.estale_cookie) ){
+                // The attrcache entry is good until the end of the
+                // stale-while-revalidate window.  If it's fresh, or
+                // if it's stale but we're allowed to use it, return
+                // it immediately.  In the latter case, revalidate it
+                // in the background.
+                auto now = clk123_t::now();
+                if(now <= cached_reply.expires)
+                    return {cached_reply.expires, cached_reply};
+                if(attr_revalidate_tp && (!max_stale || now - cached_reply.expires <= std::chrono::seconds(*max_stale))){
+                    stats.attrcache_swr_hits++;
+                    attr_revalidate_detached(pino, lc, ino, key);
+                    return {cached_reply.expires, cached_reply};
+                }
+                // Too stale for our caller.  Fall through to a
+                // synchronous refresh, which will replace the entry.
+            }else{
+                // It's not clear how we get here.  But if we're here
+                // the reply stored in the attrcache is for the same name, but
+                // a different 'ino' than the one we're being asked about.
+                // Delete the attrcache entry and fall through to refresh.
+                complain(LOG_NOTICE, "attrcache erased:  cookie mismatch in " + strfunargs("begetattr", pino, lc,  ino) + " cached.estale_cookie: " + str(cached_reply.estale_cookie));
+                attrcache->erase(key);
+            }
+        }
     }
-    return eav;
+    DIAGkey(_getattr, str("attrcache miss: pino:", pino, "lastcomponent:", lc));
+    return begetattr_upstream(pino, lc, ino, max_stale, no_cache);
 }
 
 auto begetstatfs(fuse_ino_t ino) {
@@ -986,7 +1236,20 @@ void fs123_init(void *, struct fuse_conn_info *conn_info) try {
     //
     Fs123Chunk = envto<size_t>("Fs123Chunk", 128);
     if(Fs123Chunk < 128)
-        complain(LOG_WARNING, "Fs123Chunk *may* be too small.  It must be large enough that the largest kernel-read request can be satisfied by no more than two chunks.  Don't be surprised by read errors");
+        complain(LOG_WARNING, "Fs123Chunk *may* be too small.  Large kernel-read requests will be satisfied by gathering several chunks, each of which is a separate request to the backend");
+
+    // Large reads are gathered from as many chunks as necessary (see
+    // fs123_read), so nothing here limits the size of kernel reads.
+    // That's governed by the max_read mount option and the kernel's
+    // max_pages (which libfuse2 doesn't negotiate, so 128KiB in
+    // practice).  The kernel offers its max_readahead in conn_info,
+    // and libfuse passes it through unless we lower it.  The default
+    // (0) accepts the kernel's offer.
+    auto max_readahead_kib = envto<unsigned>("Fs123MaxReadaheadKiB", 0);
+    if(max_readahead_kib){
+        conn_info->max_readahead = std::min(conn_info->max_readahead, max_readahead_kib*KiB);
+        complain(LOG_NOTICE, "fs123_init: conn_info->max_readahead set to %u", conn_info->max_readahead);
+    }
 
     req123::cachetag = envto<unsigned long>("Fs123CacheTag", 0);
     st_ino_mask = ~fuse_ino_t(0);
@@ -1107,8 +1370,18 @@ void fs123_init(void *, struct fuse_conn_info *conn_info) try {
         // it possible for multiple clients to share the same cache.
         // Requests made to different baseurls will (with high probability)
         // not collide.
+        slow_cache_dir = envto<std::string>("Fs123SlowCacheDir", "");
+        if(!slow_cache_dir.empty() && volatiles->dc_slow_maxmbytes){
+            // A tiered cache.  The lower tier goes between the
+            // (fast) diskcache and the network.
+            slowcache_be = std::make_unique<diskcache>(be, slow_cache_dir, threeroe(baseurl).hash64(),
+                                                       *volatiles, true/*lower_tier*/);
+            be = slowcache_be.get();
+        }
         diskcache_be = std::make_unique<diskcache>(be, cache_dir, threeroe(baseurl).hash64(),
                                                    *volatiles);
+        if(slowcache_be)
+            diskcache_be->set_lower_tier(slowcache_be.get());
         be = diskcache_be.get();
     }
 
@@ -1121,7 +1394,7 @@ void fs123_init(void *, struct fuse_conn_info *conn_info) try {
         // of these 'styles'
         if(distrib_cache_style == "diskcache-in-front"){
             distrib_cache_be = std::make_unique<distrib_cache_backend>(http_be.get(), diskcache_be.get(), baseurl, secret_mgr.get(), *aicache, *volatiles);
-            diskcache_be->set_upstream(distrib_cache_be.get());
+            (slowcache_be ? slowcache_be : diskcache_be)->set_upstream(distrib_cache_be.get());
         }else if(distrib_cache_style == "diskcache-behind"){
             distrib_cache_be = std::make_unique<distrib_cache_backend>(diskcache_be.get(), diskcache_be.get(), baseurl, secret_mgr.get(), *aicache, *volatiles);
             be = distrib_cache_be.get();
@@ -1132,15 +1405,36 @@ void fs123_init(void *, struct fuse_conn_info *conn_info) try {
 
     auto attrcachesz = envto<size_t>("Fs123AttrCacheSize", 100000);
     attrcache = std::make_unique<decltype(attrcache)::element_type>(attrcachesz);
+    auto attr_revalidate_threads = envto<unsigned>("Fs123AttrRevalidateThreads", 4);
+    if(attr_revalidate_threads)
+        attr_revalidate_tp = std::make_unique<core123::threadpool<void>>(attr_revalidate_threads);
 
     auto linkmapsz = envto<size_t>("Fs123LinkCacheSize", 10000);
     linkmap = std::make_unique<decltype(linkmap)::element_type>(linkmapsz);
     ino_remember(g_mount_dotdot_ino, "", 1, ~0);
 
+    auto memcache_mbytes = envto<size_t>("Fs123MemCacheMBytes", 0);
+    if(memcache_mbytes)
+        dr_memcache = std::make_unique<decltype(dr_memcache)::element_type>(memcache_mbytes*1000000,
+                                                                             envto<size_t>("Fs123MemCacheShards", 16));
+
     openfile_startscan();
+    // Readahead only makes sense if there's a diskcache to hold
+    // the prefetched chunks.
+    auto readahead_threads = envto<unsigned>("Fs123ReadaheadThreads", 8);
+    if(diskcache_be && readahead_threads){
+        readahead_stopping = false;
+        readahead_tp = std::make_unique<core123::threadpool<void>>(readahead_threads);
+    }
+    chunk_threads = envto<unsigned>("Fs123ChunkThreads", 16);
+    if(chunk_threads)
+        chunk_tp = std::make_unique<core123::threadpool<decoded_reply>>(chunk_threads);
     no_kernel_data_caching = envto<bool>("Fs123NoKernelDataCaching", false);
     no_kernel_attr_caching = envto<bool>("Fs123NoKernelAttrCaching", false);
     no_kernel_dentry_caching = envto<bool>("Fs123NoKernelDentryCaching", false);
+    nochunk_direct_io = envto<bool>("Fs123NoChunkDirectIO", true);
+    // /r is new in 7.3.
+    readdirplus = envto<bool>("Fs123ReaddirPlus", true) && backend123::proto_minor >= 3;
 
     named_pipe_name = envto<std::string>("Fs123CommandPipe", "");
     if( !named_pipe_name.empty() ){
@@ -1232,11 +1526,18 @@ void fs123_destroy(void*){
         close(named_pipe_fd);
         named_pipe_fd = -1;
     }
+    readahead_stopping = true;    // queued prefetches return immediately
+    readahead_tp.reset();         DIAG(_shutdown, "readahead_tp.reset() done");
+    chunk_tp.reset();             DIAG(_shutdown, "chunk_tp.reset() done");
+    dr_memcache.reset();          DIAG(_shutdown, "dr_memcache.reset() done");
     openfile_stopscan();          DIAG(_shutdown, "openfile_stopscan() done");
+    attr_revalidate_tp.reset();   DIAG(_shutdown, "attr_revalidate_tp.reset() done");
     linkmap.reset();              DIAG(_shutdown, "linkmap.reset() done");
     attrcache.reset();            DIAG(_shutdown, "attrcache.reset() done");
     distrib_cache_be.reset();     DIAG(_shutdown, "distrb_cache_be.reset() done");
     diskcache_be.reset();         DIAG(_shutdown, "diskcache_be.reset() done");
+    // After diskcache_be, whose eviction thread demotes to it.
+    slowcache_be.reset();         DIAG(_shutdown, "slowcache_be.reset() done");
     http_be.reset();              DIAG(_shutdown, "http_be.reset() done");
     volatiles.reset();            DIAG(_shutdown, "volatiles_be.reset() done");
     aicache.reset();              DIAG(_shutdown, "aicache.reset() done");
@@ -1475,13 +1776,14 @@ void fs123_readdir(fuse_req_t req, fuse_ino_t ino,
     }
     if(must_begetchunk>0){
         auto [byte_next_offset, chunk_next_start] = fhstate->offsets[must_begetchunk-1];
-	auto reply = begetchunk_dir(ino, chunk_next_start);
+        std::string dcontents;
+	auto reply = begetchunk_dir(ino, chunk_next_start, &dcontents);
         if( reply.eno )
             return reply_err(req, reply.eno);
         if(must_begetchunk == fhstate->offsets.size()){
-            DIAG(_readdir, str("offsets.push_back(", byte_next_offset+reply.content().size(), reply.chunk_next_start(), ")"));
+            DIAG(_readdir, str("offsets.push_back(", byte_next_offset+dcontents.size(), reply.chunk_next_start(), ")"));
             auto cns = reply.chunk_next_start();
-            fhstate->offsets.push_back(std::make_pair(byte_next_offset + reply.content().size(),
+            fhstate->offsets.push_back(std::make_pair(byte_next_offset + dcontents.size(),
                                                       std::string(cns)));
             fhstate->eof = (cns.empty());
         }
@@ -1498,7 +1800,7 @@ void fs123_readdir(fuse_req_t req, fuse_ino_t ino,
         // is extremely rare.  I find no instances of anything in
         // glibc-2.17 calling seekdir or telldir (of course, implements it several
         // different ways).
-        fhstate->contents = reply.content();
+        fhstate->contents = std::move(dcontents);
         fhstate->contents_first_byte_offset = byte_next_offset;
         DIAG(_readdir, str("fhstate->contents_first_byte_offset:", fhstate->contents_first_byte_offset));
     }
@@ -1782,8 +2084,10 @@ void fs123_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) try {
     }
     fi->keep_cache = (old_validator == new_validator);
 
+    bool o_direct = false;
 #ifdef O_DIRECT
-    fi->direct_io = fi->flags&O_DIRECT;
+    o_direct = fi->flags&O_DIRECT;
+    fi->direct_io = o_direct;
 #endif
     if(no_kernel_data_caching)
         fi->direct_io = true;
@@ -1794,6 +2098,12 @@ void fs123_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) try {
         fi->direct_io = true;
     if(!fi->direct_io){
         fi->fh = openfile_register(ino, r);
+    }else if(o_direct && nochunk_direct_io){
+        // Only genuine O_DIRECT opens skip the chunking (and the
+        // diskcache).  Other direct_io opens (no_kernel_data_caching,
+        // non-cacheable replies) still read whole chunks through the
+        // backend chain.
+        fi->fh = nochunk_fh;
     }else{
         fi->fh = 0;
     }
@@ -1817,46 +2127,20 @@ f_validator_and_content(const decoded_reply& dr){
     }
 }
 
-void fs123_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) try {
-    stats.reads++;
-    update_idle_timer();
-    atomic_scoped_nanotimer _t(&stats.read_sec);
-    DIAGfkey(_llops, "read(%p, ino=%ju, size=%zu, off=%jd)\n", req, (uintmax_t)ino, size, (intmax_t)off);
-    if(ino > 1 && ino <= max_special_ino)
-        return read_special_ino(req, ino, size, off, fi);
-    // FIXME - if fi->fh==0 , it means we were
-    // opened with direct_io.  In that case, it might make more sense
-    // to skip the chunking and request (almost) exactly the bytes we
-    // want.  Otherwise, if somebody does a lot of short reads, we
-    // might DoS ourselves by pulling Fs123Chunk*KiB over the network
-    // for every read(2).  Maybe something like:
-    // if(fi->fh == 0)
-    //     return fs123_read_nochunk(req, ino, size, off, fi);
-
-    auto chunkbytes = Fs123Chunk*KiB;	// most math below is in bytes
-    if( size > chunkbytes ){
-        // we expect size to be <= FUSE_MAX_PAGES_PER_REQ*PAGE_SIZE
-        // which is 32*4096 in modern (2016) kernels.  If wouldn't be
-        // hard to write a loop - but before we do, we should probably
-        // understand why we're getting such unexpected requests and
-        // whether we'd be better off with another strategy.
-        throw se(EINVAL, "fs123_read is limited to size<=" + std::to_string(chunkbytes) );
-    }
-        
-    std::string name;
-    uint64_t ino_validator;
-    std::tie(name, ino_validator) = ino_to_fullname_validator(ino);
-    auto chunknum = off / chunkbytes;
-    decltype(chunkbytes) off0 = off%chunkbytes;
-    auto len0 = std::min(size, chunkbytes-off0);
-    DIAGfkey(_read, "readchunk0(%s, %jd, %zu, %zu, %zu)\n", name.c_str(), (intmax_t)chunknum, chunkbytes, off0, len0);
-    auto start0kib = chunknum*Fs123Chunk;
-    auto reply0 = begetchunk_file(ino, start0kib);
-    if(reply0.eno)
-        return reply_err(req, reply0.eno);
+// begetrange_file_validated - get lenkib starting at startkib from
+// backend b and make sure the validator is no older than the one in
+// the inomap.  If it is older, retry with no_cache.  Replies with
+// non-zero eno are returned as-is.  Throws ESTALE if the no_cache
+// retry is *still* older than ino_validator.
+decoded_reply
+begetrange_file_validated(fuse_ino_t ino, uint64_t lenkib, int64_t startkib, uint64_t ino_validator, const std::string& name, backend123* b){
+    auto reply = begetrange_file(ino, lenkib, startkib, false, b);
+    if(reply.eno)
+        return reply;
     str_view content;
     uint64_t rvalidator;
-    std::tie(rvalidator, content) = f_validator_and_content(reply0);
+    std::tie(rvalidator, content) = f_validator_and_content(reply);
+    DIAGf(_read, "first-try begetrange_file(lenkib=%ju, startkib=%jd): trsum(content)=%s", (uintmax_t)lenkib, (intmax_t)startkib, threeroe(content).hexdigest().c_str());
     if(rvalidator < ino_validator){
         stats.reread_no_cache++;
         // More decisions...
@@ -1868,82 +2152,253 @@ void fs123_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct f
         // max-stale was unspecified in the original begetchunk),
         // then there's probably already a background refresh
         // "in-flight".  It's probably new enough (but not
-        // guaranteed), so if we could wait for that, we'd
-        // probably be good.  But unfortunately our diskcache
-        // doesn't attach new requests to in-flight refreshes, so
-        // we'd have to pause for an indeterminate length of time
-        // and hope that the background refresh completes.  It
-        // gets very complicated, for a fairly modest bandwidth
-        // reduction.
+        // guaranteed).  The diskcache does let new requests board
+        // in-flight refreshes (see diskcache::board), but only if
+        // the refresh was at least as strict as the new request.
+        // A background refresh isn't no-cache, so our no-cache
+        // retry won't board it, and we don't want to board it with
+        // a weaker request, only to find that its reply is still
+        // older than ino_validator.
         //
         // The simplest thing to do is to go straight to no-cache.
         // That might waste a little bandwidth, but it's simple
         // and correct.
-        reply0 = begetchunk_file(ino, start0kib, true/*no_cache*/);
-        if(reply0.eno)
-            return reply_err(req, reply0.eno);
-        std::tie(rvalidator, content) = f_validator_and_content(reply0);
+        reply = begetrange_file(ino, lenkib, startkib, true/*no_cache*/, b);
+        if(reply.eno)
+            return reply;
+        std::tie(rvalidator, content) = f_validator_and_content(reply);
+        DIAGf(_read, "re-try begetrange_file(lenkib=%ju, startkib=%jd): trsum(content)=%s", (uintmax_t)lenkib, (intmax_t)startkib, threeroe(content).hexdigest().c_str());
         if(rvalidator < ino_validator){
             stats.non_monotonic_validators++;
             throw se(ESTALE, "fs123_read:  monotonic_validator in the past even after no_cache retrieval fullname: " + name + " r_validator: " + std::to_string(rvalidator) + " ino_validator: " + std::to_string(ino_validator));
         }
     }
-    // Wake up the openfile machinery if rvalidator implies that kernel caches are stale.
-    if(rvalidator > ino_validator && fi->fh)
-        openfile_expire_now(ino, fi->fh);
-    
-    DIAGfkey(_read, "reply0: size=%zu\n", content.size());
-    struct iovec iovecs[2];
-    bool shortread = (content.size() < chunkbytes);
-    if(off0 > content.size()){
-        // We're probably reading more than one chunk past the end of
-        // the file.  It's perfectly legal, so a warning may be
-        // a bit panicy, but in practice, we've only seen it when
-        // something was misbehaving.
-        complain(LOG_WARNING, "fs123_read(ino=%ju (%s), size=%zu, off=%jd) got only content.size()=%zu bytes in reply for chunk at start0kib=%ju.  Return 0 bytes (EOF)\n",
-                 (uintmax_t)ino, name.c_str(), size, (intmax_t)off, content.size(), (uintmax_t)start0kib);
-        return reply_buf(req, nullptr, 0);
-    }
-    iovecs[0].iov_base = const_cast<char *>(content.data()) + off0;
-    iovecs[0].iov_len = std::min(len0, content.size()-off0);
-    if( shortread || iovecs[0].iov_len == size ){
-        // We're done.  Either we got a short read, indicating EOF,
-        // or we've satisfied the request for 'size' bytes.
-        stats.bytes_read += iovecs[0].iov_len;
-        return reply_iov(req, iovecs, 1);
-    }
-    auto nleft = size - len0;
-    //  Not done yet.  Request the next chunk:
-    DIAGfkey(_read, "readchunk1(%s, %jd, %zu, %zu, %zu)\n", name.c_str(), (intmax_t)chunknum+1, chunkbytes, size_t(0), nleft);
-    // FIXME - can we somehow do this read in parallel
-    // with the other one?  We've got a threadpool for
-    // use in dirent.  Can we reuse that??
-    auto start1kib = (chunknum+1)*Fs123Chunk;
-    auto reply1 = begetchunk_file(ino, start1kib);
-    if(reply1.eno)
-        return  reply_err(req, reply1.eno);
-    std::tie(rvalidator, content) = f_validator_and_content(reply1);
-    DIAGf(_read, "first-try begetchunk_file1: trsum(content)=%s", threeroe(content).hexdigest().c_str());
-    if(rvalidator < ino_validator){
-        stats.reread_no_cache++;
-        reply1 = begetchunk_file(ino, start1kib, true/*no_cache*/);
-        if(reply1.eno)
-            return reply_err(req, reply1.eno);
-        std::tie(rvalidator, content) = f_validator_and_content(reply1);
-        DIAGf(_read, "re-try begetchunk_file1: trsum(content)=%s", threeroe(content).hexdigest().c_str());
-        if(rvalidator < ino_validator){
-            stats.non_monotonic_validators++;
-            throw se(ESTALE, "fs123_read:  monotonic_validator in the past even after no_cache retrieval fullname: " + name + " r_validator: " + std::to_string(rvalidator) + " ino_validator: " + std::to_string(ino_validator));
+    return reply;
+}
+
+decoded_reply
+begetchunk_file_validated(fuse_ino_t ino, int64_t startkib, uint64_t ino_validator, const std::string& name){
+    return begetrange_file_validated(ino, Fs123Chunk, startkib, ino_validator, name, be);
+}
+
+// readahead_chunk - runs in the readahead threadpool.  Ask the
+// backend for the chunk at startkib and throw the reply away.  The
+// point is the side-effect:  the diskcache now has a fresh copy, so
+// when the kernel eventually asks for it, we won't have to wait.
+// If the file's readahead generation has moved on since we were
+// submitted (a non-sequential read, or the last release), the
+// prefetch was cancelled, and if the diskcache already has a fresh
+// copy, there's nothing to do.
+void readahead_chunk(const std::string& name, int64_t startkib, size_t nbytes,
+                     const std::shared_ptr<std::atomic<uint64_t>>& generation, uint64_t submitted_generation){
+    try{
+        if(readahead_stopping || *generation != submitted_generation){
+            stats.readahead_chunks_cancelled++;
+        }else{
+            req123 req = req123::filereq(name, Fs123Chunk, startkib);
+            if(encrypt_requests)
+                encrypt_request(req);
+            if(diskcache_be->fresh(req)){
+                stats.readahead_chunks_already_fresh++;
+            }else{
+                reply123 unused;
+                be->refresh(req, &unused);
+                stats.readahead_chunks_prefetched++;
+            }
+        }
+    }catch(std::exception& e){
+        // Not our problem.  If there's really something wrong, the
+        // foreground read will find it and report it.
+        stats.readahead_errors++;
+        DIAG(_read, "readahead_chunk(" << name << ", " << startkib << ") caught: " << e.what());
+    }
+    readahead_inflight_bytes -= nbytes;
+}
+
+// readahead_advise - called by fs123_read for every read of a
+// registered (i.e., not direct_io) file.  If the read is sequential
+// (see readahead_state::observe), we submit the chunks in the
+// readahead window that haven't been prefetched yet.  A
+// non-sequential read halves the window and cancels any pending
+// prefetches that haven't started.  The total number of bytes
+// requested but not yet delivered is capped by
+// Fs123ReadaheadInflightMBytes.
+void readahead_advise(fuse_ino_t ino, uint64_t fifh, const std::string& name, off_t off, size_t size){
+    auto maxchunks = volatiles->readahead_chunks.load();
+    if(!readahead_tp || maxchunks == 0 || size == 0)
+        return;
+    auto chunkbytes = Fs123Chunk*KiB;
+    int64_t c1 = (off+size-1)/chunkbytes;
+    readahead_state& ras = openfile_readahead_state(ino, fifh);
+    std::lock_guard<std::mutex> lg(ras.mtx);
+    size_t used = 0, wasted = 0;
+    bool sequential = ras.observe(off, size, chunkbytes, maxchunks, &used, &wasted);
+    stats.readahead_chunks_used += used;
+    stats.readahead_chunks_wasted += wasted;
+    if(!sequential)
+        return;
+    size_t budget = volatiles->readahead_inflight_mbytes * 1000000;
+    auto [first, last] = ras.candidates(c1, chunkbytes);
+    for(int64_t c = first; c < last; ++c){
+        // Reserve the bytes before checking, so that concurrent
+        // readers of other files can't all squeeze under the budget.
+        if(readahead_inflight_bytes.fetch_add(chunkbytes) + chunkbytes > budget){
+            readahead_inflight_bytes -= chunkbytes;
+            stats.readahead_budget_exhausted++;
+            break;
+        }
+        DIAGfkey(_read, "readahead_advise: prefetch chunk %jd of %s (window=%u)\n", (intmax_t)c, name.c_str(), ras.window);
+        try{
+            readahead_tp->submit([name, c, chunkbytes, generation=ras.generation, g=ras.generation->load()](){
+                                     readahead_chunk(name, c*Fs123Chunk, chunkbytes, generation, g);
+                                 });
+        }catch(std::exception& e){
+            // Don't fail the read just because we couldn't prefetch.
+            readahead_inflight_bytes -= chunkbytes;
+            complain(LOG_WARNING, e, "readahead_advise: failed to submit prefetch");
+            break;
         }
+        stats.readahead_chunks_submitted++;
+        ras.submitted(c);
     }
-    // Wake up the openfile machinery if rvalidator implies that kernel caches are stale.
-    if(rvalidator > ino_validator && fi->fh)
-        openfile_expire_now(ino, fi->fh);
-    auto len1 = std::min(nleft, content.size());
-    iovecs[1].iov_base = const_cast<char*>(content.data());
-    iovecs[1].iov_len = len1;
-    stats.bytes_read += len0+len1;
-    return reply_iov(req, iovecs, 2);
+}
+
+// fs123_read_nochunk - O_DIRECT opens (fi->fh==nochunk_fh) bypass the
+// kernel's page cache, so every read(2) comes to us, and a
+// random-access reader doing small reads would have us pull a full
+// Fs123Chunk*KiB over the network for each one.  Instead, ask for the
+// smallest KiB-aligned range that covers [off, off+size).  The /f
+// protocol is KiB-granular, so that's as close as we can get.
+//
+// These odd-sized, odd-aligned replies would never be shared with
+// chunked reads, so we send them directly to the http backend,
+// bypassing the diskcache (and distrib_cache).  Http proxies may
+// still cache them.
+void fs123_read_nochunk(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off){
+    stats.nochunk_reads++;
+    std::string name;
+    uint64_t ino_validator;
+    std::tie(name, ino_validator) = ino_to_fullname_validator(ino);
+    int64_t startkib = off/KiB;
+    uint64_t lenkib = (off + size + KiB - 1)/KiB - startkib;
+    DIAGfkey(_read, "read_nochunk(%s, lenkib=%ju, startkib=%jd)\n", name.c_str(), (uintmax_t)lenkib, (intmax_t)startkib);
+    auto reply = begetrange_file_validated(ino, lenkib, startkib, ino_validator, name, http_be.get());
+    if(reply.eno)
+        return reply_err(req, reply.eno);
+    auto content = f_validator_and_content(reply).second;
+    stats.nochunk_bytes_fetched += content.size();
+    size_t skip = off - startkib*KiB;
+    if(skip >= content.size())
+        return reply_buf(req, nullptr, 0);  // EOF
+    auto len = std::min(size, content.size() - skip);
+    stats.bytes_read += len;
+    return reply_buf(req, content.data() + skip, len);
+}
+
+void fs123_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) try {
+    stats.reads++;
+    update_idle_timer();
+    atomic_scoped_nanotimer _t(&stats.read_sec);
+    DIAGfkey(_llops, "read(%p, ino=%ju, size=%zu, off=%jd)\n", req, (uintmax_t)ino, size, (intmax_t)off);
+    if(ino > 1 && ino <= max_special_ino)
+        return read_special_ino(req, ino, size, off, fi);
+    // If fi->fh==nochunk_fh, we were opened with O_DIRECT.  Skip the
+    // chunking and request (almost) exactly the bytes we want.
+    auto chunkbytes = Fs123Chunk*KiB;	// most math below is in bytes
+    if(fi->fh == nochunk_fh && size <= chunkbytes)
+        return fs123_read_nochunk(req, ino, size, off);
+    // ofh is the openfile_register handle, or 0 for direct_io opens.
+    uint64_t ofh = (fi->fh == nochunk_fh) ? 0 : fi->fh;
+
+    std::string name;
+    uint64_t ino_validator;
+    std::tie(name, ino_validator) = ino_to_fullname_validator(ino);
+    auto chunknum = off / chunkbytes;
+    decltype(chunkbytes) off0 = off%chunkbytes;
+    // The read covers nchunks chunks, starting with chunknum.  With
+    // the kernel's traditional 128KiB limit and the default 128KiB
+    // Fs123Chunk, that's one or two.  With larger max_read (or
+    // smaller Fs123Chunk) it may be more.
+    size_t nchunks = std::max(size_t(1), (off0 + size + chunkbytes - 1)/chunkbytes);
+    // Something is very wrong if a single read needs more than this
+    // many:
+    static constexpr size_t max_chunks_per_read = 64;
+    if(nchunks > max_chunks_per_read)
+        throw se(EINVAL, fmt("fs123_read: size=%zu requires %zu chunks of %zu bytes.  Limit is %zu",
+                             size, nchunks, chunkbytes, max_chunks_per_read));
+    if(ofh)
+        readahead_advise(ino, ofh, name, off, size);
+    // Don't wait for chunk0 before asking for the rest.  Submit
+    // chunks 1 through nchunks-1 to the chunk_tp and get chunk0 on
+    // this thread.  If an early chunk turns out to be short (EOF),
+    // the later requests were wasted, but they'll be cheap, empty
+    // replies.  If the chunk_tp already has a backlog, queueing
+    // behind it could be slower than fetching serially, so chunks
+    // that don't fit are left invalid and fetched on this thread
+    // below.  N.B.  unlike std::async's, the chunk_tp's futures
+    // don't wait in their destructors, so the workunits must not
+    // refer to anything on our stack.  If we return early, they
+    // finish on their own, and at least warm the diskcache.
+    std::vector<std::future<decoded_reply>> futs(nchunks-1);
+    for(size_t i=1; i<nchunks; ++i){
+        if(!chunk_tp || chunk_tp->backlog() >= chunk_threads){
+            stats.chunk_tp_saturated++;
+            break;
+        }
+        DIAGfkey(_read, "readchunk%zu(%s, %jd) in parallel\n", i, name.c_str(), (intmax_t)(chunknum+i));
+        futs[i-1] = chunk_tp->submit_nocheck([ino, startkib=(chunknum+i)*Fs123Chunk, ino_validator, name](){
+                                                 return begetchunk_file_validated(ino, startkib, ino_validator, name);
+                                             });
+    }
+    if(nchunks > 1 && futs[0].valid())
+        stats.parallel_straddling_reads++;
+    if(nchunks > 2)
+        stats.multichunk_reads++;
+
+    // The iovecs point into the replies, so the replies must not
+    // move once they're in the vector.  Hence the reserve.
+    std::vector<decoded_reply> replies;
+    replies.reserve(nchunks);
+    std::vector<struct iovec> iovecs;
+    iovecs.reserve(nchunks);
+    size_t nleft = size;
+    for(size_t i=0; i<nchunks && nleft; ++i){
+        DIAGfkey(_read, "readchunk%zu(%s, %jd, %zu, %zu, %zu)\n", i, name.c_str(), (intmax_t)(chunknum+i), chunkbytes, (i==0)?off0:size_t(0), nleft);
+        if(i == 0)
+            replies.push_back(begetchunk_file_validated(ino, chunknum*Fs123Chunk, ino_validator, name));
+        else if(futs[i-1].valid())
+            replies.push_back(futs[i-1].get());
+        else
+            replies.push_back(begetchunk_file_validated(ino, (chunknum+i)*Fs123Chunk, ino_validator, name));
+        const decoded_reply& reply = replies.back();
+        if(reply.eno)
+            return reply_err(req, reply.eno);
+        str_view content;
+        uint64_t rvalidator;
+        std::tie(rvalidator, content) = f_validator_and_content(reply);
+        // Wake up the openfile machinery if rvalidator implies that kernel caches are stale.
+        if(rvalidator > ino_validator && ofh)
+            openfile_expire_now(ino, ofh);
+        DIAGfkey(_read, "reply%zu: size=%zu\n", i, content.size());
+        size_t coff = (i==0) ? off0 : 0;
+        if(coff > content.size()){
+            // We're probably reading more than one chunk past the end of
+            // the file.  It's perfectly legal, so a warning may be
+            // a bit panicy, but in practice, we've only seen it when
+            // something was misbehaving.
+            complain(LOG_WARNING, "fs123_read(ino=%ju (%s), size=%zu, off=%jd) got only content.size()=%zu bytes in reply for chunk at startkib=%ju.  Return 0 bytes (EOF)\n",
+                     (uintmax_t)ino, name.c_str(), size, (intmax_t)off, content.size(), (uintmax_t)(chunknum*Fs123Chunk));
+            return reply_buf(req, nullptr, 0);
+        }
+        auto len = std::min(nleft, content.size()-coff);
+        iovecs.push_back({const_cast<char *>(content.data()) + coff, len});
+        nleft -= len;
+        // A short chunk means EOF.  We're done, even if nleft>0.
+        if(content.size() < chunkbytes)
+            break;
+    }
+    stats.bytes_read += size - nleft;
+    return reply_iov(req, iovecs.data(), iovecs.size());
  } CATCH_ERRS
 
 void fs123_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) try {
@@ -1952,7 +2407,7 @@ void fs123_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) tr
     update_idle_timer();
     if(ino > 1 && ino <= max_special_ino)
         return release_special_ino(req, ino, fi);
-    if(fi->fh)
+    if(fi->fh && fi->fh != nochunk_fh)
         openfile_release(ino, fi->fh);
     reply_release(req);
  } CATCH_ERRS
@@ -2251,6 +2706,12 @@ void fs123_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg, struct fuse
     case CURL_HANDLES_REDIRECTS_IOC:
         VOLATILE_IOCTL(curl_handles_redirects);
         return;
+    case EWMA_ORIGIN_SELECTION_IOC:
+        VOLATILE_IOCTL(ewma_origin_selection);
+        return;
+    case EWMA_ORIGIN_SECONDS_IOC:
+        VOLATILE_IOCTL(ewma_origin_seconds);
+        return;
     case LOG_MAX_HOURLY_RATE_IOC:
         if( in_bufsz != sizeof(fs123_ioctl_data) )
             throw se(EINVAL, "Wrong size for ioctl");
@@ -2355,7 +2816,7 @@ begetattr_t begetattr(fuse_ino_t ino, std::optional<int> max_stale, bool no_cach
     return begetattr(pino_name.first, pino_name.second, ino, max_stale, no_cache);
 }
 
-decoded_reply::decoded_reply(reply123&& from, std::string&& plaintext, const std::string& urlstem) :
+decoded_reply::decoded_reply(reply123&& from, shared_padded_uchar_span&& plaintext, const std::string& urlstem) :
     eno{0}, // default to 0 if there's no FS123_ERRNO key
     _plaintext{std::move(plaintext)},
     _content{}
@@ -2363,11 +2824,12 @@ decoded_reply::decoded_reply(reply123&& from, std::string&& plaintext, const std
     if(!from.valid())
         throw std::runtime_error("can't construct decoded_reply from an invalid reply123");
     expires = from.expires;
+    last_refresh = from.last_refresh;
     stale_while_revalidate = from.stale_while_revalidate;
     cacheable = (from.max_age().count()>0);
     core123::str_view kvinput;
     if(backend123::proto_minor >= 3){
-        kvinput = _plaintext;
+        kvinput = as_str_view(_plaintext);
     }else{
         // Jump through hoops to cons up some text that looks like the
         // metadata in a proto7.3 reply.
@@ -2389,7 +2851,7 @@ decoded_reply::decoded_reply(reply123&& from, std::string&& plaintext, const std
         kvinput = kvinputstring7_2;
         // Don't make another copy of the plaintext.  Just put a
         // str_view pointing to it directly into _content.
-        _content = str_view(_plaintext);
+        _content = as_str_view(_plaintext);
         eno = from.eno72;
     }
     // kvinput is zero or more:
@@ -2437,8 +2899,30 @@ decoded_reply::decoded_reply(reply123&& from, std::string&& plaintext, const std
     }
 }
 
+decoded_reply decoded_reply::copy() const{
+    decoded_reply ret(*this);
+    // The kvmap's keys and values point into _plaintext, which is
+    // shared, and hence still valid in ret, or into kvinputstring7_2,
+    // which is not.  Re-point the latter into ret.kvinputstring7_2.
+    if(!kvinputstring7_2.empty()){
+        auto b = reinterpret_cast<uintptr_t>(kvinputstring7_2.data());
+        auto e = b + kvinputstring7_2.size();
+        auto rebase = [&](str_view sv){
+                          auto p = reinterpret_cast<uintptr_t>(sv.data());
+                          if(p < b || p > e)
+                              return sv;
+                          return str_view(ret.kvinputstring7_2.data() + (p-b), sv.size());
+                      };
+        ret.kvmap.clear();
+        for(const auto& kv : kvmap)
+            ret.kvmap.emplace(rebase(kv.first), rebase(kv.second));
+    }
+    return ret;
+}
+
 attrcache_value_t::attrcache_value_t(const decoded_reply& dr)  try :
     eno(dr.eno), estale_cookie{},
+    expires(dr.expires),
     stale_while_revalidate(dr.stale_while_revalidate),
     cacheable(dr.cacheable)
 {
@@ -2486,18 +2970,30 @@ std::ostream& report_stats(std::ostream& os){
     if(distrib_cache_be)
         distrib_cache_be->report_stats(os);
     os << openfile_report();
+    os << "readahead_inflight_bytes: " << readahead_inflight_bytes << "\n";
     if(secret_mgr)
         secret_mgr->report_stats(os);
     content_codec::report_stats(os);
     // N.B.  it's not useful to report the idle_time because we wouldn't
     // be asking if we hadn't received a request a couple of msec ago.
     os << "syslogs_per_hour: " << get_complaint_hourly_rate() << "\n";
-    os << "inomap_size: " << ino_count() << "\n";
+    os << "inomap_size: " << ino_count() << "\n"
+       << "inomap_paths_cached: " << ino_paths_cached() << "\n"
+       << "inomap_names_interned: " << ino_names_interned() << "\n";
     os << "attrcache_size: " << attrcache->size() << "\n"
        << "attrcache_evictions: " << attrcache->evictions() << "\n"
        << "attrcache_hits: " << attrcache->hits() << "\n"
        << "attrcache_expirations: " << attrcache->expirations() << "\n"
        << "attrcache_misses: " << attrcache->misses() << "\n";
+    if(dr_memcache)
+        os << "memcache_size: " << dr_memcache->size() << "\n"
+           << "memcache_bytes: " << dr_memcache->bytes() << "\n"
+           << "memcache_hits: " << dr_memcache->hits() << "\n"
+           << "memcache_misses: " << dr_memcache->misses() << "\n"
+           << "memcache_expirations: " << dr_memcache->expirations() << "\n"
+           << "memcache_evictions: " << dr_memcache->evictions() << "\n"
+           << "memcache_inserts: " << dr_memcache->inserts() << "\n"
+           << "memcache_too_big: " << dr_memcache->too_big() << "\n";
     os << "linkmap_size: " << linkmap->size() << "\n"
        << "linkmap_evictions: " << linkmap->evictions() << "\n"
        << "linkmap_hits: " << linkmap->hits() << "\n"
@@ -2529,9 +3025,13 @@ std::ostream& report_config(std::ostream& os){
        << "Fs123DiagDestination: " << diag_destination << "\n"
        << "Fs123TruncateTo32BitIno: " << (st_ino_mask != ~fuse_ino_t(0)) << "\n"
        << "Fs123Chunk: " << Fs123Chunk << "\n"
+       << "Fs123MaxReadaheadKiB: " << envto<unsigned>("Fs123MaxReadaheadKiB", 0) << "\n"
        << "Fs123CacheDir: " << cache_dir << "\n"
        << "Fs123CacheMaxMBytes: " << volatiles->dc_maxmbytes << "\n"
        << "Fs123CacheMaxFiles: " << volatiles->dc_maxfiles << "\n"
+       << "Fs123SlowCacheDir: " << slow_cache_dir << "\n"
+       << "Fs123SlowCacheMaxMBytes: " << volatiles->dc_slow_maxmbytes << "\n"
+       << "Fs123SlowCacheMaxFiles: " << volatiles->dc_slow_maxfiles << "\n"
        << "Fs123EvictLwm: " << volatiles->evict_lwm << "\n"
        << "Fs123EictTargetFraction: " << volatiles->evict_target_fraction << "\n"
        << "Fs123EvictThrottleLWM: " << volatiles->evict_throttle_lwm << "\n"
@@ -2563,9 +3063,26 @@ std::ostream& report_config(std::ostream& os){
        << "Fs123NoKernelDataCaching: " << no_kernel_data_caching << "\n"
        << "Fs123NoKernelAttrCaching: " << no_kernel_attr_caching << "\n"
        << "Fs123NoKernelDentryCaching: " << no_kernel_dentry_caching << "\n"
+       << "Fs123NoChunkDirectIO: " << nochunk_direct_io << "\n"
+       << "Fs123ReaddirPlus: " << readdirplus << "\n"
        << "Fs123CacheTag: " << req123::cachetag << "\n"
        << "Fs123HttpMaxRedirects: " << volatiles->http_maxredirects << "\n"
        << "Fs123CurlHandlesRedirects: " << volatiles->curl_handles_redirects << "\n"
+       << "Fs123CurlMulti: " << volatiles->curl_multi << "\n"
+       << "Fs123CurlMultiMaxHostConnections: " << volatiles->curl_multi_max_host_connections << "\n"
+       << "Fs123CurlMultiMaxStreams: " << volatiles->curl_multi_max_streams << "\n"
+       << "Fs123Http2PriorKnowledge: " << volatiles->http2_prior_knowledge << "\n"
+       << "Fs123CurlShare: " << volatiles->curl_share << "\n"
+       << "Fs123HedgeQuantile: " << volatiles->hedge_quantile << "\n"
+       << "Fs123HedgeBudget: " << volatiles->hedge_budget << "\n"
+       << "Fs123HedgeInitialMillis: " << volatiles->hedge_initial_millis << "\n"
+       << "Fs123EwmaOriginSelection: " << volatiles->ewma_origin_selection << "\n"
+       << "Fs123EwmaOriginSeconds: " << volatiles->ewma_origin_seconds << "\n"
+       << "Fs123BatchMillis: " << volatiles->batch_millis << "\n"
+       << "Fs123BatchMax: " << volatiles->batch_max << "\n"
+       << "Fs123BatchMaxBytes: " << volatiles->batch_max_bytes << "\n"
+       << "Fs123ReadaheadChunks: " << volatiles->readahead_chunks << "\n"
+       << "Fs123ReadaheadInflightMBytes: " << volatiles->readahead_inflight_mbytes << "\n"
        << "Fs123LogMaxHourlyRate: " << get_complaint_max_hourly_rate() << "\n"
        << "Fs123LogRateWindow: " << get_complaint_averaging_window() << "\n"
         ;
@@ -2594,7 +3111,10 @@ std::ostream& report_config(std::ostream& os){
         Prt(Fs123BuggyAutomountWorkaround, "false")
         Prt(Fs123Nice, 0)
         Prt(Fs123AttrCacheSize, 100000)
+        Prt(Fs123AttrRevalidateThreads, 4)
         Prt(Fs123LinkCacheSize, 10000)
+        Prt(Fs123MemCacheMBytes, 0)
+        Prt(Fs123MemCacheShards, 16)
         //Prt(Fs123StaleIfError)
         //Prt(Fs123PrivilegedServer)
         //Prt(Fs123IgnoreEstaleMismatch)
@@ -2622,6 +3142,19 @@ std::ostream& report_config(std::ostream& os){
         //Prt(Fs123CacheTag)
         //Prt(Fs123HttpMaxRedirects)
         //Prt(Fs123CurlHandlesRedirects)
+        //Prt(Fs123CurlMulti)
+        //Prt(Fs123CurlMultiMaxHostConnections)
+        //Prt(Fs123CurlMultiMaxStreams)
+        //Prt(Fs123Http2PriorKnowledge)
+        //Prt(Fs123CurlShare)
+        //Prt(Fs123HedgeQuantile)
+        //Prt(Fs123HedgeBudget)
+        //Prt(Fs123HedgeInitialMillis)
+        //Prt(Fs123EwmaOriginSelection)
+        //Prt(Fs123EwmaOriginSeconds)
+        //Prt(Fs123BatchMillis)
+        //Prt(Fs123BatchMax)
+        //Prt(Fs123BatchMaxBytes)
         // In diskcache:
         //Prt(Fs123CacheDir)
         Prt(Fs123DistribCacheExperimental, "false")// default in distrib_cache_backend.cpp
@@ -2638,6 +3171,13 @@ std::ostream& report_config(std::ostream& os){
         Prt(Fs123RefreshThreads, 10)    // default in diskcache.cpp
         Prt(Fs123RefreshBacklog, 10000)    // default in diskcache.cpp
         Prt(Fs123ForegroundSerialize, "true") // default in diskcache.cpp
+        Prt(Fs123DiskcacheIndex, "false") // default in diskcache.cpp
+        Prt(Fs123CachePolicy, "random") // default in diskcache.cpp
+        Prt(Fs123DiskcacheSmallObjectBytes, 0) // default in diskcache.cpp
+        Prt(Fs123DiskcacheIoUring, "false") // default in diskcache.cpp
+        Prt(Fs123DiskcacheSharedEviction, "false") // default in diskcache.cpp
+        Prt(Fs123ReadaheadThreads, 8)
+        Prt(Fs123ChunkThreads, 16)
         // env-vars with conventional meaning to libcurl
         // can be set on the command line.
         // Note that http{s}_proxy distinguish between being
@@ -2685,12 +3225,17 @@ try {
                                     "Fs123Subprocess=",
                                     "Fs123IdleTimeoutMinutes=",
                                     "Fs123Chunk=",
+                                    "Fs123MaxReadaheadKiB=",
                                     "Fs123LocalLocks=",
                                     "Fs123Rundir=",
                                     "Fs123BuggyAutomountWorkaround=",
                                     "Fs123Nice=",
                                     "Fs123AttrCacheSize=",
+                                    "Fs123AttrRevalidateThreads=",
                                     "Fs123LinkCacheSize=",
+                                    "Fs123MemCacheMBytes=",
+                                    "Fs123MemCacheShards=",
+                                    "Fs123ReaddirPlus=",
                                     "Fs123StaleIfError=",
                                     "Fs123PrivilegedServer=",
                                     "Fs123SquashAll=",
@@ -2729,15 +3274,32 @@ try {
                                     "Fs123NoKernelDataCaching=",    // Debug/diagnostic only.  Will kill performance.
                                     "Fs123NoKernelAttrCaching=",// Debug/diagnostic only.  Will kill performance.
                                     "Fs123NoKernelDentryCaching=",// Debug/diagnostic only.  Will kill performance.
+                                    "Fs123NoChunkDirectIO=",
                                     "Fs123NetrcFile=",
                                     "Fs123CacheTag=",
                                     "Fs123HttpMaxRedirects=",
                                     "Fs123CurlHandlesRedirects=",
+                                    "Fs123CurlMulti=",
+                                    "Fs123CurlMultiMaxHostConnections=",
+                                    "Fs123CurlMultiMaxStreams=",
+                                    "Fs123Http2PriorKnowledge=",
+                                    "Fs123CurlShare=",
+                                    "Fs123HedgeQuantile=",
+                                    "Fs123HedgeBudget=",
+                                    "Fs123HedgeInitialMillis=",
+                                    "Fs123EwmaOriginSelection=",
+                                    "Fs123EwmaOriginSeconds=",
+                                    "Fs123BatchMillis=",
+                                    "Fs123BatchMax=",
+                                    "Fs123BatchMaxBytes=",
                                     // In diskcache:
                                     "Fs123CacheDir=",
                                     "Fs123PastStaleWhileRevalidate=",
                                     "Fs123CacheMaxMBytes=",
                                     "Fs123CacheMaxFiles=",
+                                    "Fs123SlowCacheDir=",
+                                    "Fs123SlowCacheMaxMBytes=",
+                                    "Fs123SlowCacheMaxFiles=",
                                     "Fs123EvictLwm=",
                                     "Fs123EvictTargetFraction=",
                                     "Fs123EvictThrottleLWM=",
@@ -2745,6 +3307,22 @@ try {
                                     "Fs123RefreshThreads=",
                                     "Fs123RefreshBacklog=",
                                     "Fs123ForegroundSerialize=",
+                                    "Fs123DiskcacheIndex=",
+                                    "Fs123DiskcacheIndexAuditMinutes=",
+                                    "Fs123CachePolicy=",
+                                    "Fs123DiskcacheSmallObjectBytes=",
+                                    "Fs123DiskcacheSegmentFraction=",
+                                    "Fs123DiskcacheSegmentIndexMBytes=",
+                                    "Fs123DiskcacheSharedEviction=",
+                                    "Fs123DiskcacheSampleDirs=",
+                                    "Fs123DiskcacheSampleFilesPerDir=",
+                                    "Fs123DiskcacheSampleSeconds=",
+                                    "Fs123DiskcacheIoUring=",
+                                    // Readahead (app_mount.cpp):
+                                    "Fs123ReadaheadChunks=",
+                                    "Fs123ReadaheadInflightMBytes=",
+                                    "Fs123ReadaheadThreads=",
+                                    "Fs123ChunkThreads=",
                                     // In distrib_cache_backend:
                                     "Fs123DistribCacheExperimental=",
                                     "Fs123DistribCacheReflector=",
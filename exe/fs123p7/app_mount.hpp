@@ -4,6 +4,7 @@
 #include "fs123/httpheaders.hpp"
 #include <core123/svto.hpp>
 #include <core123/str_view.hpp>
+#include <core123/uchar_span.hpp>
 #include <core123/expiring.hpp>
 #include <core123/stats.hpp>
 #include <chrono>
@@ -18,17 +19,22 @@
 struct decoded_reply{ // needed in special_ino.cpp
 public:
     decoded_reply() = delete;
-    decoded_reply(const decoded_reply&) = delete;
     decoded_reply(decoded_reply&&) = default;
     decoded_reply& operator=(const decoded_reply&) = delete;
     decoded_reply& operator=(decoded_reply&&) = default;
 
     clk123_t::time_point expires;
+    // last_refresh - when the origin generated the reply, i.e., when
+    // it was received, less its Age.  See reply123::set_times.
+    clk123_t::time_point last_refresh;
     clk123_t::duration stale_while_revalidate;
     bool cacheable;
 
     int eno;
-    std::string _plaintext;
+    // _plaintext shares the reply123's content buffer (or a private,
+    // decrypted copy of it).  _content and the kvmap's str_views
+    // point into it, and they remain valid when *this is moved.
+    core123::shared_padded_uchar_span _plaintext;
     core123::str_view _content;
     core123::str_view content() const { return _content; }
     // N.B.  estale_cookie, chunk_next_start and validator throw an exception
@@ -43,7 +49,13 @@ public:
     std::map<core123::str_view, core123::str_view> kvmap;
     std::string kvinputstring7_2;
 
-    decoded_reply(reply123&& from, std::string&& plaintext, const std::string& urlstem); // in app_mount.cpp
+    decoded_reply(reply123&& from, core123::shared_padded_uchar_span&& plaintext, const std::string& urlstem); // in app_mount.cpp
+    // Like reply123, we don't want to copy "accidentally", so the
+    // copy-constructor is private, but there's a public copy()
+    // method.  It's cheap because the _plaintext is shared.
+    decoded_reply copy() const; // in app_mount.cpp
+private:
+    decoded_reply(const decoded_reply&) = default; // see copy() above
 };
 
 // The attrcache's API is not consistent with the other backends.  The begetattr
@@ -52,6 +64,8 @@ public:
 struct attrcache_value_t{ // needed in openfilemap.cpp
     int eno;
     uint64_t estale_cookie;
+    // The attrcache holds entries until expires+stale_while_revalidate.
+    clk123_t::time_point expires;
     clk123_t::duration stale_while_revalidate;
     bool cacheable;
     struct stat sb;
@@ -77,6 +91,10 @@ std::ostream& report_config(std::ostream&);      // used in special_ino.cpp
     STATISTIC(getattrs_with_fi)                 \
     STATISTIC(getattr_enoents)                  \
     STATISTIC(getattr_other_errno)              \
+    STATISTIC(attrcache_swr_hits)               \
+    STATISTIC(attrcache_swr_dups)               \
+    STATISTIC(attrcache_swr_refreshes)          \
+    STATISTIC(attrcache_swr_errors)             \
     STATISTIC(stat_scans)                       \
     STATISTIC(validator_scans)                  \
     STATISTIC(getxattrs)                        \
@@ -90,6 +108,9 @@ std::ostream& report_config(std::ostream&);      // used in special_ino.cpp
     STATISTIC_NANOTIMER(opendir_sec)            \
     STATISTIC(readdirs)                         \
     STATISTIC_NANOTIMER(readdir_sec)            \
+    STATISTIC(readdirplus_chunks)               \
+    STATISTIC(readdirplus_attrs_primed)         \
+    STATISTIC(readdirplus_fallbacks)            \
     STATISTIC(releasedirs)                      \
     STATISTIC(forget_calls)                     \
     STATISTIC(forget_inos)                      \
@@ -99,6 +120,19 @@ std::ostream& report_config(std::ostream&);      // used in special_ino.cpp
     STATISTIC(reads)                            \
     STATISTIC_NANOTIMER(read_sec)               \
     STATISTIC(bytes_read)                       \
+    STATISTIC(parallel_straddling_reads)        \
+    STATISTIC(multichunk_reads)                 \
+    STATISTIC(chunk_tp_saturated)               \
+    STATISTIC(nochunk_reads)                    \
+    STATISTIC(nochunk_bytes_fetched)            \
+    STATISTIC(readahead_chunks_submitted)       \
+    STATISTIC(readahead_chunks_prefetched)      \
+    STATISTIC(readahead_chunks_cancelled)       \
+    STATISTIC(readahead_chunks_already_fresh)   \
+    STATISTIC(readahead_chunks_used)            \
+    STATISTIC(readahead_chunks_wasted)          \
+    STATISTIC(readahead_budget_exhausted)       \
+    STATISTIC(readahead_errors)                 \
     STATISTIC(direct_io_opens)                  \
     STATISTIC(no_keep_cache_opens)              \
     STATISTIC(reread_no_cache)                  \
@@ -108,6 +142,8 @@ std::ostream& report_config(std::ostream&);      // used in special_ino.cpp
     STATISTIC(estale_retries)                   \
     STATISTIC(estale_ignored)                   \
     STATISTIC(req123_mismatch)                  \
+    STATISTIC(decode_shared_copies)             \
+    STATISTIC(decode_shared_copy_bytes)         \
     STATISTIC(releases)                         \
     STATISTIC(caught_system_errors)             \
     STATISTIC(caught_std_exceptions)            \
@@ -61,6 +61,15 @@ req123::dirreq(const std::string& name, uint64_t ckib, const std::string& chunks
     return {add_cachetag(ret, true)};
 }    
 
+// dirplusreq - readdirplus.  /r is new in 7.3, so there's no need to
+// worry about 7.2's query format.
+req123
+req123::dirplusreq(const std::string& name, uint64_t ckib, const std::string& chunkstart) /*static*/ {
+    std::string escname = urlescape(name);
+    std::string ret = "/r" + escname + "?" + std::to_string(ckib) + ";" + urlescape(chunkstart);
+    return {add_cachetag(ret, true)};
+}    
+
 req123
 req123::filereq(const std::string& name, uint64_t ckib, int64_t chunkstartkib) /*static*/ {
     std::string escname = urlescape(name);
@@ -5,6 +5,7 @@
 #include <core123/diag.hpp>
 #include <core123/throwutils.hpp>
 #include <core123/datetimeutils.hpp>
+#include <core123/uchar_span.hpp>
 #include <type_traits>
 #include <string>
 #include <sys/stat.h>
@@ -51,7 +52,11 @@ struct reply123{
     int16_t chunk_next_meta72;    // obsolete/unused in 7.3 protocol
     int16_t content_encoding;
     char content_threeroe[32];
-    std::string content;
+    // content is a reference-counted, immutable-once-shared buffer.
+    // Copying a reply123 (e.g., to hand it to a background thread)
+    // shares the bytes rather than copying them.  See the comments in
+    // core123/uchar_span.hpp about modifying content in place.
+    core123::shared_padded_uchar_span content;
     // MAGIC history:
     //   - original value:  27182835
     //   - changed to 141421356 when we appended url/url_len/magic to file
@@ -66,7 +71,8 @@ struct reply123{
     //   - changed to 915965594 when we dropped the struct stat sb.
     //   - changed to 495569519 when we dropped sbp.
     //   - changed to 223606797 when we added content_encoding.
-    static const int32_t MAGIC = 223606797; // change me whenever the serialization changes
+    //   - changed to 264575131 when the diskcache added a checksum of the header.
+    static const int32_t MAGIC = 264575131; // change me whenever the serialization changes
     enum {              // possible values of chunk_next_meta
         CNO_MISSING=0,  // HHCNO not in reply
         CNO_NOT_EOF,    // HHCNO in reply without "EOF" decorator
@@ -82,9 +88,9 @@ struct reply123{
     }
 
     // Called in curl_handler::getreply when proto_minor==2
-    reply123(int _eno72, uint64_t _esc, std::string&& _content, int16_t _content_encoding, time_t age, time_t max_age, uint64_t et64, time_t stale_while_reval):
+    reply123(int _eno72, uint64_t _esc, core123::shared_padded_uchar_span&& _content, int16_t _content_encoding, time_t age, time_t max_age, uint64_t et64, time_t stale_while_reval):
         magic(MAGIC), eno72(_eno72), etag64{et64}, estale_cookie72{_esc},
-	chunk_next_offset72{-1}, chunk_next_meta72{CNO_MISSING}, content_encoding(_content_encoding), content{_content}
+	chunk_next_offset72{-1}, chunk_next_meta72{CNO_MISSING}, content_encoding(_content_encoding), content{std::move(_content)}
     {
         if(eno72!=0 && estale_cookie72!=0)
             throw core123::se(EINVAL, "reply123 constructor with eno72!=0 && estale_cookie!=0.  This can't happen");
@@ -93,9 +99,9 @@ struct reply123{
     }
  
     // Called in curl_handler::getreply when proto_minor>2
-    reply123(std::string&& _content, int16_t _content_encoding, time_t age, time_t max_age, uint64_t et64, time_t stale_while_reval):
+    reply123(core123::shared_padded_uchar_span&& _content, int16_t _content_encoding, time_t age, time_t max_age, uint64_t et64, time_t stale_while_reval):
         magic(MAGIC), eno72{}, etag64{et64}, estale_cookie72{},
-	chunk_next_offset72{-1}, chunk_next_meta72{CNO_MISSING}, content_encoding(_content_encoding), content{_content}
+	chunk_next_offset72{-1}, chunk_next_meta72{CNO_MISSING}, content_encoding(_content_encoding), content{std::move(_content)}
     {
         set_times(age, max_age, stale_while_reval);
         fill_content_threeroe();
@@ -103,11 +109,11 @@ struct reply123{
 
     // Called in begetattr when we get a reply from the attrcache.
     template<class Rep, class Period>
-    reply123(std::string&& _content, int16_t _content_encoding, uint64_t _cookie, std::chrono::duration<Rep, Period> ttl):
+    reply123(core123::shared_padded_uchar_span&& _content, int16_t _content_encoding, uint64_t _cookie, std::chrono::duration<Rep, Period> ttl):
         magic(MAGIC), eno72(0), etag64(0), estale_cookie72(_cookie),
         chunk_next_offset72{-1}, chunk_next_meta72{CNO_MISSING},
         content_encoding(_content_encoding),
-        content(_content)
+        content(std::move(_content))
     {
         set_times(0, ttl, 0 /*stale_while_reval*/);
         fill_content_threeroe();
@@ -117,7 +123,8 @@ struct reply123{
     // but we don't want to "accidentally" do so.  So we delete the
     // copy-assignment operator and we make the copy-constructor
     // private.  But there's a public const copy() method that "can't"
-    // be used accidentally.
+    // be used accidentally.  Since content is shared, copy() is cheap:
+    // it copies the POD header and bumps a reference count.
     reply123& operator=(const reply123&) = delete;
     reply123 copy() const{
         return *this; // uses private copy-constructor
@@ -143,7 +150,7 @@ struct reply123{
 private:
     reply123(const reply123&) = default; // see copy() above
     void fill_content_threeroe(){
-        auto hd = core123::threeroe(content).hexdigest();
+        auto hd = core123::threeroe(content.data(), content.size()).hexdigest();
         ::memcpy(content_threeroe, hd.data(), 32);
     }
 
@@ -169,8 +176,15 @@ private:
     }
 };
 
+// reply123 isn't standard-layout (shared_padded_uchar_span isn't),
+// so offsetof is only "conditionally-supported".  But gcc and clang
+// support it for classes without virtual bases, and all the members
+// we care about are declared directly in reply123.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Winvalid-offsetof"
 static const size_t reply123_pod_begin = offsetof(struct reply123, magic);
 static const size_t reply123_pod_length = offsetof(struct reply123, content_threeroe) + sizeof(reply123::content_threeroe) - reply123_pod_begin;
+#pragma GCC diagnostic pop
 
 struct req123{
     static std::atomic<int> default_stale_if_error;
@@ -205,6 +219,7 @@ struct req123{
     static std::atomic<unsigned long> cachetag;
     static req123 attrreq(const std::string& name);
     static req123 dirreq(const std::string& name, uint64_t ckib, const std::string& chunkstart);
+    static req123 dirplusreq(const std::string& name, uint64_t ckib, const std::string& chunkstart);
     static req123 filereq(const std::string& name, uint64_t ckib, int64_t chunkstartkib);
     static req123 linkreq(const std::string& name);
     static req123 statfsreq(const std::string& name);
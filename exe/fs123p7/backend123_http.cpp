@@ -3,6 +3,7 @@
 #include "fs123/httpheaders.hpp"
 #include "fs123/content_codec.hpp"
 #include "fs123/acfd.hpp"
+#include "rolling_quantile.hpp"
 #include <core123/complaints.hpp>
 #include <core123/scoped_nanotimer.hpp>
 #include <core123/expiring.hpp>
@@ -13,10 +14,18 @@
 #include <core123/datetimeutils.hpp>
 #include <core123/strutils.hpp>
 #include <core123/svto.hpp>
+#include <core123/atomic_utils.hpp>
+#include <core123/netstring.hpp>
 #include <curl/curl.h>
 #include <cctype>
+#include <chrono>
+#include <cmath>
 #include <deque>
+#include <optional>
 #include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <unordered_map>
 #include <cstddef>
 #include <exception>
 #include <cstdio>
@@ -24,6 +33,7 @@
 #include <algorithm>
 #include <atomic>
 #include <fstream>
+#include <random>
 #include <regex>
 
 using namespace core123;
@@ -38,6 +48,7 @@ namespace{
     STATISTIC(curl_inits) \
     STATISTIC(curl_cleanups) \
     STATISTIC(curl_reuses) \
+    STATISTIC(curl_multi_restarts) \
     STATISTIC_NANOTIMER(backend_curl_perform_inuse_sec)
 #define STATS_STRUCT_TYPENAME libcurl_statistics_t
 #define STATS_MACRO_NAME LIBCURL_STATISTICS
@@ -241,6 +252,53 @@ void release_curl(CURL_ac c){
 // multiple backend_http's.
 refcounted_scoped_nanotimer_ctrl refcountedtimerctrl(libcurl_stats.backend_curl_perform_inuse_sec);
 
+// With Fs123CurlShare, every CURL* shares one DNS cache and one TLS
+// session cache (see setoptions).  So a thread whose CURL* is new, or
+// whose connection has been closed, can skip the name lookup and do an
+// abbreviated TLS handshake.  The locks are one mutex per
+// curl_lock_data.
+//
+// N.B.  We don't share CURL_LOCK_DATA_CONNECT.  libcurl's docs say
+// that sharing connections between concurrent threads isn't
+// supported.  To share connections, use Fs123CurlMulti, which runs all
+// transfers in one thread.
+std::mutex curl_share_mtx[CURL_LOCK_DATA_LAST];
+
+void curl_share_lock(CURL*, curl_lock_data data, curl_lock_access, void*){
+    curl_share_mtx[data].lock();
+}
+
+void curl_share_unlock(CURL*, curl_lock_data data, void*){
+    curl_share_mtx[data].unlock();
+}
+
+template <typename T>
+void wrap_curl_share_setopt(CURLSH* sh, CURLSHoption option, T arg){
+    auto ret = curl_share_setopt(sh, option, arg);
+    if(ret != CURLSHE_OK)
+        throw se(EINVAL, fmt("curl_share_setopt(%p, %d): %s", sh, option, curl_share_strerror(ret)));
+}
+
+// get_curl_share - the CURLSH is created the first time it's needed
+// and it's never cleaned up.  Thread_local CURL*'s may refer to it
+// until their threads exit, and curl_share_cleanup won't clean up
+// while they do.
+CURLSH* get_curl_share(){
+    static CURLSH* sh = [](){
+        CURLSH* ret = curl_share_init();
+        if(!ret)
+            throw se(ENOMEM, "curl_share_init failed");
+        wrap_curl_share_setopt(ret, CURLSHOPT_LOCKFUNC, curl_share_lock);
+        wrap_curl_share_setopt(ret, CURLSHOPT_UNLOCKFUNC, curl_share_unlock);
+        wrap_curl_share_setopt(ret, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+#if LIBCURL_VERSION_NUM >= 0x071700 // TLS session sharing is in libcurl >= 7.23
+        wrap_curl_share_setopt(ret, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#endif
+        return ret;
+    }();
+    return sh;
+}
+
 int curl_debug_to_diag_stream(CURL* /*handle*/, curl_infotype type, char *data, size_t /*size*/, void */*userptr*/){
     switch(type){
     case CURLINFO_TEXT:
@@ -260,7 +318,8 @@ const std::error_category& libcurl_category() noexcept{
 }
 
 url_info::url_info(const std::string& url)
-    : original(url), deferred_until(std::make_unique<std::atomic<tp_type>>(tp_type::min()))
+    : original(url), deferred_until(std::make_unique<std::atomic<tp_type>>(tp_type::min())),
+      score(std::make_unique<score_t>())
 {
     // This re is from rfc3986,
     //                       ^(([^:/?#]+):)?(//([^/?#]*))?([^?#]*)(\?([^#]*))?(#(.*))?
@@ -292,12 +351,76 @@ url_info::url_info(const std::string& url)
     do_not_lookup = std::regex_match(hostname, dotted_quadre);
 }
 
+// The EWMAs are weighted by time, not by count:  a sample that's dt
+// seconds newer than the previous one gets weight 1-exp(-dt/tau).  So
+// the averages cover the last tau seconds or so, regardless of the
+// request rate, and the first sample after a long silence replaces
+// whatever was there.
+void url_info::observe(double sec, bool ok, double tau){
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lg(score->mtx);
+    double w = 0.;
+    if(score->nobserved && tau > 0.)
+        w = std::exp(-std::chrono::duration<double>(now - score->last_observed).count()/tau);
+    score->ewma_sec = w*score->ewma_sec + (1.-w)*sec;
+    score->ewma_errors = w*score->ewma_errors + (1.-w)*(ok ? 0. : 1.);
+    score->last_observed = now;
+    score->nobserved++;
+}
+
+// The cost is, roughly, the expected time for this url to answer
+// successfully, if every request in flight had to finish first:
+//
+//   ewma_sec * (inflight + 1) / (1 - ewma_errors)
+//
+// The inflight factor spreads the load when several threads look at
+// the same scores at the same time.  While the url is idle, its EWMAs
+// decay toward the prior, i.e., toward the average of all the
+// origins, so a url that was slow or failing a while ago eventually
+// gets another chance.  N.B.  not toward zero, which would make an
+// idle bad url look better than all the good ones that are actually
+// answering requests.  A url that has never been observed is
+// average.
+double url_info::cost(double tau, const prior_t& prior) const{
+    auto now = std::chrono::steady_clock::now();
+    double sec, errors;
+    {
+        std::lock_guard<std::mutex> lg(score->mtx);
+        double decay = 0.;
+        if(score->nobserved && tau > 0.)
+            decay = std::exp(-std::chrono::duration<double>(now - score->last_observed).count()/tau);
+        sec = decay * score->ewma_sec + (1.-decay) * prior.sec;
+        errors = decay * score->ewma_errors + (1.-decay) * prior.errors;
+    }
+    static const double min_sec = 1.e-4;
+    return std::max(sec, min_sec) * (score->inflight.load() + 1) / std::max(1. - errors, 0.01);
+}
+
+url_info::prior_t url_info::prior(const std::vector<url_info>& urls) /*static*/{
+    prior_t ret;
+    size_t n = 0;
+    for(const auto& u : urls){
+        std::lock_guard<std::mutex> lg(u.score->mtx);
+        if(!u.score->nobserved)
+            continue;
+        ret.sec += u.score->ewma_sec;
+        ret.errors += u.score->ewma_errors;
+        n++;
+    }
+    if(n){
+        ret.sec /= n;
+        ret.errors /= n;
+    }
+    return ret;
+}
+
 struct backend123_http::curl_handler{
     // Callbacks *CAN NOT* be non-static class members.  So we provide
     // static class members and arrange that 'this' is passed through
     // the userdata argument.
     static size_t header_callback(char *buffer, size_t size, size_t nitems, void *userdata){
         curl_handler* ch = (curl_handler *)userdata;
+        ch->got_first_byte = true;
         ch->bep->stats.backend_header_callbacks++;
         atomic_scoped_nanotimer _t(&ch->bep->stats.backend_header_callback_sec);
         try{
@@ -327,32 +450,54 @@ struct backend123_http::curl_handler{
     }
 
     curl_handler(backend123_http* bep_) :
-        bep(bep_), exptr{}, content{}, hdrmap{}
+        bep(bep_), exptr{}, content_blob{}, content_len{0}, hdrmap{}
     {
-        if(bep->content_reserve_size>0)
-            content.reserve(bep->content_reserve_size);
     }
 
     backend123_http* bep;
     std::exception_ptr exptr;
-    std::string content;
+    // got_first_byte is set by the first header_callback, and reset
+    // by prepare, because a curl_handler is reused for fallbacks and
+    // redirects.  See perform_hedged, which looks at it while the
+    // transfer is in flight.
+    std::atomic<bool> got_first_byte{false};
+    // The body is accumulated in content_blob, which becomes the
+    // (shared) reply123::content without being copied.  See
+    // recv_data and getreply.  Or, for a record in a /b reply, the
+    // body is a slice of the /b's content.  See subreply.
+    uchar_blob content_blob;
+    size_t content_len;
+    shared_padded_uchar_span content_slice;
+    str_view content() const {
+        if(content_slice.data())
+            return as_str_view(content_slice);
+        return {reinterpret_cast<const char*>(content_blob.data()), content_len};
+    }
     // Note that the keys in hdrmap are all lower-case, e.g.,
     // "cache-control", "age", "fs123-errno".  Regardless
     // of how they were spelled by the origin server or proxies.
     std::map<std::string, std::string> hdrmap;
-    long http_code;
+    long http_code = 0;
     char curl_errbuf[CURL_ERROR_SIZE]; // 256
     std::vector<std::string> headers;
     wrapped_curl_slist connect_to_sl;
     wrapped_curl_slist headers_sl;
 
     void reset(){
-        content.clear();
+        content_len = 0;
+        content_slice = {};
         hdrmap.clear();
         exptr = nullptr;
     }
 
     bool perform_without_fallback(CURL *curl, const url_info& baseurli, const std::string& urlstem, reply123* replyp, int recursion_depth = 0){
+        prepare(curl, baseurli, urlstem);
+        return perform_once(curl, replyp, recursion_depth);
+    }
+
+    // prepare sets the url and headers for a GET of baseurli+urlstem,
+    // but doesn't perform it.
+    void prepare(CURL *curl, const url_info& baseurli, const std::string& urlstem){
         // The curl_slist API doesn't support deletion or replacement.
         // Since we can't replace the Host header, we re-initialize
         // the headers_sl curl_slist with the common headers and
@@ -378,6 +523,7 @@ struct backend123_http::curl_handler{
         // curl_easy_reset().  This looks safe (from a quick read of the
         // libcurl code), but it's not promised by libcurl's
         // documentation.
+        got_first_byte = false;
         headers_sl.reset();
         headers_sl.append(headers.begin(), headers.end());
         std::string burl = baseurli.original;
@@ -459,7 +605,34 @@ struct backend123_http::curl_handler{
         wrap_curl_easy_setopt(curl, CURLOPT_URL, (void*)(burl + urlstem).c_str());
         DIAG(_http>=2, "perform_once: CURLOPT_URL: " + (burl + urlstem));
         DIAG(_http>=2, "perform_once: CURLOPT_HTTPHEADER: " << headers_sl.get());
-        return perform_once(curl, replyp, recursion_depth);
+        wrap_curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curl_errbuf);
+        curl_errbuf[0] = '\0';
+    }
+
+    // pick_baseurl - power-of-two-choices:  of two viable (i.e.,
+    // non-deferred) urls chosen at random, return the one with the
+    // lower cost.  Comparing two, rather than all of them, keeps a url
+    // that looks a little better than the rest from getting all the
+    // traffic - and then looking a lot worse.  'first' is the first
+    // viable url.
+    size_t pick_baseurl(size_t first, std::chrono::system_clock::time_point now, double tau){
+        std::vector<size_t> viable{first};
+        for(size_t k=first+1; k<bep->baseurls.size(); ++k)
+            if(bep->baseurls[k].deferred_until->load() < now)
+                viable.push_back(k);
+        size_t n = viable.size();
+        if(n == 1)
+            return first;
+        static thread_local std::minstd_rand gen(std::random_device{}());
+        size_t a = gen() % n;
+        size_t b = gen() % (n-1);
+        if(b >= a)
+            b++;
+        bep->stats.backend_ewma_picks++;
+        a = viable[a];
+        b = viable[b];
+        auto prior = url_info::prior(bep->baseurls);
+        return (bep->baseurls[a].cost(tau, prior) <= bep->baseurls[b].cost(tau, prior)) ? a : b;
     }
 
     // perform_with_fallback is a method of curl_handler so we can
@@ -468,7 +641,9 @@ struct backend123_http::curl_handler{
     // perform_without_fallback, which calls perform_once with the
     // first viable 'baseurl', i.e., the first one whose
     // 'deferred_until' time_point is in the past.  It is assumed that
-    // retry-looping takes place at a higher level.
+    // retry-looping takes place at a higher level.  With hedging, it
+    // calls perform_hedged instead, which may also try the next
+    // viable baseurl.
     bool perform_with_fallback(CURL* curl, const std::string& urlstem, reply123* replyp){
         // If there's only one baseurl, i.e., no fallbacks, then go
         // straight to perform_without_fallback.  Skip the rigamarole
@@ -490,13 +665,51 @@ struct backend123_http::curl_handler{
                 min_deferred = dui;
             }                
         }
+        // With Fs123EwmaOriginSelection, i is just the first viable
+        // url.  pick_baseurl chooses among all the viable ones.  With
+        // hedging, the hedge goes to the next viable url after i
+        // (wrapping around), if there is one.
+        double tau = bep->vols.ewma_origin_seconds.load();
+        size_t j = nurls;
         if(i == nurls){
             i = imin;
             complain(LOG_WARNING, "curl_handler::perform:  All fallbacks are deferred.  Use the least deferred: " + bep->baseurls[i].original);
+        }else{
+            if(bep->vols.ewma_origin_selection.load())
+                i = pick_baseurl(i, started_at, tau);
+            if(bep->hedge){
+                for(size_t k=1; k<nurls; ++k){
+                    size_t kk = (i+k)%nurls;
+                    if(bep->baseurls[kk].deferred_until->load() < started_at){
+                        j = kk;
+                        break;
+                    }
+                }
+            }
         }
+        // Whatever the policy, keep score.  If a hedge won, the
+        // primary took at least as long as we waited for it, and the
+        // hedge took as long as it was in flight, not counting the
+        // hedge delay.  A hedge that won and then failed in
+        // after_perform left us with nothing from either, so both
+        // are charged with a failure.
+        const size_t primary = i;
+        auto hedged_at = started_at;
+        auto observe = [&](bool ok){
+            auto now = std::chrono::system_clock::now();
+            bep->baseurls[primary].observe(dur2dbl(now - started_at), ok, tau);
+            if(i != primary)
+                bep->baseurls[i].observe(dur2dbl(now - hedged_at), ok, tau);
+        };
+        scoped_fetch_add<int> inflight(bep->baseurls[primary].score->inflight);
         try{
-            return perform_without_fallback(curl, bep->baseurls.at(i), urlstem, replyp);
+            bool ret = (j < nurls) ?
+                perform_hedged(curl, i, j, urlstem, replyp, &i, &hedged_at) :
+                perform_without_fallback(curl, bep->baseurls.at(i), urlstem, replyp);
+            observe(true);
+            return ret;
         }catch(std::exception& e){
+            observe(false);
             auto now = std::chrono::system_clock::now();
             // There's a lot of scope for different "policy" choices
             // here.  The particular choice is that we defer
@@ -535,10 +748,23 @@ struct backend123_http::curl_handler{
         {
             atomic_scoped_nanotimer _t(&bep->stats.backend_curl_perform_sec);
             refcounted_scoped_nanotimer _rt(refcountedtimerctrl);
-            wrap_curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curl_errbuf);
-            curl_errbuf[0] = '\0';
-            ret = curl_easy_perform(curl);
+            ret = bep->perform(curl);
         }
+        return after_perform(curl, ret, replyp, recursion_depth);
+    }
+
+    // perform_hedged is like perform_without_fallback(curl,
+    // baseurls[i], ...), but if baseurls[i] is slow, it also tries
+    // baseurls[j].  *usedp is the index of the url that answered,
+    // and *hedged_atp is when the hedge was sent, if it was.  See the
+    // comments at the definition, which has to follow the definition
+    // of multi_engine.
+    bool perform_hedged(CURL* curl, size_t i, size_t j, const std::string& urlstem, reply123* replyp, size_t* usedp,
+                        std::chrono::system_clock::time_point* hedged_atp);
+
+    // after_perform is the rest of perform_once:  what we do with
+    // curl's result once the transfer is over.
+    bool after_perform(CURL* curl, CURLcode ret, reply123* replyp, int recursion_depth){
         // Retrying is a VERY slippery slope.  There is already retry
         // logic in libcurl (when there are multiple A records).
         // There is also the 'fallback' logic in perform, which calls
@@ -563,8 +789,8 @@ struct backend123_http::curl_handler{
             wrap_curl_easy_setopt(curl, CURLOPT_PROXY, "");
             complain(LOG_WARNING, "CURLE_COULDNT_CONNECT or CURLE_OPERATION_TIMEDOUT.  Proxy down?");
             // curl says it couldn't connect.  But let's check:
-            if(content.empty() && hdrmap.empty())
-                ret = curl_easy_perform(curl);
+            if(content_len==0 && hdrmap.empty())
+                ret = bep->perform(curl);
             else
                 complain(LOG_WARNING, "hdrmap and content not empty with CURLE_COULDNT_CONNECT or CURLE_OPERATION_TIMEDOUT");
         }
@@ -586,8 +812,8 @@ struct backend123_http::curl_handler{
             bep->stats.backend_got_nothing++;
             complain(LOG_NOTICE, "CURLE_GOT_NOTHING.  Keep-alive connection closed by upstream?");
             // curl says it got nothing.  But let's check:
-            if(content.empty() && hdrmap.empty())
-                ret = curl_easy_perform(curl);
+            if(content_len==0 && hdrmap.empty())
+                ret = bep->perform(curl);
             else
                 complain(LOG_WARNING, "hdrmap and content not empty with CURLE_GOT_NOTHING");
         }
@@ -636,7 +862,7 @@ struct backend123_http::curl_handler{
 
     bool getreply(reply123* replyp) {
 	if (_http >= 2) {
-            DIAG(true, "content (size=" << content.size() << ") \"\"\"" << quopri({content.data(), std::min(size_t(512), content.size())}) << "\"\"\"\n");
+            DIAG(true, "content (size=" << content_len << ") \"\"\"" << quopri(content().substr(0, 512)) << "\"\"\"\n");
 	}
         if(!(http_code == 200 || http_code == 304)){
             // We're only prepared to deal with 200 and 304.  If we
@@ -648,7 +874,7 @@ struct backend123_http::curl_handler{
             // better API?  Note that the http category adds something
             // like: ": 500 Internal Service Error" *after* the
             // message string
-            httpthrow(http_code, "<curlhandler::getreply>:\n" + content + "</curlhandler::getreply>\nunexpected HTTP status");
+            httpthrow(http_code, "<curlhandler::getreply>:\n" + std::string(content()) + "</curlhandler::getreply>\nunexpected HTTP status");
         }
         auto age = get_age();
         auto max_age = get_max_age();
@@ -680,12 +906,27 @@ struct backend123_http::curl_handler{
         auto ce = content_codec::encoding_stoi(content_encoding);
         ii = hdrmap.find(HHCOOKIE);
         uint64_t estale_cookie = (ii == hdrmap.end()) ? 0 : svto<uint64_t>(ii->second);
+        // Hand content_blob over to the reply without copying it,
+        // unless more than half of it is unused, in which case it's
+        // better to copy the (small) content into a right-sized
+        // buffer than to pin the whole blob in memory for as long as
+        // the reply lives.
+        shared_padded_uchar_span rcontent;
+        if(content_slice.data()){
+            rcontent = std::move(content_slice);
+            content_slice = {};
+        }else if(content_len >= content_blob.size()/2){
+            rcontent = shared_padded_uchar_span(std::move(content_blob), 0, content_len);
+        }else{
+            rcontent = shared_padded_uchar_span::copy_of(content());
+            bep->stats.backend_content_bytes_copied += content_len;
+        }
+        content_len = 0;
         if(backend123::proto_minor<3)
-            *replyp = reply123(eno72, estale_cookie, std::move(content), ce, age, max_age, et64, swr);
+            *replyp = reply123(eno72, estale_cookie, std::move(rcontent), ce, age, max_age, et64, swr);
         else
-            *replyp = reply123(std::move(content), ce, age, max_age, et64, swr);
+            *replyp = reply123(std::move(rcontent), ce, age, max_age, et64, swr);
             
-        // CAUTION:  content is no longer usable!!!
         ii = hdrmap.find(HHTRSUM);
         if(ii != hdrmap.end()){
             const std::string& val = ii->second;
@@ -721,12 +962,30 @@ struct backend123_http::curl_handler{
         return true;
     }
         
+    // subreply - getreply for one of the records in a /b reply, which
+    // carries the status, cache-control, etag and body that would
+    // have come in the sub-request's own reply.  body must lie within
+    // bcontent, the /b's content.  The sub-reply's content is a slice
+    // of bcontent, not a copy.  The slice's bounding box is just the
+    // body, so it can't grow into its neighbors.
+    bool subreply(long status, const std::string& cc, uint64_t etag64, const shared_padded_uchar_span& bcontent, str_view body, reply123* replyp){
+        reset();
+        http_code = status;
+        hdrmap["cache-control"] = cc;
+        if(etag64)
+            hdrmap["etag"] = '"' + std::to_string(etag64) + '"';
+        size_t off = body.data() - as_str_view(bcontent).data();
+        content_slice = shared_padded_uchar_span(bcontent, padded_uchar_span(uchar_span(bcontent).subspan(off, body.size())));
+        content_len = body.size();
+        return getreply(replyp);
+    }
+
     std::string verbose_complaint(CURL *curl) const{
         std::ostringstream oss;
         oss<< "Headers:\n";
         for(const auto& p : hdrmap)
             oss << p.first << ": " << p.second; // p.second ends with crlf
-        oss << "Received " << content.size() << " bytes of data\n";
+        oss << "Received " << content_len << " bytes of data\n";
         // What else can we report that might help to diagnose curl
         // errors?  Are we under heavy load??  The number of active
         // handlers is an indicator:
@@ -800,7 +1059,19 @@ protected:
     }
 
     void recv_data(char *buffer, size_t size, size_t nitems){
-        content.append(buffer, size*nitems);
+        size_t n = size*nitems;
+        if(content_len + n > content_blob.size()){
+            // Start with content_reserve_size, and double (like
+            // std::string) when that isn't enough.
+            uchar_blob bigger(std::max({content_len + n, 2*content_blob.size(), bep->content_reserve_size}));
+            if(content_len){
+                ::memcpy(bigger.data(), content_blob.data(), content_len);
+                bep->stats.backend_content_bytes_copied += content_len;
+            }
+            content_blob = std::move(bigger);
+        }
+        ::memcpy(content_blob.data() + content_len, buffer, n);
+        content_len += n;
         DIAGf(_http, "recv_data: append %zd bytes to content", size*nitems);
     }
 
@@ -894,7 +1165,20 @@ protected:
         curlstat(PRETRANSFER);
         curlstat(STARTTRANSFER);
         curlstat(TOTAL);
+        curlstat(APPCONNECT);
 #undef curlstat
+        // How many connections did this transfer open?  Zero means it
+        // reused one.  A non-zero APPCONNECT time means there was a
+        // TLS handshake.
+        long nconnects;
+        wrap_curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &nconnects);
+        if(nconnects == 0){
+            bep->stats.curl_reused_connections++;
+        }else{
+            bep->stats.curl_new_connections += nconnects;
+            if(t > 0.)
+                bep->stats.curl_tls_handshakes++;
+        }
         if(_transactions){
             // curl can tell us everything we need to know or we can
             // measure and count ourselves and/or retrieve stuff from
@@ -935,8 +1219,710 @@ protected:
 
 };
 
+// The multi_engine is an alternative to calling curl_easy_perform in
+// each of the (many) threads that call refresh.  With the easy
+// interface, each thread's CURL* has its own connection cache, so
+// there's a TCP (and maybe TLS) connection per thread per origin, and
+// each connection carries one request at a time.  The multi_engine
+// has a single thread that drives every transfer through one CURLM*.
+// The CURLM* has one connection cache for everyone, and when the
+// server speaks HTTP/2, concurrent transfers to the same origin are
+// multiplexed as streams over a few connections.
+//
+// The threads that call refresh still block.  perform() hands a fully
+// configured CURL* to the loop thread and waits until it's done.
+// Everything else - the curl_handler, fallbacks, redirects, getreply -
+// is unchanged.  N.B.  the curl_handler's header and write callbacks
+// are called in the loop thread, not the waiting thread.  That's ok
+// because the waiting thread doesn't look at the curl_handler until
+// the transfer is done, and the mutex makes the loop thread's writes
+// visible.
+//
+// N.B.  The loop thread is a throughput bottleneck.  It runs every
+// transfer's header and write callbacks (i.e., every byte of every
+// reply is copied by it), and with https it does all the TLS
+// decryption.  So with Fs123CurlMulti, the client's aggregate
+// bandwidth is limited to what one core can decrypt and copy,
+// regardless of how many threads call refresh.
+//
+// If curl_multi_perform or curl_multi_poll fails, the transfers in
+// flight are aborted, and the loop starts over with the same CURLM*
+// after a short, increasing delay.  Transfers that were submitted but
+// not yet added wait for the restart.  If it fails
+// max_consecutive_failures times in a row without completing a
+// transfer in between, the loop gives up, and subsequent transfers
+// fall back to curl_easy_perform in the calling thread.
+//
+// There's one multi_engine per process, shared by all the
+// backend123_http's that want one, i.e., the primary and all the
+// distrib_cache peers.  It's created when the first of them is
+// constructed, and it's destroyed (and its thread joined) when the
+// last of them is destroyed.
+#if LIBCURL_VERSION_NUM >= 0x074400 // curl_multi_poll and curl_multi_wakeup are in libcurl >= 7.68
+struct backend123_http::multi_engine{
+    multi_engine(const volatiles_t& vols);
+    ~multi_engine();
+    CURLcode perform(CURL* curl);
+    const bool http2; // was libcurl built with HTTP/2?
+    static std::shared_ptr<multi_engine> get(const volatiles_t& vols);
+
+    // The asynchronous interface, for callers (i.e., hedging) that
+    // want more than one transfer in flight at a time.  A submitted
+    // transfer must not be destroyed (and its CURL* must not be
+    // touched) until it's done.  The loop notifies the transfer's cv
+    // when it's done, so several transfers can share one cv, and the
+    // caller can wait for whichever finishes first.  cancel makes a
+    // transfer done, with CURLE_ABORTED_BY_CALLBACK, if it isn't
+    // done already.  Its result and done may only be examined in a
+    // wait or wait_until predicate, or after it's done.  submit
+    // returns false, without touching the transfer, if the loop has
+    // given up, in which case the caller should use curl_easy_perform
+    // instead.
+    struct transfer{
+        transfer(CURL* c, std::condition_variable& cv_) : curl(c), cv(cv_){}
+        CURL* curl;
+        CURLcode result = CURLE_OK;
+        bool done = false;
+        std::condition_variable& cv;
+    };
+    bool submit(transfer* t);
+    void cancel(transfer* t);
+    template <typename Pred>
+    void wait(std::condition_variable& cv, Pred pred){
+        std::unique_lock<std::mutex> lk(mtx);
+        cv.wait(lk, pred);
+    }
+    template <typename Pred>
+    bool wait_until(std::condition_variable& cv, std::chrono::steady_clock::time_point deadline, Pred pred){
+        std::unique_lock<std::mutex> lk(mtx);
+        return cv.wait_until(lk, deadline, pred);
+    }
+private:
+    void loop();
+    void run_until_stopped();
+    void abort_inflight();
+    void finish(transfer* t, CURLcode result);
+    static const int max_consecutive_failures = 5;
+    CURLM* multi;
+    std::mutex mtx;
+    // submitted, cancelled, stopping and every transfer's result and
+    // done are protected by mtx.  inflight and completed are only
+    // touched by the loop thread.  completed counts the transfers
+    // finished since the loop was last (re)started.  N.B.  cancelled
+    // holds CURL*'s, not transfer*'s, because a cancelled transfer may
+    // finish (and its waiter may destroy it) before the loop gets to
+    // it.  The loop looks them up in inflight instead.
+    std::vector<transfer*> submitted;
+    std::vector<CURL*> cancelled;
+    bool stopping = false;
+    uint64_t completed = 0;
+    std::unordered_map<CURL*, transfer*> inflight;
+    std::thread thr;
+};
+
+namespace{
+void wrap_curl_multi_setopt(CURLM* multi, CURLMoption option, long l){
+    auto ret = curl_multi_setopt(multi, option, l);
+    if(ret != CURLM_OK)
+        throw se(EINVAL, fmt("curl_multi_setopt(%p, %d, (long)%ld): %s", multi, option, l, curl_multi_strerror(ret)));
+}
+} // namespace <anonymous>
+
+backend123_http::multi_engine::multi_engine(const volatiles_t& vols) :
+    http2(curl_version_info(CURLVERSION_NOW)->features & CURL_VERSION_HTTP2),
+    multi(curl_multi_init())
+{
+    if(!multi)
+        throw se(ENOMEM, "multi_engine: curl_multi_init failed");
+    try{
+        wrap_curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+        wrap_curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, vols.curl_multi_max_host_connections);
+        wrap_curl_multi_setopt(multi, CURLMOPT_MAX_CONCURRENT_STREAMS, vols.curl_multi_max_streams);
+        thr = std::thread(&multi_engine::loop, this);
+    }catch(...){
+        curl_multi_cleanup(multi);
+        throw;
+    }
+    if(!http2)
+        complain(LOG_WARNING, "Fs123CurlMulti:  libcurl was built without HTTP/2.  Transfers will share connections, but they won't be multiplexed.");
+}
+
+backend123_http::multi_engine::~multi_engine(){
+    {
+        std::lock_guard<std::mutex> lg(mtx);
+        stopping = true;
+    }
+    curl_multi_wakeup(multi);
+    thr.join();
+    curl_multi_cleanup(multi);
+}
+
+std::shared_ptr<backend123_http::multi_engine>
+backend123_http::multi_engine::get(const volatiles_t& vols) /*static*/{
+    static std::mutex getmtx;
+    static std::weak_ptr<multi_engine> the_engine;
+    std::lock_guard<std::mutex> lg(getmtx);
+    auto ret = the_engine.lock();
+    if(!ret){
+        ret = std::make_shared<multi_engine>(vols);
+        the_engine = ret;
+    }
+    return ret;
+}
+
+CURLcode
+backend123_http::multi_engine::perform(CURL* curl){
+    std::condition_variable cv;
+    transfer t(curl, cv);
+    if(!submit(&t))
+        return curl_easy_perform(curl);
+    wait(cv, [&t]{ return t.done; });
+    return t.result;
+}
+
+bool
+backend123_http::multi_engine::submit(transfer* t){
+    {
+        std::lock_guard<std::mutex> lg(mtx);
+        if(stopping)
+            return false;
+        submitted.push_back(t);
+    }
+    curl_multi_wakeup(multi);
+    return true;
+}
+
+void
+backend123_http::multi_engine::cancel(transfer* t){
+    {
+        std::lock_guard<std::mutex> lg(mtx);
+        if(t->done)
+            return;
+        // If it hasn't been added yet, we can finish it right here.
+        auto ii = std::find(submitted.begin(), submitted.end(), t);
+        if(ii != submitted.end()){
+            submitted.erase(ii);
+            finish(t, CURLE_ABORTED_BY_CALLBACK);
+            return;
+        }
+        // Otherwise, only the loop thread can remove it from the CURLM*.
+        cancelled.push_back(t->curl);
+    }
+    curl_multi_wakeup(multi);
+}
+
+void
+backend123_http::multi_engine::finish(transfer* t, CURLcode result) /*private*/{
+    // N.B.  mtx must be held.  Notify all, because the cv may be
+    // shared by several transfers, with a single waiter whose
+    // predicate depends on all of them.
+    t->result = result;
+    t->done = true;
+    t->cv.notify_all();
+}
+
+void
+backend123_http::multi_engine::loop() /*private*/{
+    int failures = 0;
+    while(true){
+        try{
+            completed = 0;
+            run_until_stopped();
+            break;
+        }catch(std::exception& e){
+            // Whatever went wrong, the transfers in flight are
+            // suspect.  Abort them, and start over with an empty
+            // CURLM*.  Their callers see CURLE_ABORTED_BY_CALLBACK,
+            // just as if they'd been cancelled, and it's up to them
+            // (e.g., app_mount's retry logic) to try again.
+            abort_inflight();
+            failures = completed ? 1 : failures+1;
+            if(failures >= max_consecutive_failures){
+                complain(e, fmt("multi_engine::loop:  the event loop failed %d times in a row.  Giving up.  Subsequent Fs123CurlMulti transfers will use curl_easy_perform", failures));
+                break;
+            }
+            complain(e, "multi_engine::loop:  the event loop failed.  Restarting it");
+            libcurl_stats.curl_multi_restarts++;
+            std::this_thread::sleep_for(std::chrono::milliseconds(100<<failures));
+        }
+    }
+    // Don't leave anybody hanging.  If we're here because of the
+    // destructor, there shouldn't be anybody waiting.  But if we're
+    // here because we gave up, there might be.
+    abort_inflight();
+    std::lock_guard<std::mutex> lg(mtx);
+    stopping = true;
+    for(auto t : submitted)
+        finish(t, CURLE_ABORTED_BY_CALLBACK);
+    submitted.clear();
+    cancelled.clear();
+}
+
+void
+backend123_http::multi_engine::abort_inflight() /*private*/{
+    std::lock_guard<std::mutex> lg(mtx);
+    for(auto& p : inflight){
+        curl_multi_remove_handle(multi, p.first);
+        finish(p.second, CURLE_ABORTED_BY_CALLBACK);
+    }
+    inflight.clear();
+    // Anything cancelled was in flight, and it's now done.
+    cancelled.clear();
+}
+
+void
+backend123_http::multi_engine::run_until_stopped() /*private*/{
+    while(true){
+        {
+            std::lock_guard<std::mutex> lg(mtx);
+            if(stopping)
+                return;
+            // Cancel before adding, because a CURL* whose transfer
+            // finished after cancel was called may already have been
+            // resubmitted, in a new transfer that mustn't be cancelled.
+            for(auto c : cancelled){
+                auto ii = inflight.find(c);
+                // It may have finished after cancel was called.
+                if(ii == inflight.end())
+                    continue;
+                curl_multi_remove_handle(multi, c);
+                finish(ii->second, CURLE_ABORTED_BY_CALLBACK);
+                inflight.erase(ii);
+            }
+            cancelled.clear();
+            for(auto t : submitted){
+                auto mc = curl_multi_add_handle(multi, t->curl);
+                if(mc == CURLM_OK){
+                    inflight[t->curl] = t;
+                }else{
+                    complain(LOG_ERR, "multi_engine:  curl_multi_add_handle: %s", curl_multi_strerror(mc));
+                    finish(t, CURLE_FAILED_INIT);
+                }
+            }
+            submitted.clear();
+        }
+        int nrunning;
+        auto mc = curl_multi_perform(multi, &nrunning);
+        if(mc != CURLM_OK)
+            throw se(EIO, fmt("curl_multi_perform: %s", curl_multi_strerror(mc)));
+        CURLMsg *msg;
+        int nqueued;
+        while((msg = curl_multi_info_read(multi, &nqueued))){
+            if(msg->msg != CURLMSG_DONE)
+                continue;
+            // N.B.  *msg is invalidated by curl_multi_remove_handle.
+            CURL* curl = msg->easy_handle;
+            CURLcode result = msg->data.result;
+            curl_multi_remove_handle(multi, curl);
+            auto ii = inflight.find(curl);
+            if(ii == inflight.end()){
+                complain(LOG_ERR, "multi_engine:  curl_multi_info_read reported an unknown transfer");
+                continue;
+            }
+            std::lock_guard<std::mutex> lg(mtx);
+            finish(ii->second, result);
+            inflight.erase(ii);
+            completed++;
+        }
+        // Sleep until there's socket activity, a timeout (curl's or
+        // ours), or curl_multi_wakeup is called by perform or the
+        // destructor.
+        mc = curl_multi_poll(multi, nullptr, 0, 1000, nullptr);
+        if(mc != CURLM_OK)
+            throw se(EIO, fmt("curl_multi_poll: %s", curl_multi_strerror(mc)));
+    }
+}
+#else
+struct backend123_http::multi_engine{
+    static std::shared_ptr<multi_engine> get(const volatiles_t&){
+        complain(LOG_WARNING, "Fs123CurlMulti requires libcurl >= 7.68.0.  Using curl_easy_perform instead.");
+        return {};
+    }
+    CURLcode perform(CURL*){
+        return CURLE_FAILED_INIT;
+    }
+    const bool http2 = false;
+};
+#endif
+
+// Hedging.  One slow replica among the baseurls sets our tail
+// latency, because perform_with_fallback doesn't move on until the
+// slow one actually fails.  With Fs123HedgeQuantile, if a request
+// hasn't gotten its first byte from baseurls[i] by the hedge
+// deadline, the same request is also sent to the next non-deferred
+// fallback, baseurls[j], and we use whichever answers first.  The
+// other one is cancelled.
+//
+// The hedge deadline is a quantile of the recent times-to-first-byte
+// for the same type of request, i.e., the letter after the leading
+// slash in the urlstem ('a' for attributes, 'f' for file contents,
+// etc.), because a 128k chunk legitimately takes longer than a stat.
+// The budget is a token bucket:  every hedgeable request earns
+// hedge_budget tokens, a hedge spends one, and the bucket holds at
+// most max_millitokens/1000 tokens, so a sudden burst of slow replies
+// only starts a few hedges.
+//
+// Hedging needs the multi_engine, which lets one thread wait for two
+// transfers at once.
+struct backend123_http::hedge_state{
+    hedge_state(double q){
+        for(int i=0; i<ntypes; ++i)
+            ttfb.emplace_back(q, 256, 32);
+    }
+    rolling_quantile& quantile(const std::string& urlstem){
+        char c = (urlstem.size() > 1) ? urlstem[1] : '\0';
+        return ttfb[(c >= 'a' && c <= 'z') ? c-'a'+1 : 0];
+    }
+    void earn(float budget){
+        long add = long(budget * millitokens_per_hedge);
+        long cur = millitokens.load();
+        while(!millitokens.compare_exchange_weak(cur, std::min(cur + add, max_millitokens)))
+            ;
+    }
+    bool spend(){
+        long cur = millitokens.load();
+        do{
+            if(cur < millitokens_per_hedge)
+                return false;
+        }while(!millitokens.compare_exchange_weak(cur, cur - millitokens_per_hedge));
+        return true;
+    }
+    static constexpr int ntypes = 27; // 'a' through 'z', and everything else.
+    static constexpr long millitokens_per_hedge = 1000;
+    static constexpr long max_millitokens = 10*millitokens_per_hedge;
+    std::deque<rolling_quantile> ttfb; // a deque because rolling_quantile isn't movable
+    std::atomic<long> millitokens{0};
+};
+
+#if LIBCURL_VERSION_NUM >= 0x074400 // see multi_engine
+bool
+backend123_http::curl_handler::perform_hedged(CURL* curl, size_t i, size_t j, const std::string& urlstem, reply123* replyp, size_t* usedp,
+                                              std::chrono::system_clock::time_point* hedged_atp){
+    using namespace std::chrono;
+    auto& hs = *bep->hedge;
+    auto& multi = *bep->multi;
+    auto& ttfb = hs.quantile(urlstem);
+    hs.earn(bep->vols.hedge_budget.load());
+    double delay = ttfb.get();
+    if(std::isinf(delay))
+        delay = 1.e-3 * bep->vols.hedge_initial_millis.load();
+    *usedp = i;
+    prepare(curl, bep->baseurls.at(i), urlstem);
+    atomic_scoped_nanotimer _t(&bep->stats.backend_curl_perform_sec);
+    refcounted_scoped_nanotimer _rt(refcountedtimerctrl);
+
+    // N.B.  Everything the loop thread might touch - the cv, the
+    // hedge's CURL* and curl_handler - must outlive the transfers, and
+    // the transfers must be done before they're destroyed, even if we
+    // throw.  Hence the order of the declarations, and the canceller.
+    std::condition_variable cv;
+    CURL_ac hcurl;
+    curl_handler hch(bep);
+    multi_engine::transfer primary(curl, cv);
+    multi_engine::transfer hedge(nullptr, cv);
+    struct canceller{
+        multi_engine& m;
+        std::condition_variable& cv;
+        std::vector<multi_engine::transfer*> ts;
+        ~canceller(){
+            for(auto t : ts)
+                m.cancel(t);
+            m.wait(cv, [this]{ return std::all_of(ts.begin(), ts.end(), [](multi_engine::transfer* t){ return t->done; }); });
+        }
+    } guard{multi, cv, {}};
+
+    auto start = steady_clock::now();
+    bep->stats.curl_performs++;
+    // If the loop has given up, there's no hedging.
+    if(!multi.submit(&primary))
+        return after_perform(curl, curl_easy_perform(curl), replyp, 0);
+    guard.ts.push_back(&primary);
+    // Learn from the primary's time-to-first-byte.  If we cancelled it
+    // before its first byte, all we know is that it would have taken
+    // at least as long as we waited, but leaving it out would bias the
+    // quantile low.
+    auto learn = [&](){
+        if(primary.result == CURLE_OK){
+            double t;
+            wrap_curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &t);
+            ttfb.add(t);
+        }else if(primary.result == CURLE_ABORTED_BY_CALLBACK && !got_first_byte){
+            ttfb.add(duration<double>(steady_clock::now() - start).count());
+        }
+    };
+    auto deadline = start + duration_cast<steady_clock::duration>(duration<double>(delay));
+    bool slow = !multi.wait_until(cv, deadline, [&]{ return primary.done; }) && !got_first_byte;
+    if(slow && !hs.spend()){
+        bep->stats.backend_hedges_over_budget++;
+        slow = false;
+    }
+    if(!slow){
+        multi.wait(cv, [&]{ return primary.done; });
+        learn();
+        return after_perform(curl, primary.result, replyp, 0);
+    }
+
+    DIAG(_http, "perform_hedged: no reply from " << bep->baseurls[i].original << " after " << delay << " sec.  Hedge with " << bep->baseurls[j].original);
+    hcurl.reset(curl_easy_init());
+    if(!hcurl)
+        throw se(ENOMEM, "perform_hedged: curl_easy_init failed");
+    libcurl_stats.curl_inits++;
+    bep->setoptions(hcurl);
+    wrap_curl_easy_setopt(hcurl, CURLOPT_HEADERFUNCTION, curl_handler::header_callback);
+    wrap_curl_easy_setopt(hcurl, CURLOPT_HEADERDATA, (void *)&hch);
+    wrap_curl_easy_setopt(hcurl, CURLOPT_WRITEFUNCTION, curl_handler::write_callback);
+    wrap_curl_easy_setopt(hcurl, CURLOPT_WRITEDATA, (void *)&hch);
+    hch.headers = headers;
+    hch.prepare(hcurl, bep->baseurls.at(j), urlstem);
+    hedge.curl = hcurl;
+    *hedged_atp = system_clock::now();
+    if(!multi.submit(&hedge)){
+        multi.wait(cv, [&]{ return primary.done; });
+        learn();
+        return after_perform(curl, primary.result, replyp, 0);
+    }
+    bep->stats.backend_hedges++;
+    bep->stats.curl_performs++;
+    guard.ts.push_back(&hedge);
+
+    // The winner is the first to finish successfully.  If they both
+    // fail, report the primary's failure.
+    auto answered = [](const multi_engine::transfer& t){ return t.done && t.result == CURLE_OK; };
+    multi_engine::transfer* winner = nullptr;
+    multi.wait(cv, [&]{
+        if(answered(primary))
+            winner = &primary;
+        else if(answered(hedge))
+            winner = &hedge;
+        else if(primary.done && hedge.done)
+            winner = &primary;
+        return winner != nullptr;
+    });
+    auto loser = (winner == &primary) ? &hedge : &primary;
+    multi.cancel(loser);
+    multi.wait(cv, [&]{ return loser->done; });
+    learn();
+    if(winner == &hedge){
+        bep->stats.backend_hedges_won++;
+        *usedp = j;
+        return hch.after_perform(hcurl, hedge.result, replyp, 0);
+    }
+    return after_perform(curl, primary.result, replyp, 0);
+}
+#else
+bool
+backend123_http::curl_handler::perform_hedged(CURL* curl, size_t i, size_t, const std::string& urlstem, reply123* replyp, size_t* usedp,
+                                              std::chrono::system_clock::time_point*){
+    // Unreachable:  without a multi_engine, there's no hedge_state.
+    *usedp = i;
+    return perform_without_fallback(curl, bep->baseurls.at(i), urlstem, replyp);
+}
+#endif
+
+// Batching.  An openfilemap scan, a readdir followed by a stat of
+// every entry, or a cold import can have many small, independent
+// requests in flight at once, each paying for its own HTTP round
+// trip.  With Fs123BatchMillis, concurrent refreshes are collected
+// and sent together in a single /b request (see docs/Fs123Protocol).
+//
+// The first refresh to find no open batch is the 'leader'.  If there
+// are no other refreshes in flight, there's nothing to batch with,
+// and it goes on its own.  Otherwise, it opens a batch and waits for
+// up to Fs123BatchMillis, or until the batch is full, while others
+// join it.  Then it sends the /b, splits the reply, and hands each
+// member the reply123 it would have gotten on its own, so the layers
+// above (e.g., the diskcache) cache each of them under its own
+// urlstem.  If anything goes wrong with the /b as a whole or with
+// any of its records, the affected members refresh on their own, as
+// if batching were off.  A 4xx reply to the /b means the server
+// doesn't understand it, so batching is disabled.
+//
+// Only plaintext replies can be batched:  the content of an
+// encrypted /b reply can only be decrypted (in app_mount.cpp) after
+// it leaves the backend, and by then it's too late to split it.
+struct backend123_http::batch_state{
+    struct member{
+        member(const req123& req_, reply123* replyp_, std::string item_) :
+            req(req_), replyp(replyp_), item(std::move(item_)) {}
+        const req123& req;
+        reply123* replyp;
+        std::string item;  // Inm64,Urlstem
+        bool ok = false;   // set by the leader, before done.
+        bool ret = false;  // ditto
+        bool done = false; // protected by mtx
+    };
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::vector<member*> open; // the batch that's collecting members
+    size_t open_bytes = 0;
+    bool full = false;
+    std::atomic<int> inflight{0}; // all refreshes, batched or not
+    std::atomic<bool> disabled{false};
+
+    static bool batchable(const req123& req){
+        // The encrypted /e, /n (statistics), /p and /b itself are not
+        // batchable.
+        auto& u = req.urlstem;
+        return u.size() >= 2 && u[0] == '/' && ::strchr("adflrsx", u[1]) &&
+            (u.size() == 2 || u[2] == '/' || u[2] == '?');
+    }
+
+    void send(backend123_http* bep, const std::vector<member*>& members);
+};
+
+bool
+backend123_http::refresh_batched(const req123& req, reply123* replyp, bool* retp) /*private*/{
+    auto& bs = *batch;
+    if(bs.disabled.load() || req.no_cache || !batch_state::batchable(req))
+        return false;
+    uint64_t inm64 = replyp->valid() ? replyp->etag64 : 0;
+    batch_state::member me(req, replyp, std::to_string(inm64) + ',' + urlescape(req.urlstem));
+    size_t max = vols.batch_max.load();
+    size_t max_bytes = vols.batch_max_bytes.load();
+    if(me.item.size() > max_bytes)
+        return false;
+    std::unique_lock<std::mutex> lk(bs.mtx);
+    if(bs.open.empty()){
+        // We're the leader.
+        if(bs.inflight.load() < 2)
+            return false;
+        bs.open.push_back(&me);
+        bs.open_bytes = me.item.size();
+        bs.full = false;
+        bs.cv.wait_for(lk, std::chrono::milliseconds(vols.batch_millis), [&]{ return bs.full; });
+        std::vector<batch_state::member*> members;
+        members.swap(bs.open);
+        lk.unlock();
+        if(members.size() == 1)
+            return false; // nobody joined.
+        bs.send(this, members);
+        lk.lock();
+        for(auto m : members)
+            m->done = true;
+        bs.cv.notify_all();
+    }else{
+        // Join the open batch, if there's room.
+        if(bs.full || bs.open.size() >= max || bs.open_bytes + 1 + me.item.size() > max_bytes){
+            bs.full = true;
+            bs.cv.notify_all();
+            return false;
+        }
+        bs.open.push_back(&me);
+        bs.open_bytes += 1 + me.item.size();
+        if(bs.open.size() >= max){
+            bs.full = true;
+            bs.cv.notify_all();
+        }
+        bs.cv.wait(lk, [&]{ return me.done; });
+    }
+    if(!me.ok)
+        return false;
+    *retp = me.ret;
+    return true;
+}
+
+// send - send a /b for the members, and set their ok and ret.  It
+// doesn't throw.  If the /b fails, the members aren't ok, and they
+// refresh on their own.
+void
+backend123_http::batch_state::send(backend123_http* bep, const std::vector<member*>& members) try {
+    auto& stats = bep->stats;
+    stats.backend_batches++;
+    stats.backend_batched_requests += members.size();
+    std::string urlstem = "/b?";
+    for(size_t i=0; i<members.size(); ++i)
+        urlstem += (i ? "&" : "") + members[i]->item;
+    auto curl = get_curl();
+    bep->setoptions(curl);
+    curl_handler ch(bep);
+    wrap_curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, curl_handler::header_callback);
+    wrap_curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void *)&ch);
+    wrap_curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_handler::write_callback);
+    wrap_curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&ch);
+    ch.headers.push_back("User-Agent: fs123p7/" GIT_DESCRIPTION);
+    DIAGfkey(_http, "backend123_http::batch_state::send: GET %s\n", urlstem.c_str());
+    reply123 breply;
+    try{
+        ch.perform_with_fallback(curl, urlstem, &breply);
+    }catch(std::exception& e){
+        if(ch.http_code >= 400 && ch.http_code < 500 && !disabled.exchange(true))
+            complain(LOG_NOTICE, e, fmt("/b request got HTTP status %ld.  The server doesn't support batching?  Batching disabled", ch.http_code));
+        throw;
+    }
+    release_curl(std::move(curl));
+    // Each record is:  STATUS CC ETAG BODY\n
+    str_view content = as_str_view(breply.content);
+    size_t next = 0;
+    for(auto m : members){
+        str_view status, cc, etag, body;
+        for(auto p : {&status, &cc, &etag}){
+            next = svscan_netstring<false>(content, p, next);
+            if(content.at(next++) != ' ')
+                throw std::runtime_error("expected space after netstring in /b reply");
+        }
+        next = svscan_netstring<false>(content, &body, next);
+        if(content.at(next++) != '\n')
+            throw std::runtime_error("expected newline after record in /b reply");
+        try{
+            curl_handler sub(bep);
+            m->ret = sub.subreply(svto<long>(status), std::string(cc), svto<uint64_t>(etag), breply.content, body, m->replyp);
+            m->ok = true;
+        }catch(std::exception& e){
+            // E.g., a 302 or an error status.  The member will
+            // try again on its own.
+            DIAG(_http, "/b record for " << m->req.urlstem << " not usable: " << e.what());
+            stats.backend_batch_fallbacks++;
+        }
+    }
+ }catch(std::exception& e){
+    DIAG(_http, "/b request failed.  Members will refresh on their own: " << e.what());
+    for(auto m : members){
+        if(!m->ok)
+            bep->stats.backend_batch_fallbacks++;
+    }
+ }
+
+CURLcode
+backend123_http::perform(CURL* curl) /*private*/{
+    if(!multi)
+        return curl_easy_perform(curl);
+    stats.curl_multi_performs++;
+    stats.curl_multi_inflight++;
+    atomic_scoped_nanotimer _t(&stats.curl_multi_perform_sec);
+    auto ret = multi->perform(curl);
+    stats.curl_multi_inflight--;
+    return ret;
+}
+
 std::ostream& backend123_http::report_stats(std::ostream& os){
-    return os << stats;
+    os << stats;
+    double reused = stats.curl_reused_connections;
+    double total = reused + stats.curl_new_connections;
+    os << "curl_connection_reuse_ratio: " << (total ? reused/total : 0.) << "\n";
+    // The origin scores are only kept when there are fallbacks.  See
+    // perform_with_fallback.
+    if(baseurls.size() > 1){
+        double tau = vols.ewma_origin_seconds.load();
+        auto prior = url_info::prior(baseurls);
+        for(size_t i=0; i<baseurls.size(); ++i){
+            const auto& u = baseurls[i];
+            double sec, errors;
+            uint64_t n;
+            {
+                std::lock_guard<std::mutex> lg(u.score->mtx);
+                sec = u.score->ewma_sec;
+                errors = u.score->ewma_errors;
+                n = u.score->nobserved;
+            }
+            os << "origin_" << i << "_url: " << u.original << "\n"
+               << "origin_" << i << "_observed: " << n << "\n"
+               << "origin_" << i << "_ewma_sec: " << sec << "\n"
+               << "origin_" << i << "_ewma_error_rate: " << errors << "\n"
+               << "origin_" << i << "_inflight: " << u.score->inflight.load() << "\n"
+               << "origin_" << i << "_cost: " << u.cost(tau, prior) << "\n";
+        }
+    }
+    return os;
 }
 
 #ifndef CURL_SOCKOPT_OK // it's not defined in 7.19 on CentOS6
@@ -973,7 +1959,21 @@ void backend123_http::setoptions(CURL *curl) const{
     // badly if the server were truly incapable of any 1.1 features (like
     // keepalive).  Let's take our chances for now.  We can make it an
     // option later, if necessary.
-    wrap_curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+#if LIBCURL_VERSION_NUM >= 0x074400 // see multi_engine
+    if(multi && multi->http2){
+        // The whole point of the multi_engine is to share connections,
+        // so ask for HTTP/2.  With CURL_HTTP_VERSION_2TLS, cleartext
+        // http urls still get HTTP/1.1 (see above), as do https
+        // servers that don't negotiate h2.
+        wrap_curl_easy_setopt(curl, CURLOPT_HTTP_VERSION,
+                              vols.http2_prior_knowledge ? CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE : CURL_HTTP_VERSION_2TLS);
+        // Wait for an existing connection to finish connecting and
+        // tell us whether it can multiplex, rather than opening
+        // another one.
+        wrap_curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+    }else
+#endif
+        wrap_curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
 
     // If the _http diagnostic level is >= 2, then direct curl's
     // debug stream to our diagnostic stream:
@@ -982,6 +1982,9 @@ void backend123_http::setoptions(CURL *curl) const{
         wrap_curl_easy_setopt(curl, CURLOPT_DEBUGFUNCTION, curl_debug_to_diag_stream);
     }
 
+    if(share)
+        wrap_curl_easy_setopt(curl, CURLOPT_SHARE, share);
+
     curl_easy_setopt(curl, CURLOPT_SOCKOPTDATA, &vols);
     curl_easy_setopt(curl, CURLOPT_SOCKOPTFUNCTION, sockoptcallback);
     // libcurl's SIGALRM handler is buggy.  We've definitely seen the
@@ -1096,6 +2099,23 @@ backend123_http::backend123_http(const std::string& _baseurl, const std::string&
         break;
     }
 
+    if(vols.curl_multi)
+        multi = multi_engine::get(vols);
+    if(vols.curl_share)
+        share = get_curl_share();
+    if(vols.hedge_quantile > 0.f){
+        if(multi)
+            hedge = std::make_shared<hedge_state>(vols.hedge_quantile);
+        else
+            complain(LOG_WARNING, "Fs123HedgeQuantile requires Fs123CurlMulti.  Requests will not be hedged.");
+    }
+    if(vols.batch_millis > 0 && flavor == primary){
+        if(proto_minor >= 3 && accept_encoding.empty())
+            batch = std::make_shared<batch_state>();
+        else
+            complain(LOG_WARNING, "Fs123BatchMillis requires protocol 7.3 and plaintext replies.  Requests will not be batched.");
+    }
+
     // libcurl defaults to a 300 sec connection timeout.  That's
     // extremely painful when the server is down.  Unfortunately,
     // there are no sub-second settings and a zero value is
@@ -1135,6 +2155,13 @@ backend123_http::refresh(const req123& req, reply123* replyp) try{
         throw se(EIO, "backend123_http::refresh:  disconnected");
     }
     atomic_scoped_nanotimer _t(&stats.backend_get_sec);
+    std::optional<scoped_fetch_add<int>> inflight;
+    if(batch){
+        inflight.emplace(batch->inflight);
+        bool ret;
+        if(refresh_batched(req, replyp, &ret))
+            return ret;
+    }
     auto curl = get_curl();
     // get_curl gives us a CURL* that has been curl_easy_init'ed or curl_easy_reset.
     // We have to call curl_easy_setopt to establish our own policies and defaults.
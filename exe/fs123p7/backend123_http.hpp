@@ -6,7 +6,10 @@
 #include <core123/addrinfo_cache.hpp>
 #include <core123/stats.hpp>
 #include <curl/curl.h>
+#include <chrono>
 #include <memory>
+#include <mutex>
+#include <vector>
 
 #define BACKEND_HTTP_STATISTICS \
     STATISTIC(curl_performs) \
@@ -16,6 +19,10 @@
     STATISTIC_NANOTIMER(curl_PRETRANSFER_sec)   \
     STATISTIC_NANOTIMER(curl_STARTTRANSFER_sec) \
     STATISTIC_NANOTIMER(curl_TOTAL_sec)         \
+    STATISTIC_NANOTIMER(curl_APPCONNECT_sec)    \
+    STATISTIC(curl_new_connections)             \
+    STATISTIC(curl_reused_connections)          \
+    STATISTIC(curl_tls_handshakes)              \
     STATISTIC(backend_header_bytes_rcvd)        \
     STATISTIC(backend_body_bytes_rcvd)          \
     STATISTIC(backend_gets)                     \
@@ -29,12 +36,23 @@
     STATISTIC_NANOTIMER(backend_INM_sec)                \
     STATISTIC(backend_304)                              \
     STATISTIC(backend_304_bytes_saved)                  \
+    STATISTIC(backend_content_bytes_copied)             \
     STATISTIC(backend_couldnt_connect)                  \
     STATISTIC(backend_got_nothing)                      \
     STATISTIC(backend_disconnected)                     \
     STATISTIC(backend_30x_redirected)                   \
     STATISTIC(aicache_lookups)                          \
-    STATISTIC(aicache_successes)
+    STATISTIC(aicache_successes)                        \
+    STATISTIC(curl_multi_performs)                      \
+    STATISTIC(curl_multi_inflight)                      \
+    STATISTIC_NANOTIMER(curl_multi_perform_sec)         \
+    STATISTIC(backend_hedges)                           \
+    STATISTIC(backend_hedges_won)                       \
+    STATISTIC(backend_hedges_over_budget)               \
+    STATISTIC(backend_ewma_picks)                       \
+    STATISTIC(backend_batches)                          \
+    STATISTIC(backend_batched_requests)                 \
+    STATISTIC(backend_batch_fallbacks)
 
 struct url_info{
     // Extracting the hostname from a url, and remembering the
@@ -52,6 +70,33 @@ struct url_info{
     // unique_ptr because a bare std::atomic is not move-constructible and
     // therefore can't be emplace'ed into a vector.
     std::unique_ptr<std::atomic<tp_type>> deferred_until;
+    // ... and how well it's been doing lately, for
+    // Fs123EwmaOriginSelection:  exponentially weighted moving
+    // averages of the response time and the error rate, and the
+    // number of requests in flight.  Also a unique_ptr, because of the
+    // mutex and the atomic.
+    struct score_t{
+        std::mutex mtx; // protects everything but inflight
+        double ewma_sec = 0.;
+        double ewma_errors = 0.;
+        std::chrono::steady_clock::time_point last_observed{};
+        uint64_t nobserved = 0;
+        std::atomic<int> inflight{0};
+    };
+    std::unique_ptr<score_t> score;
+    // observe - fold one request's response time and outcome into the
+    // EWMAs.  tau is the EWMAs' time constant, in seconds.
+    void observe(double sec, bool ok, double tau);
+    // prior - the neutral score that an idle url's EWMAs decay
+    // toward:  the mean of the EWMAs of the urls that have been
+    // observed at all, or zeros if none have.
+    struct prior_t{
+        double sec = 0.;
+        double errors = 0.;
+    };
+    static prior_t prior(const std::vector<url_info>& urls);
+    // cost - lower is better.  See the comments in backend123_http.cpp.
+    double cost(double tau, const prior_t& prior) const;
 };
 
 struct backend123_http : public backend123 {
@@ -75,6 +120,9 @@ struct backend123_http : public backend123 {
 
     std::ostream& report_stats(std::ostream&) override;
     struct curl_handler;
+    struct multi_engine;
+    struct hedge_state;
+    struct batch_state;
 
     std::string get_url() const {
         return baseurls.front().original;
@@ -83,6 +131,17 @@ struct backend123_http : public backend123 {
 private:
     std::vector<url_info> baseurls;
     void setoptions(CURL* curl) const;
+    // perform - either curl_easy_perform(curl) or, if vols.curl_multi
+    // is set, hand curl to the (shared) multi_engine and wait for it
+    // to finish.
+    CURLcode perform(CURL* curl);
+    std::shared_ptr<multi_engine> multi;
+    CURLSH* share = nullptr; // see get_curl_share in backend123_http.cpp
+    std::shared_ptr<hedge_state> hedge; // null unless Fs123HedgeQuantile > 0
+    std::shared_ptr<batch_state> batch; // null unless Fs123BatchMillis > 0
+    // refresh_batched - try to satisfy req as part of a /b batch.
+    // Returns false if the caller should refresh req on its own.
+    bool refresh_batched(const req123& req, reply123* replyp, bool* retp);
     std::string stale_if_error;
     size_t content_reserve_size;
     std::string accept_encoding;
@@ -0,0 +1,225 @@
+#include "cache_policy.hpp"
+#include <core123/throwutils.hpp>
+#include <core123/diag.hpp>
+#include <core123/intutils.hpp>
+#include <algorithm>
+#include <random>
+#include <cmath>
+
+using namespace core123;
+
+static auto _policy = diag_name("policy");
+
+namespace{
+// A single diskcache is used concurrently by many threads.  Take
+// care that they don't step on one another's rngs.
+std::default_random_engine& thread_engine(){
+    static std::atomic<int> seed(0); // give a different seed to every thread.
+    static thread_local std::default_random_engine eng(seed++);
+    return eng;
+}
+
+bool expired(const dcindex::entry& e, int64_t now){
+    return e.expires != 0 && e.expires < now;
+}
+
+// lru_less - expired entries first, then least recently accessed.
+struct lru_less{
+    int64_t now;
+    bool operator()(const dcindex::entry& a, const dcindex::entry& b) const{
+        bool ea = expired(a, now), eb = expired(b, now);
+        if(ea != eb)
+            return ea;
+        return a.atime < b.atime;
+    }
+};
+
+// count_min_sketch - four rows of 4-bit (saturating at 15)
+// counters, stored one per byte.  After 'sample_size' increments,
+// every counter is halved, so the estimates reflect recent history.
+// Increments and halving are racy, but the estimates are only
+// estimates anyway.
+class count_min_sketch{
+    static const int nrows = 4;
+    unsigned logw;
+    size_t width;
+    std::unique_ptr<std::atomic<uint8_t>[]> counters;
+    size_t sample_size;
+    std::atomic<size_t> additions{0};
+    size_t index(uint64_t h, int row) const{
+        static const uint64_t mult[nrows] = {0x9e3779b97f4a7c15, 0xbf58476d1ce4e5b9,
+                                             0x94d049bb133111eb, 0xd6e8feb86659fd93};
+        return size_t(((h ^ (h>>29)) * mult[row]) >> (64 - logw));
+    }
+    void halve(){
+        for(size_t i=0; i<nrows*width; ++i)
+            counters[i].store(counters[i].load(std::memory_order_relaxed)>>1, std::memory_order_relaxed);
+    }
+public:
+    explicit count_min_sketch(size_t nexpected) :
+        logw(clip(10u, unsigned(ceil(log2(std::max(nexpected, size_t(2))))), 22u)),
+        width(size_t(1)<<logw),
+        counters(new std::atomic<uint8_t>[nrows*width]()),
+        sample_size(10*width)
+    {}
+    void increment(uint64_t h){
+        for(int r=0; r<nrows; ++r){
+            auto& c = counters[r*width + index(h, r)];
+            auto v = c.load(std::memory_order_relaxed);
+            if(v < 15)
+                c.store(v+1, std::memory_order_relaxed);
+        }
+        if(additions.fetch_add(1) + 1 == sample_size){
+            halve();
+            additions -= sample_size;
+        }
+    }
+    unsigned estimate(uint64_t h) const{
+        unsigned ret = 15;
+        for(int r=0; r<nrows; ++r)
+            ret = std::min(ret, unsigned(counters[r*width + index(h, r)].load(std::memory_order_relaxed)));
+        return ret;
+    }
+};
+
+struct random_policy : public cache_policy{
+    const char* name() const override { return "random"; }
+    std::vector<dcindex::entry> victims(dcindex& idx, unsigned dir, size_t n, int64_t) override{
+        auto es = idx.entries(dir);
+        n = std::min(n, es.size());
+        // A partial Fisher-Yates shuffle.
+        for(size_t i=0; i<n; ++i)
+            std::swap(es[i], es[std::uniform_int_distribution<size_t>(i, es.size()-1)(thread_engine())]);
+        es.resize(n);
+        return es;
+    }
+};
+
+struct lru_policy : public cache_policy{
+    const char* name() const override { return "lru"; }
+    std::vector<dcindex::entry> victims(dcindex& idx, unsigned dir, size_t n, int64_t now) override{
+        return idx.candidates(dir, n, now);
+    }
+};
+
+struct tinylfu_policy : public cache_policy{
+    static const uint32_t PROTECTED = 1;
+    static constexpr double protected_fraction = 0.8;
+    count_min_sketch sketch;
+    std::atomic<bool> under_pressure{false};
+    // An exponentially weighted average of the estimated frequency
+    // of recent victims.
+    std::atomic<float> victim_freq{0.};
+
+    explicit tinylfu_policy(size_t maxfiles) : sketch(maxfiles) {}
+    const char* name() const override { return "tinylfu"; }
+
+    void record_access(const dcindex::key_t& key) override{
+        sketch.increment(key.second);
+    }
+
+    bool admit(const dcindex::key_t& key, bool resident, float injection_probability) override{
+        if(!resident && under_pressure && sketch.estimate(key.second) <= victim_freq){
+            DIAGf(_policy, "tinylfu rejects %016llx: estimate %u <= victim_freq %g",
+                  (unsigned long long)key.first, sketch.estimate(key.second), victim_freq.load());
+            rejected_++;
+            return false;
+        }
+        return cache_policy::admit(key, resident, injection_probability);
+    }
+
+    uint32_t hit_bits() const override { return PROTECTED; }
+
+    void note_usage(double usage_fraction, double evict_target_fraction) override{
+        under_pressure = usage_fraction > evict_target_fraction;
+    }
+
+    std::vector<dcindex::entry> victims(dcindex& idx, unsigned dir, size_t n, int64_t now) override{
+        auto es = idx.entries(dir);
+        auto is_probationary = [](const dcindex::entry& e){ return !(e.meta & PROTECTED); };
+        auto prot = std::partition(es.begin(), es.end(), is_probationary);
+        // Demote the least recently used members of an over-full
+        // protected segment.
+        size_t nprot = es.end() - prot;
+        size_t cap = size_t(protected_fraction * es.size());
+        if(nprot > cap){
+            auto ndemote = nprot - cap;
+            std::partial_sort(prot, prot+ndemote, es.end(),
+                              [](const dcindex::entry& a, const dcindex::entry& b){ return a.atime < b.atime; });
+            for(auto p = prot; p != prot+ndemote; ++p){
+                idx.clear_meta(p->key, PROTECTED);
+                p->meta &= ~PROTECTED;
+            }
+            prot += ndemote;
+        }
+        choose(es, prot, n, now);
+        return es;
+    }
+
+    void sample_victims(dcindex& idx, unsigned dir, size_t n, int64_t now) override{
+        // Like victims, but without demoting anything.  The leader
+        // takes care of that.
+        auto es = idx.entries(dir);
+        auto prot = std::partition(es.begin(), es.end(),
+                                   [](const dcindex::entry& e){ return !(e.meta & PROTECTED); });
+        choose(es, prot, n, now);
+    }
+
+private:
+    // choose - leave the n best victims at the front of es, whose
+    // probationary members precede prot, and shrink es to fit.  Fold
+    // their estimated frequency into victim_freq.
+    void choose(std::vector<dcindex::entry>& es, std::vector<dcindex::entry>::iterator prot, size_t n, int64_t now){
+        // Probationary victims first, then protected ones.
+        n = std::min(n, es.size());
+        size_t nprob = prot - es.begin();
+        if(n <= nprob){
+            std::partial_sort(es.begin(), es.begin()+n, prot, lru_less{now});
+        }else{
+            std::sort(es.begin(), prot, lru_less{now});
+            std::partial_sort(prot, es.begin()+n, es.end(), lru_less{now});
+        }
+        es.resize(n);
+        if(n){
+            double sum = 0.;
+            for(const auto& e : es)
+                sum += sketch.estimate(e.key.second);
+            victim_freq = 0.75*victim_freq + 0.25*sum/n;
+        }
+    }
+};
+} // namespace <anon>
+
+bool
+cache_policy::admit(const dcindex::key_t&, bool, float injection_probability){
+    std::uniform_real_distribution<float> ureal(0., 1.);
+    if(ureal(thread_engine()) > injection_probability){
+        rejected_++;
+        return false;
+    }
+    admitted_++;
+    return true;
+}
+
+std::unique_ptr<cache_policy>
+cache_policy::make(const std::string& name, size_t maxfiles){
+    if(name == "random")
+        return std::make_unique<random_policy>();
+    if(name == "lru")
+        return std::make_unique<lru_policy>();
+    if(name == "tinylfu")
+        return std::make_unique<tinylfu_policy>(maxfiles);
+    throw se(EINVAL, "cache_policy::make:  unknown policy: '" + name + "'.  Choose one of: random, lru, tinylfu");
+}
+
+std::ostream&
+cache_policy::report_stats(std::ostream& os) const{
+    std::string pfx = std::string("dc_policy_") + name();
+    size_t h = hits_, m = misses_;
+    return os << "dc_policy: " << name() << "\n"
+              << pfx << "_hits: " << h << "\n"
+              << pfx << "_misses: " << m << "\n"
+              << pfx << "_hit_ratio: " << ((h+m) ? double(h)/(h+m) : 0.) << "\n"
+              << pfx << "_admitted: " << admitted_ << "\n"
+              << pfx << "_rejected: " << rejected_ << "\n";
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+// cache_policy - admission and eviction-order policies for the
+// diskcache.
+//
+// The diskcache consults its policy at four points:
+//
+//   record_access - in diskcache::refresh, for every request, whether
+//       it's a hit or a miss.
+//   admit - in diskcache::serialize, before writing an object to
+//       disk.  'resident' is true if the object is already in the
+//       cache, i.e., if it's being rewritten after a revalidation.
+//   hit_bits - in diskcache::deserialize, on a hit, to be or-ed into
+//       the dcindex entry's 'meta'.
+//   victims - in diskcache::evict_once, to choose which files to
+//       evict from a directory.  Requires the dcindex.
+//   sample_victims - in diskcache::follow_leader, when another
+//       process is doing the evicting.  Looks at the files victims
+//       would choose, without changing anything.  Requires the
+//       dcindex.
+//
+// It's also told how full the cache is (note_usage) every time
+// evict_once looks.
+//
+// Three policies are available, selected by -oFs123CachePolicy=:
+//
+//   random (the default) - the original behavior.  Admission is a
+//       coin flip against the diskcache's injection_probability, and
+//       victims are chosen uniformly at random.
+//
+//   lru - coin flip admission.  Victims are expired objects, then the
+//       least recently accessed ones.
+//
+//   tinylfu - frequency-aware admission and a segmented LRU (SLRU)
+//       eviction order.  Every access is counted in a count-min
+//       sketch whose counters are periodically halved, so it
+//       estimates how often each object has been requested
+//       "recently".  When the cache is under pressure (usage above
+//       evict_target_fraction), a new object is only admitted if its
+//       estimated frequency is higher than that of the objects being
+//       evicted to make room for it.  Hence a one-time sequential
+//       scan can't displace frequently used objects.  Eviction
+//       follows SLRU: an object starts in the 'probationary' segment,
+//       and is promoted to the 'protected' segment when it's hit.
+//       Victims are taken from the probationary segment (expired
+//       first, then least recently used) before the protected one.
+//       If the protected segment grows beyond 80% of a directory,
+//       its least recently used members are demoted.
+//
+// The sketch is private to each process, and so is the estimated
+// frequency of the victims it's compared against.  A process that
+// follows a dccoord leader doesn't evict, so it calls sample_victims
+// to estimate that frequency for itself.  The SLRU segment lives in
+// the shared dcindex.
+//
+// The policy also counts hits and misses, which diskcache::report_stats
+// reports along with the policy's name.
+
+#include "dcindex.hpp"
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <ostream>
+
+struct cache_policy{
+    virtual ~cache_policy() = default;
+    virtual const char* name() const = 0;
+    virtual void record_access(const dcindex::key_t&) {}
+    virtual bool admit(const dcindex::key_t& key, bool resident, float injection_probability);
+    virtual uint32_t hit_bits() const { return 0; }
+    virtual std::vector<dcindex::entry> victims(dcindex& idx, unsigned dir, size_t n, int64_t now) = 0;
+    virtual void note_usage(double /*usage_fraction*/, double /*evict_target_fraction*/) {}
+    virtual void sample_victims(dcindex& /*idx*/, unsigned /*dir*/, size_t /*n*/, int64_t /*now*/) {}
+
+    // make - throws if name isn't one of the policies listed above.
+    // maxfiles sizes the tinylfu sketch.
+    static std::unique_ptr<cache_policy> make(const std::string& name, size_t maxfiles);
+
+    void count_hit() { hits_++; }
+    void count_miss() { misses_++; }
+    std::ostream& report_stats(std::ostream& os) const;
+protected:
+    std::atomic<size_t> hits_{0};
+    std::atomic<size_t> misses_{0};
+    std::atomic<size_t> admitted_{0};
+    std::atomic<size_t> rejected_{0};
+};
@@ -0,0 +1,87 @@
+#include "dccoord.hpp"
+#include "fs123/acfd.hpp"
+#include <core123/sew.hpp>
+#include <core123/diag.hpp>
+#include <core123/throwutils.hpp>
+#include <core123/exnest.hpp>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <sys/file.h>
+
+using namespace core123;
+
+static auto _dccoord = diag_name("dccoord");
+
+namespace{
+const size_t RECORD_SIZE = circular_shared_buffer::default_record_size;
+static_assert(sizeof(dccoord::record) <= RECORD_SIZE - circular_shared_buffer::cksum_size,
+              "dccoord::record doesn't fit in a circular_shared_buffer record");
+}
+
+dccoord::dccoord(const std::string& rootpath, const std::string& name) try {
+    std::string path = rootpath + "/" + name;
+    if(::access(path.c_str(), F_OK) != 0){
+        // Initialize it under a temporary name and link it into
+        // place, so nobody ever maps a file that's being truncated.
+        // If somebody else links theirs first, use theirs.
+        std::string tmppath = path + ".new." + std::to_string(::getpid());
+        size_t nrecords = ::getpagesize() / RECORD_SIZE;
+        circular_shared_buffer(tmppath, O_RDWR|O_CREAT|O_TRUNC, nrecords, RECORD_SIZE);
+        int r = ::link(tmppath.c_str(), path.c_str());
+        int eno = errno;
+        ::unlink(tmppath.c_str());
+        if(r != 0 && eno != EEXIST)
+            throw se(eno, "link(" + tmppath + ", " + path + ")");
+    }
+    csb_ = std::make_unique<circular_shared_buffer>(path, O_RDWR, 0, RECORD_SIZE);
+    // flock locks belong to the open file description, so the lock
+    // fd must be our own, not the circular_shared_buffer's.
+    lockfd_ = sew::open(path.c_str(), O_RDONLY|O_CLOEXEC);
+ }catch(std::exception&){
+    std::throw_with_nested(std::runtime_error("dccoord::dccoord(" + rootpath + ", " + name + ")"));
+ }
+
+dccoord::~dccoord(){
+    ::close(lockfd_); // releases the flock, if we're the leader.
+}
+
+bool
+dccoord::lead(){
+    if(leader_)
+        return true;
+    if(::flock(lockfd_, LOCK_EX|LOCK_NB) == 0){
+        DIAG(_dccoord, "pid " << ::getpid() << " is the leader\n");
+        leader_ = true;
+    }else if(errno != EWOULDBLOCK){
+        throw se("dccoord::lead: flock");
+    }
+    return leader_;
+}
+
+void
+dccoord::publish(record r){
+    record prev;
+    r.seq = latest(&prev) ? prev.seq + 1 : 1;
+    r.pid = ::getpid();
+    r.published = ::time(nullptr);
+    csb_->append(str_view(reinterpret_cast<const char*>(&r), sizeof(r)), '\0');
+    DIAG(_dccoord, "published seq=" << r.seq << " usage_fraction=" << r.usage_fraction << " injection_probability=" << r.injection_probability << "\n");
+}
+
+bool
+dccoord::latest(record* r) const{
+    bool found = false;
+    for(size_t i=0; i<csb_->size(); ++i){
+        std::string rec = csb_->copyrecord(i);
+        if(rec.size() < sizeof(record))
+            continue;   // never written, or being written right now.
+        record ri;
+        ::memcpy(&ri, rec.data(), sizeof(ri));
+        if(ri.seq != 0 && (!found || ri.seq > r->seq)){
+            *r = ri;
+            found = true;
+        }
+    }
+    return found;
+}
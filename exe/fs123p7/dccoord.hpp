@@ -0,0 +1,68 @@
+#pragma once
+
+// dccoord - coordinates eviction among the processes sharing a
+// diskcache root.
+//
+// Several mount.fs123 processes with the same baseurl can share one
+// diskcache.  Without coordination, each of them runs its own
+// eviction thread, scans (or audits) the cache directories, and
+// computes its own usage fraction and injection probability.  With
+// a dccoord, one of them - the 'leader' - does the scanning and
+// evicting, and publishes what it learns.  The others - 'followers'
+// - adopt the leader's injection probability without looking at the
+// cache at all.
+//
+// The coordination file (normally <root>/.evictcoord) is a
+// core123::circular_shared_buffer.  The leader appends a record
+// after each evict_once.  Each record carries a sequence number, so
+// followers read all of them (there are only a handful) and use the
+// newest valid one.
+//
+// Leadership is an flock on the coordination file.  lead() takes it
+// if nobody else has it, and it's never given up voluntarily.  The
+// kernel releases it when the leader exits, however it exits (kill
+// -9 included), and the next follower to call lead() takes over.  A
+// leader that's alive but wedged keeps the lock, so every record
+// also says how long it's good for.  A follower that finds nothing
+// newer than that does its own eviction, as if there were no
+// dccoord.
+
+#include <core123/circular_shared_buffer.hpp>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <cstdint>
+
+class dccoord{
+public:
+    struct record{
+        uint64_t seq;               // assigned by publish
+        int32_t pid;                // assigned by publish
+        uint32_t next_dir;          // where the leader's next scan starts
+        int64_t published;          // seconds since the epoch, assigned by publish
+        int64_t good_until;         // seconds since the epoch
+        double usage_fraction;
+        double injection_probability;
+    };
+
+    // Create <rootpath>/<name> if it doesn't exist.  Throws if it
+    // can't be created or opened.
+    dccoord(const std::string& rootpath, const std::string& name);
+    ~dccoord();
+
+    // lead - returns true if we're the leader, possibly because we
+    // just took over.  Never blocks.
+    bool lead();
+    bool is_leader() const { return leader_.load(); }
+    // publish - append r, with new seq, pid and published fields.
+    // Only the leader should publish.
+    void publish(record r);
+    // latest - the newest valid record.  Returns false if there
+    // isn't one.
+    bool latest(record* r) const;
+
+private:
+    std::unique_ptr<core123::circular_shared_buffer> csb_;
+    int lockfd_;
+    std::atomic<bool> leader_{false};
+};
@@ -0,0 +1,537 @@
+#include "dcindex.hpp"
+#include "fs123/acfd.hpp"
+#include <core123/sew.hpp>
+#include <core123/throwutils.hpp>
+#include <core123/complaints.hpp>
+#include <core123/diag.hpp>
+#include <core123/strutils.hpp>
+#include <unordered_map>
+#include <algorithm>
+#include <limits>
+#include <cstring>
+#include <cmath>
+#include <sys/file.h>
+#include <sys/mman.h>
+
+using namespace core123;
+
+static auto _dcindex = diag_name("dcindex");
+
+// Everything in the header, the dirhdrs and the slots is either
+// written once, before the file is visible to anyone else, or is a
+// lock-free std::atomic.  The atomics must be address-free for this
+// to work across processes.
+static_assert(std::atomic<int64_t>::is_always_lock_free, "dcindex requires lock-free 64-bit atomics");
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "dcindex requires lock-free 32-bit atomics");
+
+namespace{
+const uint64_t MAGIC = 0x78646e6963643331; // "13dcindx", little-endian
+const uint32_t VERSION = 1;
+const size_t PAGE = 4096;
+
+size_t roundup(size_t n, size_t m){
+    return ((n + m - 1)/m)*m;
+}
+
+uint32_t clip32(int64_t t){
+    return uint32_t(std::clamp<int64_t>(t, 0, std::numeric_limits<uint32_t>::max()));
+}
+
+bool parse_hex64(const char* p, uint64_t* ret){
+    uint64_t v = 0;
+    for(int i=0; i<16; ++i){
+        char c = p[i];
+        unsigned d;
+        if(c >= '0' && c <= '9')
+            d = c - '0';
+        else if(c >= 'a' && c <= 'f')
+            d = c - 'a' + 10;
+        else if(c >= 'A' && c <= 'F')
+            d = c - 'A' + 10;
+        else
+            return false;
+        v = (v<<4) | d;
+    }
+    *ret = v;
+    return true;
+}
+
+struct keyhash{
+    size_t operator()(const dcindex::key_t& k) const { return k.second; }
+};
+} // namespace <anon>
+
+struct dcindex::header{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t hexdigits;
+    uint64_t slots_per_dir;
+    std::atomic<int64_t> nfiles;
+    std::atomic<int64_t> nbytes;
+    std::atomic<int64_t> ndirs_audited;
+    std::atomic<uint32_t> obsolete;
+};
+
+struct dcindex::dirhdr{
+    std::atomic<int64_t> nfiles;
+    std::atomic<int64_t> nbytes;
+    std::atomic<int64_t> audited_at; // 0 means never
+    std::atomic<int64_t> claimed_at;
+};
+
+// A slot is empty if h0 is zero.  Writers store h0 last (and clear it
+// first) so a lock-free reader that sees a matching h0 will usually
+// see the rest of the slot too.
+struct dcindex::slot{
+    std::atomic<uint64_t> h0;
+    std::atomic<uint64_t> h1;
+    std::atomic<uint32_t> blocks;  // accounting bytes / 512
+    std::atomic<uint32_t> expires; // seconds since the epoch.  0 means unknown
+    std::atomic<uint32_t> atime;   // seconds since the epoch
+    std::atomic<uint32_t> meta;    // for the cache_policy.  See dcindex.hpp
+};
+static_assert(sizeof(dcindex::key_t) == 16, "");
+
+struct dcindex::region_lock{
+    region_lock(const dcindex& idx, unsigned dir) :
+        lg(idx.mutex_for(dir)),
+        fd(idx.fd_),
+        off(PAGE + dir*sizeof(dirhdr))
+    {
+        setlk(F_WRLCK);
+    }
+    ~region_lock(){
+        try{
+            setlk(F_UNLCK);
+        }catch(std::exception& e){
+            complain(LOG_ERR, e, "dcindex::region_lock:  unlock failed");
+        }
+    }
+    void setlk(short type){
+        struct flock fl{};
+        fl.l_type = type;
+        fl.l_whence = SEEK_SET;
+        fl.l_start = off;
+        fl.l_len = 1;
+        while(::fcntl(fd, F_SETLKW, &fl) < 0){
+            if(errno != EINTR)
+                throw se(fmt("dcindex:  fcntl(%d, F_SETLKW, {type=%d, start=%zu})", fd, type, off));
+        }
+    }
+    std::lock_guard<std::mutex> lg;
+    int fd;
+    size_t off;
+};
+
+size_t
+dcindex::recommended_slots_per_dir(size_t maxfiles, unsigned hexdigits){
+    size_t ndirs = size_t(1)<<(4*hexdigits);
+    return std::max(size_t(64), size_t(ceil(1.5*maxfiles/ndirs)));
+}
+
+uint64_t
+dcindex::accounting_bytes(uint64_t nbytes){
+    return roundup(nbytes, 4096) + 4096;
+}
+
+dcindex::dcindex(int rootfd, const std::string& name, unsigned hexdigits, size_t slots_per_dir) :
+    hexdigits_(hexdigits),
+    ndirs_(size_t(1)<<(4*hexdigits)),
+    slots_per_dir_(slots_per_dir),
+    mutexes_(new std::mutex[nmutexes])
+{
+    if(hexdigits < 1 || hexdigits > 4)
+        throw se(EINVAL, fmt("dcindex:  hexdigits=%u must be between 1 and 4", hexdigits));
+    // Serialize the open-or-create logic across processes with
+    // flock.  Use a new open file description for the directory, so
+    // that the lock excludes other threads in this process too.
+    acfd lockfd = sew::openat(rootfd, ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    sew::flock(lockfd, LOCK_EX);
+    if(!open_existing(rootfd, name))
+        create(rootfd, name);
+    // lockfd's close releases the flock.
+}
+
+dcindex::~dcindex(){
+    // Don't use sew.  We can't throw.
+    if(base_)
+        ::munmap(base_, mapsz_);
+    if(fd_ >= 0)
+        ::close(fd_);
+}
+
+void
+dcindex::map(int fd) /*private*/{
+    size_t dirbytes = roundup(ndirs_*sizeof(dirhdr), PAGE);
+    mapsz_ = PAGE + dirbytes + ndirs_*slots_per_dir_*sizeof(slot);
+    base_ = sew::mmap(nullptr, mapsz_, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    fd_ = fd;
+    hdr_ = reinterpret_cast<header*>(base_);
+    dirs_ = reinterpret_cast<dirhdr*>(static_cast<char*>(base_) + PAGE);
+    slots_ = reinterpret_cast<slot*>(static_cast<char*>(base_) + PAGE + dirbytes);
+}
+
+bool
+dcindex::open_existing(int rootfd, const std::string& name) /*private*/{
+    acfd fd = ::openat(rootfd, name.c_str(), O_RDWR|O_CLOEXEC);
+    if(!fd){
+        if(errno == ENOENT)
+            return false;
+        throw se("dcindex:  openat(" + name + ")");
+    }
+    struct stat sb;
+    sew::fstat(fd, &sb);
+    // Read the header with pread rather than mmap, so a
+    // short or garbled file can't hurt us.
+    struct{
+        uint64_t magic;
+        uint32_t version;
+        uint32_t hexdigits;
+        uint64_t slots_per_dir;
+    } h{};
+    bool ok = size_t(sb.st_size) >= PAGE &&
+        sew::pread(fd, &h, sizeof(h), 0) == sizeof(h) &&
+        h.magic == MAGIC &&
+        h.version == VERSION &&
+        h.hexdigits == hexdigits_;
+    if(ok){
+        // Adopt the existing file's slots_per_dir unless it's much
+        // smaller than what we asked for.
+        size_t spd = h.slots_per_dir;
+        size_t want = PAGE + roundup(ndirs_*sizeof(dirhdr), PAGE) + ndirs_*spd*sizeof(slot);
+        if(size_t(sb.st_size) == want && 2*spd >= slots_per_dir_){
+            if(spd != slots_per_dir_)
+                complain(LOG_NOTICE, "dcindex:  using existing index %s with %zu slots per directory (requested %zu)",
+                         name.c_str(), spd, slots_per_dir_);
+            slots_per_dir_ = spd;
+            map(fd.release());
+            DIAG(_dcindex, "opened existing index " << name << " nfiles=" << nfiles() << " nbytes=" << nbytes());
+            return true;
+        }
+    }
+    // It's not usable.  Tell anyone still using it (i.e., anyone
+    // whose header checks out) that it's obsolete, and replace it.
+    complain(LOG_NOTICE, "dcindex:  replacing existing index %s (size %jd), which is corrupt or has the wrong geometry",
+             name.c_str(), (intmax_t)sb.st_size);
+    if(size_t(sb.st_size) >= PAGE && h.magic == MAGIC){
+        void* p = sew::mmap(nullptr, PAGE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        reinterpret_cast<header*>(p)->obsolete.store(1);
+        sew::munmap(p, PAGE);
+    }
+    return false;
+}
+
+void
+dcindex::create(int rootfd, const std::string& name) /*private*/{
+    // Build the new index under a temporary name and rename it into
+    // place, so nobody ever sees a partially initialized file.  The
+    // flock in the constructor keeps other processes from doing the
+    // same thing at the same time.
+    std::string tmpname = name + ".new." + std::to_string(::getpid());
+    acfd fd = sew::openat(rootfd, tmpname.c_str(), O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+    try{
+        size_t dirbytes = roundup(ndirs_*sizeof(dirhdr), PAGE);
+        sew::ftruncate(fd, PAGE + dirbytes + ndirs_*slots_per_dir_*sizeof(slot));
+        map(fd.release());
+        // ftruncate zero-filled everything, which is exactly the
+        // initial state we want for the atomics.
+        hdr_->version = VERSION;
+        hdr_->hexdigits = hexdigits_;
+        hdr_->slots_per_dir = slots_per_dir_;
+        hdr_->magic = MAGIC;
+        sew::msync(base_, PAGE, MS_SYNC);
+        sew::renameat(rootfd, tmpname.c_str(), rootfd, name.c_str());
+    }catch(std::exception&){
+        ::unlinkat(rootfd, tmpname.c_str(), 0);
+        std::throw_with_nested(std::runtime_error("dcindex::create(" + name + ")"));
+    }
+    complain(LOG_NOTICE, "dcindex:  created new index %s with %zu directories and %zu slots per directory (%zu bytes)",
+             name.c_str(), ndirs_, slots_per_dir_, mapsz_);
+}
+
+std::mutex&
+dcindex::mutex_for(unsigned dir) const /*private*/{
+    return mutexes_[dir % nmutexes];
+}
+
+dcindex::slot*
+dcindex::region(unsigned dir) const /*private*/{
+    return slots_ + size_t(dir)*slots_per_dir_;
+}
+
+unsigned
+dcindex::dir_of(const key_t& key) const{
+    return unsigned(key.first >> (64 - 4*hexdigits_));
+}
+
+bool
+dcindex::key_of(str_view relpath, key_t* key) const{
+    // <hexdigits_ hex digits>/<32-hexdigits_ hex digits>
+    if(relpath.size() != 33 || relpath[hexdigits_] != '/')
+        return false;
+    char buf[32];
+    ::memcpy(buf, relpath.data(), hexdigits_);
+    ::memcpy(buf+hexdigits_, relpath.data()+hexdigits_+1, 32-hexdigits_);
+    return parse_hex64(buf, &key->first) && parse_hex64(buf+16, &key->second);
+}
+
+bool
+dcindex::key_of(unsigned dir, str_view fname, key_t* key) const{
+    if(fname.size() != 32-hexdigits_)
+        return false;
+    char buf[34];
+    ::snprintf(buf, sizeof(buf), "%0*x/", int(hexdigits_), dir);
+    ::memcpy(buf+hexdigits_+1, fname.data(), fname.size());
+    return key_of(str_view(buf, 33), key);
+}
+
+std::string
+dcindex::relpath(const key_t& key) const{
+    char buf[34];
+    ::snprintf(buf, sizeof(buf), "%016llx%016llx", (unsigned long long)key.first, (unsigned long long)key.second);
+    std::string ret(buf, 32);
+    return ret.insert(hexdigits_, 1, '/');
+}
+
+dcindex::slot*
+dcindex::find(slot* rgn, const key_t& key) const /*private*/{
+    size_t start = key.second % slots_per_dir_;
+    for(size_t i=0; i<slots_per_dir_; ++i){
+        slot& s = rgn[(start+i)%slots_per_dir_];
+        auto h0 = s.h0.load(std::memory_order_acquire);
+        if(h0 == 0)
+            return nullptr;
+        if(h0 == key.first && s.h1.load() == key.second)
+            return &s;
+    }
+    return nullptr;
+}
+
+bool
+dcindex::insert_locked(unsigned dir, slot* rgn, const key_t& key, uint64_t bytes, int64_t expires, int64_t atime, const uint32_t* meta) /*private*/{
+    if(key.first == 0)
+        return false;  // reserved for empty slots.
+    uint32_t blocks = clip32((bytes+511)/512);
+    int64_t dbytes = int64_t(blocks)*512;
+    int64_t dfiles = 1;
+    slot* s = find(rgn, key);
+    if(s){
+        dbytes -= int64_t(s->blocks.load())*512;
+        dfiles = 0;
+    }else{
+        size_t start = key.second % slots_per_dir_;
+        for(size_t i=0; i<slots_per_dir_ && !s; ++i){
+            slot& t = rgn[(start+i)%slots_per_dir_];
+            if(t.h0.load() == 0)
+                s = &t;
+        }
+        if(!s)
+            return false;
+        s->h1.store(key.second);
+        s->meta.store(0);
+    }
+    if(meta)
+        s->meta.store(*meta);
+    s->blocks.store(blocks);
+    s->expires.store(clip32(expires));
+    s->atime.store(clip32(atime));
+    s->h0.store(key.first, std::memory_order_release);
+    dirs_[dir].nfiles += dfiles;
+    dirs_[dir].nbytes += dbytes;
+    hdr_->nfiles += dfiles;
+    hdr_->nbytes += dbytes;
+    return true;
+}
+
+void
+dcindex::erase_locked(unsigned dir, slot* rgn, size_t i) /*private*/{
+    int64_t dbytes = int64_t(rgn[i].blocks.load())*512;
+    dirs_[dir].nfiles--;
+    dirs_[dir].nbytes -= dbytes;
+    hdr_->nfiles--;
+    hdr_->nbytes -= dbytes;
+    // Backward-shift deletion:  move later members of the probe
+    // sequence into the hole, so we never need tombstones.
+    size_t j = i;
+    for(;;){
+        j = (j+1)%slots_per_dir_;
+        slot& sj = rgn[j];
+        if(sj.h0.load() == 0)
+            break;
+        size_t home = sj.h1.load() % slots_per_dir_;
+        // If home is cyclically in (i, j], sj can stay where it is.
+        bool stays = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+        if(stays)
+            continue;
+        slot& si = rgn[i];
+        si.h0.store(0, std::memory_order_release);
+        si.h1.store(sj.h1.load());
+        si.blocks.store(sj.blocks.load());
+        si.expires.store(sj.expires.load());
+        si.atime.store(sj.atime.load());
+        si.meta.store(sj.meta.load());
+        si.h0.store(sj.h0.load(), std::memory_order_release);
+        i = j;
+    }
+    rgn[i].h0.store(0, std::memory_order_release);
+}
+
+bool
+dcindex::insert(const key_t& key, uint64_t bytes, int64_t expires, int64_t now){
+    auto dir = dir_of(key);
+    region_lock lk(*this, dir);
+    return insert_locked(dir, region(dir), key, bytes, expires, now, nullptr);
+}
+
+bool
+dcindex::erase(const key_t& key){
+    auto dir = dir_of(key);
+    region_lock lk(*this, dir);
+    auto rgn = region(dir);
+    slot* s = find(rgn, key);
+    if(!s)
+        return false;
+    erase_locked(dir, rgn, s - rgn);
+    return true;
+}
+
+void
+dcindex::touch(const key_t& key, int64_t now, uint32_t meta_bits){
+    slot* s = find(region(dir_of(key)), key);
+    if(!s)
+        return;
+    auto t = clip32(now);
+    auto old = s->atime.load(std::memory_order_relaxed);
+    if(t >= old + atime_granularity)
+        s->atime.store(t, std::memory_order_relaxed);
+    if((s->meta.load(std::memory_order_relaxed) & meta_bits) != meta_bits)
+        s->meta.fetch_or(meta_bits, std::memory_order_relaxed);
+}
+
+void
+dcindex::clear_meta(const key_t& key, uint32_t meta_bits){
+    slot* s = find(region(dir_of(key)), key);
+    if(s)
+        s->meta.fetch_and(~meta_bits, std::memory_order_relaxed);
+}
+
+bool
+dcindex::contains(const key_t& key) const{
+    return find(region(dir_of(key)), key) != nullptr;
+}
+
+// The counters can go (briefly) negative if a lock-free reader
+// catches an erase in progress, or if a crash left them off.
+size_t dcindex::nfiles() const { return std::max<int64_t>(0, hdr_->nfiles.load()); }
+size_t dcindex::nbytes() const { return std::max<int64_t>(0, hdr_->nbytes.load()); }
+size_t dcindex::dir_nfiles(unsigned dir) const { return std::max<int64_t>(0, dirs_[dir].nfiles.load()); }
+size_t dcindex::dir_nbytes(unsigned dir) const { return std::max<int64_t>(0, dirs_[dir].nbytes.load()); }
+
+bool
+dcindex::complete() const{
+    return size_t(hdr_->ndirs_audited.load()) >= ndirs_;
+}
+
+bool
+dcindex::obsolete() const{
+    return hdr_->obsolete.load() != 0;
+}
+
+std::vector<dcindex::entry>
+dcindex::entries(unsigned dir) const{
+    std::vector<entry> ret;
+    auto rgn = region(dir);
+    for(size_t i=0; i<slots_per_dir_; ++i){
+        slot& s = rgn[i];
+        auto h0 = s.h0.load(std::memory_order_acquire);
+        if(h0 == 0)
+            continue;
+        ret.push_back({{h0, s.h1.load()}, uint64_t(s.blocks.load())*512, s.expires.load(), s.atime.load(), s.meta.load()});
+    }
+    return ret;
+}
+
+std::vector<dcindex::entry>
+dcindex::candidates(unsigned dir, size_t n, int64_t now) const{
+    auto ret = entries(dir);
+    n = std::min(n, ret.size());
+    auto expired = [now](const entry& e){ return e.expires != 0 && e.expires < now; };
+    std::partial_sort(ret.begin(), ret.begin()+n, ret.end(),
+                      [&](const entry& a, const entry& b){
+                          bool ea = expired(a), eb = expired(b);
+                          if(ea != eb)
+                              return ea;
+                          return a.atime < b.atime;
+                      });
+    ret.resize(n);
+    return ret;
+}
+
+bool
+dcindex::claim_audit(unsigned dir, int64_t now, int64_t period){
+    auto& d = dirs_[dir];
+    auto audited = d.audited_at.load();
+    if(audited != 0 && now - audited < period)
+        return false;
+    // Don't step on somebody else's audit in progress.  But if they
+    // haven't finished in 10 minutes, assume they never will.
+    auto claimed = d.claimed_at.load();
+    if(now - claimed < 600)
+        return false;
+    return d.claimed_at.compare_exchange_strong(claimed, now);
+}
+
+size_t
+dcindex::audit(unsigned dir, const std::vector<found_file>& found, int64_t scan_started){
+    region_lock lk(*this, dir);
+    auto rgn = region(dir);
+    auto& d = dirs_[dir];
+    std::unordered_map<key_t, entry, keyhash> old;
+    for(size_t i=0; i<slots_per_dir_; ++i){
+        slot& s = rgn[i];
+        auto h0 = s.h0.load();
+        if(h0 == 0)
+            continue;
+        key_t k{h0, s.h1.load()};
+        old[k] = entry{k, uint64_t(s.blocks.load())*512, s.expires.load(), s.atime.load(), s.meta.load()};
+    }
+    // Rebuild the region from scratch.  That also repairs any
+    // damage to its probe sequences.
+    for(size_t i=0; i<slots_per_dir_; ++i)
+        rgn[i].h0.store(0, std::memory_order_release);
+    hdr_->nfiles -= d.nfiles.exchange(0);
+    hdr_->nbytes -= d.nbytes.exchange(0);
+    size_t wrong = 0;
+    size_t unindexed = 0;
+    for(const auto& f : found){
+        if(dir_of(f.key) != dir)
+            continue;
+        auto ii = old.find(f.key);
+        bool ok;
+        if(ii != old.end()){
+            ok = insert_locked(dir, rgn, f.key, f.bytes, ii->second.expires, ii->second.atime, &ii->second.meta);
+            old.erase(ii);
+        }else{
+            wrong++;
+            ok = insert_locked(dir, rgn, f.key, f.bytes, 0, f.mtime, nullptr);
+        }
+        if(!ok)
+            unindexed++;
+    }
+    // Whatever's left in old wasn't found by the scan.  Keep it if
+    // it was inserted (or touched) after the scan started.  Otherwise,
+    // it's gone.
+    for(const auto& [k, e] : old){
+        if(e.atime >= scan_started)
+            insert_locked(dir, rgn, k, e.bytes, e.expires, e.atime, &e.meta);
+        else
+            wrong++;
+    }
+    if(unindexed)
+        complain(LOG_WARNING, "dcindex::audit:  directory %x is full.  %zu files are not indexed.  Fs123CacheMaxFiles may have grown since the index was created", dir, unindexed);
+    if(d.audited_at.exchange(scan_started) == 0)
+        hdr_->ndirs_audited++;
+    d.claimed_at.store(0);
+    DIAG(_dcindex, "audit(" << dir << "): found " << found.size() << " files, index was wrong about " << wrong);
+    return wrong;
+}
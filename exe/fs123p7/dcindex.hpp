@@ -0,0 +1,190 @@
+#pragma once
+
+// dcindex - a persistent, memory-mapped index of the files in a
+// diskcache, shared by all the processes using the cache.
+//
+// The index lives in a single file in the cache root (normally
+// <root>/.index).  It records the accounting size, the expiration
+// time, the last-access time and some cache_policy bits ('meta') for
+// every cache file, along with per-directory and total file and byte
+// counts.  With it, the
+// eviction thread can learn how full the cache is in O(1) and choose
+// eviction candidates without readdir-ing and fstat-ing a whole
+// directory.
+//
+// Layout: a header page, followed by one dirhdr for each of the
+// cache's 16^hexdigits hash directories, followed by one 'region' of
+// slots_per_dir slots for each directory.  A file's key is its
+// 128-bit threeroe hash, i.e., the hex digits of its cache path.
+// The key's leading hexdigits select the region, and the rest select
+// a starting slot within the region for linear probing.
+//
+// Concurrency: everything in the mapped file is a lock-free
+// std::atomic, so it works across processes.  Mutations (insert,
+// erase, audit) of a region are serialized by a std::mutex (within
+// a process) and an fcntl lock on the region's dirhdr (across
+// processes).  fcntl locks are released when a process dies, so a
+// crash can't leave a region locked.  Lookups (touch, candidates)
+// take no locks at all.  They may occasionally see a slot that's
+// being moved or overwritten, in which case they may miss an entry
+// or report a stale one.  That's harmless: a missed touch loses one
+// access time, and a stale candidate is unlinked with ENOENT.
+//
+// Crash tolerance: a process that dies in the middle of an insert or
+// erase can leave its region's slots and counters slightly wrong.
+// So can anything that adds or removes cache files "behind our
+// back".  To repair such damage, each region is periodically
+// 'audited':  the caller scans the directory (the old-fashioned way,
+// with readdir and fstat) and hands the result to audit(), which
+// rewrites the region to match what's actually on disk.  A region
+// that has never been audited (e.g., because the index is new, and
+// the cache isn't) is reported by !complete().  A header with a bad
+// magic number or an unexpected geometry is discarded and the index
+// is rebuilt from scratch.
+//
+// Sizing: each slot is 32 bytes, and the number of slots per directory
+// is 1.5 times the expected number of files per directory.  So the
+// index costs about 50 bytes per cached file, e.g., about 1GB for a
+// cache with 20 million files.  Pages of the index that are never
+// touched are never allocated.
+
+#include <core123/str_view.hpp>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstdint>
+
+struct dcindex{
+    using key_t = std::pair<uint64_t, uint64_t>;
+
+    // Open (or create) the index called 'name' in the directory
+    // rootfd.  If an existing index has the right geometry it's
+    // shared.  Otherwise, a new one is created, and any
+    // processes still using the old one will see obsolete() become
+    // true.
+    dcindex(int rootfd, const std::string& name, unsigned hexdigits, size_t slots_per_dir);
+    ~dcindex();
+    dcindex(const dcindex&) = delete;
+    dcindex& operator=(const dcindex&) = delete;
+
+    // The recommended slots_per_dir for a cache of maxfiles.
+    static size_t recommended_slots_per_dir(size_t maxfiles, unsigned hexdigits);
+
+    // Conversions between keys and relative paths in the diskcache,
+    // e.g., "3/14159265358979323846264338327950" (for hexdigits=1).
+    // key_of returns false if the path isn't a well-formed cache
+    // path (e.g., a .new file or a renamed "bad" file).
+    bool key_of(core123::str_view relpath, key_t* key) const;
+    bool key_of(unsigned dir, core123::str_view fname, key_t* key) const;
+    std::string relpath(const key_t& key) const;
+    unsigned dir_of(const key_t& key) const;
+
+    // The accounting size of a cache file of nbytes, rounded up to
+    // a whole number of 4k blocks, plus another 4k for the inode and
+    // directory entry.  See the comments in diskcache::do_scan.
+    static uint64_t accounting_bytes(uint64_t nbytes);
+
+    // insert - insert or replace the entry for key.  Returns false
+    // if the key's region is full, in which case the file is not
+    // indexed until the region is audited.
+    bool insert(const key_t& key, uint64_t bytes, int64_t expires, int64_t now);
+    // erase - remove key from the index.  It's not an error if it's
+    // not there.  Returns true if it was.
+    bool erase(const key_t& key);
+    // touch - record an access at time 'now', and set meta_bits in
+    // the entry's meta.  Lock-free.  To avoid needlessly bouncing
+    // cache lines between processes, the recorded atime only moves
+    // forward in steps of at least atime_granularity seconds.
+    void touch(const key_t& key, int64_t now, uint32_t meta_bits = 0);
+    // clear_meta - clear meta_bits in the entry's meta.  Lock-free.
+    void clear_meta(const key_t& key, uint32_t meta_bits);
+    // contains - is key in the index?  Lock-free.
+    bool contains(const key_t& key) const;
+    static const int64_t atime_granularity = 60;
+
+    // Accounting.  All O(1).
+    size_t nfiles() const;
+    size_t nbytes() const;
+    size_t dir_nfiles(unsigned dir) const;
+    size_t dir_nbytes(unsigned dir) const;
+
+    // candidates - return up to n of the entries in dir that are
+    // most deserving of eviction, in order of preference.  Entries
+    // whose expiration time is before 'now' come first, then entries
+    // in order of increasing last-access time.
+    //
+    // Each entry also has 32 bits of 'meta' that belong to the
+    // cache_policy (see cache_policy.hpp).  A new entry's meta is
+    // zero.  Replacing an entry (insert of an existing key) and
+    // audit() leave it alone.
+    struct entry{
+        key_t key;
+        uint64_t bytes;
+        int64_t expires;
+        int64_t atime;
+        uint32_t meta;
+    };
+    std::vector<entry> candidates(unsigned dir, size_t n, int64_t now) const;
+    // entries - a snapshot of all the entries in dir.  Lock-free.
+    std::vector<entry> entries(unsigned dir) const;
+
+    // Auditing.  claim_audit returns true (at most once per period,
+    // across all processes sharing the index) if the caller should
+    // scan the directory and call audit() with what it found.  An
+    // unaudited dir is always due.  Files in 'found' that are
+    // already indexed keep their expires and atime.  Files that are
+    // indexed but not found are removed, unless they were inserted
+    // after scan_started (i.e., while the scan was in progress).
+    // Returns the number of files by which the index was wrong.
+    bool claim_audit(unsigned dir, int64_t now, int64_t period);
+    struct found_file{
+        key_t key;
+        uint64_t bytes;
+        int64_t mtime;
+    };
+    size_t audit(unsigned dir, const std::vector<found_file>& found, int64_t scan_started);
+    // complete - true if every region has been audited at least once,
+    // i.e., if the totals can be trusted.
+    bool complete() const;
+    // obsolete - true if another process has replaced the index file.
+    bool obsolete() const;
+
+    size_t ndirs() const { return ndirs_; }
+    size_t slots_per_dir() const { return slots_per_dir_; }
+    size_t file_size() const { return mapsz_; }
+
+private:
+    struct header;
+    struct dirhdr;
+    struct slot;
+    bool open_existing(int rootfd, const std::string& name);
+    void create(int rootfd, const std::string& name);
+    void map(int fd);
+    slot* region(unsigned dir) const;
+    // find - the slot holding key in region, or nullptr.
+    slot* find(slot* rgn, const key_t& key) const;
+    // the region locks.  lock_region locks both the in-process mutex
+    // and the fcntl lock.
+    struct region_lock;
+    std::mutex& mutex_for(unsigned dir) const;
+    // erase_locked - backward-shift deletion.  No tombstones.
+    void erase_locked(unsigned dir, slot* rgn, size_t i);
+    // insert_locked - if meta is null, a new entry's meta is zero and an
+    // existing entry's is unchanged.
+    bool insert_locked(unsigned dir, slot* rgn, const key_t& key, uint64_t bytes, int64_t expires, int64_t atime, const uint32_t* meta);
+
+    unsigned hexdigits_;
+    size_t ndirs_;
+    size_t slots_per_dir_;
+    int fd_ = -1;
+    void* base_ = nullptr;
+    size_t mapsz_ = 0;
+    header* hdr_ = nullptr;
+    dirhdr* dirs_ = nullptr;
+    slot* slots_ = nullptr;
+    std::unique_ptr<std::mutex[]> mutexes_;
+    static const size_t nmutexes = 64;
+};
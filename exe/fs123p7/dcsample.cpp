@@ -0,0 +1,55 @@
+#include "dcsample.hpp"
+#include <core123/throwutils.hpp>
+#include <cmath>
+#include <limits>
+#include <numeric>
+
+using namespace core123;
+
+void
+dcsample::add_dir(size_t nfiles, const std::vector<uint64_t>& sizes){
+    if(nfiles && sizes.empty())
+        throw se(EINVAL, "dcsample::add_dir:  non-empty directory with no sampled sizes");
+    double meansize = sizes.empty() ? 0. :
+        std::accumulate(sizes.begin(), sizes.end(), 0.) / sizes.size();
+    counts_.push_back(nfiles);
+    bytes_.push_back(nfiles * meansize);
+    nsizes_ += sizes.size();
+}
+
+dcsample::estimate
+dcsample::scaled(const std::vector<double>& v, size_t Ndirs, double z) /*private*/{
+    estimate ret;
+    size_t n = v.size();
+    if(n == 0){
+        ret.hi = std::numeric_limits<double>::infinity();
+        return ret;
+    }
+    double mean = std::accumulate(v.begin(), v.end(), 0.) / n;
+    ret.value = Ndirs * mean;
+    if(n < 2){
+        ret.hi = std::numeric_limits<double>::infinity();
+        return ret;
+    }
+    double ss = 0.;
+    for(auto x : v)
+        ss += (x - mean)*(x - mean);
+    // The standard error of the mean, scaled up to the whole cache.
+    // No finite-population correction:  it would only narrow the
+    // interval, and erring wide just means an occasional
+    // unnecessary full scan.
+    double se = Ndirs * std::sqrt(ss / (n-1) / n);
+    ret.lo = std::max(0., ret.value - z*se);
+    ret.hi = ret.value + z*se;
+    return ret;
+}
+
+dcsample::estimate
+dcsample::files(size_t Ndirs, double z) const{
+    return scaled(counts_, Ndirs, z);
+}
+
+dcsample::estimate
+dcsample::bytes(size_t Ndirs, double z) const{
+    return scaled(bytes_, Ndirs, z);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+// dcsample - estimate the number of files and bytes in a diskcache
+// from a random sample, with confidence intervals.
+//
+// Without an index, evict_once's only view of the cache's usage is a
+// full scan of one directory:  a readdir and an fstatat of every file
+// in it.  To keep up, it scans all Ndirs directories every
+// evict_period_minutes, i.e., it stats every file in the cache once
+// per period.  On a cache with tens of millions of files that's a
+// lot of stats, and most of them tell us nothing we didn't already
+// know, e.g., that the cache is half full.
+//
+// A dcsample is a two-stage sample.  The first stage is a handful of
+// directories chosen at random.  The files in each one are counted
+// (with readdir, which doesn't need a stat), and the second stage is
+// a random subset of them that are stat'ed to estimate the mean file
+// size in that directory.  Since the hash spreads files uniformly
+// over directories, each directory's count and (estimated) byte
+// total are independent, identically distributed estimates of
+// 1/Ndirs of the cache's.  The estimates below are Ndirs times the
+// mean over directories, and the confidence intervals come from the
+// spread between directories, which accounts for the variance of
+// both stages.
+//
+// dcsample does no I/O.  The caller (diskcache::sample_usage) picks
+// the directories and files and feeds their counts and sizes to
+// add_dir.
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct dcsample{
+    struct estimate{
+        double value = 0.;
+        double lo = 0.;
+        double hi = 0.;
+    };
+
+    // add_dir - nfiles is the number of files in one randomly chosen
+    // directory, and sizes are the sizes of a random subset of them.
+    // If nfiles is non-zero, sizes must not be empty.
+    void add_dir(size_t nfiles, const std::vector<uint64_t>& sizes);
+    size_t ndirs() const { return counts_.size(); }
+    size_t nsizes() const { return nsizes_; }
+
+    // The estimated total number of files and bytes in a cache with
+    // Ndirs directories.  The intervals are value +/- z standard
+    // errors.  With fewer than two directories in the sample there's
+    // no way to estimate the standard error, and the intervals are
+    // [0, infinity).
+    estimate files(size_t Ndirs, double z) const;
+    estimate bytes(size_t Ndirs, double z) const;
+
+private:
+    std::vector<double> counts_;   // per directory
+    std::vector<double> bytes_;    // per directory:  count * mean sampled size
+    size_t nsizes_ = 0;
+    static estimate scaled(const std::vector<double>& v, size_t Ndirs, double z);
+};
@@ -0,0 +1,621 @@
+#include "dcsegments.hpp"
+#include <core123/sew.hpp>
+#include <core123/throwutils.hpp>
+#include <core123/complaints.hpp>
+#include <core123/diag.hpp>
+#include <core123/strutils.hpp>
+#include <core123/threeroe.hpp>
+#include <core123/intutils.hpp>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+#include <set>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+using namespace core123;
+
+static auto _segments = diag_name("segments");
+
+namespace{
+const uint32_t RECORD = 0x31636573;    // "sec1", little-endian
+const uint32_t TOMBSTONE = 0x31626d74; // "tmb1", little-endian
+const size_t SCAN_CHUNK = 1024*1024;
+
+int64_t now_ns(){
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+} // namespace <anon>
+
+struct dcsegments::rec_hdr{
+    uint32_t magic;
+    uint32_t len;
+    uint64_t k0;
+    uint64_t k1;
+    int64_t written_at;
+    uint64_t cksum;     // threeroe of the preceding fields and the payload
+};
+
+const size_t dcsegments::payload_offset = sizeof(dcsegments::rec_hdr);
+
+struct dcsegments::segment{
+    std::string name;
+    acfd fd;
+    uint32_t id = 0;
+    bool ours = false;   // created by this process
+    // gone is protected by segs_mtx_
+    bool gone = false;   // forgotten.  Don't note() any more records.
+    std::atomic<size_t> size{0};  // bytes of valid records, written or scanned
+    std::atomic<size_t> live{0};  // bytes of records in the index
+};
+
+uint64_t
+dcsegments::checksum(const rec_hdr& h, const struct iovec* iov, int iovcnt){
+    threeroe tr(&h, offsetof(rec_hdr, cksum));
+    for(int i=0; i<iovcnt; ++i)
+        tr.update(iov[i].iov_base, iov[i].iov_len);
+    return tr.hash64();
+}
+
+dcsegments::dcsegments(int rootfd, const std::string& dirname, size_t segment_bytes, size_t max_index_bytes) :
+    dirname_(dirname),
+    segment_bytes_(clip(size_t(64*1024), segment_bytes, size_t(TOMB-1))),
+    max_slots_per_shard_(0)
+{
+    // The biggest power of 2 that keeps all the shards' tables
+    // within max_index_bytes.
+    size_t maxslots = max_index_bytes/NSHARDS/sizeof(slot);
+    if(maxslots)
+        max_slots_per_shard_ = size_t(1) << (63 - __builtin_clzll(maxslots));
+    if(::mkdirat(rootfd, dirname.c_str(), 0700) < 0 && errno != EEXIST)
+        throw se(errno, "dcsegments::dcsegments: mkdirat(" + dirname + ")");
+    dirfd_ = sew::openat(rootfd, dirname.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    DIAGf(_segments, "dcsegments(%s):  segment_bytes=%zu, max_slots_per_shard=%zu",
+          dirname_.c_str(), segment_bytes_, max_slots_per_shard_);
+}
+
+// Nothing to do.  Closing our fds releases our flocks.
+dcsegments::~dcsegments() = default;
+
+dcsegments::slot*
+dcsegments::find(shard& s, uint64_t k){
+    if(s.slots.empty())
+        return nullptr;
+    size_t mask = s.slots.size() - 1;
+    for(size_t i = k & mask; ; i = (i+1) & mask){
+        auto& sl = s.slots[i];
+        if(sl.empty())
+            return nullptr;
+        if(sl.k == k)
+            return &sl;
+    }
+}
+
+namespace{
+// first_empty - linear probing for an empty slot, which there must be.
+template <typename Slot>
+Slot* first_empty(std::vector<Slot>& slots, uint64_t k){
+    size_t mask = slots.size() - 1;
+    size_t i = k & mask;
+    while(!slots[i].empty())
+        i = (i+1) & mask;
+    return &slots[i];
+}
+}
+
+dcsegments::slot*
+dcsegments::insert(shard& s, uint64_t k){
+    // Keep the load factor under 3/4, so the probe sequences stay
+    // short.
+    if(4*(s.n+1) > 3*s.slots.size()){
+        size_t newsize = s.slots.empty() ? 64 : 2*s.slots.size();
+        if(newsize > max_slots_per_shard_)
+            return nullptr;
+        std::vector<slot> old(newsize);
+        s.slots.swap(old);
+        for(const auto& sl : old)
+            if(!sl.empty())
+                *first_empty(s.slots, sl.k) = sl;
+    }
+    auto sl = first_empty(s.slots, k);
+    sl->k = k;
+    s.n++;
+    return sl;
+}
+
+void
+dcsegments::erase_slot(shard& s, slot* sl){
+    // Backward-shift deletion:  move later members of the probe
+    // sequence into the hole, so find never stops short.
+    size_t mask = s.slots.size() - 1;
+    size_t hole = sl - s.slots.data();
+    for(size_t j = (hole+1) & mask; !s.slots[j].empty(); j = (j+1) & mask){
+        size_t home = s.slots[j].k & mask;
+        // Leave it if its home is cyclically in (hole, j].
+        bool stays = (hole <= j) ? (hole < home && home <= j) : (hole < home || home <= j);
+        if(stays)
+            continue;
+        s.slots[hole] = s.slots[j];
+        hole = j;
+    }
+    s.slots[hole] = slot{};
+    s.n--;
+}
+
+void
+dcsegments::add_segment(const segment_sp& seg){
+    // segs_mtx_ must be held.
+    seg->id = next_segid_++;
+    segs_[seg->name] = seg;
+    for(auto& s : shards_){
+        std::lock_guard<std::mutex> lg(s.mtx);
+        s.segs[seg->id] = seg;
+    }
+}
+
+dcsegments::segment_sp
+dcsegments::new_segment(){
+    // Create and lock the segment under a temporary name, so nobody
+    // else ever sees it unlocked, i.e., sealed.
+    auto seg = std::make_shared<segment>();
+    seg->name = fmt("%016llx-%d", (unsigned long long)now_ns(), ::getpid());
+    std::string tmpname = ".new-" + seg->name;
+    seg->fd = sew::openat(dirfd_, tmpname.c_str(), O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0600);
+    sew::flock(seg->fd, LOCK_EX|LOCK_NB);
+    seg->ours = true;
+    // Rename it while holding segs_mtx_, so a concurrent catch_up
+    // doesn't mistake it for somebody else's.
+    std::lock_guard<std::mutex> lg(segs_mtx_);
+    sew::renameat(dirfd_, tmpname.c_str(), dirfd_, seg->name.c_str());
+    add_segment(seg);
+    DIAGf(_segments, "new segment: %s", seg->name.c_str());
+    return seg;
+}
+
+bool
+dcsegments::note(const rec_hdr& h, const segment_sp& seg, uint32_t off){
+    auto& s = shard_for(h.k1);
+    std::lock_guard<std::mutex> lg(s.mtx);
+    // If it's not in s.segs, it's been forgotten.
+    if(!s.segs.count(seg->id))
+        return true;
+    auto sl = find(s, h.k1);
+    if(sl){
+        // When two records have the same key, the most recently
+        // written wins.  Ties go to the newcomer, so a compacted
+        // copy replaces its original.
+        if(sl->written_at > h.written_at)
+            return true;
+        s.segs.at(sl->seg)->live -= sizeof(rec_hdr) + sl->paylen();
+    }else{
+        sl = insert(s, h.k1);
+        if(!sl){
+            unindexed_++;
+            return false;
+        }
+    }
+    *sl = slot{h.k1, h.written_at, seg->id, off, h.len | (h.magic == TOMBSTONE ? TOMB : 0), 0};
+    seg->live += sizeof(rec_hdr) + h.len;
+    return true;
+}
+
+bool
+dcsegments::append(const key_t& key, uint32_t magic, int64_t written_at, const struct iovec* iov, int iovcnt){
+    size_t len = 0;
+    for(int i=0; i<iovcnt; ++i)
+        len += iov[i].iov_len;
+    size_t reclen = sizeof(rec_hdr) + len;
+    if(reclen > segment_bytes_)
+        return false;
+    {
+        // Don't write what we won't be able to find.
+        auto& s = shard_for(key.second);
+        std::lock_guard<std::mutex> lg(s.mtx);
+        if(!find(s, key.second) && 4*(s.n+1) > 3*max_slots_per_shard_){
+            unindexed_++;
+            return false;
+        }
+    }
+    rec_hdr h{magic, uint32_t(len), key.first, key.second, written_at, 0};
+    h.cksum = checksum(h, iov, iovcnt);
+    std::vector<struct iovec> v(iovcnt+1);
+    v[0] = {&h, sizeof(h)};
+    std::copy(iov, iov+iovcnt, v.begin()+1);
+
+    std::lock_guard<std::mutex> alg(append_mtx_);
+    bool full;
+    {
+        std::lock_guard<std::mutex> lg(segs_mtx_);
+        full = !active_ || active_->gone || active_->size + reclen > segment_bytes_;
+    }
+    if(full){
+        // Seal the old one by releasing our flock.  It's still open
+        // for reading.
+        if(active_)
+            sew::flock(active_->fd, LOCK_UN);
+        active_ = new_segment();
+    }
+    // active_->size only changes here, and we hold append_mtx_.
+    size_t off = active_->size;
+    auto wrote = ::pwritev(active_->fd, v.data(), v.size(), off);
+    if(wrote < 0)
+        throw se(errno, "dcsegments::append: pwritev(" + active_->name + ")");
+    if(size_t(wrote) != reclen)
+        throw se(EIO, fmt("dcsegments::append: short pwritev(%s): %zd of %zu bytes", active_->name.c_str(), wrote, reclen));
+    {
+        std::lock_guard<std::mutex> lg(segs_mtx_);
+        if(!active_->gone){
+            active_->size += reclen;
+            disk_bytes_ += reclen;
+        }
+    }
+    return note(h, active_, uint32_t(off));
+}
+
+bool
+dcsegments::put(const key_t& key, const struct iovec* iov, int iovcnt){
+    if(!append(key, RECORD, now_ns(), iov, iovcnt))
+        return false;
+    puts_++;
+    return true;
+}
+
+bool
+dcsegments::read_record(uint64_t k, const segment_sp& seg, uint32_t off, uint32_t len, uchar_blob* blob, rec_hdr* h){
+    size_t n = sizeof(rec_hdr) + len;
+    uchar_blob b(n);
+    size_t nread = sew::pread(seg->fd, b.data(), n, off);
+    if(nread == n){
+        ::memcpy(h, b.data(), sizeof(*h));
+        struct iovec payload = {b.data() + sizeof(rec_hdr), len};
+        if((h->magic == RECORD || h->magic == TOMBSTONE) && h->len == len &&
+           h->k1 == k && h->cksum == checksum(*h, &payload, 1)){
+            *blob = std::move(b);
+            return true;
+        }
+    }
+    corrupt_++;
+    complain(LOG_WARNING, "dcsegments: corrupt or missing record in %s at offset %u.  Forgetting it",
+             seg->name.c_str(), off);
+    auto& s = shard_for(k);
+    std::lock_guard<std::mutex> lg(s.mtx);
+    auto sl = find(s, k);
+    if(sl && sl->seg == seg->id && sl->off == off){
+        seg->live -= n;
+        erase_slot(s, sl);
+    }
+    return false;
+}
+
+bool
+dcsegments::get(const key_t& key, uchar_blob* blob, size_t* payload_len){
+    segment_sp seg;
+    uint32_t off, len;
+    {
+        auto& s = shard_for(key.second);
+        std::lock_guard<std::mutex> lg(s.mtx);
+        auto sl = find(s, key.second);
+        if(!sl || sl->tomb()){
+            misses_++;
+            return false;
+        }
+        seg = s.segs.at(sl->seg);
+        off = sl->off;
+        len = sl->paylen();
+    }
+    // Read outside the lock.  seg keeps the fd open, even if the
+    // segment is unlinked in the meantime.  The slot only has half
+    // the key.  The record has all of it.
+    rec_hdr h;
+    if(!read_record(key.second, seg, off, len, blob, &h) || h.k0 != key.first){
+        misses_++;
+        return false;
+    }
+    hits_++;
+    *payload_len = len;
+    return true;
+}
+
+void
+dcsegments::erase(const key_t& key){
+    // A key we don't know of gets a tombstone too.  There may be a
+    // record for it that we haven't read yet (catch_up hasn't
+    // finished, or another process's append isn't read yet).  The
+    // tombstone is newer, so it wins when we do read it.
+    {
+        auto& s = shard_for(key.second);
+        std::lock_guard<std::mutex> lg(s.mtx);
+        auto sl = find(s, key.second);
+        if(sl && sl->tomb())
+            return;
+    }
+    if(append(key, TOMBSTONE, now_ns(), nullptr, 0))
+        tombstones_++;
+}
+
+void
+dcsegments::forget(const segment_sp& seg){
+    {
+        std::lock_guard<std::mutex> lg(segs_mtx_);
+        if(seg->gone)
+            return;
+        seg->gone = true;
+        auto p = segs_.find(seg->name);
+        if(p != segs_.end() && p->second == seg)
+            segs_.erase(p);
+        disk_bytes_ -= seg->size;
+    }
+    for(auto& s : shards_){
+        std::lock_guard<std::mutex> lg(s.mtx);
+        s.segs.erase(seg->id);
+        bool any = false;
+        for(const auto& sl : s.slots)
+            if(sl.seg == seg->id)
+                any = true;
+        if(!any)
+            continue;
+        std::vector<slot> old(s.slots.size());
+        s.slots.swap(old);
+        s.n = 0;
+        for(const auto& sl : old){
+            if(!sl.empty() && sl.seg != seg->id){
+                *first_empty(s.slots, sl.k) = sl;
+                s.n++;
+            }
+        }
+    }
+}
+
+void
+dcsegments::scan_tail(const segment_sp& seg){
+    struct stat sb;
+    sew::fstat(seg->fd, &sb);
+    size_t end = sb.st_size;
+    size_t off = seg->size;
+    std::vector<unsigned char> buf;
+    std::vector<std::pair<rec_hdr, uint32_t>> found;
+    size_t need = 0;  // bytes needed for a record bigger than SCAN_CHUNK
+    bool stop = false;
+    while(!stop && off + sizeof(rec_hdr) <= end){
+        size_t want = std::min(end - off, std::max(SCAN_CHUNK, need));
+        buf.resize(want);
+        size_t n = sew::pread(seg->fd, buf.data(), want, off);
+        size_t p = 0;
+        found.clear();
+        while(p + sizeof(rec_hdr) <= n){
+            rec_hdr h;
+            ::memcpy(&h, buf.data() + p, sizeof(h));
+            size_t reclen = sizeof(rec_hdr) + h.len;
+            if((h.magic != RECORD && h.magic != TOMBSTONE) || reclen > segment_bytes_){
+                stop = true;
+                break;
+            }
+            if(p + reclen > n){
+                // Either it's incomplete (stop), or it straddles the
+                // end of buf (read it next time around).
+                if(off + p + reclen > end)
+                    stop = true;
+                need = reclen;
+                break;
+            }
+            struct iovec payload = {buf.data() + p + sizeof(rec_hdr), h.len};
+            if(h.cksum != checksum(h, &payload, 1)){
+                stop = true;
+                break;
+            }
+            found.emplace_back(h, uint32_t(off + p));
+            p += reclen;
+        }
+        {
+            std::lock_guard<std::mutex> lg(segs_mtx_);
+            if(seg->gone)
+                return;
+            seg->size += p;
+            disk_bytes_ += p;
+        }
+        for(const auto& f : found)
+            note(f.first, seg, f.second);
+        off += p;
+        if(p == 0 && need <= n)
+            break;
+    }
+    DIAGf(_segments>1, "scan_tail(%s): scanned to %zu of %zu", seg->name.c_str(), off, end);
+}
+
+void
+dcsegments::catch_up(){
+    std::lock_guard<std::mutex> slg(scan_mtx_);
+    std::set<std::string> names;
+    {
+        acDIR dp = sew::opendirat(dirfd_, ".");
+        while(auto e = sew::readdir(dp)){
+            if(e->d_name[0] != '.')
+                names.insert(e->d_name);
+        }
+    }
+    std::vector<segment_sp> gone;
+    std::vector<segment_sp> toscan;
+    {
+        std::lock_guard<std::mutex> lg(segs_mtx_);
+        // Find the segments that somebody else unlinked...
+        for(const auto& p : segs_)
+            if(!names.count(p.first))
+                gone.push_back(p.second);
+        // ... open the ones we haven't seen before ...
+        for(const auto& name : names){
+            if(segs_.count(name))
+                continue;
+            int fd = ::openat(dirfd_, name.c_str(), O_RDWR|O_CLOEXEC);
+            if(fd < 0){
+                if(errno == ENOENT)
+                    continue;   // unlinked since the readdir
+                throw se(errno, "dcsegments::catch_up: openat(" + name + ")");
+            }
+            auto seg = std::make_shared<segment>();
+            seg->name = name;
+            seg->fd = acfd(fd);
+            add_segment(seg);
+        }
+        // ... and read what others have appended.  We've already
+        // noted everything in our own segments.
+        for(const auto& p : segs_)
+            if(!p.second->ours && names.count(p.first))
+                toscan.push_back(p.second);
+    }
+    for(const auto& seg : gone){
+        DIAGf(_segments, "catch_up: %s is gone", seg->name.c_str());
+        forget(seg);
+    }
+    for(const auto& seg : toscan)
+        scan_tail(seg);
+}
+
+void
+dcsegments::drop(const segment_sp& seg){
+    size_t sz = seg->size;
+    DIAGf(_segments, "drop %s: %zu bytes", seg->name.c_str(), sz);
+    sew::unlinkat(dirfd_, seg->name.c_str(), 0);
+    forget(seg);
+    evictions_++;
+    evicted_bytes_ += sz;
+}
+
+void
+dcsegments::compact(const segment_sp& seg){
+    std::vector<slot> todo;
+    size_t sz = seg->size;
+    for(auto& s : shards_){
+        std::lock_guard<std::mutex> lg(s.mtx);
+        for(const auto& sl : s.slots)
+            if(sl.seg == seg->id)
+                todo.push_back(sl);
+    }
+    DIAGf(_segments, "compact %s: %zu records, %zu bytes", seg->name.c_str(), todo.size(), sz);
+    for(const auto& t : todo){
+        uchar_blob blob;
+        rec_hdr h;
+        if(!read_record(t.k, seg, t.off, t.paylen(), &blob, &h))
+            continue;
+        // Keep the original written_at, so the copy doesn't
+        // supersede anything written since.
+        struct iovec payload = {blob.data() + sizeof(rec_hdr), h.len};
+        append(key_t{h.k0, h.k1}, h.magic, h.written_at, &payload, 1);
+    }
+    sew::unlinkat(dirfd_, seg->name.c_str(), 0);
+    forget(seg);
+    compactions_++;
+    compacted_bytes_ += sz;
+}
+
+void
+dcsegments::maintain(size_t max_bytes){
+    std::lock_guard<std::mutex> mlg(maintain_mtx_);
+    // One process at a time.  If somebody else is doing it, we
+    // don't have to.
+    if(::flock(dirfd_, LOCK_EX|LOCK_NB) < 0){
+        if(errno == EWOULDBLOCK)
+            return;
+        throw se(errno, "dcsegments::maintain: flock(" + dirname_ + ")");
+    }
+    try{
+        catch_up();
+        segment_sp active;
+        {
+            std::lock_guard<std::mutex> alg(append_mtx_);
+            active = active_;
+        }
+        std::vector<std::pair<segment_sp, double>> sealed; // and their live fractions
+        {
+            std::lock_guard<std::mutex> lg(segs_mtx_);
+            for(const auto& p : segs_){
+                size_t sz = p.second->size;
+                if(p.second != active)
+                    sealed.emplace_back(p.second, sz ? double(p.second->live)/sz : 0.);
+            }
+        }
+        // Segments that are active in another process are flock'ed.
+        // Trying to flock our own fd tells us whether it's safe to
+        // touch them.  Our flock is released when the segment is
+        // closed (i.e., forgotten) or by the LOCK_UN below.
+        auto lockable = [](const segment_sp& seg){
+            return ::flock(seg->fd, LOCK_EX|LOCK_NB) == 0;
+        };
+        segment_sp victim;
+        if(disk_bytes_ > max_bytes){
+            for(const auto& s : sealed){
+                if(lockable(s.first)){
+                    victim = s.first;
+                    break;
+                }
+            }
+            if(victim)
+                drop(victim);
+        }else{
+            std::sort(sealed.begin(), sealed.end(),
+                      [](const auto& a, const auto& b){ return a.second < b.second; });
+            for(const auto& s : sealed){
+                if(s.second >= 0.5)
+                    break;
+                if(lockable(s.first)){
+                    victim = s.first;
+                    break;
+                }
+            }
+            if(victim)
+                compact(victim);
+        }
+        if(victim)
+            ::flock(victim->fd, LOCK_UN);
+    }catch(std::exception&){
+        ::flock(dirfd_, LOCK_UN);
+        throw;
+    }
+    ::flock(dirfd_, LOCK_UN);
+}
+
+size_t
+dcsegments::nsegments() const{
+    std::lock_guard<std::mutex> lg(segs_mtx_);
+    return segs_.size();
+}
+
+size_t
+dcsegments::nobjects() const{
+    size_t ret = 0;
+    for(const auto& s : shards_){
+        std::lock_guard<std::mutex> lg(s.mtx);
+        ret += s.n;
+    }
+    return ret;
+}
+
+size_t
+dcsegments::index_bytes() const{
+    size_t ret = 0;
+    for(const auto& s : shards_){
+        std::lock_guard<std::mutex> lg(s.mtx);
+        ret += s.slots.size() * sizeof(slot);
+    }
+    return ret;
+}
+
+std::ostream&
+dcsegments::report_stats(std::ostream& os) const{
+    size_t h = hits_, m = misses_;
+    return os << "dc_segments: " << nsegments() << "\n"
+              << "dc_segment_objects: " << nobjects() << "\n"
+              << "dc_segment_index_bytes: " << index_bytes() << "\n"
+              << "dc_segment_unindexed: " << unindexed_ << "\n"
+              << "dc_segment_bytes: " << disk_bytes() << "\n"
+              << "dc_segment_puts: " << puts_ << "\n"
+              << "dc_segment_hits: " << h << "\n"
+              << "dc_segment_misses: " << m << "\n"
+              << "dc_segment_corrupt: " << corrupt_ << "\n"
+              << "dc_segment_tombstones: " << tombstones_ << "\n"
+              << "dc_segment_compactions: " << compactions_ << "\n"
+              << "dc_segment_compacted_bytes: " << compacted_bytes_ << "\n"
+              << "dc_segment_evictions: " << evictions_ << "\n"
+              << "dc_segment_evicted_bytes: " << evicted_bytes_ << "\n";
+}
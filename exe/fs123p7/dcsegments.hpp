@@ -0,0 +1,177 @@
+#pragma once
+
+// dcsegments - log-structured storage for small diskcache objects.
+//
+// Most of the objects in a diskcache are tiny (/a/ and /l/ replies,
+// small directories, the contents of small files), but as individual
+// files each one costs an inode, a 4k block, a create and rename to
+// write it, and an open/fstat/readv/close to read it.  dcsegments
+// instead appends small objects to large 'segment' files in
+// <root>/segments/.  Reading one is a hash lookup and a single
+// pread.
+//
+// Segments:  each process appends to its own 'active' segment, which
+// it holds an exclusive flock on.  When the active segment reaches
+// segment_bytes, it's 'sealed' (the flock is released) and a new one
+// is started.  Segment names are the hex nanosecond time of their
+// creation followed by the creator's pid, so they sort (roughly) by
+// age.
+//
+// Records:  every record has a header with a magic number, the
+// payload length, the 128-bit key, the time it was written and a
+// checksum of the header and the payload.  A record with the
+// TOMBSTONE magic number and no payload erases the key.  Records are
+// self-describing, so the in-memory index (key -> segment, offset)
+// is rebuilt by reading the segments (catch_up), and kept up to date
+// with other processes' appends by reading the tails of their
+// segments (catch_up again).  A truncated or otherwise invalid
+// record (e.g., because a writer is still writing it, or crashed)
+// stops the reader, who will try again next time.  When the same key
+// appears more than once, the most recently written record wins.
+//
+// The constructor does *not* call catch_up.  Reading every segment
+// of a big cache takes a while (see ut_dcsegments for measurements),
+// so the diskcache does it in the background.  Until it's done, get
+// misses objects that are on disk.
+//
+// The index:  one 32-byte slot per object, in open-addressed hash
+// tables split into shards, each with its own mutex.  The slot holds
+// 64 of the key's 128 bits.  The other 64 are checked against the
+// record's header when it's read.  The tables grow, but their total
+// size never exceeds max_index_bytes.  When the index is full, put
+// returns false (so the diskcache stores the object in a file of its
+// own), and other processes' new records aren't indexed, i.e., this
+// process doesn't see them.
+//
+// Space is reclaimed by maintain(), called periodically by the
+// diskcache's eviction thread.  If the segments use more than
+// max_bytes, the oldest sealed segment is discarded (FIFO eviction).
+// Otherwise, the sealed segment with the most garbage (superseded
+// records), if it's at least half garbage, is compacted:  its live
+// records are appended to the active segment and the old segment is
+// unlinked.  Only one process at a time runs maintain(), and
+// segments that are still active in some process are never
+// touched.
+//
+// The payload is opaque to dcsegments.  The diskcache stores exactly
+// the bytes it would have written to an individual file.
+
+#include "dcindex.hpp"
+#include "fs123/acfd.hpp"
+#include <core123/uchar_span.hpp>
+#include <array>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <sys/uio.h>
+
+struct dcsegments{
+    using key_t = dcindex::key_t;
+    // The payload returned by get starts this many bytes into the blob.
+    static const size_t payload_offset;
+
+    // The segments are in rootfd/dirname, which is created if
+    // necessary.  segment_bytes is clipped to [64k, 2G).  The index
+    // never uses more than max_index_bytes.
+    dcsegments(int rootfd, const std::string& dirname, size_t segment_bytes, size_t max_index_bytes);
+    ~dcsegments();
+    dcsegments(const dcsegments&) = delete;
+    dcsegments& operator=(const dcsegments&) = delete;
+
+    // put - append a record whose payload is the concatenation of the
+    // iovecs.  Returns false (and does nothing) if the record would
+    // be bigger than a whole segment, or if the index is full.
+    bool put(const key_t& key, const struct iovec* iov, int iovcnt);
+    // get - if key is present, read its whole record into *blob and
+    // return true.  The payload is payload_len bytes starting at
+    // payload_offset.
+    bool get(const key_t& key, core123::uchar_blob* blob, size_t* payload_len);
+    // erase - append a tombstone for key, unless it's already erased.
+    void erase(const key_t& key);
+    // catch_up - discover new segments and read other processes'
+    // appends.  Also forgets segments that somebody else unlinked.
+    void catch_up();
+    // maintain - evict or compact (at most) one segment.  See above.
+    void maintain(size_t max_bytes);
+
+    size_t disk_bytes() const { return disk_bytes_; }
+    size_t nsegments() const;
+    size_t nobjects() const;
+    size_t index_bytes() const;
+    std::ostream& report_stats(std::ostream& os) const;
+
+private:
+    struct segment;
+    using segment_sp = std::shared_ptr<segment>;
+    // slot - an index entry.  seg==0 means the slot is empty.  The
+    // high bit of len means it's a tombstone.
+    struct slot{
+        uint64_t k;         // key.second
+        int64_t written_at;
+        uint32_t seg;       // segment::id
+        uint32_t off;
+        uint32_t len;
+        uint32_t unused;
+        bool empty() const { return seg == 0; }
+        bool tomb() const { return len & TOMB; }
+        uint32_t paylen() const { return len & ~TOMB; }
+    };
+    static_assert(sizeof(slot) == 32, "dcsegments::slot should be 32 bytes");
+    static constexpr uint32_t TOMB = 0x80000000;
+    static constexpr size_t NSHARDS = 16;
+    struct alignas(64) shard{
+        mutable std::mutex mtx;
+        std::vector<slot> slots;    // size is zero or a power of 2
+        size_t n = 0;               // occupied slots
+        // All the segments we know of, so a get (or note) doesn't
+        // need any other lock to find the segment of a slot.  A
+        // segment that isn't here has been forgotten.
+        std::unordered_map<uint32_t, segment_sp> segs;
+    };
+    shard& shard_for(uint64_t k) { return shards_[k >> 60]; }
+    // find - returns the slot for k in s, or nullptr.  s.mtx must be held.
+    slot* find(shard& s, uint64_t k);
+    // insert - returns an empty slot for k in s, growing s.slots if
+    // necessary, or nullptr if the index is full.  s.mtx must be held.
+    slot* insert(shard& s, uint64_t k);
+    void erase_slot(shard& s, slot* sl);
+    struct rec_hdr;
+    static uint64_t checksum(const rec_hdr& h, const struct iovec* iov, int iovcnt);
+    // read_record - pread the record at seg:off into *blob and check
+    // it.  If it's bad, forget the index entry that led us to it.
+    bool read_record(uint64_t k, const segment_sp& seg, uint32_t off, uint32_t len, core123::uchar_blob* blob, rec_hdr* h);
+    // append - write a record to the active segment (starting a new one
+    // if necessary) and record it in the index.
+    bool append(const key_t& key, uint32_t magic, int64_t written_at, const struct iovec* iov, int iovcnt);
+    segment_sp new_segment();
+    void add_segment(const segment_sp& seg);
+    // note - update the index with a record found at seg:off.
+    // Returns false if the index is full.
+    bool note(const rec_hdr& h, const segment_sp& seg, uint32_t off);
+    void scan_tail(const segment_sp& seg);
+    // forget - drop seg and all the index entries that refer to it.
+    void forget(const segment_sp& seg);
+    void drop(const segment_sp& seg);
+    void compact(const segment_sp& seg);
+
+    std::string dirname_;
+    acfd dirfd_;
+    size_t segment_bytes_;
+    size_t max_slots_per_shard_;
+    std::array<shard, NSHARDS> shards_;
+    std::atomic<uint32_t> next_segid_{1};
+    mutable std::mutex segs_mtx_;   // protects segs_
+    std::map<std::string, segment_sp> segs_; // by name, i.e., oldest first
+    std::mutex append_mtx_;         // serializes appends to active_
+    std::mutex scan_mtx_;           // serializes catch_up
+    std::mutex maintain_mtx_;
+    segment_sp active_;
+    std::atomic<size_t> disk_bytes_{0};
+    std::atomic<size_t> puts_{0}, hits_{0}, misses_{0}, corrupt_{0}, tombstones_{0}, unindexed_{0};
+    std::atomic<size_t> compactions_{0}, compacted_bytes_{0}, evictions_{0}, evicted_bytes_{0};
+};
@@ -0,0 +1,334 @@
+#include "dcuring.hpp"
+#include <core123/diag.hpp>
+#include <core123/throwutils.hpp>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+
+using namespace core123;
+
+namespace{
+auto _dcuring = diag_name("dcuring");
+}
+
+// The opcodes are enums, so we can't #ifdef them.  Any header with
+// IORING_FEAT_CQE_SKIP (5.17) has the direct descriptors (5.15).
+// With older headers, dcuring is never available().
+#if defined(IORING_FEAT_CQE_SKIP) && defined(__NR_io_uring_setup)
+
+namespace{
+int sys_io_uring_setup(unsigned entries, io_uring_params* p){
+    return ::syscall(__NR_io_uring_setup, entries, p);
+}
+int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags){
+    return ::syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+int sys_io_uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args){
+    return ::syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// The one direct descriptor in each ring's file table.
+const unsigned SLOT = 0;
+}
+
+// ring - the mmap'ed submission and completion queues.  Everything
+// is submitted as one batch (usually one linked chain), and the
+// caller waits for all of it to complete before submitting more.
+struct dcuring::ring{
+    static const unsigned ENTRIES = 8;
+    int fd = -1;
+    void* sq_ptr = MAP_FAILED;
+    size_t sq_sz = 0;
+    void* cq_ptr = MAP_FAILED;
+    size_t cq_sz = 0;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    size_t sqes_sz = 0;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_cqe* cqes;
+    unsigned nqueued = 0;
+    // broken - something unexpected happened, and the ring's state
+    // is unknown.  thread_ring won't hand it out again.
+    bool broken = false;
+
+    ring(){
+        io_uring_params p{};
+        fd = sys_io_uring_setup(ENTRIES, &p);
+        if(fd < 0)
+            throw se("io_uring_setup");
+        sq_sz = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+        cq_sz = p.cq_off.cqes + p.cq_entries*sizeof(io_uring_cqe);
+        if(p.features & IORING_FEAT_SINGLE_MMAP)
+            sq_sz = cq_sz = std::max(sq_sz, cq_sz);
+        sq_ptr = ::mmap(nullptr, sq_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if(sq_ptr == MAP_FAILED)
+            throw se("mmap(IORING_OFF_SQ_RING)");
+        if(p.features & IORING_FEAT_SINGLE_MMAP){
+            cq_ptr = sq_ptr;
+        }else{
+            cq_ptr = ::mmap(nullptr, cq_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if(cq_ptr == MAP_FAILED)
+                throw se("mmap(IORING_OFF_CQ_RING)");
+        }
+        sqes_sz = p.sq_entries*sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(::mmap(nullptr, sqes_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES));
+        if(sqes == MAP_FAILED)
+            throw se("mmap(IORING_OFF_SQES)");
+        auto sq = static_cast<char*>(sq_ptr);
+        sq_head = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+        sq_mask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+        auto cq = static_cast<char*>(cq_ptr);
+        cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+        cq_mask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+        int empty = -1;
+        if(sys_io_uring_register(fd, IORING_REGISTER_FILES, &empty, 1) < 0)
+            throw se("io_uring_register(IORING_REGISTER_FILES)");
+    }
+
+    ~ring(){
+        if(sqes != MAP_FAILED)
+            ::munmap(sqes, sqes_sz);
+        if(cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+            ::munmap(cq_ptr, cq_sz);
+        if(sq_ptr != MAP_FAILED)
+            ::munmap(sq_ptr, sq_sz);
+        if(fd >= 0)
+            ::close(fd);
+    }
+
+    // sqe - a zeroed sqe, whose user_data is its position in the
+    // batch.  link it to the next one if link is true.
+    io_uring_sqe* sqe(uint8_t opcode, bool link){
+        unsigned tail = *sq_tail + nqueued;
+        unsigned idx = tail & *sq_mask;
+        io_uring_sqe* ret = &sqes[idx];
+        ::memset(ret, 0, sizeof(*ret));
+        ret->opcode = opcode;
+        ret->user_data = nqueued++;
+        if(link)
+            ret->flags |= IOSQE_IO_LINK;
+        sq_array[idx] = idx;
+        return ret;
+    }
+
+    // submit_and_wait - submit the queued sqes and wait for all of
+    // them to complete.  res[i] is the result of the i'th.  Returns 0
+    // or an errno, in which case the ring is broken.
+    int submit_and_wait(int* res){
+        unsigned n = nqueued;
+        nqueued = 0;
+        __atomic_store_n(sq_tail, *sq_tail + n, __ATOMIC_RELEASE);
+        unsigned done = 0;
+        unsigned to_submit = n;
+        while(done < n){
+            int ret = sys_io_uring_enter(fd, to_submit, n-done, IORING_ENTER_GETEVENTS);
+            if(ret < 0 && errno != EINTR){
+                broken = true;
+                return errno;
+            }
+            to_submit = *sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+            unsigned head = *cq_head;
+            unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            for( ; head != tail; ++head){
+                auto& cqe = cqes[head & *cq_mask];
+                if(cqe.user_data >= n){
+                    broken = true;
+                    return EIO;
+                }
+                res[cqe.user_data] = cqe.res;
+                done++;
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        }
+        return 0;
+    }
+
+    // close_slot - close the direct descriptor, in case a broken
+    // chain left it open.
+    void close_slot(){
+        sqe(IORING_OP_CLOSE, false)->file_index = SLOT+1;
+        int res;
+        submit_and_wait(&res);
+    }
+};
+
+dcuring::dcuring() : r(std::make_unique<ring>()) {}
+dcuring::~dcuring() = default;
+
+bool dcuring::available(){
+    static const bool ret = []() -> bool {
+        try{
+            dcuring dcu;
+            auto& rng = *dcu.r;
+            // Are all the opcodes we need supported?
+            const size_t nops = 256;
+            std::unique_ptr<char[]> buf(new char[sizeof(io_uring_probe) + nops*sizeof(io_uring_probe_op)]());
+            auto probe = reinterpret_cast<io_uring_probe*>(buf.get());
+            if(sys_io_uring_register(rng.fd, IORING_REGISTER_PROBE, probe, nops) < 0)
+                throw se("io_uring_register(IORING_REGISTER_PROBE)");
+            for(int op : {IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE,
+                          IORING_OP_WRITEV, IORING_OP_RENAMEAT}){
+                if(op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+                    throw se(ENOTSUP, fmt("io_uring opcode %d is not supported", op));
+            }
+            // The probe doesn't tell us about direct descriptors.  Try one.
+            auto o = rng.sqe(IORING_OP_OPENAT, true);
+            o->fd = AT_FDCWD;
+            o->addr = reinterpret_cast<uintptr_t>("/");
+            o->open_flags = O_RDONLY|O_DIRECTORY;
+            o->file_index = SLOT+1;
+            rng.sqe(IORING_OP_CLOSE, false)->file_index = SLOT+1;
+            int res[2];
+            int eno = rng.submit_and_wait(res);
+            if(eno)
+                throw se(eno, "io_uring_enter");
+            if(res[0] != 0 || res[1] != 0)
+                throw se(ENOTSUP, fmt("direct descriptors are not supported:  openat: %d, close: %d", res[0], res[1]));
+            return true;
+        }catch(std::exception& e){
+            DIAGkey(_dcuring, "dcuring is not available: " << e.what() << "\n");
+            return false;
+        }
+    }();
+    return ret;
+}
+
+dcuring* dcuring::thread_ring(){
+    static thread_local std::unique_ptr<dcuring> tl;
+    static thread_local bool failed = false;
+    if(failed || !available())
+        return nullptr;
+    if(!tl){
+        try{
+            tl.reset(new dcuring);
+        }catch(std::exception& e){
+            DIAGkey(_dcuring, "dcuring::thread_ring: " << e.what() << "\n");
+            failed = true;
+            return nullptr;
+        }
+    }
+    if(tl->r->broken){
+        tl.reset();
+        failed = true;
+        return nullptr;
+    }
+    return tl.get();
+}
+
+int dcuring::read_file(int dirfd, const std::string& path, uchar_blob* blob){
+    struct statx stx;
+    auto s = r->sqe(IORING_OP_STATX, false);
+    s->fd = dirfd;
+    s->addr = reinterpret_cast<uintptr_t>(path.c_str());
+    s->len = STATX_TYPE|STATX_SIZE;
+    s->off = reinterpret_cast<uintptr_t>(&stx);
+    int res[3];
+    if(r->submit_and_wait(res))
+        return FALLBACK;
+    if(res[0] < 0)
+        return -res[0];
+    if(!S_ISREG(stx.stx_mode) || stx.stx_size == 0)
+        return FALLBACK;
+
+    uchar_blob b(stx.stx_size);
+    auto o = r->sqe(IORING_OP_OPENAT, true);
+    o->fd = dirfd;
+    o->addr = reinterpret_cast<uintptr_t>(path.c_str());
+    o->open_flags = O_RDONLY;
+    o->file_index = SLOT+1;
+    auto rd = r->sqe(IORING_OP_READ, true);
+    rd->fd = SLOT;
+    rd->flags |= IOSQE_FIXED_FILE;
+    rd->addr = reinterpret_cast<uintptr_t>(b.data());
+    rd->len = b.size();
+    rd->off = 0;
+    r->sqe(IORING_OP_CLOSE, false)->file_index = SLOT+1;
+    if(r->submit_and_wait(res))
+        return FALLBACK;
+    if(res[0] < 0)
+        return -res[0];  // it went away after the statx.
+    if(res[2] != 0)
+        r->close_slot(); // the short read cancelled the close
+    if(res[1] != int(b.size()))
+        return FALLBACK;  // it changed after the statx.
+    DIAGkey(_dcuring, "dcuring::read_file(" << path << ") " << b.size() << " bytes\n");
+    *blob = std::move(b);
+    return 0;
+}
+
+int dcuring::create_file(int dirfd, const std::string& tmppath, const std::string& path,
+                         const struct iovec* iov, int iovcnt, op_t* failed_op){
+    size_t nbytes = 0;
+    for(int i=0; i<iovcnt; ++i)
+        nbytes += iov[i].iov_len;
+    auto o = r->sqe(IORING_OP_OPENAT, true);
+    o->fd = dirfd;
+    o->addr = reinterpret_cast<uintptr_t>(tmppath.c_str());
+    o->open_flags = O_WRONLY|O_CREAT|O_EXCL;
+    o->len = 0600;
+    o->file_index = SLOT+1;
+    auto w = r->sqe(IORING_OP_WRITEV, true);
+    w->fd = SLOT;
+    w->flags |= IOSQE_FIXED_FILE;
+    w->addr = reinterpret_cast<uintptr_t>(iov);
+    w->len = iovcnt;
+    w->off = 0;
+    r->sqe(IORING_OP_CLOSE, true)->file_index = SLOT+1;
+    auto rn = r->sqe(IORING_OP_RENAMEAT, false);
+    rn->fd = dirfd;
+    rn->addr = reinterpret_cast<uintptr_t>(tmppath.c_str());
+    rn->len = dirfd;
+    rn->off = reinterpret_cast<uintptr_t>(path.c_str());
+    int res[4];
+    if(int eno = r->submit_and_wait(res)){
+        // We don't know how far it got.
+        *failed_op = WRITE;
+        return eno;
+    }
+    if(res[0] < 0){
+        *failed_op = OPEN;
+        return -res[0];
+    }
+    if(res[2] != 0)
+        r->close_slot();
+    if(res[1] < 0 || size_t(res[1]) != nbytes){
+        *failed_op = WRITE;
+        return res[1] < 0 ? -res[1] : ENOSPC;
+    }
+    if(res[2] < 0){
+        *failed_op = CLOSE;
+        return -res[2];
+    }
+    if(res[3] < 0){
+        *failed_op = RENAME;
+        return -res[3];
+    }
+    DIAGkey(_dcuring, "dcuring::create_file(" << path << ") " << nbytes << " bytes\n");
+    return 0;
+}
+
+#else // no io_uring
+
+struct dcuring::ring{};
+dcuring::dcuring() {}
+dcuring::~dcuring() = default;
+bool dcuring::available(){ return false; }
+dcuring* dcuring::thread_ring(){ return nullptr; }
+int dcuring::read_file(int, const std::string&, uchar_blob*){ return FALLBACK; }
+int dcuring::create_file(int, const std::string&, const std::string&, const struct iovec*, int, op_t* failed_op){
+    *failed_op = OPEN;
+    return ENOTSUP;
+}
+
+#endif
@@ -0,0 +1,70 @@
+#pragma once
+
+// dcuring - an io_uring engine for the diskcache's file I/O.
+//
+// A diskcache hit costs openat, fstat, two reads and a close, and a
+// fill costs openat, writev, close and renameat.  dcuring does the
+// same work with linked io_uring submissions, so a hit is two trips
+// into the kernel and a fill is one:
+//
+//   read_file:  statx, then openat -> read -> close, linked.  The
+//       statx says how much to read.  The openat puts the file in a
+//       'direct' descriptor (a slot in the ring's registered file
+//       table), so the read and the close can be linked to it
+//       without a trip back to user space.
+//   create_file:  openat(O_CREAT|O_EXCL) -> writev -> close ->
+//       renameat, linked.  A failure (including a short write)
+//       cancels the rest of the chain.
+//
+// Rings are per-thread (thread_ring), so there's no locking, and
+// each ring has just one direct descriptor.  The caller still waits
+// for the result; the benefit is fewer syscalls per hit or fill, not
+// fewer waiting threads.  See ut_dcuring for measurements.
+//
+// io_uring needs Linux 5.15 or later (direct descriptors for openat
+// and close), and it's often disabled (e.g., by seccomp in
+// containers, or by the io_uring_disabled sysctl).  available()
+// probes for everything dcuring needs, once, and thread_ring()
+// returns nullptr if it's not there.  Callers fall back to the
+// ordinary syscalls.
+
+#include <core123/uchar_span.hpp>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+class dcuring{
+public:
+    // available - can this process use dcuring at all?
+    static bool available();
+    // thread_ring - the calling thread's ring, created on first use.
+    // Returns nullptr if !available(), or if the ring couldn't be
+    // set up.
+    static dcuring* thread_ring();
+
+    // The value returned by read_file when the caller should use the
+    // ordinary syscalls instead, e.g., because the file isn't a
+    // regular file, or it changed size between the statx and the
+    // read.
+    static constexpr int FALLBACK = -1;
+    // read_file - read all of dirfd/path into *blob.  Returns 0 on
+    // success, FALLBACK, or the errno from statx or openat (e.g.,
+    // ENOENT).
+    int read_file(int dirfd, const std::string& path, core123::uchar_blob* blob);
+
+    // create_file - create dirfd/tmppath with O_CREAT|O_EXCL, write
+    // iov to it, close it and rename it to dirfd/path.  Returns 0 on
+    // success, or an errno, in which case *failed_op says which
+    // step failed.  If it wasn't OPEN, tmppath may exist, and the
+    // caller must unlink it.  A short write fails with ENOSPC.
+    enum op_t { OPEN, WRITE, CLOSE, RENAME };
+    int create_file(int dirfd, const std::string& tmppath, const std::string& path,
+                    const struct iovec* iov, int iovcnt, op_t* failed_op);
+
+    ~dcuring();
+private:
+    dcuring();
+    struct ring;
+    std::unique_ptr<ring> r;
+};
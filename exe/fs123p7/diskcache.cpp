@@ -1,6 +1,7 @@
 #include "diskcache.hpp"
 #include "fs123/stat_serializev3.hpp"
 #include "fs123/acfd.hpp"
+#include "dcuring.hpp"
 #include <core123/complaints.hpp>
 #include <core123/scoped_nanotimer.hpp>
 #include <core123/diag.hpp>
@@ -15,6 +16,7 @@
 #include <core123/fdstream.hpp>
 #include <core123/uuid.hpp>
 #include <core123/intuitive_compare.hpp>
+#include <core123/strutils.hpp>
 #include <random>
 #include <vector>
 #include <utility>
@@ -39,6 +41,10 @@ inline double log_16(double x){
     return ::log2(x)/4.;
 }
 
+int64_t epoch_seconds(clk123_t::time_point tp){
+    return std::chrono::duration_cast<std::chrono::seconds>(tp.time_since_epoch()).count();
+}
+
  refcounted_scoped_nanotimer_ctrl serialize_nanotimer_ctrl(stats.dc_serialize_inuse_sec);
  refcounted_scoped_nanotimer_ctrl deserialize_nanotimer_ctrl(stats.dc_deserialize_inuse_sec);
  refcounted_scoped_nanotimer_ctrl update_nanotimer_ctrl(stats.dc_update_inuse_sec);
@@ -60,8 +66,72 @@ create_uuid_symlink(int rootfd){
     sew::close(sew::openat(rootfd, uu.c_str(), O_CREAT|O_WRONLY, 0600));
 }
 
+// The header of a cache file (and of a record in the dcsegments) is
+// the reply123's POD members, the content length and a checksum of
+// the two.  The checksum is what makes it safe for update_header to
+// rewrite the header in place:  a reader that sees a torn header -
+// because it read while the pwrite was in progress, or because we
+// crashed in the middle of it - knows not to trust it.
+const size_t hdr_cksum_offset = reply123_pod_length + sizeof(size_t);
+const size_t header_length = hdr_cksum_offset + sizeof(uint64_t);
+
+// How many of the leader's next victims a follower looks at.  See
+// cache_policy::sample_victims.
+const size_t follower_victim_sample = 32;
+
+uint64_t header_cksum(const char* hdr){
+    return threeroe(hdr, hdr_cksum_offset).hash64();
+}
+
+void pack_header(const reply123& r, char hdr[header_length]){
+    size_t content_len = r.content.size();
+    ::memcpy(hdr, (const char*)&r + reply123_pod_begin, reply123_pod_length);
+    ::memcpy(hdr + reply123_pod_length, &content_len, sizeof(content_len));
+    uint64_t ck = header_cksum(hdr);
+    ::memcpy(hdr + hdr_cksum_offset, &ck, sizeof(ck));
+}
+
+// unpack_header - copy the POD members into *ret and the content
+// length into *content_len.  Returns false if the checksum doesn't
+// match.  N.B.  The caller should check ret->magic first:  a file
+// with the wrong magic number is from another version, not torn.
+bool unpack_header(const char hdr[header_length], reply123* ret, size_t* content_len){
+    ::memcpy((char*)ret + reply123_pod_begin, hdr, reply123_pod_length);
+    ::memcpy(content_len, hdr + reply123_pod_length, sizeof(*content_len));
+    uint64_t ck;
+    ::memcpy(&ck, hdr + hdr_cksum_offset, sizeof(ck));
+    return ck == header_cksum(hdr);
+}
+
+// deserialize_file - deserialize a whole cache file that dcuring read
+// into blob, including the url at the end, like demote does.
+// Returns false if anything is amiss.
+bool deserialize_file(uchar_blob&& blob, reply123* ret, std::string* returlp){
+    size_t len = blob.size();
+    const size_t trailer = 2*sizeof(int32_t);
+    if(len < header_length + trailer)
+        return false;
+    int32_t url_len, cmagic;
+    ::memcpy(&url_len, blob.data() + len - trailer, sizeof(url_len));
+    ::memcpy(&cmagic, blob.data() + len - sizeof(cmagic), sizeof(cmagic));
+    if(cmagic != reply123::MAGIC || url_len < 0 || size_t(url_len) > len - header_length - trailer)
+        return false;
+    size_t url_off = len - trailer - url_len;
+    if(returlp)
+        returlp->assign((const char*)blob.data() + url_off, url_len);
+    if(!diskcache::deserialize_buffer(std::move(blob), 0, len, ret))
+        return false;
+    if(header_length + ret->content.size() != url_off){
+        *ret = reply123{};
+        return false;
+    }
+    return true;
+}
+
 } // end namespace <anon>
 
+std::atomic<bool> diskcache::io_uring_{false};
+
 void 
 diskcache::check_root(){
     // FIXME - there should be more checks here!
@@ -96,7 +166,7 @@ diskcache::reldirname(unsigned i) const /*protected*/{
 }
 
 scan_result
-diskcache::do_scan(unsigned dirnum) const /*protected*/{
+diskcache::do_scan(unsigned dirnum, const dcindex* idx) const /*protected*/{
     scan_result ret;
     acDIR dp = sew::opendirat(rootfd_, reldirname(dirnum).c_str());
     struct dirent* entryp;
@@ -131,6 +201,9 @@ diskcache::do_scan(unsigned dirnum) const /*protected*/{
         // optimal size of an I/O for this file.
         ret.nbytes += sb.st_blocks* 512 + 4096;
         ret.names.push_back(fname);
+        dcindex::key_t key;
+        if(idx && idx->key_of(dirnum, fname, &key))
+            ret.found.push_back({key, uint64_t(sb.st_blocks)*512 + 4096, sb.st_mtime});
 
         // Should we gather more info?  E.g., open the file and
         // extract its expiration time??  What about st_atime?
@@ -147,6 +220,7 @@ diskcache::evict(size_t Nevict, size_t dir_to_evict, scan_result& sr) /*protecte
         // Randomly pick one of the names in the inclusive range [i, size()-1]
         size_t j = std::uniform_int_distribution<size_t>(i, sr.names.size()-1)(urng_);
         std::swap( sr.names[i], sr.names[j] );
+        maybe_demote(pfx + sr.names[i]);
         auto ret = ::unlinkat(rootfd_, (pfx + sr.names[i]).c_str(), 0);
         if(ret && errno != ENOENT)
             throw se("unlinkat(" + pfx+sr.names[i] + ")");
@@ -156,6 +230,125 @@ diskcache::evict(size_t Nevict, size_t dir_to_evict, scan_result& sr) /*protecte
     }
 }
 
+// evict_indexed - evict Nevict files from dir_to_evict, choosing
+// them with the index's candidates() rather than randomly.  If sr is
+// non-null, we just scanned the directory, so we also know about
+// 'strays', i.e., files whose names aren't cache paths and hence
+// aren't in the index.  They're usually files that deserialize
+// renamed because it couldn't parse them.  Evict them first.  (But
+// leave .new files alone - somebody's writing them.)
+size_t
+diskcache::evict_indexed(size_t Nevict, size_t dir_to_evict, dcindex& idx, const scan_result* sr) /*protected*/ {
+    std::string pfx = reldirname(dir_to_evict) + "/";
+    size_t nevicted = 0;
+    auto evict1 = [&](const std::string& relpath){
+        auto ret = ::unlinkat(rootfd_, relpath.c_str(), 0);
+        if(ret && errno != ENOENT)
+            throw se("unlinkat(" + relpath + ")");
+        // ENOENT is ok.  See evict.
+        stats.dc_eviction_evicted++;
+        nevicted++;
+    };
+    if(sr && sr->names.size() > sr->found.size()){
+        for(const auto& name : sr->names){
+            if(nevicted >= Nevict)
+                break;
+            dcindex::key_t key;
+            if(idx.key_of(dir_to_evict, name, &key) || endswith(name, ".new"))
+                continue;
+            evict1(pfx + name);   // not demoted:  strays don't parse.
+            stats.dc_index_strays_evicted++;
+        }
+    }
+    if(nevicted < Nevict){
+        for(const auto& e : policy_->victims(idx, dir_to_evict, Nevict - nevicted, ::time(nullptr))){
+            auto relpath = idx.relpath(e.key);
+            maybe_demote(relpath);
+            evict1(relpath);
+            idx.erase(e.key);
+        }
+    }
+    return nevicted;
+}
+
+void
+diskcache::set_lower_tier(diskcache* lower){
+    if(lower && !lower->lower_tier_)
+        throw se(EINVAL, "diskcache::set_lower_tier:  " + lower->rootpath_ + " wasn't constructed as a lower tier");
+    lower_ = lower;
+    if(lower_)
+        complain(LOG_NOTICE, "diskcache:  %s is the lower tier of %s", lower_->rootpath_.c_str(), rootpath_.c_str());
+}
+
+void
+diskcache::maybe_demote(const std::string& relpath) /*protected*/ {
+    if(!lower_)
+        return;
+    try{
+        acfd fd = ::openat(rootfd_, relpath.c_str(), O_RDONLY);
+        if(!fd)
+            return;  // ENOENT is ok.  See evict.
+        lower_->demote(fd);
+    }catch(std::exception& e){
+        // It's an optimization.  Carry on with the eviction.
+        stats.dc_demotion_failures++;
+        complain(LOG_WARNING, e, "diskcache::maybe_demote(" + rootpath_ + "/" + relpath + ")");
+    }
+}
+
+// demote - the file is in the same format we write, and it ends with
+// the url it was serialized under, so there's no need for the tiers
+// to agree on hexdigits or index sizes.  Read the whole thing (most
+// of them are at most a chunk), check it with deserialize_buffer,
+// and serialize it under its url.  Objects that are too stale to be
+// used for stale-while-revalidate aren't worth the copy.
+void
+diskcache::demote(int fd) /*protected*/ {
+    struct stat sb;
+    sew::fstat(fd, &sb);
+    size_t len = sb.st_size;
+    static const size_t sanity_max_len = size_t(1)<<30;
+    const size_t trailer = 2*sizeof(int32_t);
+    if(len < header_length + trailer || len > sanity_max_len){
+        stats.dc_demotion_rejects++;
+        return;
+    }
+    uchar_blob blob(len);
+    if(size_t(sew::pread(fd, blob.data(), len, 0)) != len){
+        stats.dc_demotion_rejects++;
+        return;
+    }
+    int32_t url_len;
+    ::memcpy(&url_len, blob.data() + len - trailer, sizeof(url_len));
+    if(url_len < 0 || size_t(url_len) > len - header_length - trailer){
+        stats.dc_demotion_rejects++;
+        return;
+    }
+    size_t url_off = len - trailer - url_len;
+    std::string url((const char*)blob.data() + url_off, url_len);
+    reply123 r;
+    if(!deserialize_buffer(std::move(blob), 0, len, &r) ||
+       header_length + r.content.size() != url_off ||
+       r.ttl() < -r.stale_while_revalidate){
+        stats.dc_demotion_rejects++;
+        return;
+    }
+    stats.dc_demotions++;
+    serialize(r, hashpath(hashkey(url)), url, true/*demoted*/);
+}
+
+std::ostream&
+diskcache::report_tier_stats(std::ostream& os, const char* tiername) /*protected*/ {
+    std::string pfx = std::string("dc_tier_") + tiername;
+    os << pfx << "_hits: " << tier_hits_ << "\n"
+       << pfx << "_misses: " << tier_misses_ << "\n"
+       << pfx << "_injection_probability: " << injection_probability_ << "\n";
+    if(auto idx = std::atomic_load(&index_))
+        os << pfx << "_index_files: " << idx->nfiles() << "\n"
+           << pfx << "_index_bytes: " << idx->nbytes() << "\n";
+    return os;
+}
+
 // The diskcache code is intentionally oblivious to external processes
 // removing files from (or adding properly named and formatted files
 // to) the cache "behind its back".  This makes it possible for
@@ -166,8 +359,9 @@ diskcache::evict(size_t Nevict, size_t dir_to_evict, scan_result& sr) /*protecte
 // allow them to share.
 //
 // If many processes share a diskcache then each will have its own
-// eviction thread that will stat every file in the cache
-// approximately once per evict_period_minutes.  This is arguably
+// eviction thread.  Without an index (the default), each one will
+// stat every file in the cache approximately once per
+// evict_period_minutes.  This is arguably
 // wasteful, and it's certainly possible to "do better".  Note that
 // we're talking about calling fstatat at a rate of
 // Nfiles*Nprocesses/evict_period_minutes, which is pretty low in the
@@ -184,12 +378,47 @@ diskcache::evict(size_t Nevict, size_t dir_to_evict, scan_result& sr) /*protecte
 // testing, and for now, the cost (risk of subtle error in tricky IPC
 // code) exceeds the benefit (fewer stats).
 //
+// The index (see dcindex.hpp, and -oFs123DiskcacheIndex=true) is
+// that "better":  it's a memory-mapped
+// file shared by all the processes using the cache, and it keeps
+// track of the size, expiration time and last-access time of every
+// file.  With it, evict_once gets the usage of the whole cache in
+// O(1), and chooses eviction candidates (expired first, then least
+// recently accessed) without reading the directory.  The directory
+// is scanned only when it's due for an audit, i.e., once every
+// Fs123DiskcacheIndexAuditMinutes, by one of the sharing processes,
+// to repair any drift between the index and reality (crashes,
+// external removals, etc.).  Until every directory has been audited
+// once (e.g., the first time an existing cache is opened with an
+// index), usage is estimated one directory at a time, as before.
+//
+// Even with the index, each process still runs its own evict_once,
+// evicts from its own dir_to_evict_ and computes its own
+// injection_probability.  With -oFs123DiskcacheSharedEviction=true,
+// a dccoord (see dccoord.hpp) - the circular_shared_buffer
+// suggested above, plus an flock - elects one 'leader' to do all of
+// that.  The others just adopt the leader's injection_probability,
+// so N mounts scan the cache once, not N times.  If the leader dies,
+// another process takes over, and if it stops publishing, the others
+// go back to evicting for themselves.
+//
 // Finally, note that if the rate of stats ever gets high enough to be
 // uncomfortable, we can probably have a bigger impact by estimating
 // 'usage_fraction' with some statistical sampling rather than
 // exhaustively stat-ing the whole cache.  E.g., if we have a Terabyte
 // cache with 20M files, we don't need to stat every one to have a
 // pretty good idea of whether we're above the usage thresholds.
+// Without an index, -oFs123DiskcacheSampleDirs=N does that (see
+// dcsample.hpp):  every Fs123DiskcacheSampleSeconds, evict_once
+// counts the files in N random directories and stats
+// Fs123DiskcacheSampleFilesPerDir of each.  If the upper end of the
+// confidence interval is comfortably below both evict_target and
+// evict_throttle_lwm there's nothing to evict and no reason to
+// throttle, so it doesn't scan anything.  Otherwise, it falls back to
+// the directory-at-a-time scan described below, and doesn't sample
+// again for another Fs123DiskcacheSampleSeconds.  On a big cache
+// that isn't near its limits, that's a few hundred stats a minute
+// instead of every file in the cache every evict_period_minutes.
 // 
 // evict_once is called periodically by a core123::periodic object.
 //
@@ -214,13 +443,60 @@ diskcache::evict_once() /*protected*/ try {
     // system_clock::duration don't mix.
     std::chrono::duration<double> sleepfor;
     float inj_prob;
-    auto scan = do_scan(dir_to_evict_);
-    auto Nfiles = scan.names.size();
-    float maxfiles_per_dir = float(vols_.dc_maxfiles) / Ndirs_;
-    float maxbytes_per_dir = float(vols_.dc_maxmbytes)*1000000. / Ndirs_;
-    double filefraction = Nfiles / maxfiles_per_dir;
-    double bytefraction = scan.nbytes / maxbytes_per_dir;
+    // Followers don't scan or evict, but they still insert into and
+    // touch the index, so they must notice when the leader's audit
+    // has replaced it.
+    auto idx = std::atomic_load(&index_);
+    if(idx && idx->obsolete()){
+        complain(LOG_NOTICE, "diskcache::evict_once:  index is obsolete.  Reopening");
+        stats.dc_index_reopens++;
+        open_index();
+        idx = std::atomic_load(&index_);
+    }
+    if(follow_leader(&sleepfor))
+        return std::chrono::duration_cast<std::chrono::system_clock::duration>(sleepfor);
+    auto now = std::chrono::steady_clock::now();
+    if(!idx && sample_dirs_ && now >= next_sample_){
+        double usage_fraction;
+        // Either way, the verdict stands for sample_period_.  If it's
+        // inconclusive, we scan, a directory at a time, until then,
+        // rather than paying for a sample before every directory.
+        next_sample_ = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(sample_period_);
+        if(sampled_below_thresholds(&usage_fraction)){
+            policy_->note_usage(usage_fraction, vols_.evict_target_fraction);
+            set_injection_probability(1.);
+            publish_usage(usage_fraction, 1., sample_period_);
+            return std::chrono::duration_cast<std::chrono::system_clock::duration>(sample_period_);
+        }
+    }
+    auto scan_started = ::time(nullptr);
+    bool scanned = !idx || idx->claim_audit(dir_to_evict_, scan_started, index_audit_period_);
+    scan_result scan;
+    if(scanned){
+        scan = do_scan(dir_to_evict_, idx.get());
+        if(idx){
+            stats.dc_index_audits++;
+            stats.dc_index_audit_corrections += idx->audit(dir_to_evict_, scan.found, scan_started);
+        }
+    }
+    size_t Nfiles = scanned ? scan.names.size() : idx->dir_nfiles(dir_to_evict_);
+    size_t Nbytes = scanned ? scan.nbytes : idx->dir_nbytes(dir_to_evict_);
+    double filefraction, bytefraction;
+    // The segments aren't in any directory.  Count an equal share of
+    // them against each one.
+    double segbytes = segments_ ? segments_->disk_bytes() : 0.;
+    if(idx && idx->complete()){
+        // The index knows about the whole cache.
+        filefraction = double(idx->nfiles()) / maxfiles_;
+        bytefraction = (idx->nbytes() + segbytes) / (maxmbytes_*1000000.);
+    }else{
+        float maxfiles_per_dir = float(maxfiles_) / Ndirs_;
+        float maxbytes_per_dir = float(maxmbytes_)*1000000. / Ndirs_;
+        filefraction = Nfiles / maxfiles_per_dir;
+        bytefraction = (Nbytes + segbytes/Ndirs_) / maxbytes_per_dir;
+    }
     double usage_fraction = std::max( filefraction, bytefraction );
+    policy_->note_usage(usage_fraction, vols_.evict_target_fraction);
     size_t Nevict = 0;
     DIAG(_evict, str("Usage fraction:", usage_fraction, "in directory", reldirname(dir_to_evict_)));
     if(usage_fraction > 1.0){
@@ -232,11 +508,23 @@ diskcache::evict_once() /*protected*/ try {
     if( usage_fraction > vols_.evict_target_fraction ){
         // We're above evict_target_fraction.  Try to get down to 'evict_lwm'
         auto evict_fraction = (usage_fraction - vols_.evict_lwm)/usage_fraction;
-        Nevict = clip(0, int(ceil(Nfiles*evict_fraction)), int(scan.names.size()));
+        Nevict = clip(0, int(ceil(Nfiles*evict_fraction)), int(Nfiles));
         complain(LOG_INFO, "evict %zd files from %zx. In this directory: files: %zu (%g) bytes: %zu (%g)",
-                 Nevict, dir_to_evict_, Nfiles, filefraction, scan.nbytes, bytefraction);
+                 Nevict, dir_to_evict_, Nfiles, filefraction, Nbytes, bytefraction);
+    }
+    if(idx)
+        evict_indexed(Nevict, dir_to_evict_, *idx, scanned ? &scan : nullptr);
+    else
+        evict(Nevict, dir_to_evict_, scan);
+    if(segments_){
+        // Evict or compact (at most) one segment.  Trouble with the
+        // segments shouldn't disable injection, so it's caught here.
+        try{
+            segments_->maintain(size_t(segment_fraction_*maxmbytes_*1000000.));
+        }catch(std::exception& e){
+            complain(LOG_WARNING, e, "evict_once:  dcsegments::maintain failed");
+        }
     }
-    evict(Nevict, dir_to_evict_, scan);
     if(++dir_to_evict_ >= Ndirs_)
         dir_to_evict_ = 0;
     if(dir_to_evict_ == 0){
@@ -249,7 +537,7 @@ diskcache::evict_once() /*protected*/ try {
     }
     files_evicted_ += Nevict;
     files_scanned_ += Nfiles;
-    bytes_scanned_ += scan.nbytes;
+    bytes_scanned_ += Nbytes;
     stats.dc_eviction_dirscans++;
 
     // If usage_fraction is above evict_throttle_lwm, we assume we're "under attack".
@@ -257,14 +545,8 @@ diskcache::evict_once() /*protected*/ try {
     //   lower the injection_probability to randomly reject insertion of new objects
     //   lower the interval between directory scans.
     inj_prob = clip(0., (1. - usage_fraction)/(1. - vols_.evict_throttle_lwm), 1.);
-    sleepfor = std::chrono::minutes(vols_.evict_period_minutes);
-    sleepfor *= inj_prob / Ndirs_;
-    DIAG(_evict, str("evict_once: sleepfor after *=:", sleepfor, sleepfor.count(), "inj_prob:", inj_prob));
-    if(inj_prob < 1.0)
-        complain(LOG_NOTICE, "Injection probability set to %g", inj_prob);
-    else if(injection_probability_ < 1.0)
-        complain(LOG_NOTICE, "Injection probability restored to 1.0");
-    injection_probability_.store(inj_prob);
+    sleepfor = set_injection_probability(inj_prob);
+    publish_usage(usage_fraction, inj_prob, sleepfor);
     return std::chrono::duration_cast<std::chrono::system_clock::duration>(sleepfor);
  }catch(std::exception& e){
     // We're the thread's entry point, so the buck stops here.  If we
@@ -277,14 +559,157 @@ diskcache::evict_once() /*protected*/ try {
     return std::chrono::minutes(5);
  }
 
+// set_injection_probability - and return how long evict_once should
+// sleep:  evict_period_minutes/Ndirs_ when the cache isn't under
+// pressure, and less when it is.
+std::chrono::duration<double>
+diskcache::set_injection_probability(float inj_prob) /*protected*/{
+    std::chrono::duration<double> sleepfor = std::chrono::minutes(vols_.evict_period_minutes);
+    sleepfor *= inj_prob / Ndirs_;
+    DIAG(_evict, str("evict_once: sleepfor after *=:", sleepfor, sleepfor.count(), "inj_prob:", inj_prob));
+    if(inj_prob < 1.0)
+        complain(LOG_NOTICE, "Injection probability set to %g", inj_prob);
+    else if(injection_probability_ < 1.0)
+        complain(LOG_NOTICE, "Injection probability restored to 1.0");
+    injection_probability_.store(inj_prob);
+    return sleepfor;
+}
+
+// publish_usage - if we're the leader, tell the followers.  If they
+// don't hear from us again in a couple of periods (plus a minute of
+// slack), they'll assume we're wedged and evict for themselves.
+void
+diskcache::publish_usage(double usage_fraction, float inj_prob, std::chrono::duration<double> sleepfor) /*protected*/{
+    if(!coord_ || !coord_->is_leader())
+        return;
+    dccoord::record rec{};
+    rec.next_dir = dir_to_evict_;
+    rec.good_until = ::time(nullptr) + int64_t(2*sleepfor.count()) + 60;
+    rec.usage_fraction = usage_fraction;
+    rec.injection_probability = inj_prob;
+    coord_->publish(rec);
+}
+
+// sample_usage - count the files in ndirs randomly chosen directories
+// (with replacement), and stat up to files_per_dir randomly chosen
+// files in each.
+dcsample
+diskcache::sample_usage(size_t ndirs, size_t files_per_dir) /*protected*/{
+    dcsample ret;
+    std::vector<std::string> names;
+    std::vector<uint64_t> sizes;
+    for(size_t i=0; i<ndirs; ++i){
+        unsigned dirnum = std::uniform_int_distribution<size_t>(0, Ndirs_-1)(urng_);
+        acDIR dp = sew::opendirat(rootfd_, reldirname(dirnum).c_str());
+        struct dirent* entryp;
+        names.clear();
+        while( (entryp = sew::readdir(dp)) ){
+            // Counting doesn't need a stat if the filesystem fills in
+            // d_type.  If it doesn't, count everything but . and ..
+            // (cache files never start with a dot).
+            if(entryp->d_type == DT_REG || (entryp->d_type == DT_UNKNOWN && entryp->d_name[0] != '.'))
+                names.push_back(entryp->d_name);
+        }
+        sizes.clear();
+        size_t m = std::min(files_per_dir, names.size());
+        for(size_t j=0; j<m; ++j){
+            // A partial Fisher-Yates shuffle:  names[0..j] are the sample.
+            size_t k = std::uniform_int_distribution<size_t>(j, names.size()-1)(urng_);
+            std::swap(names[j], names[k]);
+            struct stat sb;
+            if(::fstatat(dirfd(dp), names[j].c_str(), &sb, 0) != 0){
+                if(errno == ENOENT)
+                    continue;   // evicted since the readdir.  Not an error.
+                throw se("diskcache::sample_usage:  fstatat(" + reldirname(dirnum) + "/" + names[j] + ")");
+            }
+            // Count it the way do_scan does.
+            sizes.push_back(uint64_t(sb.st_blocks)*512 + 4096);
+        }
+        stats.dc_sample_stats += m;
+        // If every file we picked vanished, we know nothing about the
+        // sizes in this directory.  Leave it out.
+        if(sizes.empty() && !names.empty())
+            continue;
+        ret.add_dir(names.size(), sizes);
+    }
+    return ret;
+}
+
+// sampled_below_thresholds - sample the cache, and set
+// *usage_fraction to the estimate.  Return true if the sample's
+// confidence interval is entirely below both evict_target_fraction
+// and evict_throttle_lwm.
+bool
+diskcache::sampled_below_thresholds(double* usage_fraction) /*protected*/{
+    // Three standard errors.  With only a handful of directories in
+    // the sample, a Student-t quantile would be more defensible, but
+    // erring on the high side only costs an unnecessary scan.
+    static const double z = 3.;
+    stats.dc_sample_rounds++;
+    auto sample = sample_usage(sample_dirs_, sample_files_per_dir_);
+    double segbytes = segments_ ? segments_->disk_bytes() : 0.;
+    auto files = sample.files(Ndirs_, z);
+    auto bytes = sample.bytes(Ndirs_, z);
+    double maxbytes = maxmbytes_*1000000.;
+    *usage_fraction = std::max(files.value / maxfiles_, (bytes.value + segbytes) / maxbytes);
+    double hi = std::max(files.hi / maxfiles_, (bytes.hi + segbytes) / maxbytes);
+    bool below = hi < std::min(vols_.evict_target_fraction.load(), vols_.evict_throttle_lwm.load());
+    DIAG(_evict, str("sampled", sample.ndirs(), "directories and", sample.nsizes(), "files.  files:", files.value, "[", files.lo, files.hi, "] bytes:", bytes.value, "[", bytes.lo, bytes.hi, "] usage_fraction:", *usage_fraction, "hi:", hi, below ? "below thresholds" : "inconclusive"));
+    if(!below)
+        stats.dc_sample_inconclusive++;
+    return below;
+}
+
+// follow_leader - returns false if evict_once should go ahead and
+// scan and evict, either because we're the leader (possibly because
+// the previous leader went away), or because there is no leader that
+// we've heard from recently.  Otherwise, adopt the leader's
+// injection probability and return true.
+bool
+diskcache::follow_leader(std::chrono::duration<double>* sleepfor) /*protected*/{
+    if(!coord_)
+        return false;
+    bool was_leader = coord_->is_leader();
+    dccoord::record rec;
+    bool have_rec = coord_->latest(&rec);
+    if(coord_->lead()){
+        if(!was_leader){
+            // Pick up where the last leader left off.
+            stats.dc_coord_elections++;
+            if(have_rec)
+                dir_to_evict_ = rec.next_dir % Ndirs_;
+            complain(LOG_NOTICE, "diskcache:  pid %d is now the eviction leader for %s", ::getpid(), rootpath_.c_str());
+        }
+        return false;
+    }
+    if(!have_rec || rec.good_until < ::time(nullptr)){
+        stats.dc_coord_stale++;
+        DIAG(_evict, "follow_leader:  no recent record from the leader.  Evicting for ourselves\n");
+        return false;
+    }
+    stats.dc_coord_follows++;
+    policy_->note_usage(rec.usage_fraction, vols_.evict_target_fraction);
+    // We don't call victims, but the policy may still want to know
+    // what the leader is about to evict.
+    if(auto idx = std::atomic_load(&index_))
+        policy_->sample_victims(*idx, rec.next_dir % Ndirs_, follower_victim_sample, ::time(nullptr));
+    *sleepfor = set_injection_probability(rec.injection_probability);
+    // Don't wait too long to notice if the leader goes away.
+    *sleepfor = std::min(*sleepfor, std::chrono::duration<double>(std::chrono::minutes(1)));
+    return true;
+}
+
     
 diskcache::diskcache(backend123* upstream, const std::string& root,
-                     uint64_t hash_seed_first, volatiles_t& vols) :
+                     uint64_t hash_seed_first, volatiles_t& vols, bool lower_tier) :
     backend123(),
     upstream_(upstream),
     injection_probability_(1.0),
     hashseed_(hash_seed_first, 0),
-    vols_(vols)
+    vols_(vols),
+    lower_tier_(lower_tier),
+    maxmbytes_(lower_tier ? vols.dc_slow_maxmbytes : vols.dc_maxmbytes),
+    maxfiles_(lower_tier ? vols.dc_slow_maxfiles : vols.dc_maxfiles)
 {
     // We made injection_probability_ std:atomic<float> so we wouldn't
     // have to worry about it getting ripped or torn.  But helgrind
@@ -311,20 +736,65 @@ diskcache::diskcache(backend123* upstream, const std::string& root,
     // If no pre-existing "0*" directories were found, set hexdigits so
     // that we have a reasonable number of files (1000) in each directory
     // when we have maxfiles total files.
-    unsigned suggested_hexdigits = clip(1, int(floor(log_16(vols_.dc_maxfiles/1000.))), 4);
+    unsigned suggested_hexdigits = clip(1, int(floor(log_16(maxfiles_/1000.))), 4);
     if(hexdigits_ == 0)
         hexdigits_ = suggested_hexdigits;
 
     // warn if the actual number and the suggested number differ.
     if(hexdigits_ != suggested_hexdigits)
         complain(LOG_WARNING, "Found pre-existing cache directory: %s with %d-digit sub-directories.  Differs from recommended value of %d-digits when maxfiles = %zd",
-                 root.c_str(), hexdigits_, suggested_hexdigits, vols_.dc_maxfiles.load());
+                 root.c_str(), hexdigits_, suggested_hexdigits, maxfiles_.load());
 
-    DIAGkey(_diskcache, "cachedir root: " << root << " maxfiles=" << vols_.dc_maxfiles << " hexdigits=" << hexdigits_ << "\n");
+    DIAGkey(_diskcache, "cachedir root: " << root << " maxfiles=" << maxfiles_ << " hexdigits=" << hexdigits_ << "\n");
     Ndirs_ = 1<<(4*hexdigits_);
     
     check_root();
 
+    index_audit_period_ = envto<int64_t>("Fs123DiskcacheIndexAuditMinutes", 24*60) * 60;
+    // The index is opt-in, because it adds a file to the cache's
+    // on-disk layout.
+    if(envto<bool>("Fs123DiskcacheIndex", false))
+        open_index();
+    // The default policy is random, i.e., the original one.  The
+    // others need the index, which is also off by default.  See
+    // cache_policy.hpp.
+    policy_ = cache_policy::make(envto<std::string>("Fs123CachePolicy", "random"), maxfiles_);
+    if(!index_ && policy_->name() != std::string("random"))
+        complain(LOG_WARNING, "diskcache:  Fs123CachePolicy=%s needs the index for eviction.  Without it, files are evicted at random", policy_->name());
+    // 0, the default, turns the segments off.  See diskcache.hpp.
+    small_object_bytes_ = envto<size_t>("Fs123DiskcacheSmallObjectBytes", 0);
+    segment_fraction_ = envto<double>("Fs123DiskcacheSegmentFraction", 0.1);
+    sample_dirs_ = envto<size_t>("Fs123DiskcacheSampleDirs", 0);
+    sample_files_per_dir_ = envto<size_t>("Fs123DiskcacheSampleFilesPerDir", 32);
+    sample_period_ = std::chrono::seconds(envto<unsigned>("Fs123DiskcacheSampleSeconds", 60));
+    if(sample_dirs_ && index_)
+        complain(LOG_NOTICE, "diskcache:  Fs123DiskcacheSampleDirs is ignored because the index knows the cache's usage exactly");
+    // Opt-in, because it's slower than the syscalls in ut_dcuring.
+    // See dcuring.hpp.
+    if(envto<bool>("Fs123DiskcacheIoUring", false)){
+        io_uring_ = dcuring::available();
+        if(!io_uring_)
+            complain(LOG_WARNING, "diskcache:  Fs123DiskcacheIoUring is set, but io_uring isn't available here.  Using the syscalls");
+    }
+    // Opt-in, like the index, because it adds a file to the cache's
+    // on-disk layout.
+    if(envto<bool>("Fs123DiskcacheSharedEviction", false)) try {
+        coord_ = std::make_unique<dccoord>(rootpath_, ".evictcoord");
+    }catch(std::exception& e){
+        // Another optimization.  Without it, every process evicts.
+        complain(LOG_WARNING, e, "diskcache:  no eviction coordination for " + rootpath_ + ".  Every process sharing it will scan and evict");
+    }
+    if(small_object_bytes_ && segment_fraction_ > 0.) try {
+        // At least eight segments, so that evicting the oldest one
+        // doesn't throw away too much at once.
+        size_t segbytes = clip(size_t(1)<<20, size_t(segment_fraction_*maxmbytes_*1000000./8), size_t(64)<<20);
+        size_t indexbytes = envto<size_t>("Fs123DiskcacheSegmentIndexMBytes", 64)*1000000;
+        segments_ = std::make_unique<dcsegments>(rootfd_, "segments", segbytes, indexbytes);
+    }catch(std::exception& e){
+        // Like the index, the segments are an optimization.
+        complain(LOG_WARNING, e, "diskcache:  no segments for " + rootpath_ + ".  Small objects will be stored in individual files");
+    }
+
     // start the periodic evict_thread.  The evict_thread is almost
     // independent of the rest of the diskcache code.  Points are
     // contact are:
@@ -334,63 +804,156 @@ diskcache::diskcache(backend123* upstream, const std::string& root,
     //   - evict_once does unlinkat(diskcache::rootfd_, ...
     //     and calls 'diskcache::reldirname'
     evict_thread_ = std::make_unique<periodic>([this](){return evict_once();});
+    if(segments_)
+        catch_up_thread_ = std::make_unique<periodic>([this](){return catch_up_segments();});
 }
 
+// catch_up_segments - the first call reads all the segments, which
+// may take a while, so it's done here, rather than in the constructor
+// or in the foreground.  After that, we pick up other processes'
+// appends once a second.
+std::chrono::seconds
+diskcache::catch_up_segments() /*protected*/ try {
+    auto t0 = std::chrono::steady_clock::now();
+    segments_->catch_up();
+    stats.dc_segment_catch_ups++;
+    if(!segments_caught_up_){
+        segments_caught_up_ = true;
+        complain(LOG_NOTICE, "diskcache:  read %zu objects (%zu bytes) in %zu segments in %s in %.3f seconds.  The index uses %zu bytes",
+                 segments_->nobjects(), segments_->disk_bytes(), segments_->nsegments(), rootpath_.c_str(),
+                 std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count(), segments_->index_bytes());
+    }
+    return std::chrono::seconds(1);
+ }catch(std::exception& e){
+    // periodic stops calling us if we throw.  Keep trying.
+    complain(LOG_WARNING, e, "diskcache::catch_up_segments:  dcsegments::catch_up failed");
+    return std::chrono::seconds(1);
+ }
+
+void
+diskcache::open_index() /*protected*/ try {
+    auto spd = dcindex::recommended_slots_per_dir(maxfiles_, hexdigits_);
+    std::atomic_store(&index_, std::make_shared<dcindex>(rootfd_, ".index", hexdigits_, spd));
+ }catch(std::exception& e){
+    // The index is an optimization.  We can live without it.
+    complain(LOG_WARNING, e, "diskcache::open_index:  no index for " + rootpath_ + ".  Eviction will scan directories instead");
+    std::atomic_store(&index_, std::shared_ptr<dcindex>());
+ }
+
 // It's not uncommon (python startup with an empty cache) to see lots
-// of back-to-back requests for the same resource.  This hack discards
-// rapidly repeated requests.  It can be disabled simply by not
-// calling recently_refreshed() at the top of mabye_refresh().
-
-// 'recently' is a vector of urls that we've recently (within
-// 500ms) issued a request for.  If a url is already on the list, then
-// recently_refreshed(url) returns true.  If it's not on the list,
-// then recently_refreshed pushes it (with a timestamp) onto the back
-// of the list.  We only keep items on the list for one second, so it
-// "can't possibly" get too long.  Use a vector even though we do
-// a fair amount of erase-from-the-middle.  
+// of back-to-back requests for the same resource.  Rather than send
+// them all upstream (and then discard all but one of the replies when
+// only one of them can create the .new file in serialize), we keep
+// track of the requests that are "in flight", keyed by urlstem.  A
+// request for a urlstem that's already in flight "boards" the flight
+// and waits for it to "land", i.e., for the leader's upstream request
+// to complete.  Then it shares the leader's reply (or exception).
+// The flight stays listed until the leader's reply is on disk, so a
+// request that arrives after the reply but before the serialize
+// shares it too, rather than missing on disk and going upstream
+// again.
+//
+// Background (stale-while-revalidate) refreshes are flights too, so
+// a urlstem is never refreshed in the background more than once at a
+// time, and a foreground request that arrives while it's being
+// refreshed in the background waits for the result rather than
+// asking again.  But a background refresh may sit in the threadpool's
+// queue, behind thousands of others, for a long time before it
+// starts.  A foreground request doesn't board a flight that hasn't
+// started.  It takes the flight over instead, i.e., it becomes the
+// leader of a new flight, and the queued background refresh does
+// nothing when it eventually runs.  See detached_upstream_refresh.
 //
-// Note that the 'EnhancedConsistency' code in openfilemap.cpp
-// aggressively refreshes objects as soon as they expire, and if they
-// are within the swr, it refreshes them again a short time (currently
-// 750msec) later.  It's important that the window here be less than
-// the delay in openfilemap.cpp.  The fact that these two are so
-// closely related suggests a design error.
-std::mutex recently_mtx;
-using recently_p = std::pair<std::string, std::chrono::system_clock::time_point>;
-std::vector<recently_p> recently;
-bool recently_refreshed(const std::string& url){
-    auto now = std::chrono::system_clock::now();
-    auto short_time_ago = now - std::chrono::milliseconds(500);
-    std::lock_guard<std::mutex> lgd(recently_mtx);
-    // blow away anything too old
-    auto e = std::lower_bound(recently.begin(), recently.end(), short_time_ago,
-                              [&](const recently_p& a, const std::chrono::system_clock::time_point& then){
-                                  return a.second < then;
-                              });
-    stats.dc_recently_refreshed_erased += std::distance(recently.begin(), e);
-    recently.erase(recently.begin(), e);
-    // find an entry with a matching url
-    e = std::find_if(recently.begin(), recently.end(), 
-                  [&](const recently_p& a){
-                      return a.first == url;
-                  });
-    if(e != recently.end()){
-        stats.dc_recently_refreshed_matched++;
-        DIAGfkey(_diskcache, "recently_refreshed(%s) -> true\n", url.c_str());
-        return true;
-    }
-    recently.emplace_back(url, now);
-    DIAGfkey(_diskcache, "recently_refreshed(%s) -> false (emplaced)\n", url.c_str());
-    stats.dc_recently_refreshed_appended++;
-    return false;
+// A follower can only board a flight if the leader's request was at
+// least as strict, i.e., the follower's no-cache or max-stale
+// mustn't be stricter than the leader's.  Otherwise, the follower
+// goes upstream on its own, without coalescing.
+std::pair<diskcache::flight_sp, bool>
+diskcache::board(const req123& req) /*protected*/ {
+    std::lock_guard<std::mutex> lg(flights_mtx_);
+    auto ii = flights_.find(req.urlstem);
+    if(ii == flights_.end() || !ii->second->started){
+        if(ii != flights_.end())
+            stats.dc_singleflight_takeovers++;
+        auto f = std::make_shared<flight>();
+        f->no_cache = req.no_cache;
+        f->max_stale = req.max_stale;
+        flights_[req.urlstem] = f;
+        stats.dc_singleflight_leaders++;
+        return {f, true};
+    }
+    auto& f = ii->second;
+    bool boardable = (f->no_cache || !req.no_cache) &&
+        (!req.max_stale || (f->max_stale && *f->max_stale <= *req.max_stale));
+    if(!boardable){
+        stats.dc_singleflight_unboardable++;
+        return {nullptr, false};
+    }
+    stats.dc_singleflight_followers++;
+    return {f, false};
+}
+
+// land - called by the leader when the upstream request is done,
+// with either a reply or an exception.  Landing the same flight more
+// than once is harmless:  only the first one counts.
+void
+diskcache::land(const std::string& urlstem, const flight_sp& f, const reply123* r, std::exception_ptr eptr) /*protected*/ {
+    unlist(urlstem, f);
+    deliver(f, r, eptr);
+}
+
+// unlist - remove f from flights_, so that the next request for
+// urlstem leads a new flight rather than boarding f.  Harmless if f
+// isn't there (e.g., it was already unlisted, or taken over).
+void
+diskcache::unlist(const std::string& urlstem, const flight_sp& f) /*protected*/ {
+    if(!f)
+        return;
+    std::lock_guard<std::mutex> lg(flights_mtx_);
+    auto ii = flights_.find(urlstem);
+    if(ii != flights_.end() && ii->second == f)
+        flights_.erase(ii);
+}
+
+// deliver - wake up f's followers with either a reply or an
+// exception.  Later followers that board f while it's still listed
+// get the same reply without waiting.  Only the first delivery
+// counts.
+void
+diskcache::deliver(const flight_sp& f, const reply123* r, std::exception_ptr eptr) /*protected*/ {
+    if(!f)
+        return;
+    std::lock_guard<std::mutex> lg(f->mtx);
+    if(f->landed)
+        return;
+    if(eptr)
+        f->eptr = eptr;
+    else
+        f->reply = r->copy(); // shares r->content.  No memcpy.
+    f->landed = true;
+    f->cv.notify_all();
+}
+
+// await - called by a follower.  Wait for the flight to land and
+// either copy its reply into *r or rethrow its exception.
+void
+diskcache::await(const flight_sp& f, reply123* r) /*protected*/ {
+    atomic_scoped_nanotimer _t(&stats.dc_singleflight_wait_sec);
+    std::unique_lock<std::mutex> lk(f->mtx);
+    f->cv.wait(lk, [&f](){ return f->landed; });
+    if(f->eptr)
+        std::rethrow_exception(f->eptr);
+    *r = f->reply.copy();
 }
 
 // The stats are informative but confusing:
 //    maybe_rf_too_soon - how many maybe_bg_upstream_refreshes were elided because
-//             we had just asked about the same url
+//             the same url was already in flight
 //    maybe_rf_submitted - how many times maybe_bg_upstream_refresh sent a request
 //             to the background thread-pool
 //    maybe_rf_retired - how many of those requests have been retired.
+//    maybe_rf_superseded - how many of those requests did nothing because
+//             a foreground request took over their flight before they started.
 //    stale_while_revalidate - number of maybe_bg_upstream_refresh calls
 //    must_refresh - no data on disk or too stale to use.
 //    rf_stale_if_error - how many times we returned stale
@@ -409,45 +972,69 @@ bool recently_refreshed(const std::string& url){
 //
 //  The number of calls to maybe_bg_upstream_refresh equals the
 //  number of retired or failed background refreshes:
-//         maybe_rf_started = maybe_rf_retired + detached_refresh_failures
+//         maybe_rf_started = maybe_rf_retired + maybe_rf_superseded + detached_refresh_failures
 
 void diskcache::maybe_bg_upstream_refresh(const req123& req, const std::string& path, reply123* replyp) /*protected*/ {
-    if(recently_refreshed(req.urlstem)){
-        stats.dc_maybe_rf_too_soon++;
-        return;
-    }
     if(vols_.disconnected){
         stats.dc_rf_disconnected_skipped++;
         return;
     }
+    // The background refresh insists on max_stale=0.  See
+    // detached_upstream_refresh.
+    req123 bgreq = req;
+    bgreq.max_stale = 0;
+    flight_sp f;
+    {
+        std::lock_guard<std::mutex> lg(flights_mtx_);
+        if(flights_.count(req.urlstem)){
+            stats.dc_maybe_rf_too_soon++;
+            return;
+        }
+        f = std::make_shared<flight>();
+        f->no_cache = bgreq.no_cache;
+        f->max_stale = bgreq.max_stale;
+        f->started = false; // until detached_upstream_refresh runs.
+        flights_.emplace(req.urlstem, f);
+    }
     stats.dc_maybe_rf_started++;
     DIAGkey(_diskcache, "tp->submit(detached_upstream_refresh) submitted by thread id: " << std::this_thread::get_id() << "\n");
     // We have to copy the reply because the refresh happens on
     // another thread and "this" copy might be gone before that thread
-    // executes.  But nobody will ever need the copy of
-    // reply->contents: either it will be replaced by the
-    // upstream_refresh, or the upstream will tell us 304 Not
-    // Modified, and we'll replace just the on-disk metadata, ignoring
-    // copy_of_replyp.content.  It shouldn't be too hard to save
-    // ourselves the cost of copying reply->content (which might be
-    // non-negligible).  But this code is way too fragile already, so
-    // before we do that, let's gather some statistics to assess how
-    // much we might save.
-    stats.dc_wasted_copy_reply_bytes += replyp->content.size();
+    // executes.  The copy shares reply->content rather than
+    // duplicating it, so it costs a reference-count bump, not a
+    // memcpy.
     // The const_cast-ing and mutable modifier here is safe because
     // the lambda is working with a copy of req and replyp.  But it's
     // yet another indicator that the API is mis-designed.
-    tp->submit([=, req=const_cast<req123&>(req), reply=replyp->copy()]() mutable { detached_upstream_refresh(req, path, &reply); });
+    try{
+        tp->submit([=, req=std::move(bgreq), reply=replyp->copy()]() mutable { detached_upstream_refresh(req, path, &reply, f); });
+    }catch(std::exception&){
+        land(req.urlstem, f, nullptr, std::current_exception());
+        throw;
+    }
 }
 
-void diskcache::detached_upstream_refresh(req123& req, const std::string& path, reply123* replyp) noexcept /*protected*/ try {
+void diskcache::detached_upstream_refresh(req123& req, const std::string& path, reply123* replyp, const flight_sp& f) noexcept /*protected*/ try {
     DIAGkey(_diskcache, "detached_upstream_refresh in tid " << std::this_thread::get_id() << "(" << req.urlstem << ", " << path << " stale_if_error: " <<  req.stale_if_error << ")\n");
     // It's a background request, so it's not latency sensitive.  If we're
     // going to wait for a network round-trip, we might as well insist
     // on something that's actually fresh.  So set max_stale to 0.
-    // Should we go further and ask for no_cache?
-    req.max_stale = 0;
-    upstream_refresh(req, path, replyp, true/*already_detached*/, false/*usable_if_error*/);
+    // Should we go further and ask for no_cache?  (N.B.  max_stale
+    // was set in maybe_bg_upstream_refresh so that foreground
+    // requests can see it when they decide whether to board.)
+    {
+        // If a foreground request took over our flight while we were
+        // queued (see board), it's either in flight or has already
+        // landed.  Either way, there's nothing for us to do.
+        std::lock_guard<std::mutex> lg(flights_mtx_);
+        auto ii = flights_.find(req.urlstem);
+        if(ii == flights_.end() || ii->second != f){
+            stats.dc_maybe_rf_superseded++;
+            return;
+        }
+        f->started = true;
+    }
+    upstream_refresh(req, path, replyp, true/*already_detached*/, false/*usable_if_error*/, f);
     stats.dc_maybe_rf_retired++;
     // Can/should we check this reply for estale mismatch between the
     // reply we just got and the ino (if any) that prompted this.
@@ -472,44 +1059,39 @@ void diskcache::detached_upstream_refresh(req123& req, const std::string& path,
     // In those cases, it might be better to rethrow here, but we don't
     // have enough information to make the decision...
     DIAGkey(_diskcache, "upstream_refresh caught exception\n");
+    land(req.urlstem, f, nullptr, std::current_exception());
     stats.dc_detached_refresh_failures++;
     complain(LOG_WARNING, e, "detached_upstream_refresh:  caught error: ");
 }catch(...){
+    land(req.urlstem, f, nullptr, std::current_exception());
     complain(LOG_CRIT, "detached_upstream_refresh: caught something other than std::exception.  This can't happen");
     // no point in rethrowing.  See comment in diskcache.hpp
 }
 
-void diskcache::do_serialize(const reply123* r, const std::string& path, const std::string& urlstem, bool already_detached){
+void diskcache::do_serialize(const reply123* r, const std::string& path, const std::string& urlstem, bool already_detached, const flight_sp& f){
     // already_detached means two things:
     //  1 - we're already running in the threadpool.  DO NOT tp->submit.
     //  2 - we're wrapped in a try{}catch(...){}.  Don't worry about throwing.
+    // f, if non-null, is a flight that's been delivered but is still
+    // listed.  We unlist it when path has been written (or we've
+    // given up).  If we throw, it's the caller's job to land it.
     if(already_detached || foreground_serialize){
         // we're already detached.  Call serialize synchronously.
         // Nobody's waiting for us, and the threadpool will throw
         // an EINVAL if we try to submit to it recursively.
         DIAGkey(_diskcache, "upstream_refresh(detached) in " << std::this_thread::get_id() << " r->expires: " << ins(r->expires) << ", r->etag64: "  << r->etag64 << "\n");
         serialize(*r, path, urlstem);  // might throw, but we're already_detached, so it's caught by caller
+        unlist(urlstem, f);
     }else{
         // We are not already detached.  Submit the serializer to
         // the threadpool.
         //
-        // Work around issues when r->content is "copy-on-write".  (It
-        // shouldn't be, but it still is in RedHat's devtoolsets in
-        // 2020).  Since C++11, r->copy() *should* make a bona fide
-        // copy of r->content, and the copy should have a lifetime
-        // completely independent of the original.  But if std::string
-        // is CoW, things get confused, and when the copied reply
-        // ultimately gets destroyed in the lambda, we end up with a
-        // double-free.  To work around, we force r->content to be
-        // copied by calling its *non-const* operator[]() before
-        // calling r->copy().
-        const char* rc0 = &const_cast<std::string&>(r->content)[0];
-        tp->submit([rv = r->copy(), path, rc0, urlstem = urlstem, this](){
+        // r->copy() shares r->content with the lambda.  That's safe
+        // because nobody modifies shared content in place.  (The
+        // in-place decryption in app_mount.cpp's beget_decode makes
+        // a private copy if content's use_count() is more than 1.)
+        tp->submit([rv = r->copy(), path, urlstem = urlstem, f, this](){
                        try{
-                           if(rc0 == &rv.content[0]){
-                               complain(LOG_CRIT, "Uh oh.  Copy-on-write problems!  rc0=%p, &rv.content[0]=%p.  Reply was not copied correctly into lambda %s:%d", rc0, &rv.content[0], __FILE__, __LINE__);
-                               std::terminate();
-                           }
                            serialize(rv, path, urlstem);
                        }catch(std::exception& e){
                            complain(LOG_WARNING, e, "detached_serialize:  caught error: ");
@@ -517,21 +1099,32 @@ void diskcache::do_serialize(const reply123* r, const std::string& path, const s
                            complain(LOG_CRIT, "detached_serialize:  caught something other than std::exception.  This can't happen");
                            // no point in rethrowing.  See comment in diskcache.hpp
                        }
+                       unlist(urlstem, f);
                    });
     }
 }    
 
-void diskcache::upstream_refresh(const req123& req, const std::string& path, reply123* r, bool already_detached, bool usable_if_error)/*protected*/{
+// upstream_refresh - if f is non-null, it's a flight led by the
+// caller.  We deliver the reply to its followers as soon as we have
+// it, but we don't unlist the flight until the reply is on disk
+// (which, for a foreground request, happens later, on tp).  Until
+// then, a request for the same urlstem that misses on disk boards the
+// flight and gets the reply rather than going upstream again.  If we
+// throw, it's the caller's job to land it.
+void diskcache::upstream_refresh(const req123& req, const std::string& path, reply123* r, bool already_detached, bool usable_if_error, const flight_sp& f)/*protected*/{
     if( vols_.disconnected && usable_if_error){
         // If we're disconnected and r is within the stale-if-error window,
         // return immediately.  Don't complain. Don't ask upstream.
         stats.dc_rf_stale_if_error++;
         stats.dc_rf_disconnected_skipped++;
+        land(req.urlstem, f, r);
         return;
     }
-    if(upstream_->refresh(req, r)){
+    bool got200 = upstream_->refresh(req, r);
+    deliver(f, r);
+    if(got200){
         stats.dc_rf_200++;
-        do_serialize(r, path, req.urlstem, already_detached);
+        do_serialize(r, path, req.urlstem, already_detached, f);
     }else{
         if(req.no_cache){
             // Not clear what we should do here.  If we get here, it
@@ -542,28 +1135,73 @@ void diskcache::upstream_refresh(const req123& req, const std::string& path, rep
             // ASAP.
             throw se(EINVAL, "diskcache:: upstream_->refresh returned false, interpreted as 304 Not Modified, but the request is no-cache.  That shouldn't happen.  Find this error message in the code and FIX THE UNDERLYING PROBLEM!");
         }
-        // In earlier versions, we had some "clever" code that used a
-        // single pwrite to update only the expiration times in the
-        // on-disk cache.  POSIX says that read() and pwrite() are
-        // "atomic", i.e., "If two threads each call one of these
-        // functions, each call shall either see all of the specified
-        // effects of the other call or none of them".  But Linux
-        // (apparently) interprets this as though "the effects" of the
-        // write are undefined from the time the call is made till the
-        // time it returns.  So a read that happens concurrently with
-        // a write has no(!) all-or-nothing guarantee.
-        // 
-        // In light of this, we now just call serialize, which
-        // replaces the whole file using the conventional
-        // open(tmpfile)/write/close/rename idiom.  Writing 128k of
-        // data so that we can atomically update 32 bytes seems
-        // wasteful.  But it shouldn't be noticeable unless Fs123Chunk
-        // is a lot bigger than 128(kB).
+        // A 304 doesn't change the content, so there's no need to
+        // rewrite it.  update_header overwrites just the header, in
+        // place.  In earlier versions, we had some "clever" code that
+        // did the same, but readers had no way to tell whether a
+        // read that overlapped the pwrite saw all, some or none of
+        // it.  (POSIX says read() and pwrite() are atomic with
+        // respect to one another, but Linux doesn't deliver.)  Now
+        // the header carries a checksum, and readers retry (and
+        // ultimately reject) a header that doesn't match it.  If the
+        // file isn't there (e.g., it's in the segments, or it was
+        // evicted) or if it holds a different object, we fall back
+        // to serialize, i.e., open(tmpfile)/write/close/rename.
         stats.dc_rf_304++;
-        stats.dc_rf_304_bytes += r->content.size();
-        do_serialize(r, path, req.urlstem, already_detached);
+        if(!update_header(*r, path, req.urlstem)){
+            stats.dc_rf_304_bytes += r->content.size();
+            do_serialize(r, path, req.urlstem, already_detached, f);
+        }else{
+            unlist(req.urlstem, f);
+        }
     }
 }
+
+// update_header - the 304 path.  If the file at path holds the same
+// object as r (same magic, content length, etag and content
+// checksum), overwrite its header with r's, with a single pwrite.
+// Returns false, without throwing, if it doesn't, in which case the
+// caller should serialize r instead.
+bool
+diskcache::update_header(const reply123& r, const std::string& path, const std::string& url) /*protected*/ {
+    atomic_scoped_nanotimer _t(&stats.dc_update_sec);
+    refcounted_scoped_nanotimer _rt(update_nanotimer_ctrl);
+    refcounted_scoped_nanotimer _rtx(serdes_nanotimer_ctrl);
+    acfd fd = ::openat(rootfd_, path.c_str(), O_RDWR);
+    if(!fd)
+        return false;
+    char hdr[header_length];
+    if(::pread(fd, hdr, header_length, 0) != ssize_t(header_length))
+        return false;
+    reply123 ondisk;
+    size_t content_len;
+    if(!unpack_header(hdr, &ondisk, &content_len) ||
+       ondisk.magic != reply123::MAGIC ||
+       content_len != r.content.size() ||
+       ondisk.etag64 != r.etag64 ||
+       ::memcmp(ondisk.content_threeroe, r.content_threeroe, sizeof(r.content_threeroe)) != 0){
+        DIAGkey(_diskcache, "diskcache::update_header(" << path << "):  not the same object.  Serialize instead\n");
+        stats.dc_failed_updates++;
+        return false;
+    }
+    pack_header(r, hdr);
+    if(::pwrite(fd, hdr, header_length, 0) != ssize_t(header_length)){
+        // Whatever's there now is no worse than a torn header, which
+        // readers reject.  Serializing will replace it.
+        complain(LOG_WARNING, "diskcache::update_header: pwrite(%s) failed: %m", path.c_str());
+        stats.dc_failed_updates++;
+        return false;
+    }
+    stats.dc_updates++;
+    stats.dc_update_bytes += header_length;
+    auto idx = std::atomic_load(&index_);
+    auto key = hashkey(url);
+    size_t nbytes = header_length + content_len + url.size() + 2*sizeof(int32_t);
+    if(idx && !idx->insert(key, dcindex::accounting_bytes(nbytes), epoch_seconds(r.expires), ::time(nullptr)))
+        stats.dc_index_full++;
+    DIAGkey(_diskcache, "diskcache::update_header(" << path << ") expires=" << ins(r.expires) << "\n");
+    return true;
+}
     
 bool
 diskcache::refresh(const req123& req, reply123* r) /*override*/ try {
@@ -573,8 +1211,19 @@ diskcache::refresh(const req123& req, reply123* r) /*override*/ try {
     // disconnected operation?  What if we're not even using
     // a diskcache?  Shouldn't past_stale_while_revalidate still
     // matter?
-    auto path = hash(req.urlstem);
-    *r = deserialize(path);
+    auto key = hashkey(req.urlstem);
+    auto path = hashpath(key);
+    policy_->record_access(key);
+    auto ondisk = lookup(key, path);
+    if(lower_tier_ && !ondisk.valid()){
+        // New objects belong in the upper tier, so pass the request
+        // through without serializing.  Pass the upper tier's reply
+        // (if any) too, so upstream can answer with a 304.
+        tier_misses_++;
+        stats.dc_tier_passthroughs++;
+        return upstream_->refresh(req, r);
+    }
+    *r = std::move(ondisk);
     // According to RFC5861, stale_while_revalidate is specified by
     // the Cache-control header in the reply123, *r, which is under
     // the sole control of the origin server.
@@ -610,14 +1259,21 @@ diskcache::refresh(const req123& req, reply123* r) /*override*/ try {
     if( !req.no_cache && ttl > decltype(ttl)::zero() ){
         DIAGfkey(_diskcache, "diskcache::refresh hit\n");
         stats.dc_hits++;
+        tier_hits_++;
+        policy_->count_hit();
     }else if( !req.no_cache && ttl > -swr ){
         DIAGfkey(_diskcache, "diskcache::refresh swr\n");
         stats.dc_stale_while_revalidate++;
+        tier_hits_++;
+        policy_->count_hit();
         maybe_bg_upstream_refresh(req, path, r);
     }else{
         DIAGkey(_diskcache, "diskcache::refresh miss!\n");
         stats.dc_must_refresh++;
+        tier_misses_++;
+        policy_->count_miss();
         bool usable_if_error;
+        auto [f, leader] = board(req);
         try{
             // We could save a copy of the reply here, but since
             // exceptions should be rare, that would entail making an
@@ -626,10 +1282,15 @@ diskcache::refresh(const req123& req, reply123* r) /*override*/ try {
             // and if it was, we deserialize it again in the catch
             // block.
             usable_if_error = r->valid() && std::chrono::seconds(req.stale_if_error) >= -ttl;
-            upstream_refresh(req, path, r, false, usable_if_error);
+            if(f && !leader)
+                await(f, r);
+            else
+                upstream_refresh(req, path, r, false, usable_if_error, f);
         }catch(std::exception& e){
+            if(leader)
+                land(req.urlstem, f, nullptr, std::current_exception());
             if(usable_if_error){
-                *r = deserialize(path);
+                *r = lookup(key, path);
                 ttl = r->ttl();
                 usable_if_error = r->valid() && std::chrono::seconds(req.stale_if_error) >= -ttl;
             }
@@ -647,9 +1308,38 @@ diskcache::refresh(const req123& req, reply123* r) /*override*/ try {
     std::throw_with_nested(std::runtime_error("diskcache::refresh(req.urlstem=" + req.urlstem + ")"));
  }
 
+bool
+diskcache::fresh(const req123& req) const{
+    if(req.no_cache)
+        return false;
+    acfd fd = ::openat(rootfd_, hashpath(hashkey(req.urlstem)).c_str(), O_RDONLY);
+    if(!fd)
+        return false;
+    char hdr[header_length];
+    if(::pread(fd, hdr, header_length, 0) != ssize_t(header_length))
+        return false;
+    reply123 ondisk;
+    size_t content_len;
+    return unpack_header(hdr, &ondisk, &content_len) &&
+        ondisk.magic == reply123::MAGIC && ondisk.fresh();
+}
+
 std::ostream& 
 diskcache::report_stats(std::ostream& os) /*override*/{
     os << stats;
+    if(coord_)
+        os << "dc_coord_leader: " << coord_->is_leader() << "\n";
+    policy_->report_stats(os);
+    if(auto idx = std::atomic_load(&index_))
+        os << "dc_index_files: " << idx->nfiles() << "\n"
+           << "dc_index_bytes: " << idx->nbytes() << "\n"
+           << "dc_index_complete: " << idx->complete() << "\n";
+    if(segments_)
+        segments_->report_stats(os);
+    if(lower_){
+        report_tier_stats(os, "fast");
+        lower_->report_tier_stats(os, "slow");
+    }
     return os << "dc_threadpool_backlog: " << tp->backlog() << "\n";
 }
 
@@ -660,11 +1350,24 @@ diskcache::get_uuid() /*override*/{
     return uuid;
 }
 
+dcindex::key_t
+diskcache::hashkey(const std::string& s) const{
+    return threeroe(s, hashseed_.first, hashseed_.second).hashpair64();
+}
+
 std::string 
 diskcache::hash(const std::string& s){
-    auto hd = threeroe(s, hashseed_.first, hashseed_.second).hexdigest();
-    DIAGkey(_diskcache, "diskcache::hash(" + s + ") -> " + hd + "\n");
-    return hd.substr(0, hexdigits_) + "/" + hd.substr(hexdigits_);
+    auto ret = hashpath(hashkey(s));
+    DIAGkey(_diskcache, "diskcache::hash(" + s + ") -> " + ret + "\n");
+    return ret;
+}
+
+std::string
+diskcache::hashpath(const dcindex::key_t& key) const{
+    // Same digits as threeroe's hexdigest().
+    char hd[33];
+    ::snprintf(hd, sizeof(hd), "%016llx%016llx", (unsigned long long)key.first, (unsigned long long)key.second);
+    return std::string(hd, hexdigits_) + "/" + (hd + hexdigits_);
 }
 
 void /*static*/
@@ -674,6 +1377,28 @@ diskcache::deserialize_no_unlink(int rootfd, const std::string& path,
     atomic_scoped_nanotimer _t(&stats.dc_deserialize_sec);
     refcounted_scoped_nanotimer _rt(deserialize_nanotimer_ctrl);
     refcounted_scoped_nanotimer _rtx(serdes_nanotimer_ctrl);
+    // With Fs123DiskcacheIoUring, dcuring reads the whole file.
+    // Anything unusual (not a regular file, a file that changed
+    // between the statx and the read, a bad header checksum, e.g.,
+    // from a read that overlapped update_header's pwrite) is handed
+    // to the syscalls below, which retry, complain and throw as
+    // usual.
+    dcuring* ring = (io_uring_ && rootfd != -1) ? dcuring::thread_ring() : nullptr;
+    if(ring){
+        uchar_blob blob;
+        int eno = ring->read_file(rootfd, path, &blob);
+        if(eno > 0){
+            DIAGkey(_diskcache, "diskcache::deserialize(" << path << ") miss errno=" << eno);
+            *ret = reply123{}; // invalid!
+            return;
+        }
+        if(eno == 0 && deserialize_file(std::move(blob), ret, returlp)){
+            DIAGkey(_diskcache, "diskcache::deserialize(" << path << ") hit with dcuring\n");
+            stats.dc_uring_reads++;
+            return;
+        }
+        stats.dc_uring_fallbacks++;
+    }
     acfd fd = rootfd == -1 ? ::open(path.c_str(), O_RDONLY) :
                         ::openat(rootfd, path.c_str(), O_RDONLY);
     if(!fd){
@@ -710,22 +1435,31 @@ diskcache::deserialize_no_unlink(int rootfd, const std::string& path,
         throw se(EINVAL, "diskcache::deserialize: not a regular file");
     // ?? anything else ?? E.g., limits on st_size?? Ownership and permissions?
     size_t content_len;
-    struct iovec iov[3];
-    iov[0].iov_base = (char *)ret + reply123_pod_begin;
-    iov[0].iov_len = reply123_pod_length;
-    iov[1].iov_base = &content_len;
-    iov[1].iov_len = sizeof(content_len);
-    size_t nread = sew::readv(fd, iov, 2);
+    char hdr[header_length];
+    size_t nread = sew::read(fd, hdr, header_length);
     stats.dc_deserialize_bytes += nread;
-    if(nread != (iov[0].iov_len + iov[1].iov_len))
-        throw se(EINVAL, fmt("diskcache::deserialize: expected to read %zd+%zd bytes.  Only got %zd\n",
-                                     iov[0].iov_len, iov[1].iov_len, nread));
+    if(nread != header_length)
+        throw se(EINVAL, fmt("diskcache::deserialize: expected to read %zu header bytes.  Only got %zd\n",
+                             header_length, nread));
+    bool hdr_ok = unpack_header(hdr, ret, &content_len);
     if( ret->magic != ret->MAGIC ){
         complain(LOG_NOTICE, "Rejecting cache file with incorrect magic number (got %d, expected  %d): %s",
                  ret->magic, ret->MAGIC, path.c_str());
         *ret = reply123{}; // invalid
         return;
     }
+    // A bad checksum is most likely a read that overlapped
+    // update_header's pwrite.  Try again (with pread, so the file
+    // offset is still just past the header).  If it's still bad,
+    // it's corrupt (e.g., a crash in the middle of the pwrite).
+    for(int i=0; !hdr_ok && i<3; ++i){
+        stats.dc_header_retries++;
+        std::this_thread::yield();
+        nread = sew::pread(fd, hdr, header_length, 0);
+        hdr_ok = nread == header_length && unpack_header(hdr, ret, &content_len);
+    }
+    if(!hdr_ok)
+        throw se(EINVAL, "diskcache::deserialize: header checksum mismatch");
     // Prior to 0.34.0, there was no url and this test demanded an
     // exact match between the size of the file and the size deduced
     // from the header.  In 0.34.0 we added the url, the url's length
@@ -735,12 +1469,14 @@ diskcache::deserialize_no_unlink(int rootfd, const std::string& path,
     // this test fail, so it doesn't seem worth the trouble to do
     // extra I/O only to apply a stronger sanity-check that is
     // unlikely to ever fail.
-    size_t bytes_not_counting_url = reply123_pod_length + sizeof(content_len) + content_len + 2*sizeof(int32_t);
+    size_t bytes_not_counting_url = header_length + content_len + 2*sizeof(int32_t);
     if(comparable(sb.st_size) < comparable(bytes_not_counting_url))
         throw se(EINVAL, fmt("diskcache::deserialize: st_size=%jd, should be >= %zu\n",
 			     (intmax_t)sb.st_size, bytes_not_counting_url));
-    ret->content.resize(content_len);
-    nread = sew::read(fd, &ret->content[0], content_len);
+    // Read the content directly into the buffer that reply123 will
+    // share with its copies.  No std::string, no zero-fill, no copy.
+    uchar_blob cb(content_len);
+    nread = sew::read(fd, cb.data(), content_len);
     stats.dc_deserialize_bytes += nread;
     if(nread != content_len){
         // Sep 2017 - we're seeing these, and I don't know why... Try
@@ -751,9 +1487,11 @@ diskcache::deserialize_no_unlink(int rootfd, const std::string& path,
         throw se(EINVAL, fmt("diskcache::deserialize:  tried to read %zd content bytes.  Only got %zd.  fstat(fd): errno: %d, sb: %s\n",
                                               content_len, nread, errno, str(sb).c_str()));
     }
+    ret->content = shared_padded_uchar_span(std::move(cb));
     if (returlp) {
         size_t urlsz = sb.st_size - bytes_not_counting_url;
         int32_t ulen, cmagic;
+        struct iovec iov[3];
         returlp->resize(urlsz);
         iov[0].iov_base = &((*returlp)[0]);
         iov[0].iov_len = urlsz;
@@ -788,10 +1526,11 @@ diskcache::deserialize_no_unlink(int rootfd, const std::string& path,
     // ret->content_threeroe is not NUL-terminated, so we have to use the
     // four-argument string::compare.
     static const size_t thirtytwo = sizeof(ret->content_threeroe);
-    if(threeroe(ret->content).hexdigest().compare(0, thirtytwo, ret->content_threeroe, thirtytwo) != 0){
+    str_view rcsv = as_str_view(ret->content);
+    if(threeroe(rcsv).hexdigest().compare(0, thirtytwo, ret->content_threeroe, thirtytwo) != 0){
         throw se(EINVAL, fmt("diskcache::deserialize:  threeroe mismatch:  threeroe(data): %s, threeroe(stored_in_header): %.32s. content: %zu@%p, initial bytes: %s\n",
-                             threeroe(ret->content).hexdigest().c_str(), ret->content_threeroe,
-                             ret->content.size(), ret->content.data(), hexdump(ret->content.substr(0, 512), true).c_str()));
+                             threeroe(rcsv).hexdigest().c_str(), ret->content_threeroe,
+                             rcsv.size(), rcsv.data(), hexdump(rcsv.substr(0, 512), true).c_str()));
     }
 }
 
@@ -799,6 +1538,10 @@ reply123
 diskcache::deserialize(const std::string& path) try { 
     reply123 ret;
     deserialize_no_unlink(rootfd_, path, &ret);
+    dcindex::key_t key;
+    auto idx = std::atomic_load(&index_);
+    if(idx && ret.valid() && idx->key_of(path, &key))
+        idx->touch(key, ::time(nullptr), policy_->hit_bits());
     return ret;
  }catch(std::exception& e){
     // Unlink files that give us trouble deserializing?  In theory,
@@ -808,6 +1551,10 @@ diskcache::deserialize(const std::string& path) try {
     //   
     auto newpath = path + "." + str(std::chrono::system_clock::now());
     ::renameat(rootfd_, path.c_str(), rootfd_, newpath.c_str());
+    dcindex::key_t key;
+    auto idx = std::atomic_load(&index_);
+    if(idx && idx->key_of(path, &key))
+        idx->erase(key);
     // If this happens often, *and* we understand why, it might be better
     // to unlink instead:
     //::unlinkat(rootfd_, path.c_str(), 0);
@@ -817,8 +1564,56 @@ diskcache::deserialize(const std::string& path) try {
     return {};
  }
 
+bool /*static*/
+diskcache::deserialize_buffer(uchar_blob&& blob, size_t off, size_t len, reply123* ret){
+    // The same layout as the files written by serialize.  See
+    // deserialize_no_unlink for commentary.
+    const unsigned char* p = blob.data() + off;
+    size_t content_len;
+    const size_t hdrlen = header_length;
+    if(len < hdrlen + 2*sizeof(int32_t))
+        return false;
+    if(!unpack_header((const char*)p, ret, &content_len) ||
+       ret->magic != ret->MAGIC || content_len > len - hdrlen - 2*sizeof(int32_t)){
+        *ret = reply123{};
+        return false;
+    }
+    stats.dc_deserialize_bytes += len;
+    ret->content = shared_padded_uchar_span(std::move(blob), off + hdrlen, content_len);
+    static const size_t thirtytwo = sizeof(ret->content_threeroe);
+    if(threeroe(as_str_view(ret->content)).hexdigest().compare(0, thirtytwo, ret->content_threeroe, thirtytwo) != 0){
+        *ret = reply123{};
+        return false;
+    }
+    return true;
+}
+
+// lookup - the segments, if we have them, then the file.  A miss in
+// the segments might be something another process put there since
+// the catch_up_thread_ last looked.  We don't catch up here, in the
+// foreground.  It's just a miss.
+reply123
+diskcache::lookup(const dcindex::key_t& key, const std::string& path) /*protected*/ {
+    if(segments_){
+        uchar_blob blob;
+        size_t len;
+        if(segments_->get(key, &blob, &len)){
+            reply123 ret;
+            if(deserialize_buffer(std::move(blob), dcsegments::payload_offset, len, &ret)){
+                stats.dc_segment_deserializes++;
+                return ret;
+            }
+            // As in deserialize, don't let it trip us up again.
+            complain(LOG_WARNING, "diskcache::lookup:  unparseable record for %s in segments.  Erasing it", path.c_str());
+            stats.dc_segment_rejects++;
+            segments_->erase(key);
+        }
+    }
+    return deserialize(path);
+}
+
 void 
-diskcache::serialize(const reply123& r, const std::string& path, const std::string& url){
+diskcache::serialize(const reply123& r, const std::string& path, const std::string& url, bool demoted){
     atomic_scoped_nanotimer _t(&stats.dc_serialize_sec);
     refcounted_scoped_nanotimer _rt(serialize_nanotimer_ctrl);
     refcounted_scoped_nanotimer _rtx(serdes_nanotimer_ctrl);
@@ -828,20 +1623,83 @@ diskcache::serialize(const reply123& r, const std::string& path, const std::stri
         return;
     }
     DIAGkey(_diskcache, "diskcache::serialize(" << path << " now=" << ins(std::chrono::system_clock::now()) << " fresh=" << r.fresh() << " expires=" << ins(r.expires) << " etag64=" << r.etag64 << ")\n");
-    // A single diskcache object is used concurrently by many threads.
-    // Take care that they don't step on one anothers rngs.
-    static std::atomic<int> seed(0); // give a different seed to every thread.
-    static thread_local std::default_random_engine eng(seed++);
-    std::uniform_real_distribution<float> ureal(0., 1.);
-    if(  ureal(eng) > injection_probability_ ){
-        DIAGfkey(_diskcache, "diskcache::serialize:  rejected with injection_probability=%.2f\n", injection_probability_.load());
+    // The policy decides whether to admit new objects.  Objects that
+    // are already resident (i.e., 304 updates) or demoted from an
+    // upper tier (whose accesses our policy never saw) are subject
+    // only to the injection_probability.
+    auto idx = std::atomic_load(&index_);
+    auto key = hashkey(url);
+    bool resident = demoted || (idx && idx->contains(key));
+    if( !policy_->admit(key, resident, injection_probability_) ){
+        DIAGfkey(_diskcache, "diskcache::serialize:  rejected by policy=%s with injection_probability=%.2f\n", policy_->name(), injection_probability_.load());
         return;
     }
     if(!r.fresh())
         stats.dc_serialize_stale++;  // used to return, but that denies a lot of swr and sie opportunities.
 
+    struct iovec iov[5];
+    ssize_t nwrite = 0;
+    char hdr[header_length];
+    pack_header(r, hdr);
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = header_length;
+    nwrite += iov[0].iov_len;
+    iov[1].iov_base = r.content.data();
+    iov[1].iov_len = r.content.size();
+    nwrite += iov[1].iov_len;
+
+    // append the url and its length and the value of 'magic' to
+    // the end of the file.  This should be enough for an
+    // unrelated process, e.g., a cache scanner, to walk the
+    // cache looking for files that match a url, etc.
+    int32_t url_len = url.size();
+    iov[2].iov_base = const_cast<char*>(url.data());
+    iov[2].iov_len = url_len;
+    nwrite += iov[2].iov_len;
+    iov[3].iov_base = &url_len;
+    iov[3].iov_len = sizeof(url_len);
+    nwrite += iov[3].iov_len;
+    iov[4].iov_base = const_cast<int*>(&r.magic);
+    iov[4].iov_len = sizeof(r.magic);
+    nwrite += iov[4].iov_len;
+#if 1   // N.B.  r.content may be shared with the foreground
+    // thread.  This O(content.size()) check would catch anyone
+    // who (incorrectly) modified shared content in place.
+    str_view rcsv = as_str_view(r.content);
+    if(threeroe(rcsv).hexdigest().compare(0, 32, r.content_threeroe, 32) != 0){
+        throw se(EINVAL, fmt("diskcache::serialize: threeroe mismatch: r.content.data(): %p, r.content.size(): %zu threeroe(data): %s, threeroe(in header): %.32s",
+                             rcsv.data(), rcsv.size(),
+                             threeroe(rcsv).hexdigest().c_str(),
+                             r.content_threeroe
+                             ));
+    }
+#endif
+    if(segments_ && size_t(nwrite) <= small_object_bytes_ && segments_->put(key, iov, 5)){
+        // It's in the segments now.  Don't let an older, larger
+        // version in a file linger.
+        stats.dc_segment_serializes++;
+        stats.dc_serializes++;
+        stats.dc_serialize_bytes += nwrite;
+        if(::unlinkat(rootfd_, path.c_str(), 0) == 0 && idx)
+            idx->erase(key);
+        DIAGkey(_diskcache, "diskcache::serialize wrote " << path << " to segments\n");
+        return;
+    }
+
     std::string pathnew = path + ".new";
-    acfd fd = ::openat(rootfd_, pathnew.c_str(), O_WRONLY|O_CREAT|O_EXCL, 0600);
+    // With Fs123DiskcacheIoUring, dcuring does the openat, writev,
+    // close and renameat in one submission.  A failed openat is
+    // handled like the syscall's below.  A failure after that is
+    // thrown in the try, whose catch unlinks pathnew and path.
+    dcuring* ring = io_uring_ ? dcuring::thread_ring() : nullptr;
+    dcuring::op_t uring_op = dcuring::OPEN;
+    int uring_eno = 0;
+    if(ring){
+        uring_eno = ring->create_file(rootfd_, pathnew, path, iov, 5, &uring_op);
+        if(uring_eno && uring_op == dcuring::OPEN)
+            errno = uring_eno;
+    }
+    acfd fd = ring ? -1 : ::openat(rootfd_, pathnew.c_str(), O_WRONLY|O_CREAT|O_EXCL, 0600);
     // O_EXCL|O_CREAT guarantees that only one thread can have a valid
     // fd for the file known as pathnew.  Any thread attempting to
     // open an existing pathnew will get a 'false' fd.  This remains
@@ -849,17 +1707,16 @@ diskcache::serialize(const reply123& r, const std::string& path, const std::stri
     // must try *very* hard to unlink or rename a successfully open-ed
     // pathnew when we're done with it (see below).
     DIAGkey(_diskcache, "diskcache::serialize opened " << pathnew << " " << fd.get() << "\n");
-    if(!fd){
+    if(ring ? (uring_eno && uring_op == dcuring::OPEN) : !fd){
         switch(errno){
         case EEXIST:
-            // These aren't as rare as we might hope.  It's not uncommon to
-            // get back-to-back reads for the same chunk, and the second one
-            // will often run into the in-progress serialization of the first.
+            // These should be rare now that concurrent requests
+            // for the same urlstem are coalesced (see board()).  But
+            // a request that couldn't board an in-flight request
+            // (e.g., because it's no-cache) can still run into the
+            // in-progress serialization of the other one.
             stats.dc_serialize_eexist++;
-            // Not only that - the bandwidth was wasted!  It would take
-            // some work to "fix" it though.  We'd need a whole new control
-            // flow to "attach" one request to another already-in-progress
-            // one. Let's count before we start writing new code...
+            // Not only that - the bandwidth was wasted!
             stats.dc_serialize_eexist_wasted_bytes += r.content.size();
             // Despite our best efforts (see the catch below), it's
             // possible that pathnew exists and there's nobody around
@@ -894,56 +1751,34 @@ diskcache::serialize(const reply123& r, const std::string& path, const std::stri
         return;
     }
     try{
-        struct iovec iov[6];
-        ssize_t nwrite = 0;
-        iov[0].iov_base = (char*)&r + reply123_pod_begin;
-        iov[0].iov_len = reply123_pod_length;
-        nwrite += iov[0].iov_len;
-        size_t content_len = r.content.size();
-        iov[1].iov_base = &content_len;
-        iov[1].iov_len = sizeof(content_len);
-        nwrite += iov[1].iov_len;
-        iov[2].iov_base = const_cast<char*>(r.content.data());
-        iov[2].iov_len = content_len;
-        nwrite += iov[2].iov_len;
-
-        // append the url and its length and the value of 'magic' to
-        // the end of the file.  This should be enough for an
-        // unrelated process, e.g., a cache scanner, to walk the
-        // cache looking for files that match a url, etc.
-        int32_t url_len = url.size();
-        iov[3].iov_base = const_cast<char*>(url.data());
-        iov[3].iov_len = url_len;
-        nwrite += iov[3].iov_len;
-        iov[4].iov_base = &url_len;
-        iov[4].iov_len = sizeof(url_len);
-        nwrite += iov[4].iov_len;
-        iov[5].iov_base = const_cast<int*>(&r.magic);
-        iov[5].iov_len = sizeof(r.magic);
-        nwrite += iov[5].iov_len;
-#if 1   // N.B.  We believe r.content is now managed correctly, even
-        // if std::string is copy-on-write.  There is an O(1)
-        // check in do_serialize to confirm that.  So the
-        // O(content.size()) check here is probably unnecessary.
-        if(threeroe(r.content).hexdigest().compare(0, 32, r.content_threeroe, 32) != 0){
-            throw se(EINVAL, fmt("diskcache::serialize: threeroe mismatch: r.content.data(): %p, r.content.size(): %zu threeroe(data): %s, threeroe(in header): %.32s",
-                                 r.content.data(), r.content.size(),
-                                 threeroe(r.content).hexdigest().c_str(),
-                                 r.content_threeroe
-                                 ));
+        ssize_t wrote;
+        if(ring){
+            // dcuring reports a short write as ENOSPC.
+            if(uring_eno)
+                throw se(uring_eno, fmt("dcuring::create_file failed in step %d (0=open, 1=write, 2=close, 3=rename)", int(uring_op)));
+            wrote = nwrite;
+            stats.dc_uring_writes++;
+        }else{
+            wrote = sew::writev(fd, iov, 5);
+            if(wrote != nwrite)
+                throw se(ENOSPC, fmt("Short write: %zd of %zd.  ENOSPC is just a guess.", wrote, nwrite));
         }
-#endif
-        ssize_t wrote = sew::writev(fd, iov, 6);
-        if(wrote != nwrite)
-            throw se(ENOSPC, fmt("Short write: %zd of %zd.  ENOSPC is just a guess.", wrote, nwrite));
         stats.dc_serializes++;
         stats.dc_serialize_bytes += wrote;
         // see comments above about O_EXCL|O_CREAT.  We have exclusive
         // access to the file known as pathnew until it has been
         // rename-ed even if we close the file descriptor associated
         // with it.
-        fd.close();
-        sew::renameat(rootfd_, pathnew.c_str(), rootfd_, path.c_str());
+        if(!ring){
+            fd.close();
+            sew::renameat(rootfd_, pathnew.c_str(), rootfd_, path.c_str());
+        }
+        if(idx && !idx->insert(key, dcindex::accounting_bytes(wrote), epoch_seconds(r.expires), ::time(nullptr)))
+            stats.dc_index_full++;
+        // lookup looks in the segments first, so a smaller, older
+        // version there must go.
+        if(segments_)
+            segments_->erase(key);
 	DIAGkey(_diskcache, "diskcache::serialize wrote " << path << "\n");
         if(_transactions){
             long long elapsed_nanos = _t.finish();
@@ -969,6 +1804,8 @@ diskcache::serialize(const reply123& r, const std::string& path, const std::stri
         ret = ::unlinkat(rootfd_, path.c_str(), 0);
         if(ret && errno != ENOENT)
             complain(LOG_CRIT, "diskcache::serialize:  Unable to unlink " + path + " after serialization failure.  Reason: %m");
+        if(idx)
+            idx->erase(key);
         std::throw_with_nested(std::runtime_error("diskcache::serialize(path=" + path + "): failed"));
     }
 }
@@ -2,6 +2,11 @@
 #include "backend123.hpp"
 #include "fs123/acfd.hpp"
 #include "volatiles.hpp"
+#include "dcindex.hpp"
+#include "cache_policy.hpp"
+#include "dcsegments.hpp"
+#include "dccoord.hpp"
+#include "dcsample.hpp"
 #include <core123/threadpool.hpp>
 #include <core123/expiring.hpp>
 #include <core123/autoclosers.hpp>
@@ -10,6 +15,10 @@
 #include <string>
 #include <thread>
 #include <condition_variable>
+#include <mutex>
+#include <unordered_map>
+#include <optional>
+#include <exception>
 #include <memory>
 #include <random>
 #include <chrono>
@@ -20,16 +29,42 @@
 struct scan_result{
     size_t nbytes;
     std::vector<std::string> names;
+    // If do_scan is given an index, the names that are well-formed
+    // cache paths are also recorded in 'found'.
+    std::vector<dcindex::found_file> found;
 
-    scan_result() : nbytes(0), names(){}
+    scan_result() : nbytes(0), names(), found(){}
 };
 
 struct diskcache : public backend123{
-    // constructor takes a root and some sizing parameters.
+    // constructor takes a root and some sizing parameters.  A
+    // lower_tier diskcache is sized by vols.dc_slow_max{mbytes,files}
+    // instead of vols.dc_max{mbytes,files}.  See set_lower_tier.
     diskcache(backend123*, const std::string& root,
-              uint64_t hash_seed_first, volatiles_t& vols);
+              uint64_t hash_seed_first, volatiles_t& vols, bool lower_tier = false);
     void set_upstream(backend123* upstream) { upstream_ = upstream; }
+    // set_lower_tier - make this diskcache the 'fast' tier of a
+    // tiered cache, e.g., on an NVMe, in front of a larger, slower
+    // 'lower' tier, e.g., on a spinning disk.  The lower tier must
+    // have been constructed with lower_tier=true, and it should also
+    // be our upstream, so that:
+    //   - new objects come from upstream through the lower tier
+    //     without being stored there.  They land here.
+    //   - objects evicted from here are 'demoted', i.e., copied to
+    //     the lower tier before they're unlinked.
+    //   - our misses that hit in the lower tier are 'promoted', i.e.,
+    //     serialized here like anything else we get from upstream.
+    // The lower tier keeps its copy of promoted objects until it
+    // evicts them.  Small objects in the dcsegments are evicted a
+    // whole segment at a time, and aren't demoted.
+    void set_lower_tier(diskcache* lower);
     bool refresh(const req123& req, reply123*) override; 
+    // fresh - true if there's a fresh copy of req.urlstem in the
+    // cache.  It only reads the file's header, so it's much cheaper
+    // than refresh, but it's advisory:  it doesn't look in the
+    // dcsegments (which only hold small objects), and the answer may
+    // be out of date by the time the caller acts on it.
+    bool fresh(const req123& req) const;
     std::ostream& report_stats(std::ostream& os) override;
     std::string get_uuid() override;
 
@@ -39,13 +74,19 @@ struct diskcache : public backend123{
 
     // the hash function return a path relative to root.
     std::string hash(const std::string&);
+    // hashkey - the 128 bits behind hash().  It's also the key
+    // in the dcindex and the cache_policy.
+    dcindex::key_t hashkey(const std::string&) const;
+    std::string hashpath(const dcindex::key_t&) const;
     // serialize and deserialize work with backend::reply's
     // which have an errno, a struct stat, and a ttl.
     // serialize may do nothing if policy doesn't permit
     // or desire serialization of the argument.
     // serialization requires converting the 'ttl' into
     // a 'good_till', so that it ages out naturally.
-    void serialize(const reply123&, const std::string&, const std::string&);
+    // A demoted object (see set_lower_tier) is admitted subject only
+    // to the injection_probability, like a resident one.
+    void serialize(const reply123&, const std::string&, const std::string&, bool demoted = false);
 
     // NOTE: deserialize removes anything from the cache that it cannot
     // parse!
@@ -60,13 +101,75 @@ struct diskcache : public backend123{
                                       reply123* reply,
                                       std::string *returlp = nullptr);
 
+    // deserialize_buffer - like deserialize_no_unlink, but the
+    // serialized bytes are the len bytes at offset off in blob (e.g.,
+    // a record read from the dcsegments).  The reply's content
+    // shares the blob's memory.  Returns false (rather than throwing)
+    // if the bytes can't be parsed.
+    static bool deserialize_buffer(core123::uchar_blob&& blob, size_t off, size_t len, reply123* reply);
 
 protected:
+    // io_uring_ - serialize and deserialize_no_unlink use dcuring
+    // rather than the syscalls.  Off by default
+    // (Fs123DiskcacheIoUring).  It's static because
+    // deserialize_no_unlink is.
+    static std::atomic<bool> io_uring_;
     void evict(size_t Nevict, size_t dir_to_evict, scan_result& sr);
+    // maybe_demote - if there's a lower tier, copy relpath to it.
+    // Called just before relpath is evicted.  Never throws.
+    void maybe_demote(const std::string& relpath);
+    // demote - called on the lower tier with an fd open on a file the
+    // upper tier is about to evict.
+    void demote(int fd);
+    size_t evict_indexed(size_t Nevict, size_t dir_to_evict, dcindex& idx, const scan_result* sr);
     void check_root();
     std::string reldirname(unsigned i) const;
     std::chrono::system_clock::duration evict_once();
-    scan_result do_scan(unsigned dir_to_evict) const;
+    scan_result do_scan(unsigned dir_to_evict, const dcindex* idx = nullptr) const;
+    // The index is optional, and off by default (Fs123DiskcacheIndex),
+    // because it adds a file to the cache's on-disk layout.  It's
+    // replaced by evict_once if another process makes it obsolete, so
+    // everybody else should std::atomic_load it.
+    void open_index();
+    std::shared_ptr<dcindex> index_;
+    int64_t index_audit_period_;  // seconds
+    std::unique_ptr<cache_policy> policy_;
+    // Serialized objects no bigger than small_object_bytes_ are
+    // stored in the dcsegments rather than in individual files.
+    // lookup checks the segments before the file.  The segments are
+    // off by default (Fs123DiskcacheSmallObjectBytes=0), because they
+    // change the cache's on-disk layout, and they cost memory:  the
+    // index takes 43-85 bytes per object, up to
+    // Fs123DiskcacheSegmentIndexMBytes (default 64, i.e., about 1.5
+    // million objects).  Objects that don't fit in the index go to
+    // files.  The catch_up_thread_ reads the segments when we start
+    // (about 4 seconds for 2 million objects and 4GB with a cold page
+    // cache, see ut_dcsegments), and then reads other processes'
+    // appends once a second.  Until it's done, lookup misses objects
+    // in the segments.
+    reply123 lookup(const dcindex::key_t& key, const std::string& path);
+    std::unique_ptr<dcsegments> segments_;
+    size_t small_object_bytes_ = 0;
+    double segment_fraction_;     // of dc_maxmbytes
+    std::chrono::seconds catch_up_segments();
+    bool segments_caught_up_ = false; // only used by the catch_up_thread_
+    // With Fs123DiskcacheSharedEviction, only one of the processes
+    // sharing the cache scans and evicts.  It's off by default,
+    // because it adds a file (.evictcoord) to the cache's on-disk
+    // layout.  See dccoord.hpp.
+    std::unique_ptr<dccoord> coord_;
+    bool follow_leader(std::chrono::duration<double>* sleepfor);
+    std::chrono::duration<double> set_injection_probability(float inj_prob);
+    void publish_usage(double usage_fraction, float inj_prob, std::chrono::duration<double> sleepfor);
+    // With Fs123DiskcacheSampleDirs, evict_once estimates the usage
+    // from a dcsample, and only scans (and evicts) when the sample
+    // can't rule out being near the thresholds.
+    dcsample sample_usage(size_t ndirs, size_t files_per_dir);
+    bool sampled_below_thresholds(double* usage_fraction);
+    size_t sample_dirs_ = 0;
+    size_t sample_files_per_dir_;
+    std::chrono::duration<double> sample_period_;
+    std::chrono::steady_clock::time_point next_sample_{}; // only used by the evict_thread_
 
     backend123* upstream_;
     acfd rootfd_;
@@ -81,13 +184,47 @@ protected:
     unsigned hexdigits_;
     std::atomic<float> injection_probability_;
     std::unique_ptr<core123::periodic> evict_thread_;
+    std::unique_ptr<core123::periodic> catch_up_thread_;
     // construct the hashseed from the baseurl in the constructor.
     // This allows different baseurls to coexist in the same diskcache
     // even if they have the same relative paths.
     const std::pair<uint64_t,uint64_t> hashseed_;
     // machinery for backgrounding refresh and serialization:
+    // Single-flight:  at most one upstream request per urlstem is in
+    // flight at any time.  Later callers 'board' the flight and wait
+    // for it to 'land' rather than sending their own request.
+    struct flight{
+        std::mutex mtx;
+        std::condition_variable cv;
+        bool landed = false;
+        reply123 reply;
+        std::exception_ptr eptr;
+        // The leader's request.  A follower can't board a flight
+        // that might bring back something staler than it asked for.
+        bool no_cache;
+        std::optional<int> max_stale;
+        // A background refresh's flight hasn't started until it gets
+        // a thread.  Followers don't board it until then.  Protected
+        // by flights_mtx_.
+        bool started = true;
+    };
+    using flight_sp = std::shared_ptr<flight>;
+    std::mutex flights_mtx_;
+    std::unordered_map<std::string, flight_sp> flights_;
+    // board - returns {f, true} if the caller is the leader of a new
+    // flight f, which it must land.  Returns {f, false} if the caller
+    // should wait for f to land, and {nullptr, false} if there's a
+    // flight in progress that the caller can't board.
+    std::pair<flight_sp, bool> board(const req123& req);
+    // land = unlist + deliver.  A leader with a reply delivers it to
+    // the followers right away, but doesn't unlist the flight until
+    // the reply is on disk.  See upstream_refresh.
+    void land(const std::string& urlstem, const flight_sp& f, const reply123* r, std::exception_ptr eptr = nullptr);
+    void deliver(const flight_sp& f, const reply123* r, std::exception_ptr eptr = nullptr);
+    void unlist(const std::string& urlstem, const flight_sp& f);
+    void await(const flight_sp& f, reply123* r);
     void maybe_bg_upstream_refresh(const req123& req, const std::string& path, reply123* r);
-    void upstream_refresh(const req123& url, const std::string& path, reply123* r, bool already_detached, bool usable_if_error);
+    void upstream_refresh(const req123& url, const std::string& path, reply123* r, bool already_detached, bool usable_if_error, const flight_sp& f);
     // The detached methods are intended to be called in a lambda submit-ed to
     // the threadpool, e.g.,
     //    tp->submit([=]() mutable { detached_upstream_refresh(r,p);})
@@ -95,10 +232,21 @@ protected:
     // nobody waiting for any exceptions thrown by detached_whatever.
     // To emphasize this, we declare them noexcept, even though a
     // thrown exception wouldn't actually do any harm.
-    void detached_upstream_refresh(req123& req, const std::string& path, reply123* r) noexcept ;
-    void do_serialize(const reply123* r, const std::string& path, const std::string& urlstem, bool already_detached);
+    void detached_upstream_refresh(req123& req, const std::string& path, reply123* r, const flight_sp& f) noexcept ;
+    void do_serialize(const reply123* r, const std::string& path, const std::string& urlstem, bool already_detached, const flight_sp& f);
+    bool update_header(const reply123& r, const std::string& path, const std::string& url);
     std::unique_ptr<core123::threadpool<void>> tp;
     volatiles_t& vols_;
+    // Tiers:  we're either an ordinary (or 'fast') diskcache, with
+    // an optional lower_, or we're a lower tier.  The limits come
+    // from vols_, but which ones depends on which we are.
+    const bool lower_tier_;
+    std::atomic<size_t>& maxmbytes_;
+    std::atomic<size_t>& maxfiles_;
+    diskcache* lower_ = nullptr;
+    std::atomic<uint64_t> tier_hits_{0};
+    std::atomic<uint64_t> tier_misses_{0};
+    std::ostream& report_tier_stats(std::ostream& os, const char* tiername);
     std::string uuid;
     bool foreground_serialize;
 };
@@ -109,6 +257,7 @@ STATISTIC(dc_stale_while_revalidate)\
 STATISTIC(dc_maybe_rf_too_soon)\
 STATISTIC(dc_maybe_rf_started)\
 STATISTIC(dc_maybe_rf_retired)\
+STATISTIC(dc_maybe_rf_superseded)\
 STATISTIC(dc_must_refresh)\
 STATISTIC(dc_detached_refresh_failures)\
 STATISTIC(dc_rf_304)\
@@ -116,7 +265,6 @@ STATISTIC(dc_rf_304_bytes)\
 STATISTIC(dc_rf_200)\
 STATISTIC(dc_rf_stale_if_error)\
 STATISTIC(dc_rf_disconnected_skipped)\
-STATISTIC(dc_wasted_copy_reply_bytes)\
 STATISTIC(dc_serializes)\
 STATISTIC(dc_serialize_bytes)\
 STATISTIC_NANOTIMER(dc_serialize_sec)\
@@ -136,8 +284,33 @@ STATISTIC_NANOTIMER(dc_update_sec)\
 STATISTIC_NANOTIMER(dc_update_inuse_sec)\
 STATISTIC_NANOTIMER(dc_serdes_inuse_sec)\
 STATISTIC(dc_failed_updates)\
+STATISTIC(dc_header_retries)\
 STATISTIC(dc_eviction_dirscans)\
 STATISTIC(dc_eviction_evicted)\
-STATISTIC(dc_recently_refreshed_appended)\
-STATISTIC(dc_recently_refreshed_matched)\
-STATISTIC(dc_recently_refreshed_erased)
+STATISTIC(dc_index_full)\
+STATISTIC(dc_index_audits)\
+STATISTIC(dc_index_audit_corrections)\
+STATISTIC(dc_index_reopens)\
+STATISTIC(dc_index_strays_evicted)\
+STATISTIC(dc_coord_elections)\
+STATISTIC(dc_coord_follows)\
+STATISTIC(dc_coord_stale)\
+STATISTIC(dc_sample_rounds)\
+STATISTIC(dc_sample_stats)\
+STATISTIC(dc_sample_inconclusive)\
+STATISTIC(dc_tier_passthroughs)\
+STATISTIC(dc_demotions)\
+STATISTIC(dc_demotion_rejects)\
+STATISTIC(dc_demotion_failures)\
+STATISTIC(dc_segment_serializes)\
+STATISTIC(dc_segment_deserializes)\
+STATISTIC(dc_segment_catch_ups)\
+STATISTIC(dc_segment_rejects)\
+STATISTIC(dc_singleflight_leaders)\
+STATISTIC(dc_singleflight_followers)\
+STATISTIC(dc_singleflight_unboardable)\
+STATISTIC(dc_singleflight_takeovers)\
+STATISTIC(dc_uring_reads)\
+STATISTIC(dc_uring_writes)\
+STATISTIC(dc_uring_fallbacks)\
+STATISTIC_NANOTIMER(dc_singleflight_wait_sec)
@@ -557,7 +557,7 @@ distrib_cache_backend::handle_present(const string& peerurl){
         // FIXME?  - time the be->refresh().  If it's slow (whatever
         // that means) return before calling insert_peer.
         be->refresh(req, &rep);
-        DIAG(_distrib_cache, "handle_present: new url: " + peerurl + " uuid: " + rep.content);
+        DIAG(_distrib_cache, "handle_present: new url: " + peerurl + " uuid: " + std::string(as_str_view(rep.content)));
     }catch(exception& e){
         DIAGf(_distrib_cache, "handle_present: Failed to connect with new peer: %s", peerurl.c_str());
         // Should we discourage others?  It's unlikely to help much because any
@@ -574,7 +574,7 @@ distrib_cache_backend::handle_present(const string& peerurl){
     // secretbox, then we should have end-to-end confidentiality and
     // integrity, so a MitM isn't a huge problem.  But if we're not
     // using secretbox, this is an easy way to create an MitM!
-    peer_map.insert_peer(make_unique<peer>(rep.content, peerurl, move(be)));
+    peer_map.insert_peer(make_unique<peer>(std::string(as_str_view(rep.content)), peerurl, move(be)));
 }
 
 void
@@ -830,7 +830,7 @@ peer_handler_t::p(req::up req, uint64_t etag64, istream&) try {
         throw http_exception(500, "reply has unknown encoding.  This should have been caught earlier");
     }
     req->add_header(HHTRSUM, std::string(&reply123.content_threeroe[0], sizeof(reply123.content_threeroe)));
-    return p_reply(move(req), reply123.content, reply123.etag64, cc);
+    return p_reply(move(req), std::string(as_str_view(reply123.content)), reply123.etag64, cc);
  }catch(std::exception& e){
     try{
         std::throw_with_nested(http_exception(500, "distrib_cache_backend::peer_handler::p: url:" + string(req->uri)));
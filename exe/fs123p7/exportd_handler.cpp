@@ -80,7 +80,26 @@ exportd_handler::a(fs123p7::req::up req) try {
  }
 
 void
-exportd_handler::d(fs123p7::req::up req, uint64_t inm64, std::string start) try {
+exportd_handler::d(fs123p7::req::up req, uint64_t inm64, std::string start){
+    dir_common(std::move(req), inm64, std::move(start), false);
+}
+
+void
+exportd_handler::r(fs123p7::req::up req, uint64_t inm64, std::string start){
+    dir_common(std::move(req), inm64, std::move(start), true);
+}
+
+// dir_common - the guts of d() and r().  If plus is true, each entry
+// also gets the attributes, validator and cache-control that a() would
+// return for it.
+//
+// The /r content changes whenever an entry's attributes change, e.g.,
+// when a file is rewritten, even if the directory itself doesn't.  So
+// the /r etag is the directory's etag combined with a hash of what
+// each entry contributed (see add_dirent_with_attrs), and we can't
+// tell whether it matches inm64 until we've read the entries.
+void
+exportd_handler::dir_common(fs123p7::req::up req, uint64_t inm64, std::string start, bool plus) try {
     auto fname = opts.export_root + std::string(req->path_info);
     // use open+fdopendir so we can use O_NOFOLLOW for safety
     acfd xfd = open(fname.c_str(), O_DIRECTORY | O_NOFOLLOW | O_RDONLY);
@@ -93,7 +112,7 @@ exportd_handler::d(fs123p7::req::up req, uint64_t inm64, std::string start) try
     auto esc  = estale_cookie(sew::dirfd(dir), sb, fname);
     auto etag64 = compute_etag(sb, esc);
     auto cc = cache_control(0, req->path_info, &sb);
-    if( etag64 == inm64 )
+    if( !plus && etag64 == inm64 )
         return not_modified_reply(std::move(req), cc);
 
     struct ::dirent* de;
@@ -126,6 +145,7 @@ exportd_handler::d(fs123p7::req::up req, uint64_t inm64, std::string start) try
     // to return an error (E2BIG) rather than getting random garbage by
     // seekdir-ing to an offset we don't trust.
     uint64_t last_off = 0;
+    threeroe entries_hash(etag64);
     if(!start.empty()){
         long istart;
         try{
@@ -137,17 +157,10 @@ exportd_handler::d(fs123p7::req::up req, uint64_t inm64, std::string start) try
 	sew::seekdir(dir, istart);
     }
     while( (de = sew::readdir(dir)) ){
-        uint64_t entry_esc;
-        try{
-            entry_esc = opts.fake_ino_in_dirent ? 0 : estale_cookie(fname + "/" + de->d_name, de->d_type);
-        }catch(std::exception& e){
-            // This might happen if the file was removed or replaced
-            // between the readdir and whatever syscall we use to
-            // get the esc.
-            complain(e, "export_handler::d(): error obtaining esc for: "+fname + "/" + de->d_name  + ".  Setting entry esc to 0");
-            entry_esc = 0;
-        }
-        if(!req->add_dirent(*de, entry_esc))
+        bool added = plus ?
+            add_dirent_with_attrs(*req, sew::dirfd(dir), fname, *de, &entries_hash) :
+            req->add_dirent(*de, dirent_esc(fname, *de));
+        if(!added)
             break;
 #ifndef __APPLE__
         last_off = de->d_off;
@@ -156,6 +169,11 @@ exportd_handler::d(fs123p7::req::up req, uint64_t inm64, std::string start) try
 #endif
     }
     bool at_eof = !de;
+    if(plus){
+        etag64 = entries_hash.hash64();
+        if( etag64 == inm64 )
+            return not_modified_reply(std::move(req), cc);
+    }
     d_reply(std::move(req), at_eof ? std::string() : std::to_string(last_off), etag64, esc, cc);
 } catch (std::exception& e){
     ex_reply(std::move(req), e);
@@ -291,6 +309,61 @@ exportd_handler::compute_etag(const struct stat& sb, uint64_t estale_cookie){
         hash64();
 }
 
+uint64_t
+exportd_handler::dirent_esc(const std::string& dirname, const ::dirent& de){
+    if(opts.fake_ino_in_dirent)
+        return 0;
+    try{
+        return estale_cookie(dirname + "/" + de.d_name, de.d_type);
+    }catch(std::exception& e){
+        // This might happen if the file was removed or replaced
+        // between the readdir and whatever syscall we use to
+        // get the esc.
+        complain(e, "export_handler::d(): error obtaining esc for: "+dirname + "/" + de.d_name  + ".  Setting entry esc to 0");
+        return 0;
+    }
+}
+
+// add_dirent_with_attrs - add de to an /r reply, along with the same
+// attributes, validator and cache-control that a() would reply with.
+// If we can't (or shouldn't) provide attributes, e.g., for . and ..,
+// for things that aren't regular files, directories or symlinks, or
+// if the entry vanished since the readdir, the entry is added without
+// attributes and the client will ask for them with /a.  Returns false
+// if there's no room in the reply.
+//
+// Entries with attributes are also mixed into *entries_hash:  their
+// etag (i.e., mtime, size and estale-cookie), the attributes that an
+// ls -l would show if they changed without the mtime changing, and
+// the cache-control.  Not atime, which changes whenever the file is
+// read, and not ctime, for the same reason compute_etag avoids it.
+bool
+exportd_handler::add_dirent_with_attrs(fs123p7::req& req, int dirfd, const std::string& dirname, const ::dirent& de, threeroe* entries_hash){
+    str_view name = de.d_name;
+    struct stat sb;
+    if(name == "." || name == ".." || opts.fake_ino_in_dirent ||
+       ::fstatat(dirfd, de.d_name, &sb, AT_SYMLINK_NOFOLLOW) != 0 ||
+       !(S_ISREG(sb.st_mode) || S_ISDIR(sb.st_mode) || S_ISLNK(sb.st_mode)))
+        return req.add_dirent(de, dirent_esc(dirname, de));
+    uint64_t esc = 0;
+    if(!S_ISLNK(sb.st_mode)){
+        try{
+            esc = estale_cookie(sb, dirname + "/" + de.d_name);
+        }catch(std::exception& e){
+            complain(e, "export_handler::r(): error obtaining esc for: "+dirname + "/" + de.d_name  + ".  Sending entry without attributes");
+            return req.add_dirent(de, 0);
+        }
+    }
+    auto path = std::string(req.path_info) + "/" + de.d_name;
+    auto cc = cache_control(0, path, &sb);
+    if(!req.add_dirent_plus(name, de.d_type, esc, &sb, monotonic_validator(sb), cc))
+        return false;
+    uint64_t ids[] = {compute_etag(sb, esc), uint64_t(sb.st_ino), uint64_t(sb.st_mode),
+                      uint64_t(sb.st_uid), uint64_t(sb.st_gid), uint64_t(sb.st_nlink)};
+    entries_hash->update(name).update(ids, sizeof(ids)).update(cc);
+    return true;
+}
+
 std::string
 exportd_handler::cache_control(int eno, str_view path, const struct stat* sb){
     // If eno is non-zero, the reply will contain the specified
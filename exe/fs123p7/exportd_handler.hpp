@@ -6,6 +6,7 @@
 #include <core123/strutils.hpp>
 #include <core123/str_view.hpp>
 #include <core123/log_channel.hpp>
+#include <core123/threeroe.hpp>
 #include <memory>
 #include <optional>
 #include <sys/stat.h>
@@ -16,6 +17,7 @@ struct exportd_handler: public fs123p7::handler_base{
     bool strictly_synchronous() override { return true; }
     void a(fs123p7::req::up) override;
     void d(fs123p7::req::up, uint64_t inm64, std::string start) override;
+    void r(fs123p7::req::up, uint64_t inm64, std::string start) override;
     void f(fs123p7::req::up, uint64_t inm64, size_t len, uint64_t offset, void* buf) override;
     void l(fs123p7::req::up) override;
     void s(fs123p7::req::up) override;
@@ -34,6 +36,9 @@ struct exportd_handler: public fs123p7::handler_base{
 protected:
     void err_reply(fs123p7::req::up, int eno);
     void ex_reply(fs123p7::req::up, const std::exception& e);
+    void dir_common(fs123p7::req::up, uint64_t inm64, std::string start, bool plus);
+    uint64_t dirent_esc(const std::string& dirname, const ::dirent& de);
+    bool add_dirent_with_attrs(fs123p7::req& req, int dirfd, const std::string& dirname, const ::dirent& de, core123::threeroe* entries_hash);
     std::string cache_control(int eno, core123::str_view path, const struct stat* sb);
     uint64_t estale_cookie(int fd, const struct stat& sb, const std::string& fullpath);
     uint64_t estale_cookie(const std::string& fullpath, int d_type);
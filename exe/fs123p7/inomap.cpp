@@ -2,12 +2,15 @@
 #include <core123/complaints.hpp>
 #include <core123/diag.hpp>
 #include <core123/throwutils.hpp>
+#include <core123/intutils.hpp>
 #include <cstring>
 #include <unordered_map>
-#include <set>
 #include <mutex>
 #include <iostream>
 #include <atomic>
+#include <array>
+#include <memory>
+#include <string_view>
 
 using namespace core123;
 
@@ -16,130 +19,374 @@ auto _validator_ = diag_name("validator");
 
 namespace{
 
+// The inomap is split into shards, each with its own mutex, so that
+// threads working on different inos rarely contend.  The ino (which
+// is already a hash, see genino) selects the shard.
+//
+// Each shard keeps its inos in an open-addressed table of 32-byte
+// inorecords, and their names in a name_arena, where each distinct
+// name is stored once.  We used to keep an unordered_map of
+// inorecords with a 12-byte inline name (or a malloc'd copy of a
+// longer one), which cost about 112 bytes per ino with the names in
+// ut_inomap.  Now it's 80-90.
+//
+// Each shard also caches the full paths of a bounded number of inos
+// that have been the parent of an ino_to_fullname, i.e., directories.
+// Since the name and parent of an ino never change (the ino is a hash
+// of them), a cached path is valid for as long as the ino is in the
+// map.  With a hit, the work of constructing a path is proportional
+// to the length of the last component, rather than the depth of the
+// tree.  The cache is bounded, rather than kept in the inorecord,
+// because there may be millions of inos, and we don't want to pay for
+// a pointer in every one of them.
+constexpr size_t NSHARDS = 64;
+constexpr size_t PATHS_PER_SHARD = 256;
+
+// mix - inos are hashes, but ino 1 and the g_mount_dotdot_ino
+// aren't, so scramble them a bit anyway.  The top bits pick the
+// shard and the middle bits pick the slot within the shard.
+uint64_t mix(fuse_ino_t ino){
+    return ino * 0x9e3779b97f4a7c15ull;
+}
+
+// name_arena - the names of one shard's inos.  A name is stored once,
+// no matter how many inos have it, in a record with a 4-byte header
+// (8 bits of length and 24 bits of refcount) followed by the
+// characters (no NUL), padded to a multiple of 4 bytes.  Records are
+// carved out of 64KiB slabs, and freed records go on a free list for
+// their size, so there's no per-name malloc overhead.  A record is
+// identified by a 32-bit handle:  its slab number and its offset
+// within the slab in 4-byte units.  Handle 0 is never used.  The
+// interner's index is an open-addressed table of handles.
+//
+// A refcount that reaches 2^24-1 sticks there, and the name is never
+// freed.  When the last name is released, the slabs are freed.
+class name_arena{
+    static constexpr unsigned UNIT_SHIFT = 14;
+    static constexpr size_t SLAB_BYTES = size_t(4)<<UNIT_SHIFT;
+    static constexpr uint32_t MAXREF = (1<<24)-1;
+    static constexpr size_t MAXUNITS = (4 + 255 + 3)/4;
+    std::vector<std::unique_ptr<char[]>> slabs;
+    size_t slab_used = SLAB_BYTES; // bytes used in slabs.back()
+    std::array<uint32_t, MAXUNITS+1> freelists = {};
+    std::vector<uint32_t> index;
+    size_t nnames = 0;
+
+    static size_t units(size_t len){
+        return (4 + len + 3)/4;
+    }
+    char* rec(uint32_t h) const{
+        return slabs[h>>UNIT_SHIFT].get() + 4*(h & ((1<<UNIT_SHIFT)-1));
+    }
+    uint32_t header(uint32_t h) const{
+        uint32_t ret;
+        ::memcpy(&ret, rec(h), 4);
+        return ret;
+    }
+    void set_header(uint32_t h, uint32_t hdr){
+        ::memcpy(rec(h), &hdr, 4);
+    }
+    size_t home(std::string_view sv) const{
+        return std::hash<std::string_view>()(sv) & (index.size()-1);
+    }
+
+    uint32_t alloc(size_t n){
+        uint32_t h = freelists[n];
+        if(h){
+            ::memcpy(&freelists[n], rec(h), 4);
+            return h;
+        }
+        if(slab_used + 4*n > SLAB_BYTES){
+            if(slabs.size() >= (size_t(1)<<(32-UNIT_SHIFT)))
+                throw se(ENOMEM, "inomap:  name_arena is full");
+            // Put what's left of the old slab on a free list.
+            size_t left = (SLAB_BYTES - slab_used)/4;
+            if(left)
+                release_units(handle(slabs.size()-1, slab_used), left);
+            slabs.emplace_back(new char[SLAB_BYTES]);
+            slab_used = slabs.size()==1 ? 4 : 0; // not handle 0
+        }
+        h = handle(slabs.size()-1, slab_used);
+        slab_used += 4*n;
+        return h;
+    }
+    static uint32_t handle(size_t slab, size_t offset){
+        return (slab<<UNIT_SHIFT) | (offset/4);
+    }
+    void release_units(uint32_t h, size_t n){
+        ::memcpy(rec(h), &freelists[n], 4);
+        freelists[n] = h;
+    }
+
+    void grow_index(){
+        std::vector<uint32_t> old(std::max(size_t(64), 2*index.size()), 0);
+        old.swap(index);
+        for(auto h : old){
+            if(!h)
+                continue;
+            auto i = home(name(h));
+            while(index[i])
+                i = (i+1) & (index.size()-1);
+            index[i] = h;
+        }
+    }
+
+public:
+    std::string_view name(uint32_t h) const{
+        return {rec(h)+4, header(h) & 0xff};
+    }
+
+    uint32_t intern(std::string_view sv){
+        if(sv.size() > 255)
+            throw se(ENAMETOOLONG, fmt("inomap:  name is %zu bytes long", sv.size()));
+        if(4*(nnames+1) > 3*index.size())
+            grow_index();
+        auto i = home(sv);
+        for( ; index[i]; i = (i+1) & (index.size()-1)){
+            auto h = index[i];
+            if(name(h) == sv){
+                auto hdr = header(h);
+                if((hdr>>8) < MAXREF)
+                    set_header(h, hdr + (1<<8));
+                return h;
+            }
+        }
+        auto h = alloc(units(sv.size()));
+        set_header(h, (1<<8) | sv.size());
+        ::memcpy(rec(h)+4, sv.data(), sv.size());
+        index[i] = h;
+        nnames++;
+        return h;
+    }
+
+    void release(uint32_t h){
+        auto hdr = header(h);
+        if((hdr>>8) == MAXREF)
+            return;
+        if((hdr>>8) > 1){
+            set_header(h, hdr - (1<<8));
+            return;
+        }
+        // Remove h from the index, shifting any later members of its
+        // probe sequence back, so there are no tombstones.
+        auto mask = index.size()-1;
+        auto i = home(name(h));
+        while(index[i] != h)
+            i = (i+1) & mask;
+        for(auto j = (i+1) & mask; index[j]; j = (j+1) & mask){
+            auto k = home(name(index[j]));
+            // Move index[j] to i unless its home is cyclically in (i, j].
+            if( (i<j) ? (k<=i || k>j) : (k<=i && k>j) ){
+                index[i] = index[j];
+                i = j;
+            }
+        }
+        index[i] = 0;
+        release_units(h, units(hdr & 0xff));
+        if(--nnames == 0){
+            slabs.clear();
+            slab_used = SLAB_BYTES;
+            freelists = {};
+            index.clear();
+            index.shrink_to_fit();
+        }
+    }
+
+    size_t size() const{
+        return nnames;
+    }
+};
+
 // inorecord - we have one of these for every ino with a non-zero
-// reference count in inomap.  And we're still burning ~75 bytes per
-// ino.  See Notes.2015, near March 26, 2015 for some insights.  It
-// doesn't seem worth the trouble to try to do better.
+// reference count in inomap.  The name is a handle in the shard's
+// name_arena.  ino==0 marks an empty slot in the table.
 struct inorecord{
-    static const size_t BUFSZ = 12;
-    union{
-        char *ptr;
-        char buf[BUFSZ];
-    } __attribute__((packed)) u;
-    int32_t refcount:31;
-    uint32_t uptr:1;
+    fuse_ino_t ino;
     fuse_ino_t pino;
     uint64_t validator;
-    const char* name() const{
-        return (uptr) ? u.ptr : &u.buf[0];
-    }
-
-    inorecord(const char *from, fuse_ino_t _pino, uint64_t _validator) : refcount(0), pino(_pino), validator(_validator){
-        fill_buf(from);
-    }
-    ~inorecord(){
-        if(uptr)
-            free(u.ptr);
-    }
-    // !!! We need a move-constructor that clears from.uptr 
-    // !!! otherwise we would double-free when we delete from.
-    inorecord(inorecord&& from){
-        refcount = from.refcount;
-        uptr = from.uptr;
-        ::memcpy(&u.buf[0], &from.u.buf[0], BUFSZ);
-        from.uptr = 0;
-        pino = from.pino;
-        validator = from.validator;
-    }
-    // it's not hard to implement move-assignment, but until we do,
-    // don't allow the default one to be used accidentally.
-    inorecord& operator=(inorecord&& from) = delete; 
-    // On the other hand, it's crucial to hide the
-    // copy constructor and copy-assignment operator
-    // so they can't leave us with two copies of the ptr
-    // to be freed on delete.
-    inorecord& operator=(const inorecord&) = delete;
-    inorecord(const inorecord&) = delete;
-private:
-    void fill_buf(const char *from){
-        size_t l = ::strlen(from) + 1;
-        char *to;
-        if(l > sizeof(u.buf)){
-            uptr = 1;
-            to = u.ptr = (char *)malloc(l);
-        }else{
-            uptr = 0;
-            to = &u.buf[0];
+    int32_t refcount;
+    uint32_t name;
+};
+static_assert(sizeof(inorecord) == 32, "Oops.  Packing of inorecord doesn't look right.");
+
+using inomap_mutex_t = std::mutex;
+using inomap_lock_t = std::unique_lock<inomap_mutex_t>;
+
+struct alignas(64) inomap_shard{
+    inomap_mutex_t mtx;
+    // table - open-addressed, with linear probing.  It grows by half
+    // when it's 4/5 full and shrinks by half when it's less than 1/4
+    // full, so on average it's about 2/3 full.  (Doubling would leave
+    // it about half full, which costs another 16 bytes per ino.)
+    std::vector<inorecord> table;
+    size_t n = 0;
+    name_arena names;
+    // paths - the full paths of some of the directories in the
+    // table.  When it reaches PATHS_PER_SHARD, it's cleared.
+    std::unordered_map<uint64_t, std::string> paths;
+
+    // home - the table's size isn't a power of two, so scale the
+    // bits below the ones that picked the shard by the size.
+    size_t home(fuse_ino_t ino) const{
+        return mulhilo(mix(ino)<<6, uint64_t(table.size())).second;
+    }
+    size_t next(size_t i) const{
+        return (++i == table.size()) ? 0 : i;
+    }
+
+    inorecord* find(fuse_ino_t ino){
+        if(table.empty())
+            return nullptr;
+        for(auto i = home(ino); table[i].ino; i = next(i))
+            if(table[i].ino == ino)
+                return &table[i];
+        return nullptr;
+    }
+
+    // insert - ino must not already be in the table.
+    inorecord& insert(fuse_ino_t ino){
+        if(5*(n+1) > 4*table.size())
+            resize(std::max(size_t(16), table.size() + table.size()/2));
+        auto i = home(ino);
+        while(table[i].ino)
+            i = next(i);
+        n++;
+        table[i].ino = ino;
+        return table[i];
+    }
+
+    // erase - r must point into the table.  Like
+    // name_arena::release, it shifts the rest of the probe sequence
+    // back.
+    void erase(inorecord* r){
+        names.release(r->name);
+        size_t i = r - table.data();
+        for(auto j = next(i); table[j].ino; j = next(j)){
+            auto k = home(table[j].ino);
+            if( (i<j) ? (k<=i || k>j) : (k<=i && k>j) ){
+                table[i] = table[j];
+                i = j;
+            }
+        }
+        table[i].ino = 0;
+        --n;
+        if(table.size() > 16 && 4*n < table.size())
+            resize(table.size()/2);
+    }
+
+    void resize(size_t newsize){
+        std::vector<inorecord> old(newsize, inorecord{});
+        old.swap(table);
+        for(auto& r : old){
+            if(!r.ino)
+                continue;
+            auto i = home(r.ino);
+            while(table[i].ino)
+                i = next(i);
+            table[i] = r;
         }
-        ::memcpy(to, from, l);
     }
 };
-static_assert(sizeof(inorecord) == inorecord::BUFSZ+sizeof(int32_t)+sizeof(fuse_ino_t)+sizeof(uint64_t), 
-              "Oops.  Packing of inorecord doesn't look right.");
+std::array<inomap_shard, NSHARDS> inomap;
 
-using inomap_t = std::unordered_map<uint64_t, inorecord>;
-inomap_t inomap;
+inomap_shard& shard_for(fuse_ino_t ino){
+    return inomap[mix(ino) >> 58];
+}
+static_assert(NSHARDS == 64, "shard_for assumes 64 shards");
 
-using inomap_mutex_t = std::mutex;
-using inomap_lock_t = std::unique_lock<inomap_mutex_t>;
+// at - find ino or throw.  The shard's mutex must be held.
+inorecord& at(inomap_shard& s, fuse_ino_t ino){
+    auto p = s.find(ino);
+    if(!p)
+        throw se(EINVAL, str("couldn't find ino =", ino, "in inomap"));
+    return *p;
+}
 
-inomap_mutex_t inomap_mtx;
-
-// _fullname must be called with a lock held on the inomap_mtx
-// It may not be called on the inorecord of the root itself,
-// i.e., the one with key=1 in the inomap.  We short-circuit
-// the recursion in two places to keep that from happening.
-std::string _fullname(const struct inorecord& r){
-    if(r.pino==1)
-        return std::string("/") + r.name();
-    auto p = inomap.find(r.pino);
-    if(p == inomap.end())
-        throw se(EINVAL, str("couldn't find pino =", r.pino, "in inomap"));
-    auto pname = _fullname(p->second);
-    return pname + "/" + r.name();
+// dir_fullname - returns the full name of ino, which is (or was) the
+// parent of some other ino, and caches it in ino's shard.  We never
+// hold one shard's mutex while acquiring another's, so there's no
+// possibility of a lock-order deadlock when one thread walks the
+// pino chain while another walks a different chain.
+std::string dir_fullname(fuse_ino_t ino){
+    if(ino == 1)
+        return {};
+    auto& s = shard_for(ino);
+    fuse_ino_t pino;
+    std::string name;
+    {
+        inomap_lock_t lk(s.mtx);
+        auto pp = s.paths.find(ino);
+        if(pp != s.paths.end())
+            return pp->second;
+        auto& r = at(s, ino);
+        pino = r.pino;
+        name = s.names.name(r.name);
+    }
+    auto ret = dir_fullname(pino) + "/" + name;
+    inomap_lock_t lk(s.mtx);
+    // Don't cache the path of an ino that was forgotten while we
+    // weren't looking.  ino_forget wouldn't know to erase it.
+    if(s.find(ino)){
+        if(s.paths.size() >= PATHS_PER_SHARD)
+            s.paths.clear();
+        s.paths.emplace(ino, ret);
+    }
+    return ret;
 }
 } // namespace <anonymous>
 
 std::string ino_to_fullname(fuse_ino_t ino){
-    if(ino==1)
-        return {};
-    inomap_lock_t lk(inomap_mtx);
-    return _fullname(inomap.at(ino));
+    return ino_to_fullname_validator(ino).first;
 }
 
 std::pair<std::string, uint64_t>
 ino_to_fullname_validator(fuse_ino_t ino){
     if(ino==1)
         return {{}, 1};
-    inomap_lock_t lk(inomap_mtx);
-    auto& r = inomap.at(ino);
-    return {_fullname(r), r.validator};
+    auto& s = shard_for(ino);
+    fuse_ino_t pino;
+    std::string name;
+    uint64_t validator;
+    {
+        inomap_lock_t lk(s.mtx);
+        auto& r = at(s, ino);
+        pino = r.pino;
+        validator = r.validator;
+        name = s.names.name(r.name);
+    }
+    return {dir_fullname(pino) + "/" + name, validator};
 }
 
 fuse_ino_t ino_to_pino(fuse_ino_t ino) try {
-    inomap_lock_t lk(inomap_mtx);
-    return inomap.at(ino).pino;
+    auto& s = shard_for(ino);
+    inomap_lock_t lk(s.mtx);
+    return at(s, ino).pino;
  }catch(std::exception& e){
     std::throw_with_nested(std::runtime_error(strfunargs(__func__, ino)));
  }
 
 std::pair <fuse_ino_t, std::string> ino_to_pino_name(fuse_ino_t ino) try {
-    inomap_lock_t lk(inomap_mtx);
-    auto& r = inomap.at(ino);
-    return {r.pino, r.name()};
+    auto& s = shard_for(ino);
+    inomap_lock_t lk(s.mtx);
+    auto& r = at(s, ino);
+    return {r.pino, std::string(s.names.name(r.name))};
  }catch(std::exception& e){
     std::throw_with_nested(std::runtime_error(strfunargs( __func__, ino)));
 }
 
 uint64_t ino_update_validator(fuse_ino_t ino, uint64_t validator) try {
-    inomap_lock_t lk(inomap_mtx);
-    auto& ir = inomap.at(ino);
+    auto& s = shard_for(ino);
+    inomap_lock_t lk(s.mtx);
+    auto& ir = at(s, ino);
     uint64_t ret = ir.validator;
     if(validator > ir.validator)
         ir.validator = validator;
     DIAGfkey((ret!=validator) && (_inomap||_validator_), "update validator(ino=%lu): old: %lu, new: %lu\n", (unsigned long)ino, (unsigned long)ret, (unsigned long)validator);
-    if(validator < ir.validator )
-        throw ino_out_of_order_validator(validator, ir.validator, _fullname(ir));
+    if(validator < ir.validator ){
+        auto oldval = ir.validator;
+        lk.unlock(); // ino_to_fullname locks other shards.
+        throw ino_out_of_order_validator(validator, oldval, ino_to_fullname_nothrow(ino));
+    }
     return ret;
  }catch(ino_out_of_order_validator&){
     throw;  // call site may be looking for this.  Don't nest it.
@@ -148,50 +395,88 @@ uint64_t ino_update_validator(fuse_ino_t ino, uint64_t validator) try {
  }
 
 uint64_t ino_get_validator(fuse_ino_t ino) try {
-    inomap_lock_t lk(inomap_mtx);
-    return inomap.at(ino).validator;
+    auto& s = shard_for(ino);
+    inomap_lock_t lk(s.mtx);
+    return at(s, ino).validator;
  }catch(std::exception& e){
     std::throw_with_nested(std::runtime_error(strfunargs(__func__, ino)));
  }
 
 void ino_remember(fuse_ino_t pino, const char *name, fuse_ino_t ino, uint64_t validator){
-    inomap_lock_t lk(inomap_mtx);
-    auto iterbool = inomap.emplace(std::piecewise_construct,
-                   std::forward_as_tuple(ino), 
-                   std::forward_as_tuple(name, pino, validator));
-    if(!iterbool.second){
+    if(ino == 0)
+        throw se(EINVAL, fmt("ino_remember(pino=%lu, name=%s, ino=0):  ino 0 is reserved", pino, name));
+    auto& s = shard_for(ino);
+    inomap_lock_t lk(s.mtx);
+    auto r = s.find(ino);
+    if(r){
         // there was already an entry for ino in the map.  Let's
         // make sure that it's for the same name.
-        if( strcmp(name, iterbool.first->second.name()) )
-            throw se(EINVAL, fmt("ino_remember(pino=%lu, name=%s, ino=%lu) does not match existing record in inomap with name=%s",
-                                         pino, name, ino, iterbool.first->second.name()));
+        auto oldname = s.names.name(r->name);
+        if( oldname != name )
+            throw se(EINVAL, fmt("ino_remember(pino=%lu, name=%s, ino=%lu) does not match existing record in inomap with name=%.*s",
+                                 pino, name, ino, int(oldname.size()), oldname.data()));
+    }else{
+        auto h = s.names.intern(name);
+        try{
+            r = &s.insert(ino);
+        }catch(...){
+            s.names.release(h);
+            throw;
+        }
+        r->pino = pino;
+        r->validator = validator;
+        r->refcount = 0;
+        r->name = h;
     }
-    iterbool.first->second.refcount++;
-    DIAGfkey(_inomap, "ino_remember(%lu, %s, %ju, %lu) refcount: %d\n", pino, name, ino, (uintmax_t)validator, iterbool.first->second.refcount);
+    r->refcount++;
+    DIAGfkey(_inomap, "ino_remember(%lu, %s, %ju, %lu) refcount: %d\n", pino, name, ino, (uintmax_t)validator, r->refcount);
 }
 
 void ino_forget(fuse_ino_t ino, uint64_t nlookup){
-    inomap_lock_t lk(inomap_mtx);
-    auto p = inomap.find(ino);
-    if(p==inomap.end()){
+    auto& s = shard_for(ino);
+    inomap_lock_t lk(s.mtx);
+    auto p = s.find(ino);
+    if(!p){
         complain("forget(%lu):  can't find ino in inomap", ino);
         return;
     }
-    if(p->second.refcount == 0)
+    if(p->refcount == 0)
         complain("ino_forget(%lu) refcount was zero", ino);
-    p->second.refcount -= nlookup;
-    DIAGfkey(_inomap, "ino_forget(%lu) refcount: %d name=%s\n", ino, p->second.refcount, p->second.name());
-    if(p->second.refcount < 0){
+    p->refcount -= nlookup;
+    DIAGfkey(_inomap, "ino_forget(%lu) refcount: %d name=%s\n", ino, p->refcount, std::string(s.names.name(p->name)).c_str());
+    if(p->refcount < 0){
         complain("ino_forget(%lu) refcount < 0", ino);
-        p->second.refcount = 0;
+        p->refcount = 0;
     }
-    if( p->second.refcount == 0 ){
-        inomap.erase(p);
+    if( p->refcount == 0 ){
+        s.erase(p);
+        s.paths.erase(ino);
     }
 }
 
 size_t ino_count(){
-    inomap_lock_t lk(inomap_mtx);
-    return inomap.size();
+    size_t ret = 0;
+    for(auto& s : inomap){
+        inomap_lock_t lk(s.mtx);
+        ret += s.n;
+    }
+    return ret;
+}
+
+size_t ino_paths_cached(){
+    size_t ret = 0;
+    for(auto& s : inomap){
+        inomap_lock_t lk(s.mtx);
+        ret += s.paths.size();
+    }
+    return ret;
+}
+
+size_t ino_names_interned(){
+    size_t ret = 0;
+    for(auto& s : inomap){
+        inomap_lock_t lk(s.mtx);
+        ret += s.names.size();
+    }
+    return ret;
 }
-        
@@ -46,3 +46,5 @@ private:
 };
 
 size_t ino_count();
+size_t ino_paths_cached(); // directories whose full path is cached
+size_t ino_names_interned(); // distinct names in the name_arenas
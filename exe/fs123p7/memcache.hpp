@@ -0,0 +1,146 @@
+#pragma once
+
+// memcache - a sharded, byte-bounded, in-memory LRU cache of
+// expiring values.
+//
+// Values are held by shared_ptr<const V>, so a lookup costs a lock,
+// a hash-table probe and a reference-count bump.  The caller decides
+// what (if anything) to copy out of the returned pointer.
+//
+// The cache is divided into nshards independent shards, each with
+// its own mutex, LRU list and 1/nshards of the total byte budget.
+// The key's std::hash selects the shard.  The 'bytes' argument to
+// insert is the caller's estimate of the memory charged to the
+// entry.  Insertion evicts least-recently-used entries from the
+// shard until the shard is within its budget.  An entry bigger than
+// the shard's budget is not inserted at all.
+//
+// Entries carry an expiration time.  A lookup of an expired entry
+// erases it and counts as both an expiration and a miss.  Unlike
+// expiring_cache, insert *replaces* an existing entry, which is what
+// we want when a no-cache request brings back a fresher value.
+
+#include <chrono>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include <vector>
+#include <functional>
+#include <cstddef>
+
+template <typename K, typename V, typename Clk = std::chrono::system_clock>
+class memcache{
+public:
+    using clk_t = Clk;
+    using value_sp = std::shared_ptr<const V>;
+private:
+    struct entry;
+    using lru_t = std::list<typename std::unordered_map<K, entry>::iterator>;
+    struct entry{
+        value_sp vp;
+        typename clk_t::time_point expires;
+        size_t bytes;
+        typename lru_t::iterator lruit;
+    };
+    struct shard{
+        std::mutex mtx;
+        std::unordered_map<K, entry> themap;
+        lru_t lru;  // front is most recently used
+        size_t bytes = 0;
+    };
+    const size_t shard_budget;
+    std::vector<shard> shards;
+    std::atomic<size_t> _hits, _misses, _expirations, _evictions, _inserts, _too_big, _bytes;
+
+    shard& shard_for(const K& k){
+        return shards[std::hash<K>{}(k) % shards.size()];
+    }
+
+    // erase_locked - the shard's mutex must be held.
+    void erase_locked(shard& s, typename std::unordered_map<K, entry>::iterator ii){
+        s.bytes -= ii->second.bytes;
+        _bytes -= ii->second.bytes;
+        s.lru.erase(ii->second.lruit);
+        s.themap.erase(ii);
+    }
+
+public:
+    memcache(size_t max_bytes, size_t nshards = 16) :
+        shard_budget(max_bytes / (nshards ? nshards : 1)),
+        shards(nshards ? nshards : 1),
+        _hits(0), _misses(0), _expirations(0), _evictions(0), _inserts(0), _too_big(0), _bytes(0)
+    {}
+
+    value_sp lookup(const K& k, typename clk_t::time_point asifnow = clk_t::now()){
+        auto& s = shard_for(k);
+        std::lock_guard<std::mutex> lk(s.mtx);
+        auto ii = s.themap.find(k);
+        if(ii == s.themap.end()){
+            _misses++;
+            return {};
+        }
+        if(ii->second.expires <= asifnow){
+            erase_locked(s, ii);
+            _expirations++;
+            _misses++;
+            return {};
+        }
+        s.lru.splice(s.lru.begin(), s.lru, ii->second.lruit);
+        _hits++;
+        return ii->second.vp;
+    }
+
+    // insert - returns false if the entry was too big (or already
+    // expired) and hence not inserted.
+    bool insert(const K& k, value_sp vp, const typename clk_t::time_point& expires, size_t bytes,
+                typename clk_t::time_point asifnow = clk_t::now()){
+        if(bytes > shard_budget){
+            _too_big++;
+            return false;
+        }
+        if(expires <= asifnow)
+            return false;
+        auto& s = shard_for(k);
+        std::lock_guard<std::mutex> lk(s.mtx);
+        auto ii = s.themap.find(k);
+        if(ii != s.themap.end())
+            erase_locked(s, ii);
+        while(s.bytes + bytes > shard_budget && !s.lru.empty()){
+            erase_locked(s, s.lru.back());
+            _evictions++;
+        }
+        ii = s.themap.emplace(k, entry{std::move(vp), expires, bytes, {}}).first;
+        s.lru.push_front(ii);
+        ii->second.lruit = s.lru.begin();
+        s.bytes += bytes;
+        _bytes += bytes;
+        _inserts++;
+        return true;
+    }
+
+    void erase(const K& k){
+        auto& s = shard_for(k);
+        std::lock_guard<std::mutex> lk(s.mtx);
+        auto ii = s.themap.find(k);
+        if(ii != s.themap.end())
+            erase_locked(s, ii);
+    }
+
+    size_t hits() const { return _hits; }
+    size_t misses() const { return _misses; }
+    size_t expirations() const { return _expirations; }
+    size_t evictions() const { return _evictions; }
+    size_t inserts() const { return _inserts; }
+    size_t too_big() const { return _too_big; }
+    size_t bytes() const { return _bytes; }
+    size_t size() {
+        size_t ret = 0;
+        for(auto& s : shards){
+            std::lock_guard<std::mutex> lk(s.mtx);
+            ret += s.themap.size();
+        }
+        return ret;
+    }
+};
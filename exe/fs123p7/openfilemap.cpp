@@ -60,7 +60,7 @@ auto _shutdown = diag_name("shutdown");
 //
 // Since the mrecord is, effectively, our fi->fh, anything else
 // we might want to record at open-time for use at read-time
-// has to go in the mrecord as well.  (Nothing for now)
+// has to go in the mrecord as well.  E.g., the readahead_state.
 
 struct pqrecord;
 struct mrecord;
@@ -79,6 +79,7 @@ struct mrecord{
     ofpq_t::iterator qiter;
     bool qiter_dereferenceable;
     ofmap_t::iterator miter;
+    readahead_state ras;
     mrecord() : refcnt(0), qiter_dereferenceable(false)
     {}
     // mrecords should "stay put" where we emplace them.  Don't allow
@@ -144,6 +145,11 @@ int decrefcnt(mrecord& mr){
     // N.B.  The lock must be held when this is called!
     int ret = --mr.refcnt;
     if(ret == 0){
+        // Anything prefetched but never read was wasted, and
+        // anything still queued needn't run.
+        size_t wasted = 0;
+        mr.ras.cancel(&wasted);
+        stats.readahead_chunks_wasted += wasted;
         if(mr.qiter_dereferenceable)
             ofpq.erase(mr.qiter);
         ofmap.erase(mr.miter); // erases *mr!
@@ -371,6 +377,10 @@ openfile_register(fuse_ino_t ino, const begetattr_t& r){
         }
 
         mr.refcnt++;
+        {
+            std::lock_guard<std::mutex> ralg(mr.ras.mtx);
+            mr.ras.filesize = r.sb.st_size;
+        }
         if(mr.qiter->expires != r.good_till){
             // the expiration time has changed.  Update the ofpq.
             DIAGfkey(_ofmap, "old entry's expiration time changed.  erase.\n");
@@ -430,6 +440,16 @@ void openfile_release(fuse_ino_t ino, uint64_t fifh){
     decrefcnt(mr); // might erase miter
 }
 
+readahead_state& openfile_readahead_state(fuse_ino_t ino, uint64_t fifh){
+    if(fifh == 0)
+        throw se(EINVAL, "openfile_readahead_state called with fifh==0");
+    std::lock_guard<std::mutex> lgd(mtx);
+    mrecord& mr = *reinterpret_cast<mrecord*>(fifh);
+    if( ino != mr.miter->first || &mr != &mr.miter->second )
+        throw se(EIO, "openfile_readahead_state: mr.miter does not 'point' back to (ino,mr).  Something is very wrong");
+    return mr.ras;
+}
+
 std::string
 openfile_report(){
     std::lock_guard<std::mutex> lg(mtx);
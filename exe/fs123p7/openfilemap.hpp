@@ -1,6 +1,7 @@
 #pragma once
 
 #include "app_mount.hpp"
+#include "readahead.hpp"
 #include <fuse/fuse_lowlevel.h>
 #include <string>
 
@@ -11,3 +12,7 @@ uint64_t openfile_register(fuse_ino_t ino, const begetattr_t& reply);
 void openfile_release(fuse_ino_t ino, uint64_t fifh);
 void openfile_expire_now(fuse_ino_t ino, uint64_t fifh);
 std::string openfile_report();
+
+// openfile_readahead_state - the caller must keep fifh open, i.e., it
+// may only be called from within a read callback.
+readahead_state& openfile_readahead_state(fuse_ino_t ino, uint64_t fifh);
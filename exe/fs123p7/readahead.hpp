@@ -0,0 +1,92 @@
+#pragma once
+
+// readahead_state - the per-open-file state used by the readahead
+// engine in fs123_read (see readahead_advise in app_mount.cpp).  It
+// lives in the openfilemap's record for the ino, so it's created by
+// the first openfile_register and destroyed by the last
+// openfile_release.  N.B.  concurrent opens of the same ino share one
+// readahead_state.
+//
+// The caller must hold mtx when it calls the methods.
+//
+// Prefetches wait in a threadpool until a thread is free, which may
+// be long after they were submitted.  Each one carries the
+// generation that was current when it was submitted, and should do
+// nothing if the generation has changed by the time it runs.
+// cancel() changes it.  The generation is held by a shared_ptr
+// because queued prefetches may outlive the readahead_state.
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <utility>
+#include <sys/types.h>
+
+struct readahead_state{
+    std::mutex mtx;
+    off_t next_off = 0;          // where we expect the next sequential read to start
+    off_t filesize = 0;          // st_size at the most recent register - don't prefetch past it
+    unsigned window = 0;         // current readahead window, in chunks
+    int64_t next_prefetch = 0;   // chunk number of the next chunk to prefetch
+    std::set<int64_t> pending;   // chunk numbers prefetched but not yet read
+    std::shared_ptr<std::atomic<uint64_t>> generation = std::make_shared<std::atomic<uint64_t>>(0);
+
+    // observe - account for a read of size>0 bytes at off.  Pending
+    // chunks that the read covers were used.  Pending chunks that it
+    // skipped over were wasted.  If the read continues where the
+    // last one left off (give or take a chunk, because the kernel's
+    // own readahead may deliver reads slightly out of order to our
+    // multiple threads), the window doubles, up to maxchunks, and
+    // observe returns true.  Otherwise, the window halves, the
+    // pending prefetches are cancelled, and observe returns false.
+    bool observe(off_t off, size_t size, size_t chunkbytes, unsigned maxchunks, size_t* used, size_t* wasted){
+        int64_t c0 = off/chunkbytes;
+        int64_t c1 = (off+size-1)/chunkbytes;
+        for(auto p = pending.begin(); p!=pending.end() && *p <= c1; ){
+            if(*p >= c0)
+                ++*used;
+            else
+                ++*wasted;
+            p = pending.erase(p);
+        }
+        off_t slop = chunkbytes;
+        bool sequential = (off + slop >= next_off) && (off <= next_off + slop);
+        if(!sequential){
+            cancel(wasted);
+            window /= 2;
+            next_prefetch = 0;
+            next_off = off + size;
+            return false;
+        }
+        next_off = std::max(next_off, off_t(off + size));
+        window = std::min(window ? 2*window : 1, maxchunks);
+        return true;
+    }
+
+    // cancel - abandon the pending prefetches.  The ones that haven't
+    // started yet won't.
+    void cancel(size_t* wasted){
+        *wasted += pending.size();
+        pending.clear();
+        ++*generation;
+    }
+
+    // candidates - the half-open range of chunk numbers that should be
+    // prefetched after a sequential read whose last chunk is c1:  the
+    // window beyond c1, less what's already been prefetched, and
+    // nothing past the end of the file.
+    std::pair<int64_t, int64_t> candidates(int64_t c1, size_t chunkbytes) const{
+        int64_t eof = (filesize + chunkbytes - 1)/chunkbytes;
+        return {std::max(c1+1, next_prefetch), std::min(c1 + 1 + int64_t(window), eof)};
+    }
+
+    // submitted - chunk c has been handed to the threadpool.
+    void submitted(int64_t c){
+        pending.insert(c);
+        next_prefetch = c+1;
+    }
+};
@@ -0,0 +1,68 @@
+#pragma once
+
+// rolling_quantile - an online estimate of the q'th quantile of the
+// most recent N samples.
+//
+// The samples are kept in a ring.  Every N/8 adds, add() copies the
+// ring and nth_element's it, so the amortized cost of an add is a
+// handful of comparisons, and get() is just an atomic load.  The
+// estimate lags the samples by at most N/8 adds, which is fine for
+// its intended use:  deciding when a request has been waiting
+// "unusually" long (see hedging in backend123_http.cpp).
+//
+// Until there are at least minsamples samples, get() returns
+// infinity, i.e., "no idea".
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <limits>
+#include <mutex>
+#include <vector>
+
+class rolling_quantile{
+public:
+    rolling_quantile(double q_, size_t N, size_t minsamples_) :
+        q(std::min(std::max(q_, 0.), 1.)),
+        ring(std::max(N, size_t(1))),
+        minsamples(std::min(std::max(minsamples_, size_t(1)), ring.size())),
+        recompute_every(std::max(ring.size()/8, size_t(1)))
+    {}
+
+    void add(double x){
+        std::lock_guard<std::mutex> lg(mtx);
+        ring[next] = x;
+        next = (next+1) % ring.size();
+        if(n < ring.size())
+            n++;
+        if(n < minsamples)
+            return;
+        if(n == minsamples || ++since_recompute >= recompute_every){
+            since_recompute = 0;
+            std::vector<double> sorted(ring.begin(), ring.begin() + n);
+            auto kth = sorted.begin() + std::min(size_t(q*n), n-1);
+            std::nth_element(sorted.begin(), kth, sorted.end());
+            estimate.store(*kth);
+        }
+    }
+
+    double get() const{
+        return estimate.load();
+    }
+
+    size_t nsamples() const{
+        std::lock_guard<std::mutex> lg(mtx);
+        return n;
+    }
+
+private:
+    const double q;
+    mutable std::mutex mtx;
+    std::vector<double> ring;
+    const size_t minsamples;
+    const size_t recompute_every;
+    size_t next = 0;
+    size_t n = 0;
+    size_t since_recompute = 0;
+    std::atomic<double> estimate{std::numeric_limits<double>::infinity()};
+};
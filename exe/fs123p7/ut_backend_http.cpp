@@ -0,0 +1,441 @@
+// A unit test and benchmark for backend123_http.  It needs a server:
+//
+//   ut_backend_http URL [nthreads [nreqs]]
+//
+// URL is a baseurl without the /fs123/7/N sigil, e.g., a testserver
+// or an exportd.  Every request is for /a/<number>, which the
+// testserver answers with the attributes of a regular file and an
+// exportd answers (usually) with ENOENT.  Either is fine.  We're
+// exercising the transport, not the server.
+//
+// First, check that a backend that calls curl_easy_perform in each
+// thread and a backend that uses the (Fs123CurlMulti) multi_engine
+// get the same replies.  Then time nthreads threads, each making nreqs
+// requests, with each of them, and report requests per second and the
+// peak number of open connections.
+//
+// With Fs123EwmaOriginSelection, requests are spread over a baseurl
+// and a fallback that are really the same server.
+//
+// Hedging is checked with a "black hole" primary:  a socket that
+// accepts connections (in the kernel's backlog) but never answers, with
+// URL as its fallback.
+//
+// The testserver only speaks HTTP/1.1, so to see multiplexing, put an
+// h2c-capable proxy in front of it, e.g.,
+//
+//   testserver --port 8080 --threadpool_max 16 &
+//   nghttpx -f'127.0.0.1,3000;no-tls' -b127.0.0.1,8080 &
+//   Fs123Http2PriorKnowledge=true ut_backend_http http://127.0.0.1:3000 64 2000
+//
+// N.B.  With libcurl-7.88.1, the second transfer over an h2c
+// connection fails with CURLE_HTTP2 (16), with or without
+// Fs123CurlMulti.  libcurl-8.x is fine.
+
+#include "backend123_http.hpp"
+#include <core123/ut.hpp>
+#include <core123/complaints.hpp>
+#include <core123/svto.hpp>
+#include <core123/strutils.hpp>
+#include <core123/threadpool.hpp>
+#include <atomic>
+#include <fstream>
+#include <future>
+#include <set>
+#include <sstream>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+using namespace core123;
+
+// Normally defined in app_mount.cpp.
+const unsigned
+volatiles_t::hw_concurrency = std::thread::hardware_concurrency();
+
+namespace{
+// The number of TCP connections this process has open right now.
+// /proc/self/fd tells us which sockets are ours, and /proc/self/net/tcp
+// tells us which sockets are TCP.  The other sockets are libcurl's
+// socketpairs (for the threaded resolver and curl_multi_wakeup).
+int count_connections(){
+    std::set<std::string> inodes;
+    DIR* d = ::opendir("/proc/self/fd");
+    if(!d)
+        return -1;
+    while(auto de = ::readdir(d)){
+        char buf[64];
+        auto len = ::readlinkat(::dirfd(d), de->d_name, buf, sizeof(buf)-1);
+        if(len > 0){
+            buf[len] = '\0';
+            str_view sv(buf);
+            if(startswith(sv, "socket:["))
+                inodes.insert(std::string(sv.substr(8, sv.size()-9)));
+        }
+    }
+    ::closedir(d);
+    int n = 0;
+    for(auto tcp : {"/proc/self/net/tcp", "/proc/self/net/tcp6"}){
+        std::ifstream ifs(tcp);
+        std::string line;
+        std::getline(ifs, line); // the column headings
+        while(std::getline(ifs, line)){
+            // The inode is the tenth whitespace-separated field.
+            std::istringstream iss(line);
+            std::string field;
+            for(int i=0; i<10; ++i)
+                iss >> field;
+            if(inodes.count(field))
+                n++;
+        }
+    }
+    return n;
+}
+
+std::string stem(unsigned i){
+    return "/a/" + std::to_string(i);
+}
+
+// A listening socket on 127.0.0.1 that nobody ever accepts.  Returns
+// its port.
+unsigned short blackhole(){
+    static int fd = -1;
+    static sockaddr_in sin = {};
+    if(fd < 0){
+        fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(sin);
+        if(fd < 0 ||
+           ::bind(fd, (sockaddr*)&sin, sizeof(sin)) < 0 ||
+           ::listen(fd, 128) < 0 ||
+           ::getsockname(fd, (sockaddr*)&sin, &len) < 0)
+            throw std::system_error(errno, std::system_category(), "blackhole");
+    }
+    return ntohs(sin.sin_port);
+}
+
+// The value of the named statistic in be's report_stats.
+double stat(backend123_http& be, const std::string& name){
+    std::ostringstream oss;
+    be.report_stats(oss);
+    std::string report = oss.str();
+    auto pos = report.find("\n" + name + ": ");
+    if(pos == std::string::npos)
+        throw std::runtime_error("no " + name + " in report_stats");
+    pos += name.size() + 3;
+    return svto<double>(report.substr(pos, report.find('\n', pos) - pos));
+}
+
+void bench(const char* name, backend123_http& be, unsigned nthreads, unsigned nreqs){
+    std::atomic<unsigned> failures{0};
+    std::atomic<bool> done{false};
+    int peak_connections = 0;
+    std::thread sampler([&](){
+        while(!done){
+            peak_connections = std::max(peak_connections, count_connections());
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+    });
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for(unsigned t=0; t<nthreads; ++t){
+        threads.emplace_back([&, t](){
+            for(unsigned i=0; i<nreqs; ++i){
+                try{
+                    reply123 r;
+                    be.refresh(req123(stem(t*nreqs + i + 1)), &r);
+                    if(!r.valid())
+                        failures++;
+                }catch(std::exception& e){
+                    if(failures++ == 0)
+                        complain(e, "bench:");
+                }
+            }
+        });
+    }
+    for(auto& th : threads)
+        th.join();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    done = true;
+    sampler.join();
+    std::cout << name << ": " << nthreads << " threads x " << nreqs << " requests in "
+              << elapsed.count() << " sec:  "
+              << unsigned(nthreads*nreqs/elapsed.count()) << " req/sec, peak connections: " << peak_connections << "\n";
+    EQUAL(failures.load(), 0u);
+}
+} // namespace <anonymous>
+
+int main(int argc, char **argv) try {
+    if(argc < 2 || argc > 4){
+        std::cerr << "Usage: ut_backend_http URL [nthreads [nreqs]]\n";
+        return 1;
+    }
+    std::string baseurl = backend123::add_sigil_version(argv[1]);
+    unsigned nthreads = (argc > 2) ? svto<unsigned>(argv[2]) : 8;
+    unsigned nreqs = (argc > 3) ? svto<unsigned>(argv[3]) : 100;
+
+    addrinfo_cache aicache;
+    volatiles_t easy_vols;
+    easy_vols.curl_multi = false;
+    volatiles_t multi_vols;
+    multi_vols.curl_multi = true;
+    backend123_http easy_be(baseurl, "", aicache, easy_vols);
+    backend123_http multi_be(baseurl, "", aicache, multi_vols);
+
+    // The two engines should get identical replies.
+    for(unsigned i=1; i<=40; ++i){
+        reply123 er, mr;
+        CHECK(easy_be.refresh(req123(stem(i)), &er));
+        CHECK(multi_be.refresh(req123(stem(i)), &mr));
+        CHECK(er.valid() && mr.valid());
+        EQUAL(er.etag64, mr.etag64);
+        EQUAL(std::string(as_str_view(er.content)), std::string(as_str_view(mr.content)));
+    }
+
+    // Two multi backends (e.g., the primary and a peer) share one
+    // engine, and keep working after one of them is gone.
+    {
+        backend123_http another(baseurl, "", aicache, multi_vols);
+        reply123 r;
+        CHECK(another.refresh(req123(stem(1)), &r));
+    }
+    {
+        reply123 r;
+        CHECK(multi_be.refresh(req123(stem(2)), &r));
+    }
+
+    // With Fs123CurlShare, the replies are the same, and the stats
+    // show that connections are reused.
+    {
+        volatiles_t share_vols;
+        share_vols.curl_share = true;
+        backend123_http share_be(baseurl, "", aicache, share_vols);
+        for(unsigned i=1; i<=40; ++i){
+            reply123 er, sr;
+            CHECK(easy_be.refresh(req123(stem(i)), &er));
+            CHECK(share_be.refresh(req123(stem(i)), &sr));
+            EQUAL(std::string(as_str_view(er.content)), std::string(as_str_view(sr.content)));
+        }
+        std::ostringstream oss;
+        share_be.report_stats(oss);
+        std::string report = oss.str();
+        static const std::string ratio = "curl_connection_reuse_ratio: ";
+        auto pos = report.find(ratio);
+        CHECK(pos != std::string::npos);
+        if(pos != std::string::npos){
+            CHECK(svto<double>(report, pos + ratio.size()) > 0.5);
+        }
+    }
+
+    // Hedging:  with a generous budget, every request to the black
+    // hole is hedged, and the hedge wins.
+    {
+        volatiles_t hedge_vols;
+        hedge_vols.curl_multi = true;
+        hedge_vols.hedge_quantile = 0.9;
+        hedge_vols.hedge_budget = 1.;
+        hedge_vols.hedge_initial_millis = 20;
+        std::string bhurl = backend123::add_sigil_version("http://127.0.0.1:" + std::to_string(blackhole()));
+        backend123_http hedge_be(bhurl, "", aicache, hedge_vols);
+        hedge_be.add_fallback_baseurl(baseurl);
+        for(unsigned i=1; i<=20; ++i){
+            reply123 er, hr;
+            CHECK(easy_be.refresh(req123(stem(i)), &er));
+            CHECK(hedge_be.refresh(req123(stem(i)), &hr));
+            EQUAL(std::string(as_str_view(er.content)), std::string(as_str_view(hr.content)));
+        }
+        EQUAL(stat(hedge_be, "backend_hedges"), 20.);
+        EQUAL(stat(hedge_be, "backend_hedges_won"), 20.);
+        EQUAL(stat(hedge_be, "backend_hedges_over_budget"), 0.);
+
+        // With no budget left, there's no hedge, and the request to the
+        // black hole times out.
+        hedge_vols.hedge_budget = 0.;
+        hedge_vols.transfer_timeout = 1;
+        bool threw = false;
+        try{
+            reply123 r;
+            hedge_be.refresh(req123(stem(21)), &r);
+        }catch(std::exception&){
+            threw = true;
+        }
+        CHECK(threw);
+        EQUAL(stat(hedge_be, "backend_hedges"), 20.);
+        EQUAL(stat(hedge_be, "backend_hedges_over_budget"), 1.);
+    }
+
+    // url_info's scores:  slower and less reliable cost more, and
+    // requests in flight add to the cost.  An idle url's score decays
+    // toward the average of the observed urls, and so does one that
+    // has never been observed.
+    {
+        std::vector<url_info> urls;
+        urls.emplace_back("http://fast.example.com/");
+        urls.emplace_back("http://slow.example.com/");
+        urls.emplace_back("http://flaky.example.com/");
+        urls.emplace_back("http://new.example.com/");
+        auto& fast = urls[0];
+        auto& slow = urls[1];
+        auto& flaky = urls[2];
+        auto& unobserved = urls[3];
+        for(int i=0; i<10; ++i){
+            fast.observe(0.01, true, 10.);
+            slow.observe(0.1, true, 10.);
+            flaky.observe(0.01, i%2, 10.);
+        }
+        auto prior = url_info::prior(urls);
+        CHECK(prior.sec > 0.01 && prior.sec < 0.1);
+        CHECK(prior.errors > 0. && prior.errors < 1.);
+        CHECK(fast.cost(10., prior) < slow.cost(10., prior));
+        CHECK(fast.cost(10., prior) < flaky.cost(10., prior));
+        CHECK(unobserved.cost(10., prior) > fast.cost(10., prior));
+        CHECK(unobserved.cost(10., prior) < slow.cost(10., prior));
+        double c = fast.cost(10., prior);
+        fast.score->inflight++;
+        CHECK(fast.cost(10., prior) > 1.9*c);
+        fast.score->inflight--;
+        // After many time constants, everybody looks like the prior.
+        // In particular, the idle slow url is no cheaper than the
+        // fast one.
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        double tiny = 1.e-3;
+        CHECK(slow.cost(tiny, prior) >= fast.cost(tiny, prior));
+        CHECK(std::abs(slow.cost(tiny, prior) - unobserved.cost(tiny, prior)) < 1.e-6);
+        // With no observations at all, the prior is zero.
+        std::vector<url_info> none;
+        none.emplace_back("http://a.example.com/");
+        EQUAL(url_info::prior(none).sec, 0.);
+    }
+
+    // EWMA origin selection.  127.0.0.1 and localhost are the same
+    // server, but different baseurls.  By default, the first one gets
+    // all the requests.  With Fs123EwmaOriginSelection, they share.
+    std::string alias;
+    if(startswith(argv[1], "http://127.0.0.1:"))
+        alias = "http://localhost:" + std::string(argv[1]).substr(17);
+    else if(startswith(argv[1], "http://localhost:"))
+        alias = "http://127.0.0.1:" + std::string(argv[1]).substr(17);
+    if(!alias.empty()){
+        alias = backend123::add_sigil_version(alias);
+        volatiles_t ewma_vols;
+        backend123_http ewma_be(baseurl, "", aicache, ewma_vols);
+        ewma_be.add_fallback_baseurl(alias);
+        for(unsigned i=1; i<=20; ++i){
+            reply123 r;
+            CHECK(ewma_be.refresh(req123(stem(i)), &r));
+        }
+        EQUAL(stat(ewma_be, "origin_0_observed"), 20.);
+        EQUAL(stat(ewma_be, "origin_1_observed"), 0.);
+        EQUAL(stat(ewma_be, "backend_ewma_picks"), 0.);
+        ewma_vols.ewma_origin_selection = true;
+        for(unsigned i=1; i<=40; ++i){
+            reply123 r;
+            CHECK(ewma_be.refresh(req123(stem(i)), &r));
+        }
+        EQUAL(stat(ewma_be, "backend_ewma_picks"), 40.);
+        EQUAL(stat(ewma_be, "origin_0_observed") + stat(ewma_be, "origin_1_observed"), 60.);
+        CHECK(stat(ewma_be, "origin_1_observed") > 0.);
+        CHECK(stat(ewma_be, "origin_0_ewma_sec") > 0.);
+        EQUAL(stat(ewma_be, "origin_0_ewma_error_rate"), 0.);
+    }
+
+    // Batching:  a lone refresh goes on its own, but concurrent ones
+    // go out together in /b requests, and each gets the reply it would
+    // have gotten on its own - including a 304 for the /f's whose
+    // stale replies still have the right etag, and the redirect for
+    // /f/17.
+    {
+        volatiles_t batch_vols;
+        batch_vols.batch_millis = 20;
+        batch_vols.batch_max = 8;
+        backend123_http batch_be(baseurl, "", aicache, batch_vols);
+        reply123 r;
+        CHECK(batch_be.refresh(req123(stem(1)), &r));
+        EQUAL(stat(batch_be, "backend_batches"), 0.);
+
+        const unsigned N = 32;
+        auto fstem = [](unsigned i){ return "/f/" + std::to_string(i) + "?128;0"; };
+        std::vector<reply123> replies(N);
+        std::vector<int> rets(N);
+        for(unsigned i=1; i<N; i+=2){
+            CHECK(easy_be.refresh(req123(fstem(i)), &replies[i]));
+            replies[i].expires = clk123_t::now() - std::chrono::seconds(1);
+        }
+        std::atomic<bool> go{false};
+        std::vector<std::thread> threads;
+        for(unsigned i=0; i<N; ++i){
+            threads.emplace_back([&, i](){
+                while(!go)
+                    std::this_thread::yield();
+                rets[i] = batch_be.refresh(req123((i%2) ? fstem(i) : stem(i)), &replies[i]);
+            });
+        }
+        go = true;
+        for(auto& th : threads)
+            th.join();
+        for(unsigned i=0; i<N; ++i){
+            CHECK(replies[i].fresh());
+            EQUAL(rets[i], (i%2) ? 0 : 1);
+            reply123 er;
+            CHECK(easy_be.refresh(req123((i%2) ? fstem(i) : stem(i)), &er));
+            EQUAL(er.etag64, replies[i].etag64);
+            EQUAL(std::string(as_str_view(er.content)), std::string(as_str_view(replies[i].content)));
+        }
+        CHECK(stat(batch_be, "backend_batches") > 0.);
+        CHECK(stat(batch_be, "backend_batched_requests") > 1.);
+        // The testserver redirects /f/17.  If it was in a batch, its
+        // 302 record sent it back to refresh on its own.
+        CHECK(stat(batch_be, "backend_batch_fallbacks") <= 1.);
+        EQUAL(stat(batch_be, "backend_304"), double(N/2));
+        std::cout << "batching: " << stat(batch_be, "backend_batched_requests") << " of " << N
+                  << " requests in " << stat(batch_be, "backend_batches") << " batches\n";
+    }
+
+    // fs123_read fetches the chunks of a multi-chunk read
+    // concurrently.  On a fresh thread for each chunk (std::async),
+    // the thread_local curl handle is new, so every fetch opens (and
+    // then abandons) a connection.  On a long-lived threadpool, the
+    // handles, and their connections, are reused.
+    {
+        static const unsigned rounds = 8, chunks = 8;
+        auto fetch_chunks = [&](backend123_http& be, auto spawn){
+            auto start = std::chrono::steady_clock::now();
+            for(unsigned r=0; r<rounds; ++r){
+                std::vector<std::future<bool>> futs;
+                for(unsigned c=0; c<chunks; ++c)
+                    futs.push_back(spawn([&be, c](){
+                                             reply123 rep;
+                                             return be.refresh(req123(stem(c+1)), &rep) && rep.valid();
+                                         }));
+                for(auto& f : futs)
+                    CHECK(f.get());
+            }
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            return elapsed.count();
+        };
+        backend123_http async_be(baseurl, "", aicache, easy_vols);
+        double async_sec = fetch_chunks(async_be, [](auto f){ return std::async(std::launch::async, f); });
+        backend123_http pool_be(baseurl, "", aicache, easy_vols);
+        core123::threadpool<bool> tp(chunks);
+        double pool_sec = fetch_chunks(pool_be, [&tp](auto f){ return tp.submit(f); });
+        std::cout << "chunk fetches: std::async: " << stat(async_be, "curl_new_connections") << " new connections in " << async_sec
+                  << " sec, threadpool: " << stat(pool_be, "curl_new_connections") << " new connections in " << pool_sec << " sec\n";
+        EQUAL(stat(async_be, "curl_new_connections"), double(rounds*chunks));
+        CHECK(stat(pool_be, "curl_new_connections") <= chunks);
+    }
+
+    bench("curl_easy_perform", easy_be, nthreads, nreqs);
+    bench("curl_multi       ", multi_be, nthreads, nreqs);
+    return utstatus();
+ }catch(std::exception& e){
+    complain(e, "Exception caught.  main returns 1");
+    return 1;
+ }
@@ -0,0 +1,157 @@
+// A unit test for cache_policy.
+
+#include "cache_policy.hpp"
+#include "fs123/acfd.hpp"
+#include <core123/ut.hpp>
+#include <core123/sew.hpp>
+#include <core123/complaints.hpp>
+#include <core123/pathutils.hpp>
+#include <iostream>
+#include <sstream>
+#include <set>
+
+using namespace core123;
+
+namespace{
+// All the keys in directory 0 (hexdigits=1), with distinct atimes.
+dcindex::key_t key(uint64_t i){
+    return {i+1, i*0x9e3779b97f4a7c15};
+}
+}
+
+int main(int argc, char **argv) try {
+    if(argc != 2){
+        std::cerr << "Usage: ut_cache_policy dir\n";
+        return 1;
+    }
+    makedirs(argv[1], 0700, true);
+    acfd rootfd = sew::open(argv[1], O_DIRECTORY);
+    ::unlinkat(rootfd, ".index", 0);
+    const int64_t now = 1000000;
+    dcindex idx(rootfd, ".index", 1, 64);
+    const uint64_t N = 10;
+    for(uint64_t i=0; i<N; ++i)
+        idx.insert(key(i), 4096, now+100, now+i);
+
+    bool threw = false;
+    try{
+        cache_policy::make("bogus", 1000);
+    }catch(std::exception&){
+        threw = true;
+    }
+    CHECK(threw);
+
+    // random: n distinct victims.
+    auto rnd = cache_policy::make("random", 1000);
+    EQUAL(rnd->name(), std::string("random"));
+    auto v = rnd->victims(idx, 0, 5, now);
+    EQUAL(v.size(), 5);
+    std::set<dcindex::key_t> distinct;
+    for(const auto& e : v)
+        distinct.insert(e.key);
+    EQUAL(distinct.size(), 5);
+    EQUAL(rnd->victims(idx, 0, 100, now).size(), N);
+    // Admission is a coin flip against the injection_probability.
+    CHECK(rnd->admit(key(99), false, 1.0));
+    CHECK(!rnd->admit(key(99), false, 0.0));
+
+    // lru: least recently used first.
+    auto lru = cache_policy::make("lru", 1000);
+    v = lru->victims(idx, 0, 3, now);
+    EQUAL(v.size(), 3);
+    CHECK(v[0].key == key(0));
+    CHECK(v[2].key == key(2));
+
+    // tinylfu:  entries that have been hit are protected.
+    auto lfu = cache_policy::make("tinylfu", 1000);
+    CHECK(lfu->hit_bits() != 0);
+    for(uint64_t i : {0, 1, 2})
+        idx.touch(key(i), now, lfu->hit_bits());
+    v = lfu->victims(idx, 0, 7, now);
+    EQUAL(v.size(), 7);
+    for(const auto& e : v)
+        CHECK(!(e.meta & lfu->hit_bits()));
+    CHECK(v[0].key == key(3));
+    // ... and they're the last to go.
+    v = lfu->victims(idx, 0, N, now);
+    CHECK(v[7].key == key(0));
+    // The protected segment is at most 80%.  The least recently
+    // used protected entries are demoted.
+    for(uint64_t i=0; i<N-1; ++i)
+        idx.touch(key(i), now, lfu->hit_bits());
+    v = lfu->victims(idx, 0, 2, now);
+    CHECK(v[0].key == key(0));
+    CHECK(v[1].key == key(9));
+    size_t nprotected = 0;
+    for(const auto& e : idx.entries(0))
+        nprotected += (e.meta & lfu->hit_bits()) != 0;
+    EQUAL(nprotected, 8);
+
+    // tinylfu admission.  Without pressure, anything goes.
+    CHECK(lfu->admit(key(100), false, 1.0));
+    // Make the resident entries 'hot', put the cache under pressure
+    // and let the policy see what it would evict.
+    for(int j=0; j<5; ++j)
+        for(uint64_t i=0; i<N; ++i)
+            lfu->record_access(key(i));
+    lfu->note_usage(0.9, 0.8);
+    for(int j=0; j<20; ++j)
+        lfu->victims(idx, 0, 2, now);
+    // A one-hit wonder (e.g., part of a sequential scan) is rejected.
+    lfu->record_access(key(200));
+    CHECK(!lfu->admit(key(200), false, 1.0));
+    // But something that's hotter than the victims gets in.
+    for(int j=0; j<8; ++j)
+        lfu->record_access(key(201));
+    CHECK(lfu->admit(key(201), false, 1.0));
+    // So does anything that's already resident.
+    CHECK(lfu->admit(key(200), true, 1.0));
+    // And when the pressure's off, so does the one-hit wonder.
+    lfu->note_usage(0.5, 0.8);
+    CHECK(lfu->admit(key(200), false, 1.0));
+
+    // A sequential scan of many one-hit wonders, under pressure,
+    // admits (almost) none of them.
+    lfu->note_usage(0.9, 0.8);
+    size_t admitted = 0;
+    for(uint64_t i=1000; i<2000; ++i){
+        lfu->record_access(key(i));
+        admitted += lfu->admit(key(i), false, 1.0);
+    }
+    std::cout << "tinylfu admitted " << admitted << " of 1000 scanned objects\n";
+    CHECK(admitted < 10);
+
+    // A follower never calls victims, but sample_victims tells it as
+    // much about them as victims would, and doesn't change the index.
+    auto follower = cache_policy::make("tinylfu", 1000);
+    for(int j=0; j<5; ++j)
+        for(uint64_t i=0; i<N; ++i)
+            follower->record_access(key(i));
+    follower->note_usage(0.9, 0.8);
+    follower->record_access(key(300));
+    CHECK(follower->admit(key(300), false, 1.0));
+    auto before = idx.entries(0);
+    for(int j=0; j<20; ++j)
+        follower->sample_victims(idx, 0, 2, now);
+    auto after = idx.entries(0);
+    EQUAL(after.size(), before.size());
+    for(size_t i=0; i<after.size() && i<before.size(); ++i)
+        EQUAL(after[i].meta, before[i].meta);
+    CHECK(!follower->admit(key(300), false, 1.0));
+
+    lfu->count_hit();
+    lfu->count_hit();
+    lfu->count_hit();
+    lfu->count_miss();
+    std::ostringstream oss;
+    lfu->report_stats(oss);
+    std::cout << oss.str();
+    CHECK(oss.str().find("dc_policy: tinylfu\n") != std::string::npos);
+    CHECK(oss.str().find("dc_policy_tinylfu_hit_ratio: 0.75\n") != std::string::npos);
+
+    ::unlinkat(rootfd, ".index", 0);
+    return utstatus();
+ }catch(std::exception& e){
+    complain(e, "Exception caught.  main returns 1");
+    return 1;
+ }
@@ -0,0 +1,114 @@
+// A unit test for dccoord.
+
+#include "dccoord.hpp"
+#include <core123/ut.hpp>
+#include <core123/complaints.hpp>
+#include <core123/pathutils.hpp>
+#include <iostream>
+#include <ctime>
+#include <unistd.h>
+#include <sys/wait.h>
+
+using namespace core123;
+
+namespace{
+dccoord::record rec(double usage, unsigned next_dir){
+    dccoord::record r{};
+    r.next_dir = next_dir;
+    r.good_until = ::time(nullptr) + 60;
+    r.usage_fraction = usage;
+    r.injection_probability = 1. - usage;
+    return r;
+}
+}
+
+int main(int argc, char **argv) try {
+    if(argc != 2){
+        std::cerr << "Usage: ut_dccoord dir\n";
+        return 1;
+    }
+    makedirs(argv[1], 0700, true);
+    std::string name = "evictcoord";
+    ::unlink((std::string(argv[1]) + "/" + name).c_str());
+    {
+        // flock is per open file description, so two dccoords in
+        // one process compete just like two processes.
+        dccoord a(argv[1], name);
+        dccoord b(argv[1], name);
+        dccoord::record r;
+        CHECK(!a.latest(&r));
+        CHECK(a.lead());
+        CHECK(a.is_leader());
+        CHECK(a.lead());
+        CHECK(!b.lead());
+        CHECK(!b.is_leader());
+
+        a.publish(rec(0.5, 3));
+        CHECK(b.latest(&r));
+        EQUAL(r.seq, 1u);
+        EQUAL(r.pid, ::getpid());
+        EQUAL(r.next_dir, 3u);
+        EQUAL(r.usage_fraction, 0.5);
+        EQUAL(r.injection_probability, 0.5);
+        CHECK(r.published > 0);
+
+        // Many more than fit in the buffer.  The newest wins.
+        for(unsigned i=0; i<100; ++i)
+            a.publish(rec(i/100., i));
+        CHECK(b.latest(&r));
+        EQUAL(r.seq, 101u);
+        EQUAL(r.next_dir, 99u);
+
+        // A third instance sees the same thing.
+        dccoord c(argv[1], name);
+        CHECK(c.latest(&r));
+        EQUAL(r.seq, 101u);
+        CHECK(!c.lead());
+    }
+    {
+        // The leader went away with a, so somebody else can lead.
+        // The records are still there.
+        dccoord b(argv[1], name);
+        dccoord::record r;
+        CHECK(b.latest(&r));
+        EQUAL(r.seq, 101u);
+        CHECK(b.lead());
+        b.publish(rec(0.25, 7));
+        CHECK(b.latest(&r));
+        EQUAL(r.seq, 102u);
+    }
+    {
+        // A leader that dies without cleaning up (think kill -9)
+        // doesn't keep the lock.
+        int pipefd[2];
+        CHECK(::pipe(pipefd) == 0);
+        pid_t pid = ::fork();
+        if(pid == 0){
+            dccoord child(argv[1], name);
+            bool led = child.lead();
+            if(led)
+                child.publish(rec(0.75, 11));
+            char c = led ? 'y' : 'n';
+            (void)!::write(pipefd[1], &c, 1);
+            ::pause();
+            ::_exit(0);
+        }
+        char c = 0;
+        CHECK(::read(pipefd[0], &c, 1) == 1);
+        EQUAL(c, 'y');
+        dccoord parent(argv[1], name);
+        CHECK(!parent.lead());
+        dccoord::record r;
+        CHECK(parent.latest(&r));
+        EQUAL(r.pid, pid);
+        EQUAL(r.next_dir, 11u);
+        ::kill(pid, SIGKILL);
+        ::waitpid(pid, nullptr, 0);
+        CHECK(parent.lead());
+    }
+    ::unlink((std::string(argv[1]) + "/" + name).c_str());
+    return utstatus();
+ }catch(std::exception& e){
+    complain(e, "Exception caught.  main returns 1");
+    return 1;
+ }
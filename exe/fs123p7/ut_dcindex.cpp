@@ -0,0 +1,191 @@
+// A unit test for dcindex.
+
+#include "dcindex.hpp"
+#include "fs123/acfd.hpp"
+#include <core123/ut.hpp>
+#include <core123/sew.hpp>
+#include <core123/threeroe.hpp>
+#include <core123/complaints.hpp>
+#include <core123/pathutils.hpp>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <chrono>
+
+using namespace core123;
+
+int main(int argc, char **argv) try {
+    if(argc != 2){
+        std::cerr << "Usage: ut_dcindex dir\n";
+        return 1;
+    }
+    makedirs(argv[1], 0700, true);
+    acfd rootfd = sew::open(argv[1], O_DIRECTORY);
+    ::unlinkat(rootfd, ".index", 0);
+    const unsigned hexdigits = 1;
+    int64_t now = 1000000;
+
+    {
+        dcindex idx(rootfd, ".index", hexdigits, 64);
+        EQUAL(idx.ndirs(), 16);
+        EQUAL(idx.slots_per_dir(), 64);
+        EQUAL(idx.nfiles(), 0);
+        CHECK(!idx.complete());
+        CHECK(!idx.obsolete());
+
+        // keys and paths round-trip, and agree with threeroe's
+        // hexdigest, which is what diskcache::hash uses.
+        auto hd = threeroe(std::string("hello")).hexdigest();
+        dcindex::key_t k;
+        CHECK(idx.key_of(hd.substr(0, 1) + "/" + hd.substr(1), &k));
+        EQUAL(idx.relpath(k), hd.substr(0, 1) + "/" + hd.substr(1));
+        EQUAL(idx.dir_of(k), std::stoul(hd.substr(0, 1), nullptr, 16));
+        dcindex::key_t k2;
+        CHECK(idx.key_of(idx.dir_of(k), hd.substr(1), &k2));
+        CHECK(k == k2);
+        CHECK(!idx.key_of(hd.substr(0, 1) + "/" + hd.substr(1) + ".new", &k2));
+        CHECK(!idx.key_of(0, "notahexname", &k2));
+
+        // insert, replace, erase, and the counters that go with them.
+        CHECK(idx.insert(k, 8192, now+100, now));
+        EQUAL(idx.nfiles(), 1);
+        EQUAL(idx.nbytes(), 8192);
+        EQUAL(idx.dir_nfiles(idx.dir_of(k)), 1);
+        CHECK(idx.insert(k, 4096, now+100, now));
+        EQUAL(idx.nfiles(), 1);
+        EQUAL(idx.nbytes(), 4096);
+        CHECK(idx.erase(k));
+        CHECK(!idx.erase(k));
+        EQUAL(idx.nfiles(), 0);
+        EQUAL(idx.nbytes(), 0);
+
+        // Fill one directory (dir 3) with files with increasing atimes,
+        // a few of which are expired.
+        std::vector<dcindex::key_t> keys;
+        for(uint64_t i=0; i<50; ++i){
+            dcindex::key_t ki{(uint64_t(3)<<60) | (i+1), i*0x9e3779b97f4a7c15};
+            keys.push_back(ki);
+            CHECK(idx.insert(ki, 4096, (i%10 == 9) ? now-1 : now+100, now+i));
+        }
+        EQUAL(idx.dir_nfiles(3), 50);
+        EQUAL(idx.nfiles(), 50);
+        auto cands = idx.candidates(3, 8, now);
+        EQUAL(cands.size(), 8);
+        // the 5 expired ones first, then the oldest.
+        for(int i=0; i<5; ++i)
+            EQUAL(cands[i].expires, now-1);
+        CHECK(cands[5].key == keys[0]);
+        CHECK(cands[6].key == keys[1]);
+        CHECK(cands[7].key == keys[2]);
+        // touch moves an entry to the back of the line, but only if
+        // it's been long enough since the last touch.
+        idx.touch(keys[0], now+1);
+        CHECK(idx.candidates(3, 6, now)[5].key == keys[0]);
+        idx.touch(keys[0], now+1000);
+        CHECK(idx.candidates(3, 6, now)[5].key == keys[1]);
+
+        // Erasing from the middle of probe sequences (backward-shift
+        // deletion) mustn't lose anything else.
+        for(size_t i=0; i<keys.size(); i+=2)
+            CHECK(idx.erase(keys[i]));
+        for(size_t i=1; i<keys.size(); i+=2)
+            CHECK(!idx.candidates(3, 100, now).empty() && idx.erase(keys[i]));
+        EQUAL(idx.dir_nfiles(3), 0);
+
+        // A region holds at most slots_per_dir entries.
+        size_t inserted = 0;
+        for(uint64_t i=0; i<100; ++i)
+            inserted += idx.insert({(uint64_t(5)<<60) | (i+1), i}, 4096, now+100, now);
+        EQUAL(inserted, 64);
+        EQUAL(idx.dir_nfiles(5), 64);
+
+        // audit replaces what's in the index with what's "on disk".
+        // Entries that are found keep their expires and atime.
+        // Entries that aren't are dropped unless they're newer than
+        // the scan.
+        CHECK(idx.claim_audit(5, now, 3600));
+        CHECK(!idx.claim_audit(5, now, 3600)); // already claimed
+        std::vector<dcindex::found_file> found;
+        for(uint64_t i=0; i<10; ++i)
+            found.push_back({{(uint64_t(5)<<60) | (i+1), i}, 8192, now-10});
+        found.push_back({{(uint64_t(5)<<60) | 1000, 1000}, 8192, now-10}); // wasn't indexed
+        idx.touch({(uint64_t(5)<<60) | 20, 19}, now+120); // touched during the scan
+        EQUAL(idx.audit(5, found, now+60), 54);
+        EQUAL(idx.dir_nfiles(5), 12);
+        EQUAL(idx.dir_nbytes(5), 11*8192 + 4096);
+        EQUAL(idx.nfiles(), 12);
+        CHECK(!idx.claim_audit(5, now+100, 3600));
+        CHECK(idx.claim_audit(5, now+60+3600, 3600));
+        for(unsigned d=0; d<idx.ndirs(); ++d)
+            if(d != 5)
+                idx.audit(d, {}, now);
+        CHECK(idx.complete());
+    }
+
+    {
+        // The index persists ...
+        dcindex idx(rootfd, ".index", hexdigits, 64);
+        EQUAL(idx.nfiles(), 12);
+        CHECK(idx.complete());
+        // ... and is shared.
+        dcindex idx2(rootfd, ".index", hexdigits, 64);
+        idx2.insert({(uint64_t(7)<<60) | 1, 1}, 4096, now+100, now);
+        EQUAL(idx.nfiles(), 13);
+        EQUAL(idx.dir_nfiles(7), 1);
+        // A different geometry replaces it, and the old one is
+        // marked obsolete.
+        dcindex idx3(rootfd, ".index", hexdigits, 1000);
+        EQUAL(idx3.slots_per_dir(), 1000);
+        EQUAL(idx3.nfiles(), 0);
+        CHECK(idx.obsolete());
+        CHECK(idx2.obsolete());
+        CHECK(!idx3.obsolete());
+    }
+
+    {
+        // A garbled index is replaced.
+        acfd fd = sew::openat(rootfd, ".index", O_WRONLY);
+        sew::pwrite(fd, "garbage", 7, 0);
+        fd.close();
+        dcindex idx(rootfd, ".index", hexdigits, 64);
+        EQUAL(idx.nfiles(), 0);
+        CHECK(!idx.complete());
+    }
+
+    {
+        // Many threads inserting and erasing in the same
+        // directories.  The counters should come out right.
+        dcindex idx(rootfd, ".index", 2, dcindex::recommended_slots_per_dir(100000, 2));
+        const int NTHREADS = 4;
+        const uint64_t NPER = 20000;
+        std::vector<std::thread> threads;
+        auto start = std::chrono::steady_clock::now();
+        for(int t=0; t<NTHREADS; ++t)
+            threads.emplace_back([&idx, t, now](){
+                                     for(uint64_t i=0; i<NPER; ++i){
+                                         auto hp = threeroe(&i, sizeof(i), t).hashpair64();
+                                         idx.insert(hp, 4096, now+100, now);
+                                         if(i%4 == 0)
+                                             idx.erase(hp);
+                                         else
+                                             idx.touch(hp, now+100);
+                                     }
+                                 });
+        for(auto& th : threads)
+            th.join();
+        auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        EQUAL(idx.nfiles(), NTHREADS*NPER*3/4);
+        EQUAL(idx.nbytes(), 4096*idx.nfiles());
+        size_t sum = 0;
+        for(unsigned d=0; d<idx.ndirs(); ++d)
+            sum += idx.dir_nfiles(d);
+        EQUAL(sum, idx.nfiles());
+        std::cout << NTHREADS*NPER << " inserts: " << 1.e6*elapsed/(NTHREADS*NPER) << " usec per insert+touch/erase\n";
+        std::cout << "index file size: " << idx.file_size() << " for " << idx.nfiles() << " files\n";
+    }
+    ::unlinkat(rootfd, ".index", 0);
+    return utstatus();
+ }catch(std::exception& e){
+    complain(e, "Exception caught.  main returns 1");
+    return 1;
+ }
@@ -0,0 +1,113 @@
+// A unit test for dcsample.
+
+#include "dcsample.hpp"
+#include <core123/ut.hpp>
+#include <core123/complaints.hpp>
+#include <iostream>
+#include <random>
+#include <cmath>
+
+using namespace core123;
+
+int main(int, char **) try {
+    const double z = 3.;
+    // Nothing sampled:  no idea.
+    {
+        dcsample s;
+        EQUAL(s.ndirs(), 0u);
+        CHECK(std::isinf(s.files(16, z).hi));
+        CHECK(std::isinf(s.bytes(16, z).hi));
+    }
+    // One directory gives an estimate, but no interval.
+    {
+        dcsample s;
+        s.add_dir(10, {100, 300});
+        EQUAL(s.files(16, z).value, 160.);
+        EQUAL(s.bytes(16, z).value, 16*10*200.);
+        CHECK(std::isinf(s.files(16, z).hi));
+    }
+    // Identical directories:  the interval is a point.
+    {
+        dcsample s;
+        for(int i=0; i<4; ++i)
+            s.add_dir(10, {200});
+        EQUAL(s.ndirs(), 4u);
+        EQUAL(s.nsizes(), 4u);
+        auto f = s.files(16, z);
+        EQUAL(f.value, 160.);
+        EQUAL(f.lo, 160.);
+        EQUAL(f.hi, 160.);
+        EQUAL(s.bytes(16, z).value, 16*10*200.);
+    }
+    // Empty directories are fine, and lo is never negative.
+    {
+        dcsample s;
+        s.add_dir(0, {});
+        s.add_dir(0, {});
+        s.add_dir(100, {1000});
+        EQUAL(s.files(3, z).value, 100.);
+        EQUAL(s.files(3, z).lo, 0.);
+        CHECK(s.files(3, z).hi > 100.);
+    }
+    // A non-empty directory needs some sizes.
+    {
+        dcsample s;
+        bool threw = false;
+        try{
+            s.add_dir(10, {});
+        }catch(std::exception&){
+            threw = true;
+        }
+        CHECK(threw);
+    }
+    // Coverage:  sample a synthetic cache with files spread randomly
+    // over the directories and sizes drawn from a long-tailed
+    // distribution, many times.  The 3-sigma intervals should
+    // almost always cover the truth.
+    {
+        const size_t Ndirs = 4096;
+        const size_t Nfiles = 1000000;
+        std::mt19937_64 urng(31415);
+        std::vector<std::vector<uint64_t>> dirs(Ndirs);
+        std::lognormal_distribution<double> sizedist(9., 1.5);
+        double truebytes = 0.;
+        for(size_t i=0; i<Nfiles; ++i){
+            uint64_t sz = 4096 + uint64_t(sizedist(urng));
+            dirs[urng()%Ndirs].push_back(sz);
+            truebytes += sz;
+        }
+        const int NTRIALS = 200;
+        int files_covered = 0, bytes_covered = 0;
+        double relhi = 0.;
+        for(int t=0; t<NTRIALS; ++t){
+            dcsample s;
+            for(int d=0; d<16; ++d){
+                auto& dir = dirs[urng()%Ndirs];
+                std::vector<uint64_t> sizes;
+                for(int j=0; j<32; ++j)
+                    sizes.push_back(dir[urng()%dir.size()]);
+                s.add_dir(dir.size(), sizes);
+            }
+            auto f = s.files(Ndirs, z);
+            auto b = s.bytes(Ndirs, z);
+            if(f.lo <= Nfiles && Nfiles <= f.hi)
+                files_covered++;
+            if(b.lo <= truebytes && truebytes <= b.hi)
+                bytes_covered++;
+            relhi += b.hi/truebytes;
+        }
+        std::cout << "files covered " << files_covered << "/" << NTRIALS
+                  << " bytes covered " << bytes_covered << "/" << NTRIALS
+                  << " mean bytes hi/truth " << relhi/NTRIALS
+                  << " with " << 16*32 << " stats of " << Nfiles << " files\n";
+        CHECK(files_covered >= NTRIALS*95/100);
+        CHECK(bytes_covered >= NTRIALS*90/100);
+        // Narrow enough to be useful:  a cache at half its limit is
+        // usually clearly below an 80% threshold.
+        CHECK(relhi/NTRIALS < 1.6);
+    }
+    return utstatus();
+ }catch(std::exception& e){
+    complain(e, "Exception caught.  main returns 1");
+    return 1;
+ }
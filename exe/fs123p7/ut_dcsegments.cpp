@@ -0,0 +1,323 @@
+// A unit test and benchmark for dcsegments.
+//
+// Usage:  ut_dcsegments dir [nbench]
+//
+// With nbench, it also writes nbench objects and reports how long it
+// takes a new dcsegments to catch up with them, and how much memory
+// its index uses.
+
+#include "dcsegments.hpp"
+#include "fs123/acfd.hpp"
+#include <core123/ut.hpp>
+#include <core123/sew.hpp>
+#include <core123/complaints.hpp>
+#include <core123/pathutils.hpp>
+#include <core123/strutils.hpp>
+#include <core123/svto.hpp>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <cstring>
+#include <unistd.h>
+
+using namespace core123;
+
+namespace{
+dcsegments::key_t key(uint64_t i){
+    return {i, i*0x9e3779b97f4a7c15};
+}
+
+std::string value(uint64_t i, size_t len = 1000){
+    std::string ret = fmt("value %llu:", (unsigned long long)i);
+    ret.resize(len, char('a' + i%26));
+    return ret;
+}
+
+bool put(dcsegments& s, uint64_t i, const std::string& v){
+    // Two iovecs, like the diskcache.
+    struct iovec iov[2] = {{const_cast<char*>(v.data()), 10},
+                           {const_cast<char*>(v.data()+10), v.size()-10}};
+    return s.put(key(i), iov, 2);
+}
+
+bool get(dcsegments& s, uint64_t i, std::string* v){
+    uchar_blob blob;
+    size_t len;
+    if(!s.get(key(i), &blob, &len))
+        return false;
+    v->assign(reinterpret_cast<const char*>(blob.data()) + dcsegments::payload_offset, len);
+    return true;
+}
+
+bool has(dcsegments& s, uint64_t i, const std::string& expected){
+    std::string v;
+    return get(s, i, &v) && v == expected;
+}
+
+// rss_bytes - our resident set size, from /proc/self/statm.
+size_t rss_bytes(){
+    std::ifstream ifs("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    ifs >> pages >> resident;
+    return resident * ::sysconf(_SC_PAGESIZE);
+}
+
+void rmsegments(int rootfd){
+    try{
+        acDIR dp = sew::opendirat(rootfd, "segments");
+        while(auto e = sew::readdir(dp)){
+            if(e->d_name[0] != '.')
+                ::unlinkat(dirfd(dp), e->d_name, 0);
+        }
+    }catch(std::exception&){}
+}
+}
+
+int main(int argc, char **argv) try {
+    if(argc != 2 && argc != 3){
+        std::cerr << "Usage: ut_dcsegments dir [nbench]\n";
+        return 1;
+    }
+    size_t nbench = argc>2 ? svto<size_t>(argv[2]) : 0;
+    makedirs(argv[1], 0700, true);
+    acfd rootfd = sew::open(argv[1], O_DIRECTORY);
+    rmsegments(rootfd);
+    const size_t SEGBYTES = 64*1024;
+    const size_t INDEXBYTES = 1<<20;
+    {
+        dcsegments a(rootfd, "segments", SEGBYTES, INDEXBYTES);
+        EQUAL(a.nsegments(), 0);
+        EQUAL(a.disk_bytes(), 0);
+        std::string v;
+        CHECK(!get(a, 1, &v));
+
+        // Round trip.
+        CHECK(put(a, 1, value(1)));
+        CHECK(put(a, 2, value(2)));
+        CHECK(has(a, 1, value(1)));
+        CHECK(has(a, 2, value(2)));
+        EQUAL(a.nobjects(), 2);
+        EQUAL(a.nsegments(), 1);
+        EQUAL(a.disk_bytes(), 2*(dcsegments::payload_offset + 1000));
+
+        // The newest record wins.
+        CHECK(put(a, 1, value(101)));
+        CHECK(has(a, 1, value(101)));
+        EQUAL(a.nobjects(), 2);
+
+        // erase appends a tombstone, once.
+        a.erase(key(2));
+        CHECK(!get(a, 2, &v));
+        auto before = a.disk_bytes();
+        a.erase(key(2));
+        EQUAL(a.disk_bytes(), before);
+        // A key we don't know might be in a record we haven't read
+        // yet, so it gets a tombstone too.
+        a.erase(key(999));
+        EQUAL(a.disk_bytes(), before + dcsegments::payload_offset);
+
+        // Too big for a segment.
+        CHECK(!put(a, 3, value(3, SEGBYTES)));
+
+        // A second instance (think:  another process) doesn't know
+        // about the records until it catches up ...
+        dcsegments b(rootfd, "segments", SEGBYTES, INDEXBYTES);
+        CHECK(!get(b, 1, &v));
+        b.catch_up();
+        CHECK(has(b, 1, value(101)));
+        CHECK(!get(b, 2, &v));
+        // ... but only sees subsequent puts after it catches up.
+        CHECK(put(a, 4, value(4)));
+        CHECK(!get(b, 4, &v));
+        b.catch_up();
+        CHECK(has(b, 4, value(4)));
+        // b has its own active segment, and a sees b's records.
+        CHECK(put(b, 5, value(5)));
+        EQUAL(b.nsegments(), 2);
+        a.catch_up();
+        CHECK(has(a, 5, value(5)));
+        // Writes in both directions resolve to the latest.
+        CHECK(put(b, 4, value(204)));
+        a.catch_up();
+        CHECK(has(a, 4, value(204)));
+        b.erase(key(5));
+        a.catch_up();
+        CHECK(!get(a, 5, &v));
+        // A tombstone for a record that a hasn't read yet beats it
+        // when a catches up.
+        CHECK(put(b, 7, value(7)));
+        a.erase(key(7));
+        a.catch_up();
+        CHECK(!get(a, 7, &v));
+
+        // A torn record at the end of b's segment (b is still
+        // writing it, or crashed) stops a's scan, without harm.
+        a.catch_up();
+        std::string junk(100, 'x');
+        CHECK(put(b, 6, value(6)));
+        // Scribble over the header of b's newest record.
+        {
+            acDIR dp = sew::opendirat(rootfd, "segments");
+            acfd fd;
+            struct stat sb;
+            std::string newest;
+            while(auto e = sew::readdir(dp)){
+                std::string name = e->d_name;
+                if(name[0] != '.' && name > newest)
+                    newest = name;
+            }
+            fd = sew::openat(rootfd, ("segments/" + newest).c_str(), O_RDWR);
+            sew::fstat(fd, &sb);
+            auto off = sb.st_size - (dcsegments::payload_offset + 1000);
+            sew::pwrite(fd, junk.data(), 8, off);
+        }
+        a.catch_up();
+        CHECK(!get(a, 6, &v));
+        // b still has it in its index, but the read fails the
+        // checksum.
+        CHECK(!get(b, 6, &v));
+        std::ostringstream oss;
+        b.report_stats(oss);
+        CHECK(oss.str().find("dc_segment_corrupt: 1\n") != std::string::npos);
+    }
+
+    rmsegments(rootfd);
+    {
+        // Fill several segments, overwriting the same 30 keys.
+        dcsegments a(rootfd, "segments", SEGBYTES, INDEXBYTES);
+        const uint64_t NKEYS = 30;
+        for(int round=0; round<10; ++round)
+            for(uint64_t i=0; i<NKEYS; ++i)
+                CHECK(put(a, i, value(i + 1000*round)));
+        auto nseg = a.nsegments();
+        std::cout << "after 300 puts: " << nseg << " segments, " << a.disk_bytes() << " bytes\n";
+        CHECK(nseg > 4);
+        EQUAL(a.nobjects(), NKEYS);
+        // Plenty of room, so maintain compacts the segment with the
+        // most garbage.
+        auto before = a.disk_bytes();
+        a.maintain(100*SEGBYTES);
+        CHECK(a.disk_bytes() < before);
+        for(uint64_t i=0; i<NKEYS; ++i)
+            CHECK(has(a, i, value(i + 9000)));
+        // Another instance agrees, even after the compaction.
+        dcsegments b(rootfd, "segments", SEGBYTES, INDEXBYTES);
+        b.catch_up();
+        for(uint64_t i=0; i<NKEYS; ++i)
+            CHECK(has(b, i, value(i + 9000)));
+        EQUAL(b.disk_bytes(), a.disk_bytes());
+        while(a.nsegments() > 2){
+            auto n = a.nsegments();
+            a.maintain(100*SEGBYTES);
+            if(a.nsegments() == n)
+                break;
+        }
+        for(uint64_t i=0; i<NKEYS; ++i)
+            CHECK(has(a, i, value(i + 9000)));
+        // b notices that the compacted segments are gone, and picks
+        // up the copies.
+        b.catch_up();
+        for(uint64_t i=0; i<NKEYS; ++i)
+            CHECK(has(b, i, value(i + 9000)));
+
+        // Segments that are active in another instance are left
+        // alone, no matter what.
+        CHECK(put(b, 500, value(500)));
+        for(int i=0; i<10; ++i)
+            a.maintain(0);
+        a.catch_up();
+        CHECK(has(a, 500, value(500)));
+    }
+
+    rmsegments(rootfd);
+    {
+        // Over budget, maintain drops the oldest sealed segment.
+        dcsegments a(rootfd, "segments", SEGBYTES, INDEXBYTES);
+        for(uint64_t i=100; i<300; ++i)
+            CHECK(put(a, i, value(i)));
+        auto nseg = a.nsegments();
+        auto before = a.disk_bytes();
+        a.maintain(SEGBYTES);
+        EQUAL(a.nsegments(), nseg-1);
+        CHECK(a.disk_bytes() < before);
+        // The oldest objects are gone, the newest are not.
+        std::string v;
+        CHECK(!get(a, 100, &v));
+        CHECK(has(a, 299, value(299)));
+        EQUAL(a.nobjects(), 200 - SEGBYTES/(dcsegments::payload_offset + 1000));
+        std::ostringstream oss;
+        a.report_stats(oss);
+        std::cout << oss.str();
+        CHECK(oss.str().find("dc_segment_evictions: 1\n") != std::string::npos);
+    }
+    rmsegments(rootfd);
+    {
+        // The index is bounded.  When it's full, puts of new keys
+        // fail (and write nothing), but existing keys can still be
+        // overwritten and erased.  16 shards of 64 slots is as small
+        // as it gets, and a shard is full at 48.
+        dcsegments a(rootfd, "segments", SEGBYTES, 16*64*32);
+        uint64_t i = 0;
+        while(put(a, i, value(i, 100)))
+            ++i;
+        std::cout << "tiny index: " << i << " objects, " << a.index_bytes() << " bytes\n";
+        CHECK(i >= 48 && i <= 16*48);
+        EQUAL(a.index_bytes(), 16*64*32);
+        auto before = a.disk_bytes();
+        CHECK(!put(a, i, value(i, 100)));
+        EQUAL(a.disk_bytes(), before);
+        CHECK(put(a, 0, value(1000, 100)));
+        CHECK(has(a, 0, value(1000, 100)));
+        a.erase(key(1));
+        std::string v;
+        CHECK(!get(a, 1, &v));
+        // Another instance with a tiny index indexes what it can and
+        // counts the rest.
+        dcsegments b(rootfd, "segments", SEGBYTES, 16*64*32);
+        b.catch_up();
+        EQUAL(b.nobjects(), a.nobjects());
+    }
+    rmsegments(rootfd);
+    if(nbench){
+        // The benchmark:  how long does it take a new instance to
+        // catch up with nbench objects, and how much memory does the
+        // index take?  Object sizes are uniform in [100, 4000).
+        const size_t BIGSEG = 64<<20;
+        const size_t BIGINDEX = size_t(1)<<30;
+        {
+            dcsegments a(rootfd, "segments", BIGSEG, BIGINDEX);
+            uint64_t rng = 1;
+            for(uint64_t i=0; i<nbench; ++i){
+                rng = rng*6364136223846793005ull + 1442695040888963407ull;
+                CHECK(put(a, i, value(i, 100 + (rng>>33)%3900)));
+            }
+        }
+        // Drop the page cache (if we can) for a cold start.
+        ::sync();
+        bool cold = false;
+        int dcfd = ::open("/proc/sys/vm/drop_caches", O_WRONLY);
+        if(dcfd >= 0){
+            cold = ::write(dcfd, "3", 1) == 1;
+            ::close(dcfd);
+        }
+        auto rss0 = rss_bytes();
+        auto t0 = std::chrono::steady_clock::now();
+        dcsegments b(rootfd, "segments", BIGSEG, BIGINDEX);
+        b.catch_up();
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        auto rss1 = rss_bytes();
+        EQUAL(b.nobjects(), nbench);
+        std::cout << nbench << " objects, " << b.disk_bytes() << " bytes in " << b.nsegments() << " segments\n"
+                  << "catch_up (" << (cold ? "cold" : "warm") << " page cache): " << secs << " sec, "
+                  << b.disk_bytes()/secs/1e6 << " MB/s\n"
+                  << "index: " << double(b.index_bytes())/nbench << " bytes per object, RSS grew by "
+                  << double(rss1 - rss0)/nbench << " bytes per object\n";
+    }
+    rmsegments(rootfd);
+    ::unlinkat(rootfd, "segments", AT_REMOVEDIR);
+    return utstatus();
+ }catch(std::exception& e){
+    complain(e, "Exception caught.  main returns 1");
+    return 1;
+ }
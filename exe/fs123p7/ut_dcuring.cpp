@@ -0,0 +1,201 @@
+// A unit test and benchmark for dcuring.
+//
+// Usage:  ut_dcuring dir [nfiles [filesize [nthreads]]]
+//
+// With nfiles, it also fills dir with nfiles files of filesize
+// (default 4096) bytes, and then reads them all back with nthreads
+// (default 4) threads, first with the syscalls the diskcache uses
+// (openat, fstat, read, read, close for a hit and openat, writev,
+// close, renameat for a fill) and then with dcuring.  For each, it
+// reports the time a thread spends on each hit or fill (i.e., how
+// many threads it takes to sustain a given rate, by Little's law)
+// and the CPU time per hit or fill.
+
+#include "dcuring.hpp"
+#include "fs123/acfd.hpp"
+#include <core123/ut.hpp>
+#include <core123/sew.hpp>
+#include <core123/complaints.hpp>
+#include <core123/pathutils.hpp>
+#include <core123/strutils.hpp>
+#include <core123/svto.hpp>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <cstring>
+#include <sys/resource.h>
+#include <unistd.h>
+
+using namespace core123;
+
+namespace{
+using hrclk = std::chrono::steady_clock;
+
+double cpu_seconds(){
+    struct rusage ru;
+    ::getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + 1.e-6*(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec);
+}
+
+std::string contents(size_t i, size_t len){
+    std::string ret = fmt("file %zu:", i);
+    ret.resize(len, char('a' + i%26));
+    return ret;
+}
+
+// The diskcache's iovecs:  a header, the content, and a trailer.
+const size_t HDRLEN = 64;
+
+// syscall_read - what diskcache::deserialize_no_unlink does.
+size_t syscall_read(int dirfd, const std::string& path){
+    acfd fd = ::openat(dirfd, path.c_str(), O_RDONLY);
+    if(!fd)
+        return 0;
+    struct stat sb;
+    sew::fstat(fd, &sb);
+    char hdr[HDRLEN];
+    size_t n = sew::read(fd, hdr, HDRLEN);
+    uchar_blob b(sb.st_size - HDRLEN);
+    n += sew::read(fd, b.data(), b.size());
+    return n;
+}
+
+// syscall_create - what diskcache::serialize does.
+void syscall_create(int dirfd, const std::string& tmppath, const std::string& path, const struct iovec* iov, int iovcnt){
+    acfd fd = sew::openat(dirfd, tmppath.c_str(), O_WRONLY|O_CREAT|O_EXCL, 0600);
+    sew::writev(fd, iov, iovcnt);
+    fd.close();
+    sew::renameat(dirfd, tmppath.c_str(), dirfd, path.c_str());
+}
+
+size_t uring_read(int dirfd, const std::string& path){
+    uchar_blob b;
+    if(dcuring::thread_ring()->read_file(dirfd, path, &b))
+        return 0;
+    return b.size();
+}
+
+void uring_create(int dirfd, const std::string& tmppath, const std::string& path, const struct iovec* iov, int iovcnt){
+    dcuring::op_t op;
+    if(int eno = dcuring::thread_ring()->create_file(dirfd, tmppath, path, iov, iovcnt, &op))
+        throw se(eno, fmt("create_file failed in op %d", int(op)));
+}
+
+// bench - nthreads threads each call f for every nthreads'th file.
+template <typename F>
+void bench(const char* what, size_t nfiles, unsigned nthreads, F f){
+    std::atomic<double> thread_seconds{0.};
+    auto cpu0 = cpu_seconds();
+    auto t0 = hrclk::now();
+    std::vector<std::thread> threads;
+    for(unsigned t=0; t<nthreads; ++t)
+        threads.emplace_back([&, t](){
+                                 auto tt0 = hrclk::now();
+                                 for(size_t i=t; i<nfiles; i+=nthreads)
+                                     f(i);
+                                 auto secs = std::chrono::duration<double>(hrclk::now() - tt0).count();
+                                 // atomic<double>::fetch_add is C++20.
+                                 auto old = thread_seconds.load();
+                                 while(!thread_seconds.compare_exchange_weak(old, old+secs))
+                                     ;
+                             });
+    for(auto& th : threads)
+        th.join();
+    auto wall = std::chrono::duration<double>(hrclk::now() - t0).count();
+    auto cpu = cpu_seconds() - cpu0;
+    std::cout << what << ":  " << nfiles/wall << " per second, "
+              << thread_seconds/nfiles*1e6 << " thread-usec each, "
+              << cpu/nfiles*1e6 << " cpu-usec each\n";
+}
+}
+
+int main(int argc, char **argv) try {
+    if(argc < 2 || argc > 5){
+        std::cerr << "Usage: ut_dcuring dir [nfiles [filesize [nthreads]]]\n";
+        return 1;
+    }
+    size_t nfiles = argc>2 ? svto<size_t>(argv[2]) : 0;
+    size_t filesize = argc>3 ? svto<size_t>(argv[3]) : 4096;
+    unsigned nthreads = argc>4 ? svto<unsigned>(argv[4]) : 4;
+    makedirs(argv[1], 0700, true);
+    acfd dirfd = sew::open(argv[1], O_DIRECTORY);
+
+    if(!dcuring::available()){
+        std::cout << "dcuring is not available here.  The diskcache will use the syscalls.\n";
+        CHECK(dcuring::thread_ring() == nullptr);
+        return utstatus(true);
+    }
+    auto ring = dcuring::thread_ring();
+    CHECK(ring);
+    ::unlinkat(dirfd, "a", 0);
+    ::unlinkat(dirfd, "a.new", 0);
+
+    // A round trip.
+    std::string hdr(HDRLEN, 'h');
+    std::string data = contents(1, 10000);
+    struct iovec iov[2] = {{&hdr[0], hdr.size()}, {&data[0], data.size()}};
+    dcuring::op_t op;
+    EQUAL(ring->create_file(dirfd, "a.new", "a", iov, 2, &op), 0);
+    uchar_blob b;
+    EQUAL(ring->read_file(dirfd, "a", &b), 0);
+    EQUAL(std::string(reinterpret_cast<char*>(b.data()), b.size()), hdr + data);
+    CHECK(::faccessat(dirfd, "a.new", F_OK, 0) != 0);
+
+    // O_EXCL:  if the temporary exists, the open fails, and nothing
+    // else happens.
+    acfd tmp = sew::openat(dirfd, "a.new", O_WRONLY|O_CREAT|O_EXCL, 0600);
+    tmp.close();
+    EQUAL(ring->create_file(dirfd, "a.new", "a", iov, 1, &op), EEXIST);
+    EQUAL(op, dcuring::OPEN);
+    EQUAL(ring->read_file(dirfd, "a", &b), 0);
+    EQUAL(b.size(), hdr.size() + data.size());
+    sew::unlinkat(dirfd, "a.new", 0);
+
+    // A miss, and things the syscalls should handle.
+    EQUAL(ring->read_file(dirfd, "nonexistent", &b), ENOENT);
+    sew::mkdirat(dirfd, "d", 0700);
+    EQUAL(ring->read_file(dirfd, "d", &b), dcuring::FALLBACK);
+    sew::unlinkat(dirfd, "d", AT_REMOVEDIR);
+    acfd empty = sew::openat(dirfd, "empty", O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    EQUAL(ring->read_file(dirfd, "empty", &b), dcuring::FALLBACK);
+    sew::unlinkat(dirfd, "empty", 0);
+
+    // The ring is still good after all that.
+    EQUAL(ring->read_file(dirfd, "a", &b), 0);
+    EQUAL(dcuring::thread_ring(), ring);
+    sew::unlinkat(dirfd, "a", 0);
+
+    if(nfiles){
+        std::string body = contents(0, filesize > HDRLEN ? filesize-HDRLEN : 1);
+        // Each engine fills its own files, so both create new ones.
+        auto name = [](size_t i, bool uring = false){ return fmt("%s%zu", uring ? "u" : "f", i); };
+        auto create = [&](size_t i, bool uring){
+                          std::string h(HDRLEN, 'h');
+                          struct iovec v[2] = {{&h[0], h.size()}, {&body[0], body.size()}};
+                          auto path = name(i, uring);
+                          if(uring)
+                              uring_create(dirfd, path+".new", path, v, 2);
+                          else
+                              syscall_create(dirfd, path+".new", path, v, 2);
+                      };
+        std::cout << nfiles << " files of " << HDRLEN + body.size() << " bytes, " << nthreads << " threads\n";
+        bench("syscall fill", nfiles, nthreads, [&](size_t i){ create(i, false); });
+        bench("dcuring fill", nfiles, nthreads, [&](size_t i){ create(i, true); });
+        std::atomic<size_t> bad{0};
+        for(int pass=0; pass<2; ++pass){
+            bench("syscall hit ", nfiles, nthreads, [&](size_t i){ if(syscall_read(dirfd, name(i)) != HDRLEN+body.size()) bad++; });
+            bench("dcuring hit ", nfiles, nthreads, [&](size_t i){ if(uring_read(dirfd, name(i)) != HDRLEN+body.size()) bad++; });
+        }
+        EQUAL(bad, 0);
+        for(size_t i=0; i<nfiles; ++i){
+            ::unlinkat(dirfd, name(i).c_str(), 0);
+            ::unlinkat(dirfd, name(i, true).c_str(), 0);
+        }
+    }
+    return utstatus(true);
+}catch(std::exception& e){
+    complain(e, "Exception caught.  main returns 1");
+    return 1;
+}
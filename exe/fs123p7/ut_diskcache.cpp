@@ -4,7 +4,13 @@
 #include "fs123/content_codec.hpp"
 #include <core123/diag.hpp>
 #include <core123/envto.hpp>
+#include <core123/sew.hpp>
 #include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <future>
 
 using namespace core123;
 
@@ -14,14 +20,59 @@ const int N=100;
 
 reply123 synthetic_reply(int i){
     // ttl is only one second.
-    auto ret = reply123{0, 99, "the contents is " + std::to_string(i), content_codec::CE_IDENT, 0, 1, 0, 0};
+    auto ret = reply123{0, 99, shared_padded_uchar_span::copy_of("the contents is " + std::to_string(i)), content_codec::CE_IDENT, 0, 1, 0, 0};
     return ret;
 }
 
 bool operator!=(const reply123& a, const reply123& b){
-    return a.content != b.content;
+    return as_str_view(a.content) != as_str_view(b.content);
 }
 
+// slow_upstream - counts its calls, and takes a while to answer, so
+// that concurrent requests for the same urlstem overlap.
+struct slow_upstream : public backend123{
+    std::atomic<int> calls{0};
+    bool refresh(const req123& req, reply123* r) override{
+        calls++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        *r = reply123{0, 99, shared_padded_uchar_span::copy_of("upstream " + req.urlstem), content_codec::CE_IDENT, 0, 100, 0, 0};
+        return true;
+    }
+    std::ostream& report_stats(std::ostream& os) override { return os; }
+};
+
+// revalidating_upstream - answers the first request for a urlstem
+// with content that's already stale (max-age=0), and every request
+// after that with a 304 that makes it fresh for 100 seconds.
+struct revalidating_upstream : public backend123{
+    std::atomic<int> calls{0};
+    bool refresh(const req123& req, reply123* r) override{
+        calls++;
+        if(r->valid()){
+            r->last_refresh = clk123_t::now();
+            r->expires = r->last_refresh + std::chrono::seconds(100);
+            return false;
+        }
+        *r = reply123{0, 99, shared_padded_uchar_span::copy_of(std::string(100000, 'r') + req.urlstem), content_codec::CE_IDENT, 0, 0, 777, 0};
+        return true;
+    }
+    std::ostream& report_stats(std::ostream& os) override { return os; }
+};
+
+// cloggable_diskcache - exposes the threadpool, so the test can keep
+// it busy.
+struct cloggable_diskcache : public diskcache{
+    using diskcache::diskcache;
+    using diskcache::tp;
+};
+
+// demotable_diskcache - exposes maybe_demote, which is otherwise
+// only called by the eviction thread.
+struct demotable_diskcache : public diskcache{
+    using diskcache::diskcache;
+    using diskcache::maybe_demote;
+};
+
 int main(int argc, char **argv){
     auto diagnames = envto<std::string>("Fs123DiagNames", "");
     if(!diagnames.empty()){
@@ -37,6 +88,11 @@ int main(int argc, char **argv){
     volatiles_t vols;
     vols.dc_maxfiles=100;
     vols.dc_maxmbytes=1000;
+    // The tests below serialize and deserialize files directly.  Keep
+    // small objects out of the segments until the end.
+    ::setenv("Fs123DiskcacheSmallObjectBytes", "0", 1);
+    // The index is opt-in.  Exercise it.
+    ::setenv("Fs123DiskcacheIndex", "1", 1);
     diskcache dc(upstream.get(), argv[1], 12345, vols); // tiny - 100 files and 1MB.
 
     // sleep for long enough to let the eviction thread run once
@@ -59,11 +115,28 @@ int main(int argc, char **argv){
         auto d = dc.deserialize(h);
         if(d.fresh()){
             if( d != synthetic_reply(i) )
-                std::cerr << "Oops.  Mismatch on " << i << " got '" << d.content << "' expected '" << synthetic_reply(i).content << "'\n";
+                std::cerr << "Oops.  Mismatch on " << i << " got '" << as_str_view(d.content) << "' expected '" << as_str_view(synthetic_reply(i).content) << "'\n";
             ngood++;
         }
     }
     std::cout << "Hit " << ngood << "\n";
+
+    // The index in the cache root is shared.  Another dcindex opened
+    // on the same root sees everything dc serialized.
+    {
+        acfd rootfd = sew::open(argv[1], O_DIRECTORY);
+        dcindex idx(rootfd, ".index", 1, dcindex::recommended_slots_per_dir(vols.dc_maxfiles, 1));
+        std::cout << "Indexed " << idx.nfiles() << " files " << idx.nbytes() << " bytes\n";
+        if(idx.nfiles() != N || idx.nbytes() != N*dcindex::accounting_bytes(1)){
+            std::cerr << "Oops.  Index is wrong\n";
+            return 1;
+        }
+        dcindex::key_t key;
+        if(!idx.key_of(dc.hash("0"), &key) || idx.relpath(key) != dc.hash("0")){
+            std::cerr << "Oops.  Index keys don't match diskcache::hash\n";
+            return 1;
+        }
+    }
     
     // Now let's sleep for long enough that everything expiresand see what happens:
     std::cout << "Sleep for 2 seconds\n";
@@ -83,5 +156,270 @@ int main(int argc, char **argv){
     }
     std::cout << "Hit " << ngood << "\n";
 
+    // How many bytes do we copy on the way from the disk to a
+    // consumer of a 128KiB chunk?  deserialize reads directly into
+    // the shared content buffer, and copy() (e.g., for a background
+    // refresh) and moving the content into a decoded_reply share
+    // that buffer, so the answer should be 0 bytes, beyond the
+    // read() itself.
+    {
+        std::string big(128*1024, 'x');
+        auto bigreply = reply123{0, 99, shared_padded_uchar_span::copy_of(big), content_codec::CE_IDENT, 0, 100, 0, 0};
+        std::string name = "big";
+        std::string h = dc.hash(name);
+        dc.serialize(bigreply, h, name);
+        const int NREADS = 1000;
+        size_t bytes_copied = 0;
+        auto start = std::chrono::steady_clock::now();
+        for(int i=0; i<NREADS; ++i){
+            auto d = dc.deserialize(h);
+            auto bg = d.copy();
+            auto consumer = std::move(d.content);
+            if(bg.content.data() != consumer.data())
+                bytes_copied += consumer.size();
+            if(as_str_view(consumer) != big){
+                std::cerr << "Oops.  Mismatch on 128KiB reply\n";
+                return 1;
+            }
+        }
+        auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "128KiB reads: " << NREADS << " bytes copied per read: " << bytes_copied/NREADS
+                  << " usec per read: " << 1.e6*elapsed/NREADS << "\n";
+        if(bytes_copied)
+            return 1;
+    }
+
+    // Many threads miss on the same urlstem at once.  Only one of
+    // them should go upstream.  The others board its flight and share
+    // its reply.
+    {
+        slow_upstream slow;
+        dc.set_upstream(&slow);
+        const int NTHREADS = 16;
+        std::atomic<int> mismatches{0};
+        std::vector<std::thread> threads;
+        for(int t=0; t<NTHREADS; ++t)
+            threads.emplace_back([&](){
+                                     req123 req("/coalesce");
+                                     reply123 r;
+                                     dc.refresh(req, &r);
+                                     if(as_str_view(r.content) != "upstream /coalesce")
+                                         mismatches++;
+                                 });
+        for(auto& th : threads)
+            th.join();
+        std::cout << NTHREADS << " concurrent misses: " << slow.calls << " upstream requests\n";
+        if(mismatches || slow.calls != 1){
+            std::cerr << "Oops.  Single-flight failed: " << mismatches << " mismatches, " << slow.calls << " upstream calls\n";
+            return 1;
+        }
+    }
+
+    // A foreground miss doesn't wait for a background refresh that's
+    // still queued in a busy threadpool.  It goes upstream itself,
+    // and the background refresh does nothing when it finally runs.
+    {
+        ::setenv("Fs123RefreshThreads", "1", 1);
+        cloggable_diskcache cdc(nullptr, argv[1], 12345, vols);
+        ::unsetenv("Fs123RefreshThreads");
+        slow_upstream slow;
+        cdc.set_upstream(&slow);
+        std::promise<void> unclog;
+        auto clogged = unclog.get_future().share();
+        cdc.tp->submit([clogged](){ clogged.wait(); });
+        // Already stale when it's written.
+        auto stale = reply123{0, 99, shared_padded_uchar_span::copy_of("stale"), content_codec::CE_IDENT, 0, 0, 0, 0};
+        cdc.serialize(stale, cdc.hash("/queued"), "/queued");
+        req123 swrreq("/queued");
+        swrreq.past_stale_while_revalidate = 1000;
+        reply123 r;
+        cdc.refresh(swrreq, &r); // stale, so it queues a background refresh
+        auto fg = std::async(std::launch::async, [&cdc](){
+                                 req123 req("/queued");
+                                 req.max_stale = 0;
+                                 reply123 fr;
+                                 cdc.refresh(req, &fr);
+                                 return std::string(as_str_view(fr.content));
+                             });
+        bool waited = fg.wait_for(std::chrono::seconds(5)) != std::future_status::ready;
+        unclog.set_value();
+        if(waited || fg.get() != "upstream /queued" || slow.calls != 1){
+            std::cerr << "Oops.  Foreground request waited for a queued background refresh\n";
+            return 1;
+        }
+        while(cdc.tp->backlog())
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        std::ostringstream oss;
+        cdc.report_stats(oss);
+        if(slow.calls != 1 || oss.str().find("dc_maybe_rf_superseded: 1\n") == std::string::npos){
+            std::cerr << "Oops.  The superseded background refresh went upstream:  " << slow.calls << " calls\n";
+            return 1;
+        }
+    }
+
+    // With the segments enabled, small objects don't get files of
+    // their own, but they're still found by refresh.
+    {
+        ::setenv("Fs123DiskcacheSmallObjectBytes", "4096", 1);
+        ::setenv("Fs123ForegroundSerialize", "1", 1);
+        diskcache sdc(nullptr, argv[1], 12345, vols);
+        slow_upstream slow;
+        sdc.set_upstream(&slow);
+        req123 req("/small");
+        reply123 r;
+        sdc.refresh(req, &r);
+        r = reply123{};
+        sdc.refresh(req, &r);
+        std::cout << "small object: " << slow.calls << " upstream requests\n";
+        if(as_str_view(r.content) != "upstream /small" || slow.calls != 1){
+            std::cerr << "Oops.  Small object wasn't found in the segments\n";
+            return 1;
+        }
+        struct stat sb;
+        if(::stat((std::string(argv[1]) + "/" + sdc.hash("/small")).c_str(), &sb) == 0){
+            std::cerr << "Oops.  Small object was written to a file\n";
+            return 1;
+        }
+        std::ostringstream oss;
+        sdc.report_stats(oss);
+        if(oss.str().find("dc_segment_deserializes: 1\n") == std::string::npos){
+            std::cerr << "Oops.  Wrong segment stats:\n" << oss.str();
+            return 1;
+        }
+    }
+
+    // A 304 rewrites only the header, in place.  A torn header is
+    // rejected.  dc is over-full by now, and not admitting anything,
+    // so use a new cache.
+    {
+        ::setenv("Fs123DiskcacheSmallObjectBytes", "0", 1);
+        ::setenv("Fs123ForegroundSerialize", "1", 1);
+        std::string rroot = std::string(argv[1]) + ".304";
+        diskcache rdc(nullptr, rroot, 12345, vols);
+        revalidating_upstream reval;
+        rdc.set_upstream(&reval);
+        req123 req("/revalidate");
+        std::string expected = std::string(100000, 'r') + "/revalidate";
+        std::string path = rroot + "/" + rdc.hash("/revalidate");
+        reply123 r;
+        if(rdc.fresh(req)){
+            std::cerr << "Oops.  fresh() before anything was cached\n";
+            return 1;
+        }
+        rdc.refresh(req, &r);             // 200, stale on arrival
+        struct stat sb0, sb1;
+        sew::stat(path.c_str(), &sb0);
+        if(rdc.fresh(req)){
+            std::cerr << "Oops.  fresh() of a stale object\n";
+            return 1;
+        }
+        r = reply123{};
+        rdc.refresh(req, &r);             // 304
+        // fresh() only reads the header, so it sees the update.
+        req123 nc_req = req;
+        nc_req.no_cache = true;
+        if(!rdc.fresh(req) || rdc.fresh(nc_req)){
+            std::cerr << "Oops.  Wrong fresh() after the 304\n";
+            return 1;
+        }
+        r = reply123{};
+        rdc.refresh(req, &r);             // fresh.  No upstream request.
+        sew::stat(path.c_str(), &sb1);
+        std::ostringstream oss;
+        rdc.report_stats(oss);
+        std::cout << "revalidation: " << reval.calls << " upstream requests\n";
+        if(as_str_view(r.content) != expected || !r.fresh() || reval.calls != 2 ||
+           oss.str().find("dc_updates: 1\n") == std::string::npos ||
+           oss.str().find("dc_rf_304_bytes: 0\n") == std::string::npos){
+            std::cerr << "Oops.  304 wasn't an in-place update:\n" << oss.str();
+            return 1;
+        }
+        if(sb0.st_ino != sb1.st_ino){
+            std::cerr << "Oops.  304 replaced the file\n";
+            return 1;
+        }
+        // Tear the header:  scribble on the expiration time.
+        {
+            int fd = sew::open(path.c_str(), O_WRONLY);
+            char junk[4] = {1, 2, 3, 4};
+            // See the comment near reply123_pod_begin in backend123.hpp.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Winvalid-offsetof"
+            sew::pwrite(fd, junk, sizeof(junk), offsetof(reply123, expires) - reply123_pod_begin);
+#pragma GCC diagnostic pop
+            sew::close(fd);
+        }
+        if(rdc.fresh(req)){
+            std::cerr << "Oops.  fresh() of a torn header\n";
+            return 1;
+        }
+        if(rdc.deserialize(rdc.hash("/revalidate")).valid()){
+            std::cerr << "Oops.  Torn header wasn't rejected\n";
+            return 1;
+        }
+        oss.str("");
+        rdc.report_stats(oss);
+        if(oss.str().find("dc_header_retries: 3\n") == std::string::npos){
+            std::cerr << "Oops.  Wrong dc_header_retries:\n" << oss.str();
+            return 1;
+        }
+        // And the next 304 can't update it, because it's gone.
+        r = reply123{};
+        rdc.refresh(req, &r);
+        if(as_str_view(r.content) != expected || reval.calls != 3){
+            std::cerr << "Oops.  Wrong reply after torn header\n";
+            return 1;
+        }
+    }
+
+    // A tiered cache.  New objects land only in the fast tier.
+    // Demoted objects are found in the slow tier, and promoted back
+    // to the fast tier without going upstream.
+    {
+        vols.dc_slow_maxfiles = 1000;
+        vols.dc_slow_maxmbytes = 1000;
+        std::string froot = std::string(argv[1]) + ".fast";
+        std::string sroot = std::string(argv[1]) + ".slow";
+        slow_upstream up;
+        diskcache slow(&up, sroot, 12345, vols, true/*lower_tier*/);
+        demotable_diskcache fast(&slow, froot, 12345, vols);
+        fast.set_lower_tier(&slow);
+        req123 req("/tiered");
+        std::string fpath = froot + "/" + fast.hash("/tiered");
+        std::string spath = sroot + "/" + slow.hash("/tiered");
+        struct stat sb;
+        reply123 r;
+        fast.refresh(req, &r);
+        if(as_str_view(r.content) != "upstream /tiered" || up.calls != 1 ||
+           ::stat(fpath.c_str(), &sb) != 0 || ::stat(spath.c_str(), &sb) == 0){
+            std::cerr << "Oops.  A new object didn't land (only) in the fast tier\n";
+            return 1;
+        }
+        fast.maybe_demote(fast.hash("/tiered"));
+        sew::unlink(fpath.c_str());
+        if(::stat(spath.c_str(), &sb) != 0){
+            std::cerr << "Oops.  Demotion didn't copy to the slow tier\n";
+            return 1;
+        }
+        r = reply123{};
+        fast.refresh(req, &r);
+        if(as_str_view(r.content) != "upstream /tiered" || up.calls != 1 ||
+           ::stat(fpath.c_str(), &sb) != 0){
+            std::cerr << "Oops.  A slow tier hit wasn't promoted\n";
+            return 1;
+        }
+        std::ostringstream oss;
+        fast.report_stats(oss);
+        std::cout << "tiered: " << up.calls << " upstream requests\n";
+        if(oss.str().find("dc_demotions: 1\n") == std::string::npos ||
+           oss.str().find("dc_tier_fast_misses: 2\n") == std::string::npos ||
+           oss.str().find("dc_tier_slow_hits: 1\n") == std::string::npos ||
+           oss.str().find("dc_tier_slow_misses: 1\n") == std::string::npos){
+            std::cerr << "Oops.  Wrong tier stats:\n" << oss.str();
+            return 1;
+        }
+    }
+
     return 0;
 }
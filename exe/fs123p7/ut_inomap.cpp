@@ -1,17 +1,207 @@
-// This is more of a placeholder than a unit test, but it's small and
-// quick, and it exercises some code in inomap.cpp that's arguably
-// too-clever-by-half, so let's keep it around.
+// A unit test and benchmark for inomap.cpp.
+//
+// Usage:  ut_inomap [ndirs [nfiles_per_dir [nthreads]]]
+//
+// Builds a tree of ndirs directories (each in a random earlier
+// directory) with nfiles_per_dir files apiece, then times
+// ino_remember, ino_to_fullname (single- and multi-threaded) and
+// ino_forget, and reports the heap bytes per ino.  The defaults are
+// small enough for 'make check'.  Something like 'ut_inomap 40000 50'
+// is closer to a big, real tree.
 
 #include "inomap.hpp"
+#include <core123/ut.hpp>
+#include <core123/svto.hpp>
+#include <core123/threeroe.hpp>
+#include <core123/complaints.hpp>
+#include <chrono>
+#include <malloc.h>
+#include <thread>
+#include <vector>
+#include <iostream>
+
+using namespace core123;
+
+namespace{
+using hrclk = std::chrono::steady_clock;
+double secs_since(hrclk::time_point t0){
+    return std::chrono::duration<double>(hrclk::now() - t0).count();
+}
+
+// heap_bytes - what malloc has handed out, so we can tell what the
+// inomap costs per ino.
+size_t heap_bytes(){
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    auto mi = mallinfo2();
+#else
+    auto mi = mallinfo();
+#endif
+    return size_t(mi.uordblks) + size_t(mi.hblkhd);
+}
+
+struct node{
+    fuse_ino_t pino;
+    std::string name;
+    fuse_ino_t ino;
+    std::string fullname;
+};
+
+fuse_ino_t mkino(fuse_ino_t pino, const std::string& name){
+    return threeroe(name, pino).hash64() | 2; // never 1
+}
+}
+
+int main(int argc, char** argv) try {
+    size_t ndirs = argc>1 ? svto<size_t>(argv[1]) : 2000;
+    size_t nfiles = argc>2 ? svto<size_t>(argv[2]) : 50;
+    unsigned nthreads = argc>3 ? svto<unsigned>(argv[3]) : 4;
 
-int main(int, char**){
     fuse_ino_t fino = 123456;
     // This is how we call ino_remember in fs123_init to remember the
-    // ino of the root.  Purify thinks there's a UMR (Uninitialized Memory
-    // Reference) here, but some bisection reveals that the problem
-    // problem report can be eliminated by commenting out the strlen()
-    // in inorecord::fill_buf.  So it's almost certainly a false-positive
-    // from purify.  It can't hurt to run it under valgrind, though...
+    // ino of the root.  Purify once thought there was a UMR
+    // (Uninitialized Memory Reference) here.  It can't hurt to run it
+    // under valgrind, though...
     ino_remember(fino, "", 1, ~0);
-    return 0;
+    EQUAL(ino_count(), 1);
+    EQUAL(ino_to_fullname(1), "");
+
+    // The basics
+    ino_remember(1, "a", 10, 0);
+    ino_remember(10, "b", 11, 0);
+    ino_remember(11, "a", 12, 7);
+    EQUAL(ino_to_fullname(10), "/a");
+    EQUAL(ino_to_fullname(11), "/a/b");
+    EQUAL(ino_to_fullname(12), "/a/b/a");
+    EQUAL(ino_to_fullname_validator(12).second, 7);
+    EQUAL(ino_to_pino(12), 11);
+    EQUAL(ino_to_pino_name(12).second, "a");
+    EQUAL(ino_update_validator(12, 9), 7);
+    EQUAL(ino_get_validator(12), 9);
+    bool caught = false;
+    try{
+        ino_update_validator(12, 8);
+    }catch(ino_out_of_order_validator& e){
+        caught = true;
+        EQUAL(e.name, "/a/b/a");
+    }
+    CHECK(caught);
+    // remembering the same ino with a different name is an error.
+    caught = false;
+    try{
+        ino_remember(11, "c", 12, 0);
+    }catch(std::exception&){
+        caught = true;
+    }
+    CHECK(caught);
+    // so is a name longer than NAME_MAX.
+    caught = false;
+    try{
+        ino_remember(11, std::string(256, 'x').c_str(), 13, 0);
+    }catch(std::exception&){
+        caught = true;
+    }
+    CHECK(caught);
+    EQUAL(ino_count(), 4);
+    ino_remember(11, "a", 12, 0); // refcount 2
+    ino_forget(12, 1);
+    EQUAL(ino_to_fullname(12), "/a/b/a");
+    ino_forget(12, 1);
+    ino_forget(11, 1);
+    ino_forget(10, 1);
+    EQUAL(ino_count(), 1);
+    EQUAL(ino_paths_cached(), 0);
+    EQUAL(ino_names_interned(), 1); // the root's ""
+    caught = false;
+    try{
+        ino_to_fullname(12);
+    }catch(std::exception&){
+        caught = true;
+    }
+    CHECK(caught);
+
+    // The benchmark.  Some names (Makefile, __init__.py) repeat a
+    // lot, as they do in real trees, but most are unique.
+    static const char* common[] = {"__init__.py", "Makefile", "README.md", "CMakeLists.txt",
+                                   "index.html", "setup.py", "LICENSE", "config.h"};
+    const size_t ncommon = sizeof(common)/sizeof(*common);
+    std::vector<node> nodes;
+    nodes.reserve(ndirs*(nfiles+1));
+    std::vector<size_t> dirs;
+    uint64_t rng = 1;
+    auto rand = [&rng](){ rng = rng*6364136223846793005ull + 1442695040888963407ull; return rng>>33; };
+    for(size_t d=0; d<ndirs; ++d){
+        fuse_ino_t pino = 1;
+        std::string pname;
+        if(!dirs.empty() && d%8){
+            auto& p = nodes[dirs[rand()%dirs.size()]];
+            pino = p.ino;
+            pname = p.fullname;
+        }
+        std::string name = (d%2) ? "dir" + std::to_string(d%100) : "package_" + std::to_string(rand());
+        auto ino = mkino(pino, name);
+        // skip the rare duplicate (pino, name).
+        bool dup = false;
+        for(auto di : dirs)
+            if(nodes[di].ino == ino)
+                dup = true;
+        if(dup)
+            continue;
+        dirs.push_back(nodes.size());
+        nodes.push_back({pino, name, ino, pname + "/" + name});
+        auto dino = ino;
+        auto dname = nodes.back().fullname;
+        for(size_t f=0; f<nfiles; ++f){
+            std::string fname = (f<ncommon && rand()%2) ? common[f] : "module_" + std::to_string(f) + "_" + std::to_string(rand()) + ".cpp";
+            nodes.push_back({dino, fname, mkino(dino, fname), dname + "/" + fname});
+        }
+    }
+
+    auto h0 = heap_bytes();
+    auto t0 = hrclk::now();
+    for(auto& n : nodes)
+        ino_remember(n.pino, n.name.c_str(), n.ino, 0);
+    auto tremember = secs_since(t0);
+    auto h1 = heap_bytes();
+    EQUAL(ino_count(), nodes.size()+1);
+    std::cout << nodes.size() << " inos\n";
+    std::cout << "ino_remember:  " << tremember/nodes.size()*1e9 << " ns each\n";
+
+    t0 = hrclk::now();
+    for(auto& n : nodes)
+        EQUAL(ino_to_fullname(n.ino), n.fullname);
+    auto tfullname = secs_since(t0);
+    auto h2 = heap_bytes();
+    std::cout << "ino_to_fullname (1 thread, includes checking):  " << tfullname/nodes.size()*1e9 << " ns each\n";
+    std::cout << "heap bytes per ino:  " << double(h1-h0)/nodes.size() << " after ino_remember, "
+              << double(h2-h0)/nodes.size() << " with " << ino_paths_cached() << " cached paths\n";
+    std::cout << ino_names_interned() << " distinct names\n";
+
+    t0 = hrclk::now();
+    std::vector<std::thread> threads;
+    std::atomic<size_t> mismatches{0};
+    for(unsigned t=0; t<nthreads; ++t)
+        threads.emplace_back([&, t](){
+                                 for(size_t i=t; i<nodes.size(); i+=nthreads)
+                                     if(ino_to_fullname(nodes[i].ino).size() != nodes[i].fullname.size())
+                                         mismatches++;
+                             });
+    for(auto& th : threads)
+        th.join();
+    auto tmt = secs_since(t0);
+    EQUAL(mismatches, 0);
+    std::cout << "ino_to_fullname (" << nthreads << " threads):  " << nodes.size()/tmt << " per second\n";
+
+    t0 = hrclk::now();
+    for(auto i=nodes.rbegin(); i!=nodes.rend(); ++i)
+        ino_forget(i->ino, 1);
+    auto tforget = secs_since(t0);
+    std::cout << "ino_forget:  " << tforget/nodes.size()*1e9 << " ns each\n";
+    EQUAL(ino_count(), 1);
+    EQUAL(ino_paths_cached(), 0);
+    EQUAL(ino_names_interned(), 1);
+
+    return utstatus(true);
+}catch(std::exception& e){
+    complain(e, "Exception caught.  main returns 1");
+    return 1;
 }
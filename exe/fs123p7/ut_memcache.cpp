@@ -0,0 +1,83 @@
+// A unit test for memcache.hpp
+
+#include "memcache.hpp"
+#include <core123/ut.hpp>
+#include <core123/complaints.hpp>
+#include <string>
+#include <thread>
+
+using namespace core123;
+using clk_t = std::chrono::system_clock;
+
+int main(int, char**) try {
+    auto now = clk_t::now();
+    auto later = now + std::chrono::seconds(100);
+    // 4 shards of 1000 bytes each.
+    memcache<std::string, std::string> mc(4000, 4);
+
+    CHECK(!mc.lookup("a", now));
+    EQUAL(mc.misses(), 1);
+
+    CHECK(mc.insert("a", std::make_shared<std::string>("A"), later, 100, now));
+    auto p = mc.lookup("a", now);
+    CHECK(p);
+    EQUAL(*p, "A");
+    EQUAL(mc.hits(), 1);
+    EQUAL(mc.bytes(), 100);
+
+    // insert replaces
+    CHECK(mc.insert("a", std::make_shared<std::string>("AA"), later, 200, now));
+    EQUAL(*mc.lookup("a", now), "AA");
+    EQUAL(*p, "A"); // the old value is still alive
+    EQUAL(mc.bytes(), 200);
+    EQUAL(mc.size(), 1);
+
+    // expiration
+    CHECK(!mc.lookup("a", later));
+    EQUAL(mc.expirations(), 1);
+    EQUAL(mc.bytes(), 0);
+    EQUAL(mc.size(), 0);
+
+    // too big and already-expired values aren't inserted
+    CHECK(!mc.insert("big", std::make_shared<std::string>("B"), later, 1001, now));
+    EQUAL(mc.too_big(), 1);
+    CHECK(!mc.insert("old", std::make_shared<std::string>("O"), now, 1, now));
+
+    // Fill the cache with many more bytes than the budget.  We're
+    // never over budget, and the most recently used entries survive.
+    for(int i=0; i<1000; ++i){
+        auto k = std::to_string(i);
+        mc.insert(k, std::make_shared<std::string>(k), later, 100, now);
+        // keep "0" hot
+        CHECK(mc.lookup("0", now));
+        CHECK(mc.bytes() <= 4000);
+    }
+    CHECK(mc.evictions() > 0);
+    CHECK(mc.lookup("0", now));
+    CHECK(mc.lookup("999", now));
+    CHECK(!mc.lookup("1", now));
+
+    mc.erase("0");
+    CHECK(!mc.lookup("0", now));
+
+    // A few threads hammering on the same keys.
+    std::vector<std::thread> threads;
+    for(int t=0; t<4; ++t){
+        threads.emplace_back([&mc, now, later, t](){
+                                 for(int i=0; i<10000; ++i){
+                                     auto k = std::to_string((i*7+t)%200);
+                                     if(!mc.lookup(k, now))
+                                         mc.insert(k, std::make_shared<std::string>(k), later, 50, now);
+                                 }
+                             });
+    }
+    for(auto& th : threads)
+        th.join();
+    CHECK(mc.bytes() <= 4000);
+    EQUAL(mc.bytes(), 50*mc.size());
+
+    return utstatus(true);
+}catch(std::exception& e){
+    complain(e, "Exception caught.  main returns 1");
+    return 1;
+}
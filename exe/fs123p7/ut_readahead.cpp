@@ -0,0 +1,100 @@
+// A unit test for readahead_state.
+
+#include "readahead.hpp"
+#include <core123/ut.hpp>
+#include <core123/complaints.hpp>
+
+using namespace core123;
+
+namespace{
+const size_t chunk = 128*1024;
+}
+
+int main(int, char **) try {
+    // Sequential reads double the window, up to maxchunks, and the
+    // candidates are the window beyond the read, less what's already
+    // been submitted.
+    {
+        readahead_state ras;
+        ras.filesize = 100*chunk;
+        size_t used = 0, wasted = 0;
+        CHECK(ras.observe(0, chunk, chunk, 8, &used, &wasted));
+        EQUAL(ras.window, 1u);
+        auto [first, last] = ras.candidates(0, chunk);
+        EQUAL(first, 1);
+        EQUAL(last, 2);
+        ras.submitted(1);
+        CHECK(ras.observe(chunk, chunk, chunk, 8, &used, &wasted));
+        EQUAL(used, 1u);
+        EQUAL(ras.window, 2u);
+        std::tie(first, last) = ras.candidates(1, chunk);
+        EQUAL(first, 2);
+        EQUAL(last, 4);
+        for(int64_t c=first; c<last; ++c)
+            ras.submitted(c);
+        for(int i=0; i<10; ++i)
+            ras.observe((2+i)*chunk, chunk, chunk, 8, &used, &wasted);
+        EQUAL(ras.window, 8u);
+        EQUAL(wasted, 0u);
+    }
+    // Nothing past EOF.
+    {
+        readahead_state ras;
+        ras.filesize = 3*chunk + 1;
+        size_t used = 0, wasted = 0;
+        for(int i=0; i<4; ++i)
+            ras.observe(0, 1, chunk, 8, &used, &wasted);
+        auto [first, last] = ras.candidates(0, chunk);
+        EQUAL(first, 1);
+        EQUAL(last, 4);
+    }
+    // A non-sequential read halves the window, counts the pending
+    // chunks as wasted, and bumps the generation, so that queued
+    // prefetches know they've been cancelled.
+    {
+        readahead_state ras;
+        ras.filesize = 100*chunk;
+        size_t used = 0, wasted = 0;
+        for(int i=0; i<4; ++i)
+            ras.observe(i*chunk, chunk, chunk, 8, &used, &wasted);
+        EQUAL(ras.window, 8u);
+        auto [first, last] = ras.candidates(3, chunk);
+        for(int64_t c=first; c<last; ++c)
+            ras.submitted(c);
+        auto gen = ras.generation;
+        uint64_t g = gen->load();
+        CHECK(!ras.observe(50*chunk, chunk, chunk, 8, &used, &wasted));
+        EQUAL(wasted, size_t(last-first));
+        EQUAL(ras.window, 4u);
+        CHECK(ras.pending.empty());
+        CHECK(*gen != g);
+        // Queued prefetches hold the generation, so it outlives the
+        // readahead_state.
+        g = gen->load();
+        {
+            readahead_state doomed;
+            gen = doomed.generation;
+            g = gen->load();
+            doomed.cancel(&wasted);
+        }
+        CHECK(*gen != g);
+    }
+    // A read that skips over pending chunks wastes them, but if it's
+    // still within the slop, it's still sequential.
+    {
+        readahead_state ras;
+        ras.filesize = 100*chunk;
+        size_t used = 0, wasted = 0;
+        ras.observe(0, chunk, chunk, 8, &used, &wasted);
+        ras.observe(chunk, chunk, chunk, 8, &used, &wasted);
+        ras.submitted(2);
+        ras.submitted(3);
+        CHECK(ras.observe(3*chunk, chunk, chunk, 8, &used, &wasted));
+        EQUAL(used, 1u);
+        EQUAL(wasted, 1u);
+    }
+    return utstatus();
+ }catch(std::exception& e){
+    complain(e, "Exception caught.  main returns 1");
+    return 1;
+ }
@@ -0,0 +1,70 @@
+// A unit test for rolling_quantile.
+
+#include "rolling_quantile.hpp"
+#include <core123/ut.hpp>
+#include <core123/complaints.hpp>
+#include <iostream>
+#include <random>
+#include <cmath>
+
+using namespace core123;
+
+int main(int, char **) try {
+    // Not enough samples:  no idea.
+    {
+        rolling_quantile rq(0.9, 100, 10);
+        CHECK(std::isinf(rq.get()));
+        for(int i=0; i<9; ++i)
+            rq.add(1.);
+        CHECK(std::isinf(rq.get()));
+        rq.add(1.);
+        EQUAL(rq.get(), 1.);
+        EQUAL(rq.nsamples(), 10u);
+    }
+    // 0..99, in any order:  the 90th percentile is 90.
+    {
+        rolling_quantile rq(0.9, 100, 10);
+        std::vector<double> v;
+        for(int i=0; i<100; ++i)
+            v.push_back(i);
+        std::shuffle(v.begin(), v.end(), std::mt19937(12345));
+        for(auto x : v)
+            rq.add(x);
+        EQUAL(rq.get(), 90.);
+        EQUAL(rq.nsamples(), 100u);
+    }
+    // Only the most recent N count.  After N samples of 1000, the
+    // earlier (small) samples are forgotten.
+    {
+        rolling_quantile rq(0.5, 64, 8);
+        for(int i=0; i<64; ++i)
+            rq.add(1.);
+        EQUAL(rq.get(), 1.);
+        for(int i=0; i<64; ++i)
+            rq.add(1000.);
+        EQUAL(rq.get(), 1000.);
+        EQUAL(rq.nsamples(), 64u);
+    }
+    // Exponential samples:  the estimate of the 95th percentile should
+    // be near -log(0.05) = 3.0.
+    {
+        rolling_quantile rq(0.95, 4096, 32);
+        std::mt19937 gen(42);
+        std::exponential_distribution<double> expo(1.);
+        for(int i=0; i<8192; ++i)
+            rq.add(expo(gen));
+        double est = rq.get();
+        std::cout << "exponential: estimated 95th percentile: " << est << "\n";
+        CHECK(std::abs(est - 3.0) < 0.3);
+    }
+    // Silly arguments are clipped, rather than crashing.
+    {
+        rolling_quantile rq(1.5, 0, 0);
+        rq.add(7.);
+        EQUAL(rq.get(), 7.);
+    }
+    return utstatus();
+ }catch(std::exception& e){
+    complain(e, "Exception caught.  main returns 1");
+    return 1;
+ }
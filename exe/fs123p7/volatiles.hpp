@@ -42,8 +42,63 @@ struct volatiles_t{
     // so_rcvbuf:  see comments in backend123_http.cpp.  0 means leave system default in place.
     std::atomic<int> so_rcvbuf{core123::envto<int>("Fs123SO_RCVBUF", 24*1024)};
     // Note that netrc_file is not atomic and cannot be modified at runtime with
-    // an ioctl.  
+    // an ioctl.
     std::string netrc_file{core123::envto<std::string>("Fs123NetrcFile", "")};
+    // curl_multi:  if true, transfers are handed to a single curl_multi
+    // event loop, shared by all backend123_http's, instead of calling
+    // curl_easy_perform in the calling thread.  See the multi_engine
+    // in backend123_http.cpp.  Like netrc_file, these are read once,
+    // when the multi_engine is created, and can't be changed at runtime.
+    // N.B.  the event loop's one thread runs every transfer's header
+    // and write callbacks and does all the TLS decryption, so it caps
+    // the client's aggregate throughput at what one core can do.
+    bool curl_multi{core123::envto<bool>("Fs123CurlMulti", false)};
+    // 0 means no limit.  With HTTP/2, curl prefers to add streams to an
+    // existing connection, so the limit rarely matters.
+    long curl_multi_max_host_connections{core123::envto<long>("Fs123CurlMultiMaxHostConnections", 0)};
+    long curl_multi_max_streams{core123::envto<long>("Fs123CurlMultiMaxStreams", 100)};
+    // With the multi_engine, https urls negotiate HTTP/2 with ALPN.
+    // There's no negotiation for cleartext http urls, so HTTP/2 is only
+    // used if we're told that the server (or proxy) speaks it.
+    bool http2_prior_knowledge{core123::envto<bool>("Fs123Http2PriorKnowledge", false)};
+    // curl_share:  if true, all CURL*'s share a DNS cache and TLS
+    // sessions.  See get_curl_share in backend123_http.cpp.  Read once,
+    // when a backend123_http is constructed.
+    bool curl_share{core123::envto<bool>("Fs123CurlShare", false)};
+    // hedge_quantile:  if greater than zero (and there are fallback
+    // baseurls, and Fs123CurlMulti is set), a request that hasn't
+    // gotten its first byte within the hedge_quantile'th quantile of
+    // recent times-to-first-byte is also sent to the next non-deferred
+    // fallback, and whichever answers first wins.  See perform_hedged
+    // in backend123_http.cpp.  Read once, when a backend123_http is
+    // constructed.  hedge_budget caps the extra requests as a fraction
+    // of all requests.  hedge_initial_millis is the hedge delay until
+    // there are enough samples to estimate the quantile.
+    float hedge_quantile{core123::envto<float>("Fs123HedgeQuantile", 0.f)};
+    std::atomic<float> hedge_budget{core123::envto<float>("Fs123HedgeBudget", 0.05f)};
+    std::atomic<unsigned> hedge_initial_millis{core123::envto<unsigned>("Fs123HedgeInitialMillis", 100)};
+    // ewma_origin_selection:  if true, each request goes to the better
+    // of two randomly chosen non-deferred baseurls, scored by EWMAs of
+    // their response times and error rates.  If false, the first
+    // non-deferred baseurl wins.  See pick_baseurl in
+    // backend123_http.cpp.  ewma_origin_seconds is the EWMAs' time
+    // constant.  Both can be changed with an ioctl.
+    std::atomic<bool> ewma_origin_selection{core123::envto<bool>("Fs123EwmaOriginSelection", false)};
+    std::atomic<float> ewma_origin_seconds{core123::envto<float>("Fs123EwmaOriginSeconds", 10.f)};
+    // batch_millis:  if greater than zero, concurrent refreshes of /a,
+    // /d, /f, /l, /r, /s and /x urlstems are collected for up to
+    // batch_millis and sent together in a single /b request.  See
+    // batch_state in backend123_http.cpp.  Read once, when a
+    // backend123_http is constructed.  batch_max limits the number of
+    // requests in a batch, and batch_max_bytes limits the length of its
+    // query, which has to fit in the server's limit on the size of the
+    // request's headers.  N.B.  /b replies are no-store, so batched
+    // requests bypass any shared HTTP proxy cache.  Don't batch if the
+    // origin relies on a shared proxy to absorb the load.  See /b in
+    // docs/Fs123Protocol.
+    unsigned batch_millis{core123::envto<unsigned>("Fs123BatchMillis", 0)};
+    std::atomic<unsigned> batch_max{core123::envto<unsigned>("Fs123BatchMax", 16)};
+    std::atomic<unsigned> batch_max_bytes{core123::envto<unsigned>("Fs123BatchMaxBytes", 1500)};
     
     // See retry logic in app_mount.cpp
     std::atomic<unsigned> retry_timeout{core123::envto<unsigned>("Fs123RetryTimeout", 0)};
@@ -61,6 +116,15 @@ struct volatiles_t{
     std::atomic<unsigned> evict_period_minutes{core123::envto<unsigned>("Fs123EvictPeriodMinutes", 60)};
     std::atomic<size_t> dc_maxmbytes{core123::envto<size_t>("Fs123CacheMaxMBytes", 100)};
     std::atomic<size_t> dc_maxfiles{core123::envto<size_t>("Fs123CacheMaxFiles", dc_maxmbytes*1000000/16384)};
+    // The limits for the (optional) lower tier of a tiered diskcache.
+    // See diskcache::set_lower_tier.
+    std::atomic<size_t> dc_slow_maxmbytes{core123::envto<size_t>("Fs123SlowCacheMaxMBytes", 0)};
+    std::atomic<size_t> dc_slow_maxfiles{core123::envto<size_t>("Fs123SlowCacheMaxFiles", dc_slow_maxmbytes*1000000/16384)};
+
+    // Used by the readahead engine in app_mount.cpp.  A readahead_chunks
+    // of zero disables readahead.
+    std::atomic<unsigned> readahead_chunks{core123::envto<unsigned>("Fs123ReadaheadChunks", 8)};
+    std::atomic<size_t> readahead_inflight_mbytes{core123::envto<size_t>("Fs123ReadaheadInflightMBytes", 64)};
 
     // Used in distrib_cache_backend.cpp
     std::atomic<unsigned> multicast_timestamp_skew{core123::envto<unsigned>("Fs123MulticastTimestampSkew", 10)};
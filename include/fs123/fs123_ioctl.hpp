@@ -47,5 +47,7 @@ struct fs123_ioctl_data{
 #define SO_RCVBUF_IOC _IOW(0, 135, fs123_ioctl_data)
 #define NAMECACHE_SIZE_IOC _IOW(0, 136, fs123_ioctl_data)
 #define MULTICAST_TIMESTAMP_SKEW_IOC _IOW(0, 137, fs123_ioctl_data)
+#define EWMA_ORIGIN_SELECTION_IOC _IOW(0, 138, fs123_ioctl_data)
+#define EWMA_ORIGIN_SECONDS_IOC _IOW(0, 139, fs123_ioctl_data)
 
 #endif
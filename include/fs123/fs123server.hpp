@@ -141,6 +141,16 @@
 // which allows plaintext (i.e., int /e/<ncrypted>) URLs even
 // when the --sharedkeydir is specified.
 
+// The /b "batch" function (7.3 and later) carries a list of
+// sub-requests, e.g., /a, /f and /l requests, in its query.  The
+// server library fans them out to the handler's a(), f(), l(), etc.,
+// exactly as if they had arrived separately, so handlers need no
+// changes to support it.  The replies are collected and sent back
+// together in one reply, each with its own status, cache-control, etag
+// and body.  /p, /e and /b may not be sub-requests.  The logger is
+// called for each sub-request, with the uri it would have had on its
+// own, as well as for the /b itself.  See docs/Fs123Protocol.
+
 // Short-circuiting HEAD requests is up to the handler.  I.e., the
 // handler *may* look at the req::method field, and call f_reply,
 // d_reply or p_reply with empty data arguments.  Even if the handler
@@ -336,6 +346,8 @@ struct req{
     // We've experimented with increasing Fs123Chunk, but it's never
     // been advantageous.  So we make max_reply_size a bit more than 1MB.
     static const size_t max_reply_size = 1025 * 1024;
+    // max_batch_items says how many sub-requests a /b may carry.
+    static const size_t max_batch_items = 64;
     // N.B.  The str_view members will typically "point" into data
     // that's owned by the evhr evhttp_request.  They are guaranteed
     // to remain valid until the one of the XXX_reply functions is
@@ -367,10 +379,18 @@ struct req{
     // It's possible to reconstruct the decrypted uri as:
     //    prefix + function + path_info + (query->data()?"?":"") + query
 
-    // Methods that may only be called from within a d() handler:
+    // Methods that may only be called from within a d() or r() handler:
     bool add_dirent(core123::str_view name, int type, uint64_t esc);
     bool add_dirent(const ::dirent& de, uint64_t esc);
     size_t dirent_space_avail() const;
+    // Method that may only be called from within an r() handler.  In
+    // addition to the name, type and estale-cookie, the entry carries
+    // the same attributes, validator and cache-control that an a()
+    // handler would reply with.  If sb is null, the entry has no
+    // attributes (equivalent to add_dirent), and the client will have
+    // to ask for them with /a.
+    bool add_dirent_plus(core123::str_view name, int type, uint64_t esc,
+                         const struct stat* sb, uint64_t validator, core123::str_view cc);
     // Methods that may only be called from within a p() handler:
     //
     // The underlying evhttp_add_header takes NUL-terminated char*, so
@@ -401,6 +421,7 @@ struct req{
     friend void redirect_reply(up th, const std::string& location, const std::string& cc={}) { th->redirect_reply(location, cc); }
     friend void a_reply(up th, const struct stat& sb, uint64_t content_validator, uint64_t esc, const std::string& cc){
         th->a_reply(sb, content_validator, esc, cc); }
+    // d_reply is also the reply to an r() request.
     friend void d_reply(up th, const std::string& nextstart, uint64_t etag64, uint64_t esc, const std::string& cc){
         th->d_reply(nextstart, etag64, esc, cc); }
     friend void f_reply(up th, size_t nbytes, uint64_t content_validator, uint64_t etag64, uint64_t esc, const std::string& cc){
@@ -422,6 +443,8 @@ private:
     req(evhttp_request* evreq, server* _server, async_reply_mechanism* _arm);
     static void http_cb(evhttp_request* evreq, void *vserver);
     static void parse_and_handle(std::unique_ptr<fs123p7::req> req);
+    static void dispatch(std::unique_ptr<fs123p7::req> req, uint64_t inm64);
+    static void batch_handle(std::unique_ptr<fs123p7::req> req);
     const size_t secretbox_padding = 32; // command line option??
     const size_t secretbox_leadersz = sizeof(fs123_secretbox_header) + crypto_secretbox_MACBYTES;
 
@@ -439,19 +462,26 @@ private:
     bool replied;
     bool synchronous_reply = false;
     std::vector<std::pair<std::string, std::string>> kvpairs;
+    // The sub-requests of a /b have a batch_collector.  Their
+    // replies go to it, rather than to evhr (which belongs to the /b).
+    struct batch_collector;
+    std::shared_ptr<batch_collector> batch;
+    size_t batch_idx = 0;
+    void batch_reply(int status, const std::string& cc, uint64_t etag64, core123::str_view body);
     bool may_use_secrets() const;
     void common_reply200(const std::string& cc, uint64_t etag64 = 0);
     void encrypt_and_send200(const std::string& cc, uint64_t etag64);
     void log_and_send_destructively(int status);  // N.B.  *this is unusable after this!
     void maybe_call_logger(int status);
+    void maybe_call_logger_for_batch_item(int status, size_t length);
     std::string maybe_encode_content();
     static const size_t final_netstring_bytes = 2; // ",\n" that closes the value of the content kv-pair
-    void allocate_pbuf(size_t sz){
+    void allocate_pbuf(size_t sz, size_t limit = max_reply_size){
         static const size_t fs123_max_headersz = 1024;
         if(blob)
             throw std::logic_error("allocate_pbuf called twice.  Definitely a logic error");
-        if(sz > max_reply_size)
-            throw std::runtime_error(core123::fmt("allocate_pbuf too large: %zd > %zd", sz, max_reply_size));
+        if(sz > limit)
+            throw std::runtime_error(core123::fmt("allocate_pbuf too large: %zd > %zd", sz, limit));
         blob = core123::uchar_blob(secretbox_leadersz + fs123_max_headersz + sz + secretbox_padding + final_netstring_bytes);
         buf = core123::padded_uchar_span(blob, secretbox_leadersz + fs123_max_headersz, 0);
     }
@@ -504,6 +534,13 @@ struct handler_base{
     virtual void n(req::up req) {
         n_reply(std::move(req), {}, "max-age=30,stale-while-revalidate=30");
     }
+    // r is "readdirplus":  like d, but the handler calls
+    // add_dirent_plus so that each entry also carries its attributes.
+    // Handlers that don't override it reply with ENOTSUP, which tells
+    // the client to fall back to d.
+    virtual void r(req::up req, uint64_t /*inm64*/, std::string /*start*/){
+        errno_reply(std::move(req), ENOTSUP, "max-age=86400,stale-while-revalidate=864000");
+    }
     virtual void logger(const char* /*remote*/, method_e /*method*/, const char* /*uri*/, int /*status*/, size_t /*length*/, const char* /*date*/){
     }
     virtual ~handler_base(){}
@@ -563,6 +600,11 @@ public:
                       h.n(req::up(p));
                   });
     }
+    void r(req::up req, uint64_t inm64, std::string start) override {
+        tp.submit([=, p=req.release()](){
+                      h.r(req::up(p), inm64, start);
+                  });
+    }
     void logger(const char* remote, method_e method, const char* uri, int status, size_t length, const char* date) override {
         // DO NOT submit to threadpool!  The pointer lifetimes are not guaranteed past the return.
         // And in any case, we're already running in a thread in the pool.
@@ -701,11 +743,14 @@ private:
   STATISTIC(a_requests) \
   STATISTIC(f_requests) \
   STATISTIC(d_requests) \
+  STATISTIC(r_requests) \
   STATISTIC(l_requests) \
   STATISTIC(x_requests) \
   STATISTIC(s_requests) \
   STATISTIC(n_requests) \
   STATISTIC(p_requests) \
+  STATISTIC(b_requests) \
+  STATISTIC(b_items) \
   STATISTIC(reply_200s) \
   STATISTIC(reply_304s) \
   STATISTIC(reply_others)
@@ -28,6 +28,7 @@
 #include <tuple>
 #include <fstream>
 #include <thread>
+#include <mutex>
 #include <netinet/tcp.h>
 
 using namespace core123;
@@ -393,6 +394,31 @@ req::maybe_call_logger(int status) {
     }
  }
 
+void /*private*/
+req::maybe_call_logger_for_batch_item(int status, size_t length) {
+    // Like maybe_call_logger, but for a sub-request of a /b, which
+    // shares the /b's evhr.  So there's no Date header to borrow
+    // (and we mustn't add one for each item), and the uri is the one
+    // the sub-request would have had if it had arrived on its own.
+    // The server_stats are left alone:  the /b's reply counts them.
+    if(!evhr)
+        return complain(LOG_ERR, "req::maybe_call_logger_for_batch_item called with evhr==nullptr.  This *SHOULD NOT HAPPEN*.  Start debugging!");
+    auto [remote, port] = get_peer();
+    unused(port); // silence gcc7 warning
+    auto evmethod = evhttp_request_get_method(evhr);
+    std::string suburi = std::string(prefix.substr(0, prefix.size()-1)) + std::string(uri);
+    char date[50];
+    if (!(sizeof(date) - evutil_date_rfc1123(date, sizeof(date), NULL) > 0)) {
+        complain(LOG_ERR, "evutil_date_rfc1123 didn't fit in 50 chars?");
+        strcpy(date, "-");
+    }
+    try{
+        svr.handler.logger(remote.c_str(), evmethod, suburi.c_str(), status, length, date);
+    }catch(std::exception& e){
+        complain(e, "exception thrown by logger handler");
+    }
+ }
+
 void /*private*/
 server::incast_collapse_workaround(evhttp_request *evreq){
     auto evcon = evhttp_request_get_connection(evreq);
@@ -614,12 +640,35 @@ req::parse_and_handle(req::up req) try {
         server_stats.INM_requests++;
     DIAGf(_fs123server, "If-None-Match: %s inm64: %016" PRIx64, std::string(req->inm).c_str(), inm64);
 
-    handler_base& handler = svr.handler;
+    dispatch(std::move(req), inm64);
+ }catch(std::exception& e){
+    if(req)
+        req->internal_exception(e);
+    else
+        complain(e, "exception thrown by handler, assuming the handler called a _reply function (perhaps in the req's destructor)");
+ }
+
+// dispatch - call the handler method that corresponds to
+// req->function.  It's called by parse_and_handle for requests that
+// arrive over the wire, and by batch_handle for each of the
+// sub-requests of a /b.
+void /* static private */
+req::dispatch(req::up req, uint64_t inm64) try {
+    handler_base& handler = req->svr.handler;
     if(req->function == "a"){
         server_stats.a_requests++;
         handler.a(std::move(req));
-    }else if(req->function == "d"){
-        server_stats.d_requests++;
+    }else if(req->function == "d" || req->function == "r"){
+        // /r (readdirplus) has the same query as /d.  It's new in 7.3,
+        // so there's no need to handle 7.2's Len;Begin;Offset.
+        bool plus = (req->function == "r");
+        if(plus){
+            server_stats.r_requests++;
+            if(req->proto_minor < 3)
+                httpthrow(400, "/r requires protocol 7.3 or later");
+        }else{
+            server_stats.d_requests++;
+        }
         uint64_t lenkib;
         size_t start_offset;
         try{
@@ -655,14 +704,17 @@ req::parse_and_handle(req::up req) try {
                 }
             }
         }catch(std::exception& e){
-            std::throw_with_nested(http_exception(400, "failed to parse query in /d...?" + std::string(req->query)));
+            std::throw_with_nested(http_exception(400, "failed to parse query in /" + std::string(req->function) + "...?" + std::string(req->query)));
         }
         if(lenkib > max_reply_size/1024)
-            httpthrow(400, "/d requested length too large: " + std::to_string(lenkib) + " > " + std::to_string(max_reply_size));
+            httpthrow(400, "/" + std::string(req->function) + " requested length too large: " + std::to_string(lenkib) + " > " + std::to_string(max_reply_size));
         auto requested_len = lenkib*1024;
         auto start = req->query.substr(start_offset);
         req->allocate_pbuf(requested_len);
-        handler.d(std::move(req), inm64, urlunescape(start));
+        if(plus)
+            handler.r(std::move(req), inm64, urlunescape(start));
+        else
+            handler.d(std::move(req), inm64, urlunescape(start));
     }else if(req->function == "f"){
         server_stats.f_requests++;
         // The query is Len;Offset
@@ -722,8 +774,11 @@ req::parse_and_handle(req::up req) try {
         server_stats.p_requests++;
         evistream bufis(evhttp_request_get_input_buffer(req->evhr));
         handler.p(std::move(req), inm64, bufis);
+    }else if(req->function == "b"){
+        server_stats.b_requests++;
+        batch_handle(std::move(req));
     }else{
-        httpthrow(400, fmt("Unknown fs123 /function: %s uri_path: %s", std::string(req->function).c_str(), uri_path));
+        httpthrow(400, fmt("Unknown fs123 /function: %s uri: %s", std::string(req->function).c_str(), std::string(req->uri).c_str()));
     }
  }catch(std::exception& e){
     if(req)
@@ -732,6 +787,174 @@ req::parse_and_handle(req::up req) try {
         complain(e, "exception thrown by handler, assuming the handler called a _reply function (perhaps in the req's destructor)");
  }
 
+// The batch_collector owns a /b request while its sub-requests are
+// being handled.  Each sub-request hands its reply to add().  When the
+// last one is in, finish() sends them all in the /b's reply.
+struct req::batch_collector{
+    struct sub{
+        std::string raw;       // e.g., /a/foo%20bar, as in the client's urlstem
+        std::string decoded;   // e.g., /a/foo bar
+        std::string inm;
+        uint64_t inm64 = 0;
+        int status = 0;
+        std::string cc;
+        uint64_t etag64 = 0;
+        std::string body;
+    };
+    req::up parent;
+    std::vector<sub> subs;
+    std::mutex mtx;
+    size_t remaining = 0;
+
+    void add(size_t idx, int status, const std::string& cc, uint64_t etag64, str_view body){
+        std::unique_lock<std::mutex> lk(mtx);
+        auto& s = subs.at(idx);
+        s.status = status;
+        s.cc = cc;
+        s.etag64 = etag64;
+        s.body = std::string(body);
+        if(--remaining)
+            return;
+        lk.unlock();
+        finish();
+    }
+
+    void finish(){
+        req::up p = std::move(parent);
+        try{
+            // Each record is:  STATUS CC ETAG BODY\n
+            std::vector<std::string> leaders;
+            size_t total = 0;
+            for(auto& s : subs){
+                leaders.push_back(netstring(std::to_string(s.status)) + ' ' + netstring(s.cc) + ' ' +
+                                  netstring(std::to_string(s.etag64)) + ' ' + std::to_string(s.body.size()) + ':');
+                total += leaders.back().size() + s.body.size() + 2;
+            }
+            // The records are bounded by max_batch_items sub-replies,
+            // each of which was bounded by max_reply_size (plus a
+            // little for kvpairs).
+            p->allocate_pbuf(total, max_batch_items * 2 * max_reply_size);
+            for(size_t i=0; i<subs.size(); ++i){
+                p->buf = p->buf.append(leaders[i]);
+                p->buf = p->buf.append(subs[i].body);
+                p->buf = p->buf.append(",\n");
+            }
+            p->encrypt_and_send200("no-store", 0);
+        }catch(std::exception& e){
+            p->internal_exception(e);
+        }
+    }
+};
+
+// batch_handle - split a /b into its sub-requests, and dispatch each
+// of them as if it had arrived on its own.  The sub-requests share the
+// /b's evhr, so they can look at its headers and peer, but they
+// reply to the batch_collector.
+void /* static private */
+req::batch_handle(req::up req){
+    if(req->proto_minor < 3)
+        httpthrow(400, "/b requires protocol 7.3 or later");
+    if(req->method != fs123p7::GET)
+        httpthrow(400, "/b requires GET");
+    if(!req->path_info.empty())
+        httpthrow(400, "/b may not have a path");
+    auto bc = std::make_shared<batch_collector>();
+    // The query is Item&Item&..., where each Item is Inm64,Urlstem
+    str_view q = req->query;
+    for(size_t b = 0; b < q.size(); ){
+        auto e = std::min(q.find('&', b), q.size());
+        str_view item = q.substr(b, e-b);
+        b = e+1;
+        if(bc->subs.size() == max_batch_items)
+            httpthrow(400, fmt("/b has more than %zd items", max_batch_items));
+        auto& sub = bc->subs.emplace_back();
+        size_t comma;
+        try{
+            comma = svscan(item, &sub.inm64);
+            if(comma >= item.size() || item[comma] != ',')
+                throw std::runtime_error("expected a comma after Inm64");
+            sub.raw = urlunescape(item.substr(comma+1));
+            auto qidx = sub.raw.find('?');
+            sub.decoded = urlunescape(str_view(sub.raw).substr(0, qidx));
+        }catch(std::exception& ex){
+            std::throw_with_nested(http_exception(400, "failed to parse /b item: " + std::string(item)));
+        }
+        if(sub.inm64)
+            sub.inm = '"' + std::to_string(sub.inm64) + '"';
+    }
+    if(bc->subs.empty())
+        httpthrow(400, "/b has no items");
+    server_stats.b_items += bc->subs.size();
+    // version is /fs123/7/3 (or whatever our proto_minor is).
+    auto sigilidx = req->prefix.find("/fs123/");
+    if(sigilidx == str_view::npos)
+        httpthrow(500, "No SIGIL in prefix?  Didn't we check this already?");
+    std::string version(req->prefix.substr(sigilidx, req->prefix.size()-1-sigilidx));
+
+    // N.B.  bc->subs won't be resized, so the str_views that point
+    // into it are good until bc is destroyed.  Create all the
+    // sub-requests before dispatching any of them:  when the last one
+    // replies, the /b is sent, after which we mustn't touch it.
+    std::vector<req::up> subreqs;
+    std::vector<std::exception_ptr> errs(bc->subs.size());
+    for(size_t i=0; i<bc->subs.size(); ++i){
+        auto& sub = bc->subs[i];
+        auto sr = make_up(req->evhr, &req->svr, req->arm);
+        sr->batch = bc;
+        sr->batch_idx = i;
+        sr->uri = sub.raw;
+        sr->prefix = req->prefix;
+        sr->proto_minor = req->proto_minor;
+        sr->accept_encoding = content_codec::CE_IDENT;
+        sr->inm = sub.inm;
+        try{
+            str_view dsv = sub.decoded;
+            auto qidx = sub.raw.find('?');
+            sr->query = (qidx == std::string::npos) ? str_view{nullptr, 0} : str_view(sub.raw).substr(qidx+1);
+            if(dsv.empty() || dsv[0] != '/')
+                httpthrow(400, "/b item must start with /");
+            auto pidx = dsv.find('/', 1);
+            sr->function = dsv.substr(1, pidx-1);
+            sr->path_info = (pidx == str_view::npos) ? str_view("") : dsv.substr(pidx);
+            if(sr->function == "b" || sr->function == "e" || sr->function == "p")
+                httpthrow(400, "/b may not contain /" + std::string(sr->function) + " requests");
+            validate_path(sr->path_info);
+            sr->kvpairs.emplace_back(FS123_REQUEST, version + sub.raw);
+        }catch(std::exception&){
+            errs[i] = std::current_exception();
+        }
+        subreqs.push_back(std::move(sr));
+    }
+    bc->remaining = bc->subs.size();
+    bc->parent = std::move(req);
+    for(size_t i=0; i<subreqs.size(); ++i){
+        if(errs[i]){
+            try{
+                std::rethrow_exception(errs[i]);
+            }catch(std::exception& e){
+                subreqs[i]->exception_reply(e);
+            }
+            continue;
+        }
+        dispatch(std::move(subreqs[i]), bc->subs[i].inm64);
+    }
+}
+
+// batch_reply - a sub-request of a /b doesn't reply over the wire.
+// Its status, cache-control, etag and body go to the batch_collector.
+void /* private */
+req::batch_reply(int status, const std::string& cc, uint64_t etag64, str_view body) try {
+    if(replied)
+        return complain(LOG_ERR, "req::batch_reply has already been called");
+    replied = true;
+    maybe_call_logger_for_batch_item(status, body.size());
+    evhr = nullptr; // it belongs to the /b
+    auto bc = std::move(batch);
+    bc->add(batch_idx, status, cc, etag64, body);
+ }catch(std::exception& e){
+    complain(LOG_CRIT, e, "Exception thrown by req::batch_reply.  The /b reply will not be sent.  Client will eventually time out.");
+ }
+
 void /* private */
 req::log_and_send_destructively(int status) try {
     if(replied)
@@ -793,6 +1016,13 @@ req::common_reply200(const std::string& cc, uint64_t etag64/*=0*/){
 
 void /* private */
 req::encrypt_and_send200(const std::string& cc, uint64_t etag64){
+    if(batch){
+        // Sub-requests of a /b are never encrypted individually.  The
+        // /b's reply may be.
+        if(!blob)
+            allocate_pbuf(0);
+        return batch_reply(200, cc, etag64, as_str_view(buf));
+    }
     svr.incast_collapse_workaround(evhr);
     auto ohdrs = evhttp_request_get_output_headers(evhr);
     add_hdr(ohdrs, "Cache-control", cc);
@@ -841,6 +1071,12 @@ req::internal_exception(const std::exception& e) {
 // recipient *may* choose to log.
 void
 req::exception_reply(const std::exception& e) {
+    if(batch){
+        std::string what;
+        for(auto& ep : exnest(e))
+            what += std::string(ep.what()) + "\n";
+        return batch_reply(http_status_from_evnest(e), {}, 0, what);
+    }
     // clear any headers or content that had already been
     // associated with evhr before the throw:
     evhttp_clear_headers(evhttp_request_get_output_headers(evhr));
@@ -1084,6 +1320,10 @@ void req::errno_reply(int eno, const std::string& cc) try {
 void req::not_modified_reply(const std::string& cc) try {
     if(inm.empty())
         return internal_exception(http_exception(500, "handler called not_modified_reply but there is no If-None-Match header"));
+    // Like the ETag header below, the record's etag is the one the
+    // client sent, i.e., the sub-request's Inm64.
+    if(batch)
+        return batch_reply(304, cc, batch->subs.at(batch_idx).inm64, {});
     auto ohdrs = evhttp_request_get_output_headers(evhr);
     add_hdr(ohdrs, "ETag", inm);
     add_hdr(ohdrs, "Cache-control", cc.c_str());
@@ -1091,6 +1331,8 @@ void req::not_modified_reply(const std::string& cc) try {
  }catch(std::exception& e){ internal_exception(e); }
 
 void req::redirect_reply(const std::string& location, const std::string& cc) try {
+    if(batch)
+        return batch_reply(302, cc, 0, location);
     auto ohdrs = evhttp_request_get_output_headers(evhr);
     if(envelope_sid.empty())
         add_hdr(ohdrs, "Location", location.c_str());
@@ -1148,6 +1390,8 @@ void req::a_reply(const struct stat& sb, uint64_t validator, uint64_t esc, const
  }catch(std::exception& e) { internal_exception(e); }
 
 bool req::add_dirent(core123::str_view name, int type, uint64_t estale_cookie){
+    if(function == "r")
+        return add_dirent_plus(name, type, estale_cookie, nullptr, 0, {});
     if(function != "d")
         httpthrow(500, "handler called add_dirent while handling " + std::string(function) + " request");
     if(name.size() > 255) // 255 == NAME_MAX on Linux and is hardwired into the client as well
@@ -1161,6 +1405,27 @@ bool req::add_dirent(core123::str_view name, int type, uint64_t estale_cookie){
     return true;
 }
 
+// An /r entry starts with the same three fields as a /d entry,
+// followed by the netstring-encoded attributes (empty if sb is null),
+// the validator and the netstring-encoded cache-control:
+//   NAME TYPE ESC ATTRS VALIDATOR CC\n
+bool req::add_dirent_plus(core123::str_view name, int type, uint64_t estale_cookie,
+                          const struct stat* sb, uint64_t validator, core123::str_view cc){
+    if(function != "r")
+        httpthrow(500, "handler called add_dirent_plus while handling " + std::string(function) + " request");
+    if(name.size() > 255) // 255 == NAME_MAX on Linux and is hardwired into the client as well
+        throw core123::se(ENAMETOOLONG, "dirbuf::add");
+    if(name.size() == 0)
+        throw core123::se(EINVAL, "dirbuf::add:  zero-length name");
+    std::string entry = core123::netstring(name) + " " + std::to_string(type) + " " + std::to_string(estale_cookie) + " "
+        + core123::netstring(sb ? str(*sb) : std::string()) + " " + std::to_string(sb ? validator : 0) + " "
+        + core123::netstring(sb ? cc : core123::str_view()) + "\n";
+    if(entry.size() > dirent_space_avail())
+        return false;
+    buf = buf.append(entry);
+    return true;
+}
+
 bool req::add_dirent(const ::dirent& de, uint64_t estale_cookie){
     return add_dirent(de.d_name, de.d_type, estale_cookie);
 }
@@ -1187,7 +1452,7 @@ std::optional<std::string> req::get_header(const std::string& name){
 }
 
 void req::d_reply(const std::string& nextstart, uint64_t etag64, uint64_t esc, const std::string& cc) try {
-        if(function != "d")
+        if(function != "d" && function != "r")
             httpthrow(500, "handler replied to " + std::string(function) + " with d_reply");
 
         if(buf.empty() && !nextstart.empty()){